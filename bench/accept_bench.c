@@ -0,0 +1,188 @@
+/*
+ * accept_bench.c -- measure how accept() throughput scales with the number
+ * of SO_REUSEPORT acceptors.
+ *
+ * For every acceptor count from 1 up to -m (doubling), the benchmark opens
+ * that many listening sockets on one loopback port, runs one accepting
+ * thread per socket and lets -c client threads connect and disconnect as
+ * fast as they can for -d seconds. Both sides close with an RST so the run
+ * does not exhaust ephemeral ports with TIME_WAIT sockets.
+ *
+ * Usage: accept_bench [-c clients] [-d seconds] [-m max_acceptors] [-A]
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+static atomic_int running;
+static atomic_ulong accepted;
+static struct sockaddr_in bench_addr;
+static int pin;
+
+static void set_linger0(int fd) {
+    struct linger lg = {1, 0};
+    setsockopt(fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+}
+
+static void pin_self(int cpu) {
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu % (ncpu > 0 ? ncpu : 1), &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+static int open_listener(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0) {
+        perror("setsockopt(SO_REUSEPORT)");
+        exit(1);
+    }
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 4096) < 0) {
+        perror("bind/listen");
+        exit(1);
+    }
+    return fd;
+}
+
+struct acceptor {
+    int fd;
+    int cpu;
+    pthread_t thread;
+};
+
+static void *acceptor_fn(void *arg) {
+    struct acceptor *a = (struct acceptor *)arg;
+    if (pin)
+        pin_self(a->cpu);
+    while (1) {
+        int fd = accept(a->fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINVAL || errno == EBADF)
+                break;
+            continue;
+        }
+        atomic_fetch_add_explicit(&accepted, 1, memory_order_relaxed);
+        set_linger0(fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+static void *client_fn(void *arg) {
+    while (atomic_load_explicit(&running, memory_order_relaxed)) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0)
+            continue;
+        connect(fd, (struct sockaddr *)&bench_addr, sizeof(bench_addr));
+        set_linger0(fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Run one round with n acceptors and return accepts per second */
+static double run_round(int n, int clients, double seconds) {
+    struct acceptor *acceptors = (struct acceptor *)calloc(n, sizeof(struct acceptor));
+    pthread_t *client_threads = (pthread_t *)calloc(clients, sizeof(pthread_t));
+
+    acceptors[0].fd = open_listener(0);
+    socklen_t len = sizeof(bench_addr);
+    getsockname(acceptors[0].fd, (struct sockaddr *)&bench_addr, &len);
+    for (int i = 1; i < n; i++)
+        acceptors[i].fd = open_listener(ntohs(bench_addr.sin_port));
+    for (int i = 0; i < n; i++) {
+        acceptors[i].cpu = i;
+        pthread_create(&acceptors[i].thread, NULL, acceptor_fn, acceptors + i);
+    }
+
+    atomic_store(&accepted, 0);
+    atomic_store(&running, 1);
+    for (int i = 0; i < clients; i++)
+        pthread_create(&client_threads[i], NULL, client_fn, NULL);
+
+    double start = now_sec();
+    usleep((useconds_t)(seconds * 1e6));
+    unsigned long count = atomic_load(&accepted);
+    double elapsed = now_sec() - start;
+
+    atomic_store(&running, 0);
+    for (int i = 0; i < clients; i++)
+        pthread_join(client_threads[i], NULL);
+    for (int i = 0; i < n; i++) {
+        shutdown(acceptors[i].fd, SHUT_RDWR);
+        pthread_join(acceptors[i].thread, NULL);
+        close(acceptors[i].fd);
+    }
+    free(acceptors);
+    free(client_threads);
+    return count / elapsed;
+}
+
+int main(int argc, char *argv[]) {
+    int clients = 8;
+    double seconds = 2.0;
+    int max_acceptors = sysconf(_SC_NPROCESSORS_ONLN);
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:d:m:A")) != -1) {
+        switch (opt) {
+            case 'c':
+                clients = atoi(optarg);
+                break;
+            case 'd':
+                seconds = atof(optarg);
+                break;
+            case 'm':
+                max_acceptors = atoi(optarg);
+                break;
+            case 'A':
+                pin = 1;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-c clients] [-d seconds] [-m max_acceptors] [-A]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (max_acceptors < 1)
+        max_acceptors = 1;
+
+    printf("%-10s %14s %10s\n", "acceptors", "accepts/sec", "speedup");
+    double base = 0;
+    int n = 1;
+    while (1) {
+        double rate = run_round(n, clients, seconds);
+        if (n == 1)
+            base = rate;
+        printf("%-10d %14.0f %9.2fx\n", n, rate, base > 0 ? rate / base : 0);
+        fflush(stdout);
+        if (n == max_acceptors)
+            break;
+        n = n * 2 < max_acceptors ? n * 2 : max_acceptors;
+    }
+    return 0;
+}
@@ -0,0 +1,582 @@
+/*
+ * loadgen.c -- HTTP load generator for the proxy, against bench/origin.
+ *
+ * Each of -c connections runs in its own thread and sends GET requests
+ * for http://127.0.0.1:<origin>/obj/<id> through the proxy over a
+ * keep-alive connection, reconnecting whenever the proxy closes it.
+ *
+ * Closed loop (the default): a connection sends its next request as soon
+ * as the previous response is complete, so throughput is what the proxy
+ * sustains. Open loop (-R): requests are due at a fixed total rate, spread
+ * evenly over the connections, and each is timed from when it was due
+ * rather than when it could be sent, so a stall is charged to every
+ * request it delays instead of hiding them.
+ *
+ * Object ids are drawn from -n objects with Zipf popularity of exponent -z
+ * (0 for uniform) from a fixed seed, so a run can be repeated. With -f the
+ * requests are instead replayed from a trace in the format of policy_sim
+ * ("key size" per line, optionally after a timestamp): each key becomes an
+ * id and the origin is asked for a body of its size. -q is appended to
+ * every URL's query string to set the origin's sizes, latency and
+ * Cache-Control (see origin.c).
+ *
+ * Requests during the first -w seconds warm the cache and are not counted.
+ * The hit ratio is one less the share of counted requests the origin saw,
+ * from its /stats before and after. The result is printed as one line of
+ * JSON: throughput, latency quantiles, errors and hit ratio.
+ *
+ * Usage: loadgen -p proxy_port -o origin_port [-c connections] [-d seconds]
+ *                [-w warmup seconds] [-R requests/s] [-n objects] [-z alpha]
+ *                [-f trace] [-q query] [-S seed] [-l label]
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <math.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define MAX_CONNECTIONS 1024
+#define READ_BUF (64 << 10)
+#define HIST_SUB_BITS 4
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_MAX_EXP 40
+#define HIST_BUCKETS ((HIST_MAX_EXP - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS)
+
+enum phase {
+    PHASE_WARMUP,
+    PHASE_MEASURE,
+    PHASE_STOP
+};
+
+struct trace_request {
+     uint64_t id;
+     size_t size;
+};
+
+/* One connection's thread and what it measured */
+struct client {
+     int index;
+     int fd;
+     pthread_t thread;
+     uint64_t state;              /* random generator */
+     char buf[READ_BUF];
+     size_t start, end;           /* unread bytes of buf */
+     unsigned long requests;
+     unsigned long errors;
+     unsigned long bytes;
+     uint64_t max_ns;
+     unsigned long hist[HIST_BUCKETS];
+};
+
+static int proxy_port, origin_port;
+static int connections = 16;
+static double rate;
+static long objects = 10000;
+static double alpha = 0.9;
+static const char *query = "";
+static double *cdf;
+static struct trace_request *trace;
+static size_t trace_len;
+static atomic_size_t trace_pos;
+static atomic_int phase;
+static struct client *clients;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t next_random(uint64_t *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+static unsigned bucket_index(uint64_t ns) {
+    if (ns < HIST_SUB_BUCKETS)
+        return (unsigned)ns;
+    if (ns >= (uint64_t)1 << HIST_MAX_EXP)
+        ns = ((uint64_t)1 << HIST_MAX_EXP) - 1;
+    unsigned e = 63 - __builtin_clzll(ns);
+    return (e - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS + ((ns >> (e - HIST_SUB_BITS)) & (HIST_SUB_BUCKETS - 1));
+}
+
+/* One past the largest value bucket i holds */
+static uint64_t bucket_limit(unsigned i) {
+    if (i < HIST_SUB_BUCKETS)
+        return i + 1;
+    unsigned shift = i / HIST_SUB_BUCKETS - 1;
+    return ((uint64_t)(HIST_SUB_BUCKETS + i % HIST_SUB_BUCKETS) + 1) << shift;
+}
+
+static double quantile_ms(const unsigned long *hist, unsigned long total, double q) {
+    if (total == 0)
+        return 0;
+    unsigned long rank = (unsigned long)(q * total);
+    if (rank >= total)
+        rank = total - 1;
+    unsigned long seen = 0;
+    for (unsigned i = 0; i < HIST_BUCKETS; i++) {
+        seen += hist[i];
+        if (seen > rank)
+            return (bucket_limit(i) - 1) / 1e6;
+    }
+    return (bucket_limit(HIST_BUCKETS - 1) - 1) / 1e6;
+}
+
+static uint64_t fnv1a(const char *s, size_t len) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)s[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static int trace_read(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+    size_t cap = 0;
+    char line[4096];
+    while (fgets(line, sizeof(line), f)) {
+        char *field[3];
+        int n = 0;
+        char *save;
+        for (char *tok = strtok_r(line, " \t\r\n", &save); tok && n < 3; tok = strtok_r(NULL, " \t\r\n", &save))
+            field[n++] = tok;
+        if (n < 2)
+            continue;
+        char *key = field[n - 2], *end;
+        unsigned long long size = strtoull(field[n - 1], &end, 10);
+        if (*end || key[0] == '#')
+            continue;
+        if (trace_len == cap) {
+            cap = cap ? cap * 2 : 1 << 16;
+            struct trace_request *t = (struct trace_request *)realloc(trace, cap * sizeof(*trace));
+            if (!t)
+                break;
+            trace = t;
+        }
+        /* ids stay below 2^53 so they print exactly */
+        trace[trace_len].id = fnv1a(key, strlen(key)) >> 11;
+        trace[trace_len].size = size;
+        trace_len++;
+    }
+    fclose(f);
+    return trace_len ? 0 : -1;
+}
+
+static int zipf_init(void) {
+    cdf = (double *)malloc(objects * sizeof(double));
+    if (!cdf)
+        return -1;
+    double total = 0;
+    for (long i = 0; i < objects; i++) {
+        total += 1.0 / pow(i + 1, alpha);
+        cdf[i] = total;
+    }
+    for (long i = 0; i < objects; i++)
+        cdf[i] /= total;
+    return 0;
+}
+
+static long zipf_next(uint64_t *state) {
+    double u = (next_random(state) >> 11) * (1.0 / (1ULL << 53));
+    long lo = 0, hi = objects - 1;
+    while (lo < hi) {
+        long mid = (lo + hi) / 2;
+        if (cdf[mid] < u)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static int connect_proxy(void) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(proxy_port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+static int send_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n <= 0)
+            return -1;
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Read more into c->buf. Returns the bytes read, 0 at EOF, -1 on error. */
+static ssize_t fill(struct client *c) {
+    if (c->start == c->end)
+        c->start = c->end = 0;
+    if (c->end == READ_BUF) {
+        memmove(c->buf, c->buf + c->start, c->end - c->start);
+        c->end -= c->start;
+        c->start = 0;
+        if (c->end == READ_BUF)
+            return -1;
+    }
+    ssize_t n = recv(c->fd, c->buf + c->end, READ_BUF - c->end, 0);
+    if (n > 0)
+        c->end += n;
+    return n;
+}
+
+/* The next line without its CRLF, NUL terminated in place; NULL if the connection ended */
+static char *read_line(struct client *c) {
+    for (;;) {
+        char *line = c->buf + c->start;
+        char *eol = (char *)memmem(line, c->end - c->start, "\r\n", 2);
+        if (eol) {
+            *eol = '\0';
+            c->start = eol + 2 - c->buf;
+            return line;
+        }
+        if (fill(c) <= 0)
+            return NULL;
+    }
+}
+
+/* Consume len body bytes, or up to EOF if len is -1. Returns -1 if the connection ended early. */
+static int skip(struct client *c, long long len) {
+    while (len != 0) {
+        if (c->start == c->end) {
+            ssize_t n = fill(c);
+            if (n <= 0)
+                return len < 0 && n == 0 ? 0 : -1;
+        }
+        size_t n = c->end - c->start;
+        if (len >= 0 && (long long)n > len)
+            n = len;
+        c->start += n;
+        c->bytes += n;
+        if (len > 0)
+            len -= n;
+    }
+    return 0;
+}
+
+/*
+   Read one response. Returns its status, or -1 if the connection failed.
+   *reusable is cleared when the connection cannot carry another request.
+ */
+static int read_response(struct client *c, int *reusable) {
+    char *line = read_line(c);
+    if (!line || strncmp(line, "HTTP/1.", 7) || strlen(line) < 12)
+        return -1;
+    int status = atoi(line + 9);
+    int http10 = line[7] == '0';
+    long long length = -1;
+    int chunked = 0, close_after = http10;
+    while ((line = read_line(c)) && *line) {
+        if (!strncasecmp(line, "Content-Length:", 15))
+            length = atoll(line + 15);
+        else if (!strncasecmp(line, "Transfer-Encoding:", 18) && strcasestr(line, "chunked"))
+            chunked = 1;
+        else if (!strncasecmp(line, "Connection:", 11))
+            close_after = strcasestr(line, "close") != NULL;
+    }
+    if (!line)
+        return -1;
+
+    if (status == 304 || status == 204 || (status >= 100 && status < 200)) {
+        length = 0;
+    } else if (chunked) {
+        for (;;) {
+            if (!(line = read_line(c)))
+                return -1;
+            long long size = strtoll(line, NULL, 16);
+            if (size == 0)
+                break;
+            if (skip(c, size) < 0 || !read_line(c))
+                return -1;
+        }
+        /* trailers up to the empty line */
+        while ((line = read_line(c)) && *line)
+            ;
+        if (!line)
+            return -1;
+        length = 0;
+    }
+    if (length < 0)
+        close_after = 1;
+    if (skip(c, length) < 0)
+        return -1;
+    *reusable = !close_after;
+    return status;
+}
+
+static void record(struct client *c, uint64_t ns, int ok) {
+    if (atomic_load(&phase) != PHASE_MEASURE)
+        return;
+    c->requests++;
+    if (!ok) {
+        c->errors++;
+        return;
+    }
+    c->hist[bucket_index(ns)]++;
+    if (ns > c->max_ns)
+        c->max_ns = ns;
+}
+
+static void *client_fn(void *arg) {
+    struct client *c = (struct client *)arg;
+    char req[1024];
+    uint64_t interval = rate > 0 ? (uint64_t)(1e9 * connections / rate) : 0;
+    uint64_t due = now_ns() + (rate > 0 ? (uint64_t)(1e9 * c->index / rate) : 0);
+
+    c->fd = -1;
+    while (atomic_load(&phase) != PHASE_STOP) {
+        uint64_t id;
+        char size_param[48] = "";
+        if (trace) {
+            size_t pos = atomic_fetch_add(&trace_pos, 1);
+            if (pos >= trace_len)
+                break;
+            id = trace[pos].id;
+            snprintf(size_param, sizeof(size_param), "size=%zu%s", trace[pos].size, *query ? "&" : "");
+        } else {
+            id = zipf_next(&c->state);
+        }
+        int len = snprintf(req, sizeof(req), "GET http://127.0.0.1:%d/obj/%llu?%s%s HTTP/1.1\r\n"
+                           "Host: 127.0.0.1:%d\r\nUser-Agent: loadgen\r\n\r\n", origin_port,
+                           (unsigned long long)id, size_param, query, origin_port);
+
+        uint64_t start;
+        if (interval) {
+            /* open loop: wait for the request's turn, and time it from then */
+            struct timespec ts = {due / 1000000000, due % 1000000000};
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+                ;
+            start = due;
+            due += interval;
+        } else {
+            start = now_ns();
+        }
+
+        int status = -1, reusable = 0;
+        for (int attempt = 0; attempt < 2 && status < 0; attempt++) {
+            /* a kept-alive connection the proxy has just closed gets one retry on a new one */
+            int fresh = c->fd < 0;
+            if (fresh) {
+                c->fd = connect_proxy();
+                c->start = c->end = 0;
+                if (c->fd < 0)
+                    break;
+            }
+            if (send_all(c->fd, req, len) == 0)
+                status = read_response(c, &reusable);
+            if (status < 0 || !reusable) {
+                close(c->fd);
+                c->fd = -1;
+            }
+            if (fresh)
+                break;
+        }
+        record(c, now_ns() - start, status >= 200 && status < 400);
+    }
+    if (c->fd >= 0)
+        close(c->fd);
+    return NULL;
+}
+
+/* Requests the origin has answered, from its /stats; -1 if it cannot be asked */
+static long origin_requests(void) {
+    struct client *c = (struct client *)calloc(1, sizeof(struct client));
+    if (!c)
+        return -1;
+    long requests = -1;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(origin_port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    const char *req = "GET /stats HTTP/1.1\r\nHost: 127.0.0.1\r\nConnection: close\r\n\r\n";
+    if (fd >= 0 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0 && send_all(fd, req, strlen(req)) == 0) {
+        c->fd = fd;
+        char *line;
+        while ((line = read_line(c)) && *line)
+            ;
+        if (line && fill(c) >= 0) {
+            c->buf[c->end < READ_BUF ? c->end : READ_BUF - 1] = '\0';
+            char *field = strstr(c->buf + c->start, "\"requests\":");
+            if (field)
+                requests = atol(field + 11);
+        }
+    }
+    if (fd >= 0)
+        close(fd);
+    free(c);
+    return requests;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s -p proxy_port -o origin_port [-c connections] [-d seconds] [-w warmup seconds]\n"
+            "          [-R requests/s] [-n objects] [-z alpha] [-f trace] [-q query] [-S seed] [-l label]\n", prog);
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    double duration = 10, warmup = 0;
+    uint64_t seed = 0x2545f4914f6cdd1dULL;
+    const char *trace_path = NULL, *label = "loadgen";
+    int opt;
+    while ((opt = getopt(argc, argv, "p:o:c:d:w:R:n:z:f:q:S:l:")) != -1) {
+        switch (opt) {
+            case 'p':
+                proxy_port = atoi(optarg);
+                break;
+            case 'o':
+                origin_port = atoi(optarg);
+                break;
+            case 'c':
+                connections = atoi(optarg);
+                break;
+            case 'd':
+                duration = atof(optarg);
+                break;
+            case 'w':
+                warmup = atof(optarg);
+                break;
+            case 'R':
+                rate = atof(optarg);
+                break;
+            case 'n':
+                objects = atol(optarg);
+                break;
+            case 'z':
+                alpha = atof(optarg);
+                break;
+            case 'f':
+                trace_path = optarg;
+                break;
+            case 'q':
+                query = optarg;
+                break;
+            case 'S':
+                seed = strtoull(optarg, NULL, 0) | 1;
+                break;
+            case 'l':
+                label = optarg;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (!proxy_port || !origin_port || connections <= 0 || connections > MAX_CONNECTIONS || objects <= 0 ||
+        duration <= 0)
+        usage(argv[0]);
+    if (trace_path ? trace_read(trace_path) < 0 : zipf_init() < 0) {
+        fprintf(stderr, "No requests to send\n");
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    clients = (struct client *)calloc(connections, sizeof(struct client));
+    if (!clients)
+        return 1;
+    atomic_store(&phase, warmup > 0 ? PHASE_WARMUP : PHASE_MEASURE);
+    long origin_before = warmup > 0 ? 0 : origin_requests();
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, 256 << 10);
+    for (int i = 0; i < connections; i++) {
+        clients[i].index = i;
+        clients[i].state = seed ^ (0x9e3779b97f4a7c15ULL * (i + 1));
+        if (pthread_create(&clients[i].thread, &attr, client_fn, clients + i) != 0) {
+            fprintf(stderr, "Failed to start connection %d\n", i);
+            return 1;
+        }
+    }
+    if (warmup > 0) {
+        usleep((useconds_t)(warmup * 1e6));
+        origin_before = origin_requests();
+        atomic_store(&phase, PHASE_MEASURE);
+    }
+    uint64_t start = now_ns();
+    /* a trace may run out before the duration is up */
+    uint64_t deadline = start + (uint64_t)(duration * 1e9);
+    while (now_ns() < deadline && !(trace && atomic_load(&trace_pos) >= trace_len))
+        usleep(10000);
+    long origin_after = origin_requests();
+    atomic_store(&phase, PHASE_STOP);
+    double elapsed = (now_ns() - start) / 1e9;
+    for (int i = 0; i < connections; i++)
+        pthread_join(clients[i].thread, NULL);
+
+    unsigned long *hist = (unsigned long *)calloc(HIST_BUCKETS, sizeof(unsigned long));
+    unsigned long requests = 0, errors = 0, bytes = 0;
+    uint64_t max_ns = 0;
+    double sum_ns = 0;
+    for (int i = 0; i < connections; i++) {
+        struct client *c = clients + i;
+        requests += c->requests;
+        errors += c->errors;
+        bytes += c->bytes;
+        if (c->max_ns > max_ns)
+            max_ns = c->max_ns;
+        for (unsigned b = 0; b < HIST_BUCKETS; b++) {
+            hist[b] += c->hist[b];
+            sum_ns += (double)c->hist[b] * (b ? (bucket_limit(b - 1) + bucket_limit(b)) / 2.0 : 0.5);
+        }
+    }
+    unsigned long ok = requests - errors;
+    double max_ms = max_ns / 1e6;
+    /* a quantile is its bucket's upper bound, which may lie past the largest value seen */
+    double p50 = fmin(quantile_ms(hist, ok, 0.5), max_ms), p90 = fmin(quantile_ms(hist, ok, 0.9), max_ms);
+    double p99 = fmin(quantile_ms(hist, ok, 0.99), max_ms), p999 = fmin(quantile_ms(hist, ok, 0.999), max_ms);
+
+    printf("{\"label\": \"%s\", \"mode\": \"%s\", \"connections\": %d, \"rate\": %.0f, \"duration_s\": %.3f, "
+           "\"requests\": %lu, \"errors\": %lu, \"throughput_rps\": %.1f, \"mb_per_s\": %.2f, "
+           "\"latency_ms\": {\"mean\": %.3f, \"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f, \"p999\": %.3f, \"max\": %.3f}, ",
+           label, rate > 0 ? "open" : "closed", connections, rate, elapsed, requests, errors, ok / elapsed,
+           bytes / elapsed / 1048576, ok ? sum_ns / ok / 1e6 : 0.0, p50, p90, p99, p999, max_ms);
+    if (origin_before >= 0 && origin_after >= 0 && requests > 0) {
+        /* the proxy's own fetches in flight at the edges of the run blur this by a few requests */
+        double hit_ratio = 1.0 - (double)(origin_after - origin_before) / requests;
+        printf("\"origin_requests\": %ld, \"hit_ratio\": %.4f}\n", origin_after - origin_before,
+               hit_ratio < 0 ? 0 : hit_ratio);
+    } else {
+        printf("\"origin_requests\": null, \"hit_ratio\": null}\n");
+    }
+    free(hist);
+    free(clients);
+    free(cdf);
+    free(trace);
+    return errors && !ok;
+}
@@ -0,0 +1,343 @@
+/*
+ * origin.c -- stand-in origin server for load tests of the proxy.
+ *
+ * Answers GET /obj/<id>[?name=value&...] with a generated body, and
+ * GET /stats with the requests answered so far as JSON, so a load
+ * generator can tell how many of its requests reached the origin. Every
+ * response parameter has a default set on the command line, which the
+ * query string can override per request:
+ *
+ *   size=N or size=MIN-MAX  body bytes; a range gives each object id its
+ *                           own size in it, the same on every request
+ *   delay=MS                wait before answering
+ *   jitter=MS               and a further random 0 to MS
+ *   cc=VARIANT              max-age:    Cache-Control: max-age=<-m>
+ *                           no-store:   Cache-Control: no-store
+ *                           private:    Cache-Control: private, max-age=<-m>
+ *                           revalidate: Cache-Control: max-age=0 with an ETag,
+ *                                       If-None-Match is answered with 304
+ *                           heuristic:  Last-Modified only
+ *   chunked=1               chunked transfer encoding instead of Content-Length
+ *
+ * Connections are kept alive and served by a thread each.
+ *
+ * Usage: origin [-p port] [-s size|min-max] [-l delay ms] [-j jitter ms]
+ *               [-c cache-control variant] [-m max-age]
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define REQUEST_MAX 8192
+#define PATTERN_SIZE (64 << 10)
+
+enum cc_variant {
+    CC_MAX_AGE,
+    CC_NO_STORE,
+    CC_PRIVATE,
+    CC_REVALIDATE,
+    CC_HEURISTIC
+};
+
+static const char *const cc_names[] = {"max-age", "no-store", "private", "revalidate", "heuristic"};
+
+struct params {
+     size_t size_min;
+     size_t size_max;
+     long delay_ms;
+     long jitter_ms;
+     enum cc_variant cc;
+     int chunked;
+};
+
+static struct params defaults = {1024, 1024, 0, 0, CC_MAX_AGE, 0};
+static long max_age = 3600;
+static char pattern[PATTERN_SIZE];
+static atomic_ulong served, not_modified, body_bytes;
+static __thread uint64_t jitter_state;
+
+static int parse_size(const char *s, size_t *min, size_t *max) {
+    char *end;
+    *min = *max = strtoul(s, &end, 10);
+    if (*end == '-')
+        *max = strtoul(end + 1, &end, 10);
+    return (*end && *end != '&' && *end != ' ') || *max < *min ? -1 : 0;
+}
+
+static int parse_cc(const char *s, size_t len, enum cc_variant *cc) {
+    for (size_t i = 0; i < sizeof(cc_names) / sizeof(cc_names[0]); i++) {
+        if (strlen(cc_names[i]) == len && !strncmp(s, cc_names[i], len)) {
+            *cc = (enum cc_variant)i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/* Override p with the name=value pairs of query, which ends at a space */
+static void parse_query(const char *query, struct params *p) {
+    while (*query && *query != ' ') {
+        const char *eq = strchr(query, '=');
+        const char *next = strpbrk(query, "& ");
+        if (!next)
+            next = query + strlen(query);
+        if (eq && eq < next) {
+            size_t name_len = eq - query;
+            const char *value = eq + 1;
+            if (name_len == 4 && !strncmp(query, "size", 4))
+                parse_size(value, &p->size_min, &p->size_max);
+            else if (name_len == 5 && !strncmp(query, "delay", 5))
+                p->delay_ms = atol(value);
+            else if (name_len == 6 && !strncmp(query, "jitter", 6))
+                p->jitter_ms = atol(value);
+            else if (name_len == 2 && !strncmp(query, "cc", 2))
+                parse_cc(value, next - value, &p->cc);
+            else if (name_len == 7 && !strncmp(query, "chunked", 7))
+                p->chunked = atoi(value);
+        }
+        query = *next == '&' ? next + 1 : next;
+    }
+}
+
+static uint64_t mix(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    return x ^ (x >> 33);
+}
+
+static int send_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n <= 0)
+            return -1;
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Send len bytes of the body pattern, starting at offset id so objects differ */
+static int send_body(int fd, uint64_t id, size_t len, int chunked) {
+    size_t pos = id % 251;
+    while (len > 0) {
+        size_t n = PATTERN_SIZE - pos < len ? PATTERN_SIZE - pos : len;
+        if (chunked) {
+            char size_line[32];
+            int size_len = snprintf(size_line, sizeof(size_line), "%zx\r\n", n);
+            if (send_all(fd, size_line, size_len) < 0)
+                return -1;
+        }
+        if (send_all(fd, pattern + pos, n) < 0 || (chunked && send_all(fd, "\r\n", 2) < 0))
+            return -1;
+        len -= n;
+        pos = 0;
+    }
+    return chunked ? send_all(fd, "0\r\n\r\n", 5) : 0;
+}
+
+static void sleep_ms(long ms) {
+    struct timespec ts = {ms / 1000, (ms % 1000) * 1000000L};
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+        ;
+}
+
+static int answer_stats(int fd) {
+    char body[256], head[256];
+    int body_len = snprintf(body, sizeof(body), "{\"requests\": %lu, \"not_modified\": %lu, \"body_bytes\": %lu}\n",
+                            atomic_load(&served), atomic_load(&not_modified), atomic_load(&body_bytes));
+    int head_len = snprintf(head, sizeof(head), "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\n"
+                            "Cache-Control: no-store\r\nContent-Length: %d\r\n\r\n", body_len);
+    return send_all(fd, head, head_len) < 0 ? -1 : send_all(fd, body, body_len);
+}
+
+/* Answer the request whose headers are at req. Returns -1 to close the connection. */
+static int answer(int fd, char *req) {
+    char *target = strchr(req, ' ');
+    if (strncmp(req, "GET ", 4) || !target)
+        return -1;
+    target++;
+    if (!strncmp(target, "http://", 7)) {
+        /* absolute form, as sent to a proxy */
+        char *path = strchr(target + 7, '/');
+        target = path ? path : target;
+    }
+    if (!strncmp(target, "/stats ", 7))
+        return answer_stats(fd);
+    if (strncmp(target, "/obj/", 5)) {
+        const char *nf = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n";
+        return send_all(fd, nf, strlen(nf));
+    }
+
+    uint64_t id = strtoull(target + 5, NULL, 10);
+    struct params p = defaults;
+    char *query = strpbrk(target, "? ");
+    if (query && *query == '?')
+        parse_query(query + 1, &p);
+    size_t size = p.size_min;
+    if (p.size_max > p.size_min)
+        size += mix(id) % (p.size_max - p.size_min + 1);
+    if (p.delay_ms > 0 || p.jitter_ms > 0)
+        sleep_ms(p.delay_ms + (p.jitter_ms > 0 ? (long)(mix(++jitter_state) % (p.jitter_ms + 1)) : 0));
+
+    char etag[48];
+    snprintf(etag, sizeof(etag), "\"%llx-%zx\"", (unsigned long long)id, size);
+    char date[64];
+    time_t now = time(NULL);
+    struct tm tm;
+    strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", gmtime_r(&now, &tm));
+    char cc[128];
+    switch (p.cc) {
+        case CC_MAX_AGE:
+            snprintf(cc, sizeof(cc), "Cache-Control: max-age=%ld\r\n", max_age);
+            break;
+        case CC_NO_STORE:
+            snprintf(cc, sizeof(cc), "Cache-Control: no-store\r\n");
+            break;
+        case CC_PRIVATE:
+            snprintf(cc, sizeof(cc), "Cache-Control: private, max-age=%ld\r\n", max_age);
+            break;
+        case CC_REVALIDATE:
+            snprintf(cc, sizeof(cc), "Cache-Control: max-age=0\r\nETag: %s\r\n", etag);
+            break;
+        case CC_HEURISTIC:
+            snprintf(cc, sizeof(cc), "Last-Modified: Mon, 01 Jan 2024 00:00:00 GMT\r\n");
+            break;
+    }
+
+    char head[512];
+    atomic_fetch_add(&served, 1);
+    char *inm = strcasestr(req, "\r\nIf-None-Match:");
+    char *match = inm ? strstr(inm, etag) : NULL;
+    if (p.cc == CC_REVALIDATE && match && match < strstr(inm + 2, "\r\n")) {
+        atomic_fetch_add(&not_modified, 1);
+        int head_len = snprintf(head, sizeof(head), "HTTP/1.1 304 Not Modified\r\nDate: %s\r\n%s\r\n", date, cc);
+        return send_all(fd, head, head_len);
+    }
+    int head_len;
+    if (p.chunked)
+        head_len = snprintf(head, sizeof(head), "HTTP/1.1 200 OK\r\nDate: %s\r\n%sContent-Type: application/octet-stream\r\n"
+                            "Transfer-Encoding: chunked\r\n\r\n", date, cc);
+    else
+        head_len = snprintf(head, sizeof(head), "HTTP/1.1 200 OK\r\nDate: %s\r\n%sContent-Type: application/octet-stream\r\n"
+                            "Content-Length: %zu\r\n\r\n", date, cc, size);
+    atomic_fetch_add(&body_bytes, size);
+    if (send_all(fd, head, head_len) < 0)
+        return -1;
+    return send_body(fd, id, size, p.chunked);
+}
+
+static void *conn_fn(void *arg) {
+    int fd = (int)(long)arg;
+    char buf[REQUEST_MAX + 1];
+    size_t len = 0;
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    jitter_state = (uint64_t)fd << 32 ^ (uint64_t)time(NULL);
+    for (;;) {
+        buf[len] = '\0';
+        char *end = strstr(buf, "\r\n\r\n");
+        if (!end) {
+            if (len == REQUEST_MAX)
+                break;
+            ssize_t n = recv(fd, buf + len, REQUEST_MAX - len, 0);
+            if (n <= 0)
+                break;
+            len += n;
+            continue;
+        }
+        end[2] = '\0';
+        int close_after = strcasestr(buf, "\r\nConnection: close") != NULL;
+        if (answer(fd, buf) < 0 || close_after)
+            break;
+        size_t used = end + 4 - buf;
+        memmove(buf, buf + used, len - used);
+        len -= used;
+    }
+    close(fd);
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    int port = 8090;
+    int opt;
+    while ((opt = getopt(argc, argv, "p:s:l:j:c:m:")) != -1) {
+        switch (opt) {
+            case 'p':
+                port = atoi(optarg);
+                break;
+            case 's':
+                if (parse_size(optarg, &defaults.size_min, &defaults.size_max) < 0) {
+                    fprintf(stderr, "Bad size: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'l':
+                defaults.delay_ms = atol(optarg);
+                break;
+            case 'j':
+                defaults.jitter_ms = atol(optarg);
+                break;
+            case 'c':
+                if (parse_cc(optarg, strlen(optarg), &defaults.cc) < 0) {
+                    fprintf(stderr, "Unknown cache-control variant: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'm':
+                max_age = atol(optarg);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-p port] [-s size|min-max] [-l delay ms] [-j jitter ms] "
+                        "[-c max-age|no-store|private|revalidate|heuristic] [-m max-age]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    for (size_t i = 0; i < PATTERN_SIZE; i++)
+        pattern[i] = "abcdefghijklmnopqrstuvwxyz0123456789"[i % 36];
+    signal(SIGPIPE, SIG_IGN);
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 4096) < 0) {
+        perror("bind/listen");
+        return 1;
+    }
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_attr_setstacksize(&attr, 256 << 10);
+    for (;;) {
+        int client = accept(fd, NULL, NULL);
+        if (client < 0) {
+            if (errno != EINTR)
+                perror("accept");
+            continue;
+        }
+        pthread_t tid;
+        if (pthread_create(&tid, &attr, conn_fn, (void *)(long)client) != 0)
+            close(client);
+    }
+    return 0;
+}
@@ -0,0 +1,179 @@
+/*
+ * parse_bench.c -- compare the request parsing rate of the original
+ * strndup()/strtok_r() parser, of ParsedRequest_parse() as a wrapper around
+ * the view parser, and of RequestView_parse() on its own.
+ *
+ * Every mode parses the same browser-like request with 20 headers -n times
+ * on one thread and the best of -r rounds is reported, so the rates are
+ * requests per second per core.
+ *
+ * Usage: parse_bench [-n requests] [-r rounds]
+ */
+
+#define _GNU_SOURCE
+#include "proxy_parse.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+enum {
+    MODE_LEGACY,
+    MODE_COMPAT,
+    MODE_VIEW
+};
+
+static const char *mode_names[] = {"strtok/strndup", "ParsedRequest", "RequestView"};
+
+static const char request[] =
+    "GET http://www.example.com/static/js/app.bundle.js?v=20240611 HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:126.0) Gecko/20100101 Firefox/126.0\r\n"
+    "Accept: */*\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Referer: http://www.example.com/products/index.html\r\n"
+    "Connection: keep-alive\r\n"
+    "Cookie: session=7f3a9c1e2b4d6f80; theme=dark; consent=1\r\n"
+    "Sec-Fetch-Dest: script\r\n"
+    "Sec-Fetch-Mode: no-cors\r\n"
+    "Sec-Fetch-Site: same-origin\r\n"
+    "Pragma: no-cache\r\n"
+    "Cache-Control: no-cache\r\n"
+    "If-None-Match: \"5d8c72a5edda8\"\r\n"
+    "If-Modified-Since: Tue, 11 Jun 2024 08:12:31 GMT\r\n"
+    "DNT: 1\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "TE: trailers\r\n"
+    "X-Requested-With: XMLHttpRequest\r\n"
+    "X-Forwarded-For: 203.0.113.7\r\n"
+    "\r\n";
+
+/*
+   The parser as it was before the view parser: it copies the request twice,
+   tokenizes the request line with strtok_r() and copies every header key
+   and value twice on the way into the header array.
+ */
+static int legacy_header_parse(struct ParsedRequest *pr, char *line) {
+    char *index1 = strchr(line, ':');
+    if (!index1)
+        return -1;
+    char *key = strndup(line, index1 - line);
+    index1 += 2;
+    char *index2 = strstr(index1, "\r\n");
+    char *value = strndup(index1, index2 - index1);
+    ParsedHeader_set(pr, key, value);
+    free(key);
+    free(value);
+    return 0;
+}
+
+static int legacy_parse(struct ParsedRequest *parse, const char *buf, int buflen) {
+    char *tmp_buf = strndup(buf, buflen);
+    char *index = strstr(tmp_buf, "\r\n\r\n");
+    if (!index) {
+        free(tmp_buf);
+        return -1;
+    }
+    index = strstr(tmp_buf, "\r\n");
+    parse->buf = strndup(tmp_buf, index - tmp_buf);
+
+    char *saveptr;
+    parse->method = strtok_r(parse->buf, " ", &saveptr);
+    char *full_addr = strtok_r(NULL, " ", &saveptr);
+    parse->version = full_addr + strlen(full_addr) + 1;
+    parse->protocol = strtok_r(full_addr, "://", &saveptr);
+    parse->host = strtok_r(NULL, "/", &saveptr);
+    char *tmp_path = strtok_r(NULL, " ", &saveptr);
+    parse->path = (char *)malloc(strlen(tmp_path) + 2);
+    strcpy(parse->path, "/");
+    strcat(parse->path, tmp_path);
+    parse->host = strtok_r(parse->host, ":", &saveptr);
+    parse->port = strtok_r(NULL, "/", &saveptr);
+
+    char *currentHeader = strstr(tmp_buf, "\r\n") + 2;
+    while (currentHeader[0] != '\0' && !(currentHeader[0] == '\r' && currentHeader[1] == '\n')) {
+        if (legacy_header_parse(parse, currentHeader))
+            break;
+        currentHeader = strstr(currentHeader, "\r\n");
+        if (!currentHeader || strlen(currentHeader) < 2)
+            break;
+        currentHeader += 2;
+    }
+    free(tmp_buf);
+    return 0;
+}
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Parse the request n times in mode and return the rate in requests/s */
+static double run_round(int mode, long n) {
+    size_t len = sizeof(request) - 1;
+    size_t check = 0;
+    double start = now_sec();
+    for (long i = 0; i < n; i++) {
+        if (mode == MODE_VIEW) {
+            struct RequestView rv;
+            if (RequestView_parse(&rv, request, len) == 0)
+                check += rv.host.len + rv.headersused;
+            RequestView_release(&rv);
+        } else {
+            struct ParsedRequest *pr = ParsedRequest_create();
+            int ret = mode == MODE_LEGACY ? legacy_parse(pr, request, len) : ParsedRequest_parse(pr, request, len);
+            if (ret == 0)
+                check += strlen(pr->host) + pr->headersused;
+            ParsedRequest_destroy(pr);
+        }
+    }
+    double elapsed = now_sec() - start;
+    if (check != (size_t)n * (strlen("www.example.com") + 20))
+        fprintf(stderr, "%s: unexpected parse result\n", mode_names[mode]);
+    return n / elapsed;
+}
+
+int main(int argc, char *argv[]) {
+    long requests = 1000000;
+    int rounds = 3;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:r:")) != -1) {
+        switch (opt) {
+            case 'n':
+                requests = strtol(optarg, NULL, 10);
+                break;
+            case 'r':
+                rounds = atoi(optarg);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-n requests] [-r rounds]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (rounds < 1)
+        rounds = 1;
+    if (requests < 1)
+        requests = 1;
+
+    printf("parsing a %zu byte request with 20 headers %ld times, best of %d\n",
+           sizeof(request) - 1, requests, rounds);
+    printf("%-16s %12s %10s %10s\n", "mode", "requests/s", "ns/req", "speedup");
+    double base = 0;
+    for (int mode = MODE_LEGACY; mode <= MODE_VIEW; mode++) {
+        double best = 0;
+        for (int i = 0; i < rounds; i++) {
+            double rate = run_round(mode, requests);
+            if (rate > best)
+                best = rate;
+        }
+        if (mode == MODE_LEGACY)
+            base = best;
+        printf("%-16s %12.0f %10.1f %9.2fx\n", mode_names[mode], best, 1e9 / best, base > 0 ? best / base : 0);
+        fflush(stdout);
+    }
+    return 0;
+}
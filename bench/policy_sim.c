@@ -0,0 +1,331 @@
+/*
+ * policy_sim.c -- replay a request trace against each eviction policy and
+ * report object and byte hit ratios.
+ *
+ * The trace is a text file with one request per line, the key and the
+ * response size in bytes, optionally after a timestamp: "key size" or
+ * "time key size", separated by whitespace as in common CDN traces. Other
+ * lines are skipped. Without a trace file, -g generates that many
+ * requests: 70% for 100,000 objects with Zipf popularity (alpha 0.9) and
+ * 30% for objects requested only once, as a crawler would, with sizes of
+ * 1-64 KB, and a tenth of the objects up to 1 MB and a hundredth up to
+ * 10 MB.
+ *
+ * Each policy runs one instance over a cache of -c MB, as one shard of the
+ * proxy does, looked up and filled the way the proxy does: every request is
+ * an access, and a miss stores the response, evicting victims until it
+ * fits. Responses over -m bytes (MAX_ELEMENT_SIZE by default) are never
+ * stored, and a request whose size differs from the cached one is a miss.
+ *
+ * Usage: policy_sim [-c cache MB] [-m max bytes] [-p policy] [-g requests] [trace]
+ */
+
+#include "proxy_cache.h"
+#include "proxy_policy.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+
+#define SIM_OBJECTS 100000
+#define SIM_ZIPF 0.9
+#define SIM_SCAN_PERCENT 30
+
+struct request {
+     uint64_t hash;
+     size_t size;
+};
+
+struct trace {
+     struct request *req;
+     size_t count;
+     size_t cap;
+};
+
+/* Resident entries by key hash; open addressing, backward shift deletion */
+struct table {
+     cache_element **slot;
+     size_t mask;
+     size_t count;
+};
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static int trace_add(struct trace *t, uint64_t hash, size_t size) {
+    if (t->count == t->cap) {
+        size_t cap = t->cap ? t->cap * 2 : 1 << 16;
+        struct request *req = (struct request *)realloc(t->req, cap * sizeof(struct request));
+        if (!req)
+            return -1;
+        t->req = req;
+        t->cap = cap;
+    }
+    t->req[t->count].hash = hash;
+    t->req[t->count].size = size;
+    t->count++;
+    return 0;
+}
+
+static int trace_read(struct trace *t, const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+    char line[4096];
+    while (fgets(line, sizeof(line), f)) {
+        char *field[3];
+        int n = 0;
+        char *save;
+        for (char *tok = strtok_r(line, " \t\r\n", &save); tok && n < 3; tok = strtok_r(NULL, " \t\r\n", &save))
+            field[n++] = tok;
+        if (n < 2)
+            continue;
+        char *key = field[n - 2], *end;
+        unsigned long long size = strtoull(field[n - 1], &end, 10);
+        if (*end || key[0] == '#')
+            continue;
+        if (trace_add(t, cache_hash(key, strlen(key)), size) < 0)
+            break;
+    }
+    fclose(f);
+    return t->count ? 0 : -1;
+}
+
+static uint64_t next_random(uint64_t *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+/* Size of object id, fixed for the object */
+static size_t object_size(uint64_t id) {
+    uint64_t r = id * 0x9e3779b97f4a7c15ULL;
+    double u = (r >> 11) * (1.0 / (1ULL << 53));
+    unsigned pick = (r >> 3) % 100;
+    if (pick == 0)
+        return (size_t)((1 << 20) * pow(10, u));           /* 1-10 MB */
+    if (pick < 10)
+        return (size_t)((64 << 10) * pow(16, u));          /* 64 KB-1 MB */
+    return (size_t)(1024 * pow(64, u));                    /* 1-64 KB */
+}
+
+static int trace_generate(struct trace *t, size_t count) {
+    double *cdf = (double *)malloc(SIM_OBJECTS * sizeof(double));
+    if (!cdf)
+        return -1;
+    double total = 0;
+    for (int i = 0; i < SIM_OBJECTS; i++) {
+        total += 1.0 / pow(i + 1, SIM_ZIPF);
+        cdf[i] = total;
+    }
+    uint64_t state = 0x2545f4914f6cdd1dULL, once = SIM_OBJECTS;
+    for (size_t n = 0; n < count; n++) {
+        uint64_t id;
+        if (next_random(&state) % 100 < SIM_SCAN_PERCENT) {
+            id = once++;
+        } else {
+            double u = (next_random(&state) >> 11) * (1.0 / (1ULL << 53)) * total;
+            size_t lo = 0, hi = SIM_OBJECTS - 1;
+            while (lo < hi) {
+                size_t mid = (lo + hi) / 2;
+                if (cdf[mid] < u)
+                    lo = mid + 1;
+                else
+                    hi = mid;
+            }
+            id = lo;
+        }
+        char key[64];
+        int len = snprintf(key, sizeof(key), "GET http://sim.example.com/object/%lu", (unsigned long)id);
+        if (trace_add(t, cache_hash(key, len), object_size(id)) < 0) {
+            free(cdf);
+            return -1;
+        }
+    }
+    free(cdf);
+    return 0;
+}
+
+static size_t table_find(struct table *tb, uint64_t hash) {
+    size_t i = hash & tb->mask;
+    while (tb->slot[i]) {
+        if (tb->slot[i]->hash == hash)
+            return i;
+        i = (i + 1) & tb->mask;
+    }
+    return (size_t)-1;
+}
+
+static void table_place(cache_element **slot, size_t mask, cache_element *e) {
+    size_t i = e->hash & mask;
+    while (slot[i])
+        i = (i + 1) & mask;
+    slot[i] = e;
+}
+
+static int table_insert(struct table *tb, cache_element *e) {
+    if ((tb->count + 1) * 10 > (tb->mask + 1) * 7) {
+        size_t slots = (tb->mask + 1) * 2;
+        cache_element **bigger = (cache_element **)calloc(slots, sizeof(cache_element *));
+        if (!bigger)
+            return -1;
+        for (size_t i = 0; i <= tb->mask; i++) {
+            if (tb->slot[i])
+                table_place(bigger, slots - 1, tb->slot[i]);
+        }
+        free(tb->slot);
+        tb->slot = bigger;
+        tb->mask = slots - 1;
+    }
+    table_place(tb->slot, tb->mask, e);
+    tb->count++;
+    return 0;
+}
+
+static void table_delete(struct table *tb, size_t i) {
+    size_t j = i;
+    tb->slot[i] = NULL;
+    for (;;) {
+        j = (j + 1) & tb->mask;
+        if (!tb->slot[j])
+            break;
+        size_t k = tb->slot[j]->hash & tb->mask;
+        int stays = i <= j ? (i < k && k <= j) : (i < k || k <= j);
+        if (!stays) {
+            tb->slot[i] = tb->slot[j];
+            tb->slot[j] = NULL;
+            i = j;
+        }
+    }
+    tb->count--;
+}
+
+/* Replay t against policy over a cache of budget bytes and print a row */
+static int replay(const struct cache_policy *policy, const struct trace *t, size_t budget, size_t max_size) {
+    struct table tb = {(cache_element **)calloc(1024, sizeof(cache_element *)), 1023, 0};
+    void *p = policy->create(budget);
+    if (!tb.slot || !p)
+        return -1;
+
+    double start = now_ms();
+    size_t used = 0;
+    unsigned long hits = 0;
+    unsigned long long bytes = 0, hit_bytes = 0;
+    for (size_t n = 0; n < t->count; n++) {
+        const struct request *r = t->req + n;
+        size_t i = table_find(&tb, r->hash);
+        cache_element *e = i == (size_t)-1 ? NULL : tb.slot[i];
+        policy->access(p, r->hash, e);
+        bytes += r->size;
+        if (e && e->size == r->size) {
+            hits++;
+            hit_bytes += r->size;
+            continue;
+        }
+        if (e) {
+            policy->remove(p, e);
+            table_delete(&tb, i);
+            used -= e->size;
+            free(e);
+        }
+        if (r->size > max_size || r->size > budget)
+            continue;
+        while (used + r->size > budget) {
+            cache_element *victim = policy->victim(p);
+            if (!victim)
+                break;
+            policy->remove(p, victim);
+            table_delete(&tb, table_find(&tb, victim->hash));
+            used -= victim->size;
+            free(victim);
+        }
+        e = (cache_element *)calloc(1, sizeof(cache_element));
+        if (!e)
+            return -1;
+        e->hash = r->hash;
+        e->size = r->size;
+        if (policy->insert(p, e) < 0 || table_insert(&tb, e) < 0)
+            return -1;
+        used += e->size;
+    }
+    double elapsed = now_ms() - start;
+
+    struct policy_stats st;
+    policy->stats(p, &st);
+    printf("%-9s %10zu %9.2f%% %9.2f%% %10lu %10lu %10lu %9.0f\n", policy->name, t->count,
+           100.0 * hits / t->count, bytes ? 100.0 * hit_bytes / bytes : 0.0, st.victims, st.admitted,
+           st.rejected, elapsed);
+    fflush(stdout);
+
+    for (size_t i = 0; i <= tb.mask; i++)
+        free(tb.slot[i]);
+    free(tb.slot);
+    policy->destroy(p);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    size_t cache_mb = 64;
+    size_t max_size = MAX_ELEMENT_SIZE;
+    size_t generate = 0;
+    const char *only = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:m:p:g:")) != -1) {
+        switch (opt) {
+            case 'c':
+                cache_mb = strtoul(optarg, NULL, 10);
+                break;
+            case 'm':
+                max_size = strtoul(optarg, NULL, 10);
+                break;
+            case 'p':
+                only = optarg;
+                break;
+            case 'g':
+                generate = strtoul(optarg, NULL, 10);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-c cache MB] [-m max bytes] [-p policy] [-g requests] [trace]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (only && !policy_find(only)) {
+        fprintf(stderr, "Unknown eviction policy: %s\n", only);
+        return 1;
+    }
+
+    struct trace t = {NULL, 0, 0};
+    if (optind < argc) {
+        if (trace_read(&t, argv[optind]) < 0) {
+            fprintf(stderr, "No requests in %s\n", argv[optind]);
+            return 1;
+        }
+        printf("replaying %zu requests from %s", t.count, argv[optind]);
+    } else {
+        if (trace_generate(&t, generate ? generate : 2000000) < 0)
+            return 1;
+        printf("replaying %zu generated requests (%d%% one-time)", t.count, SIM_SCAN_PERCENT);
+    }
+    printf(" over a %zu MB cache\n", cache_mb);
+    printf("%-9s %10s %10s %10s %10s %10s %10s %9s\n", "policy", "requests", "objects", "bytes", "evicted",
+           "admitted", "rejected", "ms");
+    for (int i = 0; cache_policies[i]; i++) {
+        if (only && strcmp(only, cache_policies[i]->name))
+            continue;
+        if (replay(cache_policies[i], &t, cache_mb << 20, max_size) < 0) {
+            fprintf(stderr, "Out of memory\n");
+            return 1;
+        }
+    }
+    free(t.req);
+    return 0;
+}
@@ -0,0 +1,206 @@
+/*
+ * relay_bench.c -- compare the throughput of relaying a large response
+ * body between two TCP sockets with the original recv()/send() loop and
+ * with the splice() relay, with and without a tee()d copy for the cache.
+ *
+ * An origin thread streams -s megabytes into the upstream socket and a sink
+ * thread reads the client socket to the end; the main thread relays between
+ * them. Every mode runs -r rounds over loopback and the best is reported.
+ *
+ * Usage: relay_bench [-s megabytes] [-r rounds]
+ */
+
+#define _GNU_SOURCE
+#include "proxy_relay.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define IO_CHUNK (256 * 1024)
+#define LOOP_BYTES 4096     /* MAX_BYTES of the original relay loop */
+
+enum {
+    MODE_LOOP,
+    MODE_SPLICE,
+    MODE_SPLICE_TEE
+};
+
+static const char *mode_names[] = {"recv/send loop", "splice", "splice+tee"};
+
+static size_t total_bytes;
+
+static int listen_any(struct sockaddr_in *addr) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(*addr);
+    if (bind(fd, (struct sockaddr *)addr, len) < 0 || listen(fd, 1) < 0) {
+        perror("bind/listen");
+        exit(1);
+    }
+    getsockname(fd, (struct sockaddr *)addr, &len);
+    return fd;
+}
+
+static int connect_to(struct sockaddr_in *addr) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(fd, (struct sockaddr *)addr, sizeof(*addr)) < 0) {
+        perror("connect");
+        exit(1);
+    }
+    return fd;
+}
+
+static void *origin_fn(void *arg) {
+    int fd = *(int *)arg;
+    char *chunk = (char *)malloc(IO_CHUNK);
+    memset(chunk, 'x', IO_CHUNK);
+    size_t sent = 0;
+    while (sent < total_bytes) {
+        size_t want = total_bytes - sent < IO_CHUNK ? total_bytes - sent : IO_CHUNK;
+        ssize_t n = send(fd, chunk, want, 0);
+        if (n <= 0)
+            break;
+        sent += n;
+    }
+    shutdown(fd, SHUT_WR);
+    free(chunk);
+    return NULL;
+}
+
+static void *sink_fn(void *arg) {
+    int fd = *(int *)arg;
+    char *chunk = (char *)malloc(IO_CHUNK);
+    size_t *received = (size_t *)calloc(1, sizeof(size_t));
+    ssize_t n;
+    while ((n = recv(fd, chunk, IO_CHUNK, 0)) > 0)
+        *received += n;
+    free(chunk);
+    return received;
+}
+
+/* The relay loop handle_request() used: 4 KB recv, send, byte-wise copy */
+static void relay_loop(int from, int to) {
+    char *buf = (char *)calloc(LOOP_BYTES, 1);
+    char *temp_buffer = (char *)malloc(LOOP_BYTES);
+    size_t temp_buffer_size = LOOP_BYTES;
+    size_t temp_buffer_index = 0;
+
+    ssize_t bytes_recv = recv(from, buf, LOOP_BYTES - 1, 0);
+    while (bytes_recv > 0) {
+        send(to, buf, bytes_recv, 0);
+        for (int i = 0; i < bytes_recv; i++)
+            temp_buffer[temp_buffer_index++] = buf[i];
+        temp_buffer_size += LOOP_BYTES;
+        temp_buffer = (char *)realloc(temp_buffer, temp_buffer_size);
+        memset(buf, 0, LOOP_BYTES);
+        bytes_recv = recv(from, buf, LOOP_BYTES - 1, 0);
+    }
+    free(temp_buffer);
+    free(buf);
+}
+
+static void relay_splice(int from, int to, int keep) {
+    struct relay r;
+    if (relay_open(&r, NULL, 0, keep, (size_t)-1) < 0)
+        exit(1);
+    while (relay_fill(&r, from) > 0) {
+        if (relay_drain(&r, to) < 0)
+            break;
+    }
+    if (keep && r.copy.len != total_bytes)
+        fprintf(stderr, "tee copy holds %zu of %zu bytes\n", r.copy.len, total_bytes);
+    relay_close(&r);
+}
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Relay total_bytes once in mode and return the rate in MB/s */
+static double run_round(int mode) {
+    struct sockaddr_in origin_addr, proxy_addr;
+    int origin_listen = listen_any(&origin_addr);
+    int proxy_listen = listen_any(&proxy_addr);
+
+    int upstream = connect_to(&origin_addr);
+    int origin = accept(origin_listen, NULL, NULL);
+    int sink = connect_to(&proxy_addr);
+    int client = accept(proxy_listen, NULL, NULL);
+
+    pthread_t origin_thread, sink_thread;
+    double start = now_sec();
+    pthread_create(&sink_thread, NULL, sink_fn, &sink);
+    pthread_create(&origin_thread, NULL, origin_fn, &origin);
+
+    if (mode == MODE_LOOP)
+        relay_loop(upstream, client);
+    else
+        relay_splice(upstream, client, mode == MODE_SPLICE_TEE);
+    shutdown(client, SHUT_WR);
+
+    void *received;
+    pthread_join(origin_thread, NULL);
+    pthread_join(sink_thread, &received);
+    double elapsed = now_sec() - start;
+    if (*(size_t *)received != total_bytes)
+        fprintf(stderr, "%s: sink got %zu of %zu bytes\n", mode_names[mode], *(size_t *)received, total_bytes);
+    free(received);
+
+    close(upstream);
+    close(origin);
+    close(sink);
+    close(client);
+    close(origin_listen);
+    close(proxy_listen);
+    return total_bytes / elapsed / (1 << 20);
+}
+
+int main(int argc, char *argv[]) {
+    size_t megabytes = 256;
+    int rounds = 3;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:r:")) != -1) {
+        switch (opt) {
+            case 's':
+                megabytes = strtoul(optarg, NULL, 10);
+                break;
+            case 'r':
+                rounds = atoi(optarg);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-s megabytes] [-r rounds]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (rounds < 1)
+        rounds = 1;
+    total_bytes = megabytes << 20;
+
+    printf("relaying %zu MB, best of %d\n", megabytes, rounds);
+    printf("%-16s %10s %10s\n", "mode", "MB/s", "speedup");
+    double base = 0;
+    for (int mode = MODE_LOOP; mode <= MODE_SPLICE_TEE; mode++) {
+        double best = 0;
+        for (int i = 0; i < rounds; i++) {
+            double rate = run_round(mode);
+            if (rate > best)
+                best = rate;
+        }
+        if (mode == MODE_LOOP)
+            base = best;
+        printf("%-16s %10.0f %9.2fx\n", mode_names[mode], best, base > 0 ? best / base : 0);
+        fflush(stdout);
+    }
+    return 0;
+}
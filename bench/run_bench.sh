@@ -0,0 +1,121 @@
+#!/bin/bash
+#
+# run_bench.sh -- run the proxy's load-test scenarios on loopback.
+#
+# Starts bench/origin and, for each scenario and engine, a fresh proxy with
+# an empty cache, then drives it with bench/loadgen. Each scenario prints
+# one line of JSON (see loadgen.c), tagged with the engine; all lines are
+# also written to $OUT. Nothing leaves the machine.
+#
+# If $BASELINE names the output of an earlier run, each scenario's
+# throughput and p99 are printed next to the baseline's for comparison.
+#
+# Usage: bench/run_bench.sh [scenario...]
+#
+# Environment:
+#   ENGINES      engines to test (default "thread epoll")
+#   DURATION     seconds measured per scenario (default 10)
+#   WARMUP       seconds of warm-up before measuring (default 2)
+#   CONNECTIONS  concurrent client connections (default 32)
+#   RATE         requests/s for the open-loop scenario (default 5000)
+#   TRACE        trace to replay for the "trace" scenario
+#   PROXY_ARGS   extra proxy options, e.g. "-p wtinylfu -G"
+#   OUT          results file (default bench/results.jsonl)
+#   BASELINE     results file to compare against
+#
+
+cd "$(dirname "$0")/.." || exit 1
+
+ENGINES=${ENGINES:-"thread epoll"}
+DURATION=${DURATION:-10}
+WARMUP=${WARMUP:-2}
+CONNECTIONS=${CONNECTIONS:-32}
+RATE=${RATE:-5000}
+OUT=${OUT:-bench/results.jsonl}
+ORIGIN_PORT=${ORIGIN_PORT:-18080}
+PROXY_PORT=${PROXY_PORT:-18081}
+
+SCENARIOS=${*:-"hot zipf open no_store revalidate large"}
+[ -n "$TRACE" ] && [ -z "$*" ] && SCENARIOS="$SCENARIOS trace"
+
+for bin in proxy bench/origin bench/loadgen; do
+    if [ ! -x "$bin" ]; then
+        echo "$bin is not built; run make bench" >&2
+        exit 1
+    fi
+done
+
+origin_pid=
+proxy_pid=
+cleanup() {
+    [ -n "$proxy_pid" ] && kill "$proxy_pid" 2>/dev/null
+    [ -n "$origin_pid" ] && kill "$origin_pid" 2>/dev/null
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+wait_for_port() {
+    i=0
+    while ! (exec 3<>"/dev/tcp/127.0.0.1/$1") 2>/dev/null; do
+        i=$((i + 1))
+        if [ $i -ge 50 ]; then
+            echo "Nothing listening on port $1" >&2
+            exit 1
+        fi
+        sleep 0.1
+    done
+}
+
+./bench/origin -p "$ORIGIN_PORT" >/dev/null &
+origin_pid=$!
+wait_for_port "$ORIGIN_PORT"
+
+# scenario name -> loadgen options
+scenario_args() {
+    case "$1" in
+        hot)        echo "-n 100 -z 0 -q size=1024" ;;
+        zipf)       echo "-n 100000 -z 0.9 -q size=512-65536" ;;
+        open)       echo "-n 100000 -z 0.9 -q size=512-65536 -R $RATE" ;;
+        no_store)   echo "-n 10000 -z 0.9 -q size=4096&cc=no-store&delay=2" ;;
+        revalidate) echo "-n 1000 -z 0.9 -q size=4096&cc=revalidate" ;;
+        large)      echo "-n 64 -z 0 -q size=1048576" ;;
+        trace)      echo "-f $TRACE" ;;
+        *)          return 1 ;;
+    esac
+}
+
+: > "$OUT"
+for scenario in $SCENARIOS; do
+    if ! args=$(scenario_args "$scenario"); then
+        echo "Unknown scenario $scenario" >&2
+        exit 1
+    fi
+    for engine in $ENGINES; do
+        # shellcheck disable=SC2086
+        ./proxy -e "$engine" $PROXY_ARGS "$PROXY_PORT" >/dev/null 2>&1 &
+        proxy_pid=$!
+        wait_for_port "$PROXY_PORT"
+        # shellcheck disable=SC2086
+        ./bench/loadgen -p "$PROXY_PORT" -o "$ORIGIN_PORT" -c "$CONNECTIONS" -d "$DURATION" -w "$WARMUP" \
+            -l "$scenario" $args | sed "s/^{/{\"engine\": \"$engine\", /" | tee -a "$OUT"
+        kill "$proxy_pid"
+        wait "$proxy_pid" 2>/dev/null
+        proxy_pid=
+    done
+done
+
+if [ -n "$BASELINE" ]; then
+    echo
+    printf '%-12s %-8s %14s %14s %10s %10s\n' scenario engine "req/s base" "req/s now" "p99 base" "p99 now"
+    # field extraction from loadgen's one-line JSON, keyed by engine and label
+    extract() {
+        sed -n 's/.*"engine": "\([^"]*\)".*"label": "\([^"]*\)".*"throughput_rps": \([0-9.]*\).*"p99": \([0-9.]*\).*/\1 \2 \3 \4/p' "$1"
+    }
+    extract "$BASELINE" > "$OUT.base.tmp"
+    extract "$OUT" | while read -r engine label rps p99; do
+        base=$(awk -v e="$engine" -v l="$label" '$1 == e && $2 == l { print $3, $4 }' "$OUT.base.tmp")
+        set -- $base
+        printf '%-12s %-8s %14s %14s %10s %10s\n' "$label" "$engine" "${1:--}" "$rps" "${2:--}" "$p99"
+    done
+    rm -f "$OUT.base.tmp"
+fi
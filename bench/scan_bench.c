@@ -0,0 +1,121 @@
+/*
+ * scan_bench.c -- request parsing rate with each byte scanning
+ * implementation: the scalar loop, SSE4.2 and AVX2.
+ *
+ * The requests are browser-like, with about 1, 2 and 4 KB of headers; the
+ * larger ones carry longer cookie, referer and client hint values, which
+ * is where real requests grow. Every request is parsed with
+ * RequestView_parse() -n times on one thread per implementation and the
+ * best of -r rounds is reported. Implementations the CPU lacks are skipped.
+ *
+ * Usage: scan_bench [-n requests] [-r rounds]
+ */
+
+#include "proxy_parse.h"
+#include "proxy_scan.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+static const char head[] =
+    "GET http://www.example.com/app/dashboard/reports?range=30d&view=table HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "User-Agent: Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/125.0.0.0 Safari/537.36\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,*/*;q=0.8\r\n"
+    "Accept-Language: en-US,en;q=0.9,de;q=0.8\r\n"
+    "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+    "Connection: keep-alive\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "Sec-Fetch-Dest: document\r\n"
+    "Sec-Fetch-Mode: navigate\r\n"
+    "Sec-Fetch-Site: same-origin\r\n"
+    "Sec-Fetch-User: ?1\r\n"
+    "sec-ch-ua: \"Google Chrome\";v=\"125\", \"Chromium\";v=\"125\", \"Not.A/Brand\";v=\"24\"\r\n"
+    "sec-ch-ua-mobile: ?0\r\n"
+    "sec-ch-ua-platform: \"Windows\"\r\n"
+    "Cache-Control: max-age=0\r\n";
+
+/* Build a request with roughly target bytes of headers into buf */
+static size_t build_request(char *buf, size_t cap, size_t target) {
+    size_t len = snprintf(buf, cap, "%s", head);
+    len += snprintf(buf + len, cap - len, "Referer: http://www.example.com/app/dashboard?session=%0*d\r\n",
+                    (int)(target / 16), 7);
+    len += snprintf(buf + len, cap - len, "Cookie: ");
+    for (int i = 0; len + 64 < target && len + 64 < cap; i++)
+        len += snprintf(buf + len, cap - len, "%s_ga_%d=GS1.1.1718000000.%d.1.1718000%03d.0.0.0", i ? "; " : "", i, i, i);
+    len += snprintf(buf + len, cap - len, "\r\n\r\n");
+    return len;
+}
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Parse the request n times and return the rate in requests/s */
+static double run_round(const char *req, size_t len, long n) {
+    size_t check = 0;
+    double start = now_sec();
+    for (long i = 0; i < n; i++) {
+        struct RequestView rv;
+        if (RequestView_parse(&rv, req, len) == 0)
+            check += rv.headersused;
+        RequestView_release(&rv);
+    }
+    double elapsed = now_sec() - start;
+    if (check == 0)
+        fprintf(stderr, "request did not parse\n");
+    return n / elapsed;
+}
+
+int main(int argc, char *argv[]) {
+    long requests = 200000;
+    int rounds = 3;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:r:")) != -1) {
+        switch (opt) {
+            case 'n':
+                requests = strtol(optarg, NULL, 10);
+                break;
+            case 'r':
+                rounds = atoi(optarg);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-n requests] [-r rounds]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (rounds < 1)
+        rounds = 1;
+    if (requests < 1)
+        requests = 1;
+
+    static const size_t sizes[] = {1024, 2048, 4096};
+    char req[8192];
+    printf("parsing browser-like requests %ld times, best of %d\n", requests, rounds);
+    printf("%-7s %-8s %12s %10s %10s %9s\n", "size", "scanner", "requests/s", "ns/req", "MB/s", "speedup");
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        size_t len = build_request(req, sizeof(req), sizes[s]);
+        double base = 0;
+        for (int level = SCAN_SCALAR; level <= SCAN_AVX2; level++) {
+            if (scan_set_level(level) != level)
+                continue;
+            double best = 0;
+            for (int i = 0; i < rounds; i++) {
+                double rate = run_round(req, len, requests);
+                if (rate > best)
+                    best = rate;
+            }
+            if (level == SCAN_SCALAR)
+                base = best;
+            printf("%-7zu %-8s %12.0f %10.1f %10.0f %8.2fx\n", len, scan_level_name(level), best, 1e9 / best,
+                   best * len / 1e6, best / base);
+            fflush(stdout);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,134 @@
+/*
+ * slab_bench.c -- memory held by the cache against its budget as the mix
+ * of response sizes shifts.
+ *
+ * The cache is filled in phases, each storing twice MAX_SIZE worth of
+ * responses with sizes drawn from its own range: small (100 B-2 KB), then
+ * large (64-512 KB), then small again, then both mixed. Once the small
+ * responses are gone the slab has to move pages from class to class. After
+ * each phase the bytes the cache is charged, the bytes its responses and
+ * keys asked for, the process's resident memory, and the pages reclaimed
+ * from one class for another are reported. Resident memory should stay
+ * near MAX_SIZE however many phases have run.
+ *
+ * Usage: slab_bench [-G (huge pages)] [-r rounds of the phases]
+ */
+
+#include "proxy_cache.h"
+#include "proxy_slab.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#define BENCH_SHARDS 16
+
+struct phase {
+     const char *name;
+     size_t min;
+     size_t max;
+};
+
+static const struct phase phases[] = {
+    {"small", 100, 2 << 10},
+    {"large", 64 << 10, 512 << 10},
+    {"small again", 100, 2 << 10},
+    {"mixed", 100, 512 << 10},
+};
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static uint64_t next_random(uint64_t *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+static size_t resident_bytes(void) {
+    unsigned long size, resident;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (!f)
+        return 0;
+    if (fscanf(f, "%lu %lu", &size, &resident) != 2)
+        resident = 0;
+    fclose(f);
+    return resident * (size_t)sysconf(_SC_PAGESIZE);
+}
+
+/* Store twice the budget of responses with sizes in [p->min, p->max] */
+static void run_phase(const struct phase *p, const char *data, long *next_key, uint64_t *state) {
+    size_t stored = 0;
+    unsigned long count = 0, refused = 0;
+    char buf[128];
+    double start = now_ms();
+    while (stored < 2 * (size_t)(MAX_SIZE)) {
+        size_t size = p->min + next_random(state) % (p->max - p->min + 1);
+        cache_key key;
+        struct seg_buffer body;
+        size_t len = snprintf(buf, sizeof(buf), "GET http://media.example.com/objects/%08ld", (*next_key)++);
+        cache_key_borrow(&key, buf, len);
+        seg_buffer_init(&body);
+        if (seg_buffer_append(&body, data, size) < 0 ||
+            !add_cache_element(&body, &key, CACHE_HAS_VALIDATORS, time(NULL) + 3600, NULL)) {
+            seg_buffer_free(&body);
+            refused++;
+        }
+        stored += size;
+        count++;
+    }
+    double elapsed = now_ms() - start;
+
+    struct slab_stats st;
+    slab_stats(&st);
+    printf("%-12s %8lu %7lu %8zu %9.1f %9.1f %9.1f %6.1f%% %8lu %8.0f\n", p->name, count, refused, cache_count(),
+           cache_bytes() / 1048576.0, st.requested / 1048576.0, resident_bytes() / 1048576.0,
+           100.0 * resident_bytes() / (size_t)(MAX_SIZE), st.reclaimed, elapsed);
+    fflush(stdout);
+}
+
+int main(int argc, char *argv[]) {
+    int hugepages = 0, rounds = 1;
+    int opt;
+    while ((opt = getopt(argc, argv, "Gr:")) != -1) {
+        switch (opt) {
+            case 'G':
+                hugepages = 1;
+                break;
+            case 'r':
+                rounds = atoi(optarg);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-G (huge pages)] [-r rounds]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    cache_set_hugepages(hugepages);
+    if (cache_init(BENCH_SHARDS) < 0)
+        return 1;
+    char *data = (char *)malloc(phases[1].max);
+    if (!data)
+        return 1;
+    memset(data, 'x', phases[1].max);
+
+    struct slab_stats st;
+    slab_stats(&st);
+    static const char *const backing[] = {"small pages", "transparent huge pages", "huge pages"};
+    printf("%d MB cache on %s, %zu size classes\n", (MAX_SIZE) >> 20, backing[st.backing], (size_t)slab_classes());
+    printf("%-12s %8s %7s %8s %9s %9s %9s %7s %8s %8s\n", "phase", "stored", "refused", "entries", "charged",
+           "requested", "RSS MB", "budget", "reclaims", "ms");
+    long next_key = 0;
+    uint64_t state = 0x2545f4914f6cdd1dULL;
+    for (int r = 0; r < rounds; r++) {
+        for (size_t i = 0; i < sizeof(phases) / sizeof(phases[0]); i++)
+            run_phase(phases + i, data, &next_key, &state);
+    }
+    free(data);
+    return 0;
+}
@@ -0,0 +1,165 @@
+/*
+ * snapshot_bench.c -- time to save a full memory cache to a snapshot and
+ * to start again from it.
+ *
+ * A child process fills a cache of MAX_SIZE bytes with -s byte responses
+ * and saves it to -f. The snapshot's pages are then dropped from the page
+ * cache, so that reading it back goes to the disk, and the parent, with an
+ * empty cache, loads it. Reported are the save, the load (mapping the file
+ * and rebuilding the index, after which the proxy could serve), and two
+ * passes of lookups over every key: the first pages each response in and
+ * checks it, the second finds it resident.
+ *
+ * Usage: snapshot_bench [-f file] [-s response size] [-k (keep the file)]
+ */
+
+#include "proxy_cache.h"
+#include "proxy_snapshot.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/wait.h>
+
+#define BENCH_SHARDS 16
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static void make_key(cache_key *key, char *buf, size_t cap, long i) {
+    size_t len = snprintf(buf, cap, "GET http://static.example.com/assets/%08ld.js", i);
+    cache_key_borrow(key, buf, len);
+}
+
+/* Fill the cache to nine tenths of its budget and save it. Returns the count saved. */
+static long fill_and_save(const char *path, size_t size) {
+    char *data = (char *)malloc(size);
+    if (!data)
+        return -1;
+    for (size_t i = 0; i < size; i++)
+        data[i] = "0123456789abcdefghijklmnopqrstuvwxyz\n"[(i * 7 + i / 37) % 37];
+
+    size_t per_entry = size + 64 + sizeof(cache_element);
+    long count = (long)(MAX_SIZE / per_entry) * 9 / 10;
+    char buf[128];
+    for (long i = 0; i < count; i++) {
+        cache_key key;
+        struct seg_buffer body;
+        make_key(&key, buf, sizeof(buf), i);
+        seg_buffer_init(&body);
+        memcpy(data, &i, sizeof(i));
+        if (seg_buffer_append(&body, data, size) < 0 ||
+            !add_cache_element(&body, &key, CACHE_HAS_VALIDATORS, time(NULL) + 3600, NULL))
+            seg_buffer_free(&body);
+    }
+    free(data);
+
+    double start = now_ms();
+    long saved = snapshot_save(path);
+    double elapsed = now_ms() - start;
+    if (saved < 0)
+        return -1;
+    printf("%-22s %8ld entries %8.1f MB %10.1f ms %8.0f MB/s\n", "save", saved,
+           saved * (double)size / (1 << 20), elapsed, saved * (double)size / (1 << 20) / (elapsed / 1e3));
+    return saved;
+}
+
+/* Look up keys 0..count-1 and return the ms taken, or -1 if one is missing */
+static double lookup_pass(long count) {
+    char buf[128];
+    double start = now_ms();
+    for (long i = 0; i < count; i++) {
+        cache_key key;
+        make_key(&key, buf, sizeof(buf), i);
+        cache_element *e = find(&key);
+        if (!e)
+            return -1;
+        long id;
+        cache_element_copyout(e, 0, (char *)&id, sizeof(id));
+        cache_release(e);
+        if (id != i)
+            return -1;
+    }
+    return now_ms() - start;
+}
+
+int main(int argc, char *argv[]) {
+    const char *path = "snapshot_bench.snap";
+    size_t size = 32 * 1024;
+    int keep = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "f:s:k")) != -1) {
+        switch (opt) {
+            case 'f':
+                path = optarg;
+                break;
+            case 's':
+                size = strtoul(optarg, NULL, 10);
+                break;
+            case 'k':
+                keep = 1;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-f file] [-s response size] [-k]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (size < sizeof(long))
+        size = sizeof(long);
+
+    printf("snapshot of a %d MB cache of %zu byte responses in %s\n", MAX_SIZE >> 20, size, path);
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        if (cache_init(BENCH_SHARDS) < 0)
+            _exit(1);
+        int ret = fill_and_save(path, size) < 0;
+        fflush(stdout);
+        _exit(ret);
+    }
+    int status;
+    if (pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "saving the snapshot failed\n");
+        return 1;
+    }
+
+    int fd = open(path, O_RDONLY);
+    if (fd >= 0) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+
+    if (cache_init(BENCH_SHARDS) < 0)
+        return 1;
+    double start = now_ms();
+    long loaded = snapshot_load(path);
+    double elapsed = now_ms() - start;
+    if (loaded <= 0) {
+        fprintf(stderr, "loading the snapshot failed\n");
+        return 1;
+    }
+    double mb = loaded * (double)size / (1 << 20);
+    printf("%-22s %8ld entries %8.1f MB %10.1f ms\n", "load (index)", loaded, mb, elapsed);
+    const char *passes[] = {"first hits (page in)", "second hits"};
+    for (int i = 0; i < 2; i++) {
+        double ms = lookup_pass(loaded);
+        if (ms < 0) {
+            fprintf(stderr, "an entry was lost\n");
+            return 1;
+        }
+        printf("%-22s %8ld entries %8.1f MB %10.1f ms %8.0f ns/hit\n", passes[i], loaded, mb, ms, ms * 1e6 / loaded);
+    }
+
+    struct snapshot_stats st;
+    snapshot_stats(&st);
+    printf("checked %lu, corrupt %lu\n", st.verified, st.corrupt);
+    if (!keep)
+        unlink(path);
+    return 0;
+}
@@ -0,0 +1,155 @@
+/*
+  proxy_arena.c -- bump-pointer arenas for per-request allocations.
+
+  Chunks are kept on a list, newest first, so resetting to a mark releases
+  the chunks allocated after it by walking the list from the head. Each
+  arena counts its own allocations and adds them to the shared totals only
+  when it is reset, so the counters cost one atomic add per request rather
+  than one per allocation.
+*/
+
+#include "proxy_arena.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#define ARENA_ALIGN 16
+#define ALIGN_UP(n) (((n) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+struct arena_chunk {
+    struct arena_chunk *next;    /* allocated before this one */
+    size_t size;                 /* usable bytes */
+};
+
+#define CHUNK_HEADER ALIGN_UP(sizeof(struct arena_chunk))
+
+static atomic_ulong stat_requests, stat_allocs, stat_bytes, stat_mallocs;
+
+static __thread struct arena *thread_cache[ARENA_THREAD_CACHE];
+static __thread int thread_cached;
+
+static char *chunk_data(struct arena_chunk *c) {
+    return (char *)c + CHUNK_HEADER;
+}
+
+static void chunk_release(struct arena *a, struct arena_chunk *c) {
+    if (c->size == ARENA_CHUNK && !a->spare) {
+        c->next = NULL;
+        a->spare = c;
+    } else {
+        free(c);
+    }
+}
+
+/* Start a chunk with room for size bytes */
+static int arena_grow(struct arena *a, size_t size) {
+    struct arena_chunk *c;
+    if (size <= ARENA_CHUNK && a->spare) {
+        c = a->spare;
+        a->spare = NULL;
+    } else {
+        size_t cap = size > ARENA_CHUNK ? size : ARENA_CHUNK;
+        c = (struct arena_chunk *)malloc(CHUNK_HEADER + cap);
+        if (!c)
+            return -1;
+        c->size = cap;
+        a->mallocs++;
+    }
+    c->next = a->chunk;
+    a->chunk = c;
+    a->ptr = chunk_data(c);
+    a->end = a->ptr + c->size;
+    return 0;
+}
+
+void *arena_alloc(struct arena *a, size_t size) {
+    size = ALIGN_UP(size ? size : 1);
+    a->allocs++;
+    a->bytes += size;
+    if ((size_t)(a->end - a->ptr) < size && arena_grow(a, size) < 0)
+        return NULL;
+    void *p = a->ptr;
+    a->ptr += size;
+    return p;
+}
+
+void *arena_realloc(struct arena *a, void *p, size_t old_size, size_t new_size) {
+    char *old_end = (char *)p + ALIGN_UP(old_size);
+    if (p && old_end == a->ptr && new_size >= old_size && (size_t)(a->end - (char *)p) >= ALIGN_UP(new_size)) {
+        a->allocs++;
+        a->bytes += ALIGN_UP(new_size) - ALIGN_UP(old_size);
+        a->ptr = (char *)p + ALIGN_UP(new_size);
+        return p;
+    }
+    void *q = arena_alloc(a, new_size);
+    if (q && p)
+        memcpy(q, p, old_size < new_size ? old_size : new_size);
+    return q;
+}
+
+char *arena_strndup(struct arena *a, const char *s, size_t len) {
+    char *copy = (char *)arena_alloc(a, len + 1);
+    if (copy) {
+        memcpy(copy, s, len);
+        copy[len] = '\0';
+    }
+    return copy;
+}
+
+struct arena_mark arena_mark(struct arena *a) {
+    struct arena_mark mark = {a->chunk, a->ptr};
+    return mark;
+}
+
+static void arena_flush(struct arena *a, int request) {
+    if (request)
+        atomic_fetch_add(&stat_requests, 1);
+    atomic_fetch_add(&stat_allocs, a->allocs);
+    atomic_fetch_add(&stat_bytes, a->bytes);
+    atomic_fetch_add(&stat_mallocs, a->mallocs);
+    a->allocs = a->bytes = a->mallocs = 0;
+}
+
+static void arena_rewind(struct arena *a, struct arena_mark mark) {
+    while (a->chunk != mark.chunk) {
+        struct arena_chunk *c = a->chunk;
+        a->chunk = c->next;
+        chunk_release(a, c);
+    }
+    if (mark.chunk) {
+        a->ptr = mark.ptr;
+        a->end = chunk_data(mark.chunk) + mark.chunk->size;
+    } else {
+        a->ptr = a->end = NULL;
+    }
+}
+
+void arena_reset(struct arena *a, struct arena_mark mark) {
+    arena_rewind(a, mark);
+    arena_flush(a, 1);
+}
+
+struct arena *arena_acquire(void) {
+    if (thread_cached > 0)
+        return thread_cache[--thread_cached];
+    return (struct arena *)calloc(1, sizeof(struct arena));
+}
+
+void arena_recycle(struct arena *a) {
+    struct arena_mark empty = {NULL, NULL};
+    arena_rewind(a, empty);
+    arena_flush(a, 0);
+    if (thread_cached < ARENA_THREAD_CACHE) {
+        thread_cache[thread_cached++] = a;
+        return;
+    }
+    free(a->spare);
+    free(a);
+}
+
+void arena_stats(struct arena_stats *st) {
+    st->requests = atomic_load(&stat_requests);
+    st->allocs = atomic_load(&stat_allocs);
+    st->bytes = atomic_load(&stat_bytes);
+    st->mallocs = atomic_load(&stat_mallocs);
+}
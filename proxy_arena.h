@@ -0,0 +1,87 @@
+/*
+ * proxy_arena.h -- bump-pointer arenas for per-request allocations.
+ *
+ * Every connection owns an arena. What lasts as long as the connection
+ * (its receive buffer) is allocated first and marked; everything a request
+ * needs while it is served -- the ParsedRequest with its header array and
+ * strings, the cache key, the upstream request and the buffers the
+ * response headers are read into -- is bumped off the arena above the mark
+ * and released in one step by resetting the arena to the mark once the
+ * request is done. Nothing in an arena is freed individually.
+ *
+ * An arena grows in ARENA_CHUNK sized chunks, allocations too large for
+ * one getting a chunk of their own. One chunk released by a reset is kept
+ * for the next request. Arenas of closed connections go back to a small
+ * cache of the thread that served them, so a worker or event loop
+ * settles into serving requests without calling malloc() at all.
+ */
+
+#ifndef PROXY_ARENA
+#define PROXY_ARENA
+
+#include <stddef.h>
+
+#define ARENA_CHUNK (16 * 1024)
+#define ARENA_THREAD_CACHE 8     /* idle arenas kept per thread */
+
+struct arena_chunk;
+
+struct arena {
+     struct arena_chunk *chunk;   /* being allocated from; earlier ones follow it */
+     char *ptr;                   /* next free byte in chunk */
+     char *end;
+     struct arena_chunk *spare;   /* a released chunk, for reuse */
+     unsigned long allocs;        /* counted until the next reset */
+     unsigned long bytes;
+     unsigned long mallocs;
+};
+
+/* Position to reset an arena back to */
+struct arena_mark {
+     struct arena_chunk *chunk;
+     char *ptr;
+};
+
+/* Allocation counts over all arenas, per request reset */
+struct arena_stats {
+     unsigned long requests;
+     unsigned long allocs;        /* arena_alloc() calls */
+     unsigned long bytes;         /* bytes handed out */
+     unsigned long mallocs;       /* of those, calls that went to malloc() */
+};
+
+/*
+   An empty arena, from the calling thread's cache if it has one. Returns
+   NULL if none can be allocated.
+ */
+struct arena *arena_acquire(void);
+
+/* Release everything in a and return it to the calling thread's cache */
+void arena_recycle(struct arena *a);
+
+/*
+   size bytes aligned for any type. Returns NULL if a new chunk is needed
+   and cannot be allocated.
+ */
+void *arena_alloc(struct arena *a, size_t size);
+
+/*
+   Grow p, of old_size bytes, to new_size: in place if it is the latest
+   allocation and there is room, else by copying it.
+ */
+void *arena_realloc(struct arena *a, void *p, size_t old_size, size_t new_size);
+
+/* NUL terminated copy of the first len bytes of s */
+char *arena_strndup(struct arena *a, const char *s, size_t len);
+
+struct arena_mark arena_mark(struct arena *a);
+
+/*
+   Release everything allocated since mark was taken, at the end of a
+   request, and add the request's allocations to the totals.
+ */
+void arena_reset(struct arena *a, struct arena_mark mark);
+
+void arena_stats(struct arena_stats *st);
+
+#endif
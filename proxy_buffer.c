@@ -0,0 +1,219 @@
+/*
+  proxy_buffer.c -- segmented byte buffers for responses.
+*/
+
+#include "proxy_buffer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#define SEG_LOCAL_MAX 32          /* free segments cached per thread */
+#define SEG_POOL_MAX 1024         /* free segments shared by all threads */
+#define SEG_IOV_MAX 64            /* iovecs per sendmsg() */
+
+static __thread struct seg *local_free;
+static __thread int local_count;
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct seg *pool_free;
+static int pool_count;
+
+/*
+  Segment pool private functions
+*/
+
+static struct seg *seg_alloc(void) {
+    struct seg *s = local_free;
+    if (s) {
+        local_free = s->next;
+        local_count--;
+    } else {
+        pthread_mutex_lock(&pool_lock);
+        s = pool_free;
+        if (s) {
+            pool_free = s->next;
+            pool_count--;
+        }
+        pthread_mutex_unlock(&pool_lock);
+    }
+    if (!s) {
+        s = (struct seg *)malloc(sizeof(struct seg) + SEG_SIZE);
+        if (!s)
+            return NULL;
+    }
+    s->next = NULL;
+    s->len = 0;
+    s->cap = SEG_SIZE;
+    return s;
+}
+
+static void seg_release(struct seg *s) {
+    if (s->cap != SEG_SIZE) {
+        free(s);
+        return;
+    }
+    if (local_count < SEG_LOCAL_MAX) {
+        s->next = local_free;
+        local_free = s;
+        local_count++;
+        return;
+    }
+    pthread_mutex_lock(&pool_lock);
+    if (pool_count < SEG_POOL_MAX) {
+        s->next = pool_free;
+        pool_free = s;
+        pool_count++;
+        s = NULL;
+    }
+    pthread_mutex_unlock(&pool_lock);
+    free(s);
+}
+
+/*
+  Buffer functions
+*/
+
+void seg_buffer_init(struct seg_buffer *b) {
+    b->head = b->tail = NULL;
+    b->len = 0;
+    b->nsegs = 0;
+}
+
+void seg_buffer_free(struct seg_buffer *b) {
+    struct seg *s = b->head;
+    while (s) {
+        struct seg *next = s->next;
+        seg_release(s);
+        s = next;
+    }
+    seg_buffer_init(b);
+}
+
+void seg_buffer_move(struct seg_buffer *dst, struct seg_buffer *src) {
+    *dst = *src;
+    seg_buffer_init(src);
+}
+
+char *seg_buffer_reserve(struct seg_buffer *b, size_t *avail) {
+    if (!b->tail || b->tail->len == b->tail->cap) {
+        struct seg *s = seg_alloc();
+        if (!s)
+            return NULL;
+        if (b->tail)
+            b->tail->next = s;
+        else
+            b->head = s;
+        b->tail = s;
+        b->nsegs++;
+    }
+    *avail = b->tail->cap - b->tail->len;
+    return b->tail->data + b->tail->len;
+}
+
+void seg_buffer_commit(struct seg_buffer *b, size_t len) {
+    b->tail->len += len;
+    b->len += len;
+}
+
+int seg_buffer_append(struct seg_buffer *b, const char *data, size_t len) {
+    while (len > 0) {
+        size_t avail;
+        char *dst = seg_buffer_reserve(b, &avail);
+        if (!dst)
+            return -1;
+        size_t n = len < avail ? len : avail;
+        memcpy(dst, data, n);
+        seg_buffer_commit(b, n);
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int seg_buffer_append_range(struct seg_buffer *b, const struct seg_buffer *src, size_t offset, size_t len) {
+    for (struct seg *s = src->head; s && len > 0; s = s->next) {
+        if (offset >= s->len) {
+            offset -= s->len;
+            continue;
+        }
+        size_t n = s->len - offset < len ? s->len - offset : len;
+        if (seg_buffer_append(b, s->data + offset, n) < 0)
+            return -1;
+        len -= n;
+        offset = 0;
+    }
+    return 0;
+}
+
+size_t seg_buffer_copyout(const struct seg_buffer *b, size_t offset, char *dst, size_t len) {
+    size_t copied = 0;
+    for (struct seg *s = b->head; s && copied < len; s = s->next) {
+        if (offset >= s->len) {
+            offset -= s->len;
+            continue;
+        }
+        size_t n = s->len - offset < len - copied ? s->len - offset : len - copied;
+        memcpy(dst + copied, s->data + offset, n);
+        copied += n;
+        offset = 0;
+    }
+    return copied;
+}
+
+void seg_buffer_trim(struct seg_buffer *b) {
+    struct seg *tail = b->tail;
+    if (!tail || tail->len == tail->cap)
+        return;
+    struct seg *s = (struct seg *)malloc(sizeof(struct seg) + tail->len);
+    if (!s)
+        return;
+    memcpy(s->data, tail->data, tail->len);
+    s->next = NULL;
+    s->len = s->cap = tail->len;
+
+    if (b->head == tail) {
+        b->head = s;
+    } else {
+        struct seg *prev = b->head;
+        while (prev->next != tail)
+            prev = prev->next;
+        prev->next = s;
+    }
+    b->tail = s;
+    seg_release(tail);
+}
+
+size_t seg_buffer_footprint(const struct seg_buffer *b) {
+    size_t bytes = 0;
+    for (struct seg *s = b->head; s; s = s->next)
+        bytes += sizeof(struct seg) + s->cap;
+    return bytes;
+}
+
+int seg_buffer_iov(const struct seg_buffer *b, size_t offset, struct iovec *iov, int max) {
+    int n = 0;
+    for (struct seg *s = b->head; s && n < max; s = s->next) {
+        if (offset >= s->len) {
+            offset -= s->len;
+            continue;
+        }
+        iov[n].iov_base = s->data + offset;
+        iov[n].iov_len = s->len - offset;
+        n++;
+        offset = 0;
+    }
+    return n;
+}
+
+ssize_t seg_buffer_send(const struct seg_buffer *b, int fd, size_t offset, int flags) {
+    struct iovec iov[SEG_IOV_MAX];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = seg_buffer_iov(b, offset, iov, SEG_IOV_MAX);
+    if (msg.msg_iovlen == 0)
+        return 0;
+    return sendmsg(fd, &msg, flags);
+}
@@ -0,0 +1,78 @@
+/*
+ * proxy_buffer.h -- segmented byte buffers for responses.
+ *
+ * A seg_buffer is a singly-linked list of fixed-size segments plus the
+ * total length. Appending never moves bytes already stored, so a response
+ * of any size is accumulated with one copy per byte, and the segments can
+ * be handed to writev()/sendmsg() as they are. The same buffer is the body
+ * of a cache entry, so a response moves from the miss path into the cache
+ * without being flattened. Contents are arbitrary bytes; nothing relies on
+ * NUL termination.
+ *
+ * Full-size segments come from a pool: each thread keeps a few free ones
+ * and shares the rest through a global free list, so steady-state traffic
+ * does not go through malloc().
+ */
+
+#ifndef PROXY_BUFFER
+#define PROXY_BUFFER
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define SEG_SIZE (16 * 1024)
+
+struct seg {
+     struct seg *next;
+     size_t len;                  /* bytes used */
+     size_t cap;                  /* SEG_SIZE, or less once trimmed */
+     char data[];
+};
+
+struct seg_buffer {
+     struct seg *head;
+     struct seg *tail;
+     size_t len;                  /* total bytes */
+     size_t nsegs;
+};
+
+void seg_buffer_init(struct seg_buffer *b);
+
+/* Return all segments to the pool and empty b */
+void seg_buffer_free(struct seg_buffer *b);
+
+/* Move the contents of src to dst, which must be empty, leaving src empty */
+void seg_buffer_move(struct seg_buffer *dst, struct seg_buffer *src);
+
+int seg_buffer_append(struct seg_buffer *b, const char *data, size_t len);
+
+/* Append len bytes of src starting at offset */
+int seg_buffer_append_range(struct seg_buffer *b, const struct seg_buffer *src, size_t offset, size_t len);
+
+/*
+   Free space at the end of b, adding a segment if the last one is full.
+   Write up to *avail bytes there and pass the count to seg_buffer_commit().
+ */
+char *seg_buffer_reserve(struct seg_buffer *b, size_t *avail);
+void seg_buffer_commit(struct seg_buffer *b, size_t len);
+
+/* Copy up to len bytes starting at offset into dst. Returns the count. */
+size_t seg_buffer_copyout(const struct seg_buffer *b, size_t offset, char *dst, size_t len);
+
+/* Shrink the last segment to its contents, for buffers kept a long time */
+void seg_buffer_trim(struct seg_buffer *b);
+
+/* Bytes of memory b holds, segment headers included */
+size_t seg_buffer_footprint(const struct seg_buffer *b);
+
+/* Describe the bytes from offset on in at most max iovecs. Returns the count. */
+int seg_buffer_iov(const struct seg_buffer *b, size_t offset, struct iovec *iov, int max);
+
+/*
+   Send the bytes from offset on to the socket fd with one sendmsg() call.
+   Returns the number of bytes sent or -1 as sendmsg() does.
+ */
+ssize_t seg_buffer_send(const struct seg_buffer *b, int fd, size_t offset, int flags);
+
+#endif
@@ -0,0 +1,712 @@
+/*
+  proxy_cache.c -- in-memory cache of upstream responses.
+
+  The cache is split into a power-of-two number of shards chosen by the key
+  hash. Each shard has its own reader/writer lock, index, recency list and
+  slice of MAX_SIZE, so unrelated keys never contend.
+
+  The index is an open-addressing table with linear probing. Each slot holds
+  the key's full 64-bit hash next to the entry pointer, so probes compare
+  keys only when the hashes match, and deletion uses backward shifting so
+  no tombstones accumulate.
+
+  Which entry is evicted is left to the shard's instance of the eviction
+  policy (see proxy_policy.h). Hits only hold the shard's read lock, so
+  they merely report the access; reordering is deferred to the writers,
+  which ask the policy for victims.
+
+  Evicted responses bound for the disk tier are detached under the shard
+  lock and chained through their now unused next pointers; they are handed
+  to the tier only once the lock is dropped.
+
+  Entries live in slab chunks (see proxy_slab.h): the element with its key
+  in one, the response in chunks of up to one segment each, copied there
+  when the entry is added. An entry's size is what its chunks are charged,
+  computed before anything is allocated so that the shard can make room
+  first; the slab only has to reclaim pages when the chunks freed by the
+  policy's victims are of the wrong class.
+*/
+
+#define _GNU_SOURCE
+#include "proxy_cache.h"
+#include "proxy_disk.h"
+#include "proxy_snapshot.h"
+#include "proxy_policy.h"
+#include "proxy_slab.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#define CACHE_INITIAL_SLOTS 1024
+#define CACHE_SHARD_SHIFT 40     /* shard bits are taken above the index bits */
+
+struct cache_slot {
+    uint64_t hash;
+    cache_element *element;   /* NULL for an empty slot */
+};
+
+struct cache_shard {
+    pthread_rwlock_t lock;
+    struct cache_slot *table;
+    size_t table_mask;
+    size_t count;
+
+    void *policy;             /* the eviction policy's state */
+    size_t cache_size;
+    size_t budget;
+
+    atomic_ulong acquisitions;
+    atomic_ulong contended;
+    atomic_ulong wait_ns;
+    atomic_ulong hits;
+    atomic_ulong misses;
+} __attribute__((aligned(64)));
+
+static struct cache_shard *shards;
+static unsigned shard_mask;
+static size_t max_element;
+static const struct cache_policy *policy = &policy_lru;
+static int use_hugepages;
+static atomic_size_t pinned_bytes;     /* evicted but still being read */
+
+/* FNV-1a */
+uint64_t cache_hash(const char *key, size_t len) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)key[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+void cache_key_set(cache_key *key, char *str, size_t len) {
+    key->str = str;
+    key->len = len;
+    key->hash = cache_hash(str, len);
+    key->owned = 1;
+}
+
+void cache_key_borrow(cache_key *key, char *str, size_t len) {
+    cache_key_set(key, str, len);
+    key->owned = 0;
+}
+
+void cache_key_free(cache_key *key) {
+    if (key->owned)
+        free(key->str);
+    key->str = NULL;
+    key->len = 0;
+}
+
+static struct cache_shard *shard_for(uint64_t hash) {
+    return shards + ((hash >> CACHE_SHARD_SHIFT) & shard_mask);
+}
+
+/*
+  Shard locking. The uncontended path is a single trylock; only when it
+  fails is the wait timed.
+*/
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void shard_lock(struct cache_shard *s, int exclusive) {
+    int busy = exclusive ? pthread_rwlock_trywrlock(&s->lock) : pthread_rwlock_tryrdlock(&s->lock);
+    if (busy) {
+        uint64_t start = now_ns();
+        if (exclusive)
+            pthread_rwlock_wrlock(&s->lock);
+        else
+            pthread_rwlock_rdlock(&s->lock);
+        atomic_fetch_add_explicit(&s->wait_ns, now_ns() - start, memory_order_relaxed);
+        atomic_fetch_add_explicit(&s->contended, 1, memory_order_relaxed);
+    }
+    atomic_fetch_add_explicit(&s->acquisitions, 1, memory_order_relaxed);
+}
+
+static void shard_unlock(struct cache_shard *s) {
+    pthread_rwlock_unlock(&s->lock);
+}
+
+int cache_set_policy(const char *name) {
+    const struct cache_policy *p = policy_find(name);
+    if (!p)
+        return -1;
+    policy = p;
+    return 0;
+}
+
+const char *cache_policy_name(void) {
+    return policy->name;
+}
+
+void cache_set_hugepages(int on) {
+    use_hugepages = on;
+}
+
+static void evict_hash(uint64_t hash);
+
+int cache_init(unsigned nshards) {
+    if (nshards == 0 || (nshards & (nshards - 1))) {
+        fprintf(stderr, "Cache shard count must be a power of two\n");
+        return -1;
+    }
+    size_t budget = (size_t)(MAX_SIZE) / nshards;
+    max_element = budget / SHARD_ELEMENT_SHARE;
+    if (max_element > (size_t)(MAX_ELEMENT_SIZE))
+        max_element = MAX_ELEMENT_SIZE;
+    if (max_element < MIN_ELEMENT_SIZE) {
+        fprintf(stderr, "Too many cache shards: each would get %zu bytes\n", budget);
+        return -1;
+    }
+    if (slab_init((size_t)(MAX_SIZE), use_hugepages, evict_hash) < 0)
+        return -1;
+    shards = (struct cache_shard *)aligned_alloc(64, nshards * sizeof(struct cache_shard));
+    if (!shards)
+        return -1;
+    memset(shards, 0, nshards * sizeof(struct cache_shard));
+    shard_mask = nshards - 1;
+
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    /* a steady stream of hits must not starve inserts */
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    for (unsigned i = 0; i < nshards; i++) {
+        struct cache_shard *s = shards + i;
+        pthread_rwlock_init(&s->lock, &attr);
+        s->table = (struct cache_slot *)calloc(CACHE_INITIAL_SLOTS, sizeof(struct cache_slot));
+        if (!s->table)
+            return -1;
+        s->table_mask = CACHE_INITIAL_SLOTS - 1;
+        s->budget = budget;
+        s->policy = policy->create(s->budget);
+        if (!s->policy)
+            return -1;
+    }
+    pthread_rwlockattr_destroy(&attr);
+    return 0;
+}
+
+unsigned cache_shards(void) {
+    return shard_mask + 1;
+}
+
+size_t cache_max_element(void) {
+    return max_element;
+}
+
+/*
+  Index private functions. Lookups need the shard's read lock, changes its
+  write lock.
+*/
+
+static size_t index_lookup(struct cache_shard *s, uint64_t hash, const char *key, size_t len) {
+    size_t i = hash & s->table_mask;
+    while (s->table[i].element) {
+        cache_element *e = s->table[i].element;
+        if (s->table[i].hash == hash && e->url_len == len && !memcmp(e->url, key, len))
+            return i;
+        i = (i + 1) & s->table_mask;
+    }
+    return (size_t)-1;
+}
+
+static void index_place(struct cache_slot *slots, size_t mask, uint64_t hash, cache_element *e) {
+    size_t i = hash & mask;
+    while (slots[i].element)
+        i = (i + 1) & mask;
+    slots[i].hash = hash;
+    slots[i].element = e;
+}
+
+static int index_grow(struct cache_shard *s) {
+    size_t slots = (s->table_mask + 1) * 2;
+    struct cache_slot *bigger = (struct cache_slot *)calloc(slots, sizeof(struct cache_slot));
+    if (!bigger)
+        return -1;
+    for (size_t i = 0; i <= s->table_mask; i++) {
+        if (s->table[i].element)
+            index_place(bigger, slots - 1, s->table[i].hash, s->table[i].element);
+    }
+    free(s->table);
+    s->table = bigger;
+    s->table_mask = slots - 1;
+    return 0;
+}
+
+static int index_insert(struct cache_shard *s, cache_element *e) {
+    /* keep the load factor under 0.7 */
+    if ((s->count + 1) * 10 > (s->table_mask + 1) * 7 && index_grow(s) < 0)
+        return -1;
+    index_place(s->table, s->table_mask, e->hash, e);
+    s->count++;
+    return 0;
+}
+
+/* Remove slot i, shifting later members of the probe run back into the hole */
+static void index_delete(struct cache_shard *s, size_t i) {
+    size_t j = i;
+    for (;;) {
+        s->table[i].element = NULL;
+        for (;;) {
+            j = (j + 1) & s->table_mask;
+            if (!s->table[j].element) {
+                s->count--;
+                return;
+            }
+            size_t k = s->table[j].hash & s->table_mask;
+            int stays = i <= j ? (i < k && k <= j) : (i < k || k <= j);
+            if (!stays)
+                break;
+        }
+        s->table[i] = s->table[j];
+        i = j;
+    }
+}
+
+static void index_remove(struct cache_shard *s, cache_element *e) {
+    size_t i = e->hash & s->table_mask;
+    while (s->table[i].element != e)
+        i = (i + 1) & s->table_mask;
+    index_delete(s, i);
+}
+
+static size_t element_size(cache_element *e) {
+    return e->size;
+}
+
+/* Free the slab chunks of a body built by slab_body() */
+static void slab_body_free(struct seg_buffer *b) {
+    struct seg *s = b->head;
+    while (s) {
+        struct seg *next = s->next;
+        slab_free(s);
+        s = next;
+    }
+    seg_buffer_init(b);
+}
+
+static void element_free(cache_element *e) {
+    if (e->slab)
+        slab_body_free(&e->body);
+    else
+        seg_buffer_free(&e->body);
+    if (e->flags & CACHE_ON_DISK)
+        disk_unpin(e->segment);
+    if (e->flags & CACHE_MAPPED)
+        snapshot_unpin(e->snapshot);
+    if (e->slab) {
+        slab_free(e);
+    } else {
+        free(e->url);
+        free(e);
+    }
+}
+
+/*
+   Take e out of the index and recency list. The cache's reference goes
+   with it; its bytes move from the shard's budget to pinned_bytes until
+   the last holder lets go.
+ */
+static void detach_element(struct cache_shard *s, cache_element *e) {
+    index_remove(s, e);
+    policy->remove(s->policy, e);
+    s->cache_size -= element_size(e);
+    atomic_fetch_add_explicit(&pinned_bytes, element_size(e), memory_order_relaxed);
+}
+
+/* Detach e and drop the cache's reference. Readers that still hold e keep it alive. */
+static void unlink_element(struct cache_shard *s, cache_element *e) {
+    detach_element(s, e);
+    cache_release(e);
+}
+
+/* Charge of an entry under key with body, 0 if a chunk is too small for it */
+static size_t entry_charge(cache_key *key, const struct seg_buffer *body) {
+    size_t charge = slab_charge(sizeof(cache_element) + key->len + 1);
+    for (struct seg *s = body ? body->head : NULL; s && charge; s = s->next) {
+        size_t n = slab_charge(sizeof(struct seg) + s->len);
+        charge = n ? charge + n : 0;
+    }
+    return charge;
+}
+
+/* An element with its key in one slab chunk */
+static cache_element *slab_element(cache_key *key, unsigned flags, time_t expires) {
+    cache_element *e = (cache_element *)slab_alloc(sizeof(cache_element) + key->len + 1, key->hash);
+    if (!e)
+        return NULL;
+    memset(e, 0, sizeof(cache_element));
+    e->url = (char *)(e + 1);
+    memcpy(e->url, key->str, key->len);
+    e->url[key->len] = '\0';
+    e->url_len = key->len;
+    e->hash = key->hash;
+    e->flags = flags;
+    e->expires = expires;
+    e->slab = 1;
+    seg_buffer_init(&e->body);
+    atomic_init(&e->refcount, 1);
+    return e;
+}
+
+/* Copy src into slab chunks, one per segment, as the body of e. Returns 0 or -1. */
+static int slab_body(cache_element *e, const struct seg_buffer *src) {
+    for (struct seg *s = src->head; s; s = s->next) {
+        struct seg *copy = (struct seg *)slab_alloc(sizeof(struct seg) + s->len, e->hash);
+        if (!copy)
+            return -1;
+        copy->next = NULL;
+        copy->len = copy->cap = s->len;
+        memcpy(copy->data, s->data, s->len);
+        if (e->body.tail)
+            e->body.tail->next = copy;
+        else
+            e->body.head = copy;
+        e->body.tail = copy;
+        e->body.len += s->len;
+        e->body.nsegs++;
+    }
+    return 0;
+}
+
+/* Detach an eviction victim, chaining it onto *demoted if the disk tier takes it */
+static void evict_element(struct cache_shard *s, cache_element *e, cache_element **demoted) {
+    if (!disk_enabled() || (e->flags & CACHE_VARY_MARKER)) {
+        unlink_element(s, e);
+        return;
+    }
+    detach_element(s, e);
+    e->next = *demoted;
+    *demoted = e;
+}
+
+/* Hand evicted entries to the disk tier. Shard lock not held. */
+static void demote_elements(cache_element *e) {
+    while (e) {
+        cache_element *next = e->next;
+        e->next = NULL;
+        disk_demote(e);
+        e = next;
+    }
+}
+
+void cache_release(cache_element *e) {
+    if (atomic_fetch_sub_explicit(&e->refcount, 1, memory_order_acq_rel) == 1) {
+        atomic_fetch_sub_explicit(&pinned_bytes, element_size(e), memory_order_relaxed);
+        element_free(e);
+    }
+}
+
+void cache_retain(cache_element *e) {
+    atomic_fetch_add_explicit(&e->refcount, 1, memory_order_relaxed);
+}
+
+size_t cache_pinned_bytes(void) {
+    return atomic_load_explicit(&pinned_bytes, memory_order_relaxed);
+}
+
+cache_element *cache_element_new(cache_key *key, unsigned flags, time_t expires) {
+    cache_element *e = (cache_element *)calloc(1, sizeof(cache_element));
+    if (!e)
+        return NULL;
+    e->url = (char *)malloc(key->len + 1);
+    if (!e->url) {
+        free(e);
+        return NULL;
+    }
+    memcpy(e->url, key->str, key->len);
+    e->url[key->len] = '\0';
+    e->url_len = key->len;
+    e->hash = key->hash;
+    e->flags = flags;
+    e->expires = expires;
+    seg_buffer_init(&e->body);
+    atomic_init(&e->refcount, 1);
+    return e;
+}
+
+size_t cache_element_len(const cache_element *e) {
+    if (e->flags & CACHE_ON_DISK)
+        return e->disk_len;
+    if (e->flags & CACHE_MAPPED)
+        return e->mapped_len;
+    return e->body.len;
+}
+
+ssize_t cache_element_send(cache_element *e, int fd, size_t offset, int flags) {
+    if (e->flags & CACHE_ON_DISK)
+        return disk_send(e->segment, e->disk_offset + offset, e->disk_len - offset, fd);
+    if (e->flags & CACHE_MAPPED)
+        return send(fd, e->mapped + offset, e->mapped_len - offset, flags);
+    return seg_buffer_send(&e->body, fd, offset, flags);
+}
+
+size_t cache_element_copyout(cache_element *e, size_t offset, char *dst, size_t len) {
+    size_t total = cache_element_len(e);
+    if (!(e->flags & (CACHE_ON_DISK | CACHE_MAPPED)))
+        return seg_buffer_copyout(&e->body, offset, dst, len);
+    if (offset >= total)
+        return 0;
+    if (len > total - offset)
+        len = total - offset;
+    if (e->flags & CACHE_MAPPED) {
+        memcpy(dst, e->mapped + offset, len);
+        return len;
+    }
+    return disk_read(e->segment, e->disk_offset + offset, dst, len);
+}
+
+int cache_element_iov(const cache_element *e, size_t offset, struct iovec *iov, int max) {
+    if (e->flags & CACHE_ON_DISK)
+        return 0;
+    if (!(e->flags & CACHE_MAPPED))
+        return seg_buffer_iov(&e->body, offset, iov, max);
+    if (offset >= e->mapped_len || max < 1)
+        return 0;
+    iov[0].iov_base = (void *)(e->mapped + offset);
+    iov[0].iov_len = e->mapped_len - offset;
+    return 1;
+}
+
+int cache_element_append(struct seg_buffer *dst, const cache_element *e, size_t offset, size_t len) {
+    if (e->flags & CACHE_ON_DISK)
+        return -1;
+    if (e->flags & CACHE_MAPPED)
+        return offset + len > e->mapped_len ? -1 : seg_buffer_append(dst, e->mapped + offset, len);
+    return seg_buffer_append_range(dst, &e->body, offset, len);
+}
+
+/*
+  Cache public functions
+*/
+
+cache_element *find(cache_key *key) {
+    struct cache_shard *s = shard_for(key->hash);
+    cache_element *site = NULL;
+
+    shard_lock(s, 0);
+    size_t i = index_lookup(s, key->hash, key->str, key->len);
+    if (i != (size_t)-1) {
+        site = s->table[i].element;
+        atomic_fetch_add_explicit(&site->refcount, 1, memory_order_relaxed);
+    }
+    policy->access(s->policy, key->hash, site);
+    shard_unlock(s);
+
+    /* a snapshot entry is checked on its first hit, and dropped if it is damaged */
+    if (site && (site->flags & CACHE_MAPPED) && !snapshot_verify(site)) {
+        shard_lock(s, 1);
+        i = index_lookup(s, key->hash, key->str, key->len);
+        if (i != (size_t)-1 && s->table[i].element == site)
+            unlink_element(s, site);
+        shard_unlock(s);
+        cache_release(site);
+        site = NULL;
+    }
+    atomic_fetch_add_explicit(site ? &s->hits : &s->misses, 1, memory_order_relaxed);
+    return site;
+}
+
+/* Evict the policy's victim in the fullest shard */
+void remove_cache_element() {
+    struct cache_shard *fullest = shards;
+    size_t most = 0;
+    for (unsigned i = 0; i <= shard_mask; i++) {
+        shard_lock(shards + i, 0);
+        if (shards[i].cache_size > most) {
+            most = shards[i].cache_size;
+            fullest = shards + i;
+        }
+        shard_unlock(shards + i);
+    }
+    cache_element *demoted = NULL;
+    shard_lock(fullest, 1);
+    cache_element *victim = policy->victim(fullest->policy);
+    if (victim)
+        evict_element(fullest, victim, &demoted);
+    shard_unlock(fullest);
+    demote_elements(demoted);
+}
+
+/* Evict the policy's victims until size more bytes fit in shard s. Write lock held. */
+static void evict_for(struct cache_shard *s, size_t size, cache_element **demoted) {
+    while (s->cache_size + size > s->budget) {
+        cache_element *victim = policy->victim(s->policy);
+        if (!victim)
+            break;
+        evict_element(s, victim, demoted);
+    }
+}
+
+/* Make room for size bytes in shard s before they are allocated */
+static void make_room(struct cache_shard *s, size_t size) {
+    cache_element *demoted = NULL;
+    shard_lock(s, 1);
+    evict_for(s, size, &demoted);
+    shard_unlock(s);
+    demote_elements(demoted);
+}
+
+/* Evict the entries with key hash, for the slab to reclaim their chunks */
+static void evict_hash(uint64_t hash) {
+    struct cache_shard *s = shard_for(hash);
+    cache_element *demoted = NULL;
+    shard_lock(s, 1);
+    size_t i = hash & s->table_mask;
+    while (s->table[i].element) {
+        if (s->table[i].hash == hash) {
+            evict_element(s, s->table[i].element, &demoted);
+            i = hash & s->table_mask;
+        } else {
+            i = (i + 1) & s->table_mask;
+        }
+    }
+    shard_unlock(s);
+    demote_elements(demoted);
+}
+
+/*
+   Put element, sized and not yet in any shard, into shard s, replacing
+   any entry under its key and evicting as needed. Returns 1, or 0 with
+   the element freed.
+ */
+static int insert_element(struct cache_shard *s, cache_element *element) {
+    cache_element *demoted = NULL;
+    shard_lock(s, 1);
+    size_t i = index_lookup(s, element->hash, element->url, element->url_len);
+    if (i != (size_t)-1)
+        unlink_element(s, s->table[i].element);
+    evict_for(s, element->size, &demoted);
+
+    int placed = policy->insert(s->policy, element) == 0;
+    if (placed && index_insert(s, element) < 0) {
+        policy->remove(s->policy, element);
+        placed = 0;
+    }
+    if (!placed) {
+        shard_unlock(s);
+        demote_elements(demoted);
+        element_free(element);
+        return 0;
+    }
+    s->cache_size += element->size;
+    shard_unlock(s);
+    demote_elements(demoted);
+    return 1;
+}
+
+int add_cache_element(struct seg_buffer *body, cache_key *key, unsigned flags, time_t expires,
+                      cache_element **pinned) {
+    struct cache_shard *s = shard_for(key->hash);
+    size_t new_size = entry_charge(key, body);
+    if (new_size == 0 || new_size > max_element)
+        return 0;
+
+    make_room(s, new_size);
+    cache_element *element = slab_element(key, flags, expires);
+    if (!element)
+        return 0;
+    if (slab_body(element, body) < 0) {
+        element_free(element);
+        return 0;
+    }
+    element->size = new_size;
+    if (pinned)
+        cache_retain(element);
+    if (!insert_element(s, element))
+        return 0;
+    seg_buffer_free(body);
+    if (pinned)
+        *pinned = element;
+    return 1;
+}
+
+int cache_add_mapped(cache_key *key, unsigned flags, time_t expires, const char *data, size_t len,
+                     struct snapshot *snap) {
+    struct cache_shard *s = shard_for(key->hash);
+    size_t new_size = entry_charge(key, NULL) + len;
+    if (new_size == len || new_size > max_element)
+        return 0;
+
+    make_room(s, new_size);
+    cache_element *element = slab_element(key, flags | CACHE_MAPPED, expires);
+    if (!element)
+        return 0;
+    snapshot_pin(snap);
+    element->snapshot = snap;
+    element->mapped = data;
+    element->mapped_len = len;
+    element->size = new_size;
+    return insert_element(s, element);
+}
+
+cache_element **cache_collect(unsigned shard, size_t *count) {
+    struct cache_shard *s = shards + shard;
+    cache_element **entries = NULL;
+    *count = 0;
+    shard_lock(s, 0);
+    if (s->count > 0)
+        entries = (cache_element **)malloc(s->count * sizeof(cache_element *));
+    if (entries) {
+        *count = policy->order(s->policy, entries);
+        for (size_t i = 0; i < *count; i++)
+            cache_retain(entries[i]);
+    }
+    shard_unlock(s);
+    return entries;
+}
+
+void cache_shard_stats(unsigned shard, struct cache_shard_stats *stats) {
+    struct cache_shard *s = shards + shard;
+    shard_lock(s, 0);
+    stats->count = s->count;
+    stats->bytes = s->cache_size;
+    stats->budget = s->budget;
+    shard_unlock(s);
+    stats->acquisitions = atomic_load_explicit(&s->acquisitions, memory_order_relaxed);
+    stats->contended = atomic_load_explicit(&s->contended, memory_order_relaxed);
+    stats->wait_ns = atomic_load_explicit(&s->wait_ns, memory_order_relaxed);
+    stats->hits = atomic_load_explicit(&s->hits, memory_order_relaxed);
+    stats->misses = atomic_load_explicit(&s->misses, memory_order_relaxed);
+}
+
+void cache_policy_stats(struct policy_stats *st) {
+    memset(st, 0, sizeof(*st));
+    for (unsigned i = 0; i <= shard_mask; i++) {
+        struct policy_stats one;
+        shard_lock(shards + i, 0);
+        policy->stats(shards[i].policy, &one);
+        shard_unlock(shards + i);
+        st->victims += one.victims;
+        st->reordered += one.reordered;
+        st->admitted += one.admitted;
+        st->rejected += one.rejected;
+    }
+}
+
+size_t cache_count(void) {
+    size_t n = 0;
+    for (unsigned i = 0; i <= shard_mask; i++) {
+        struct cache_shard_stats stats;
+        cache_shard_stats(i, &stats);
+        n += stats.count;
+    }
+    return n;
+}
+
+size_t cache_bytes(void) {
+    size_t n = 0;
+    for (unsigned i = 0; i <= shard_mask; i++) {
+        struct cache_shard_stats stats;
+        cache_shard_stats(i, &stats);
+        n += stats.bytes;
+    }
+    return n;
+}
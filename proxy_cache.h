@@ -0,0 +1,212 @@
+/*
+ * proxy_cache.h -- in-memory cache of upstream responses.
+ *
+ * The cache is split into a power-of-two number of shards, each with its
+ * own reader/writer lock and share of MAX_SIZE. Within a shard, entries are
+ * indexed by an open-addressing hash table keyed by a 64-bit hash of the
+ * cache key, and an eviction policy chosen at startup (LRU by default,
+ * see proxy_policy.h) decides which of them to drop. Hits only take the
+ * read lock, and pin the entry with a reference count so it can be
+ * streamed to the client after the lock is dropped. Each entry records when it goes stale; whether
+ * a stale entry is revalidated or refetched is up to the caller.
+ *
+ * With the disk tier enabled (see proxy_disk.h), responses evicted from
+ * here are handed to it instead of being dropped, and entries it returns
+ * may be backed by a segment file rather than held in memory; such entries
+ * are read through cache_element_send() and cache_element_copyout(). The
+ * same goes for entries loaded from a snapshot (see proxy_snapshot.h),
+ * whose responses stay in the mapped snapshot file.
+ */
+
+#ifndef PROXY_CACHE
+#define PROXY_CACHE
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include "proxy_buffer.h"
+
+#define MAX_SIZE 200 * (1 << 20)
+#define MAX_ELEMENT_SIZE 10 * (1 << 20)
+#define SHARD_ELEMENT_SHARE 4          /* an entry takes at most 1/4 of its shard */
+#define MIN_ELEMENT_SIZE (256 * 1024)  /* the least that cache_max_element() may be */
+#define DEFAULT_CACHE_SHARDS 16
+
+/* cache_element flags */
+#define CACHE_VARY_MARKER 1       /* data holds the Vary field names, not a response */
+#define CACHE_HAS_VALIDATORS 2    /* response carries ETag or Last-Modified */
+#define CACHE_UNFRAMED 4          /* response ends only where the connection closes */
+#define CACHE_ON_DISK 8           /* the response is in a disk segment, not in body */
+#define CACHE_MAPPED 16           /* the response is in a mapped snapshot, not in body */
+
+struct disk_segment;
+struct snapshot;
+struct policy_stats;
+
+/* A cache key together with its hash, computed once per request */
+typedef struct cache_key {
+    char *str;
+    size_t len;
+    uint64_t hash;
+    int owned;                  /* str is freed with the key */
+} cache_key;
+
+typedef struct cache_element {
+    struct seg_buffer body;               /* the response, or the Vary field names */
+    size_t size;                          /* bytes charged to the cache */
+    char *url;                            /* the cache key */
+    size_t url_len;
+    uint64_t hash;
+    unsigned flags;
+    time_t expires;                       /* stale from then on */
+    atomic_int refcount;                  /* one for the cache, one per reader */
+    atomic_uint_fast64_t lru_time_track;  /* policy clock at last use */
+    uint64_t list_stamp;                  /* policy clock when put at the head */
+    struct cache_element *prev;           /* towards the head of the policy's list */
+    struct cache_element *next;           /* towards the eviction end */
+    int queue;                            /* wtinylfu: the list it is on */
+    atomic_uint hits;                     /* gdsf: hits since it was placed */
+    unsigned hits_seen;                   /* gdsf: as of the last priority */
+    double priority;                      /* gdsf: its key in the shard's heap */
+    size_t heap_slot;
+    struct disk_segment *segment;         /* CACHE_ON_DISK: where the response is */
+    off_t disk_offset;
+    size_t disk_len;
+    struct snapshot *snapshot;            /* CACHE_MAPPED: where the response is */
+    const char *mapped;
+    size_t mapped_len;
+    atomic_int mapped_ok;                 /* its checksum has been verified */
+    int slab;                             /* it, its key and body are in slab chunks */
+} cache_element;
+
+/* Per-shard occupancy and lock contention */
+struct cache_shard_stats {
+    size_t count;
+    size_t bytes;
+    size_t budget;
+    unsigned long acquisitions;
+    unsigned long contended;     /* acquisitions that had to wait */
+    unsigned long wait_ns;       /* total time spent waiting */
+    unsigned long hits;          /* find() calls that found the key */
+    unsigned long misses;
+};
+
+/*
+   Allocate nshards shards (a power of two). Must be called once before any
+   other cache function.
+ */
+int cache_init(unsigned nshards);
+
+/*
+   Evict with the policy called name (see proxy_policy.h) rather than LRU.
+   Must be called before cache_init(). Returns -1 if there is no such policy.
+ */
+int cache_set_policy(const char *name);
+const char *cache_policy_name(void);
+
+/* Back the cache's memory with huge pages. Must be called before cache_init(). */
+void cache_set_hugepages(int on);
+
+unsigned cache_shards(void);
+
+/*
+   The largest entry the cache stores: MAX_ELEMENT_SIZE, or a shard's budget
+   divided by SHARD_ELEMENT_SHARE if that is less, so that one response cannot
+   empty its shard. cache_init() rejects shard counts that would make it less
+   than MIN_ELEMENT_SIZE.
+ */
+size_t cache_max_element(void);
+
+/* 64-bit hash of a cache key */
+uint64_t cache_hash(const char *key, size_t len);
+
+/* Point key at str (len bytes, owned by the key afterwards) and hash it */
+void cache_key_set(cache_key *key, char *str, size_t len);
+/* The same for a str that stays owned by the caller, e.g. in an arena */
+void cache_key_borrow(cache_key *key, char *str, size_t len);
+void cache_key_free(cache_key *key);
+
+/*
+   Find key and mark it recently used. Returns NULL on a miss. A hit is
+   pinned: it stays valid, even if evicted meanwhile, until the caller
+   passes it to cache_release().
+ */
+cache_element *find(cache_key *key);
+void cache_release(cache_element *e);
+
+/* Pin an already pinned entry once more, for another holder */
+void cache_retain(cache_element *e);
+
+/*
+   A new entry for key, pinned once and in no shard: its body is empty and
+   its size is 0. For entries that do not live in the memory cache.
+ */
+cache_element *cache_element_new(cache_key *key, unsigned flags, time_t expires);
+
+/* Length of the response, wherever it is held */
+size_t cache_element_len(const cache_element *e);
+
+/*
+   Send the response from offset on to the socket fd, with one sendmsg()
+   or sendfile() call. Returns the byte count or -1 as those do.
+ */
+ssize_t cache_element_send(cache_element *e, int fd, size_t offset, int flags);
+
+/* Copy up to len bytes of the response at offset into dst. Returns the count. */
+size_t cache_element_copyout(cache_element *e, size_t offset, char *dst, size_t len);
+
+/*
+   Describe the response from offset on in at most max iovecs, as
+   seg_buffer_iov() does. Returns 0 for an entry on disk.
+ */
+int cache_element_iov(const cache_element *e, size_t offset, struct iovec *iov, int max);
+
+/* Append len bytes of the response at offset to dst. Returns 0 or -1, also for an entry on disk. */
+int cache_element_append(struct seg_buffer *dst, const cache_element *e, size_t offset, size_t len);
+
+/*
+   Store body in the cache under key, evicting as needed. An entry already
+   stored under key is replaced. On success the cache takes over body's
+   segments and, if pinned is not NULL, returns the new entry there pinned
+   as by find(). Returns 1, or 0 with body left to the caller.
+ */
+int add_cache_element(struct seg_buffer *body, cache_key *key, unsigned flags, time_t expires,
+                      cache_element **pinned);
+
+/*
+   Store the len bytes at data, in the mapping of snap, in the cache under
+   key as a CACHE_MAPPED entry holding a pin on snap. Returns 1, or 0 if
+   it was not stored.
+ */
+int cache_add_mapped(cache_key *key, unsigned flags, time_t expires, const char *data, size_t len,
+                     struct snapshot *snap);
+
+/*
+   The entries of shard, pinned, least recently used first, in an array
+   the caller frees after releasing them. Returns NULL if the shard is
+   empty or the array cannot be allocated.
+ */
+cache_element **cache_collect(unsigned shard, size_t *count);
+
+/*
+   Evict the policy's victim in the fullest shard. Evicted responses go to
+   the disk tier if it is enabled.
+ */
+void remove_cache_element();
+
+void cache_shard_stats(unsigned shard, struct cache_shard_stats *stats);
+
+/* The eviction policy's counts, summed over the shards */
+void cache_policy_stats(struct policy_stats *st);
+
+/* Number of entries and bytes accounted to the cache */
+size_t cache_count(void);
+size_t cache_bytes(void);
+
+/* Bytes held by entries that were evicted while readers still pinned them */
+size_t cache_pinned_bytes(void);
+
+#endif
@@ -0,0 +1,938 @@
+/*
+  proxy_disk.c -- second cache tier in segment files on local disk.
+
+  A record is a disk_record header, the key and the response. The header
+  carries its own checksum and the lengths that follow, so the startup scan
+  can walk a segment record by record and stops at the first one that is
+  torn or corrupt; the segment is truncated there.
+
+  The index maps a key hash to where its latest record is, in an
+  open-addressing table with linear probing and backward-shift deletion,
+  as in the memory cache. Keys that share a hash share a slot; the later
+  record wins. Each segment counts the bytes of its records the index still
+  points to, which is what the compactor goes by.
+
+  One mutex covers the index, the segment list and both queues. Only
+  the writer thread appends to segments or deletes them, and it does the
+  I/O with the lock dropped, publishing a record in the index only once it
+  is written. A segment is reference counted: one reference while it is in
+  the log, one per entry reading from it, so a segment deleted under a
+  reader keeps its descriptor until the reader is done.
+
+  The event loops must not wait for the disk, so their lookups are split:
+  the index is consulted on the loop, and the rest of the lookup, checking
+  the record's key and promoting the response, is queued to a reader
+  thread of its own so that it does not wait behind writes and compaction.
+*/
+
+#define _GNU_SOURCE
+#include "proxy_disk.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+
+#define DISK_MAGIC 0x31434450u           /* "PDC1" */
+#define DISK_INDEX_SLOTS 4096
+#define DISK_IOV 64
+
+struct disk_record {
+     uint32_t magic;
+     uint32_t flags;
+     uint64_t hash;
+     int64_t expires;
+     uint64_t body_len;
+     uint32_t key_len;
+     uint32_t check;              /* of the fields above */
+};
+
+struct disk_segment {
+     unsigned long id;
+     int fd;
+     size_t size;                 /* bytes written */
+     size_t live;                 /* bytes of records in the index */
+     int busy;                    /* being compacted, not to be evicted */
+     atomic_int refs;
+     struct disk_segment *next;   /* newer */
+};
+
+struct disk_entry {
+     uint64_t hash;
+     struct disk_segment *seg;    /* NULL for an empty slot */
+     off_t offset;                /* of the record */
+     size_t body_len;
+     uint32_t key_len;
+     unsigned flags;
+     time_t expires;
+};
+
+/*
+   A disk_query() handed to the reader thread. The caller and the reader
+   each hold a reference; result is the caller's once done is set.
+ */
+struct disk_lookup {
+     struct disk_lookup *next;    /* in the reader's queue */
+     cache_key key;               /* a copy */
+     struct disk_entry entry;     /* as found in the index, its segment pinned */
+     int notify_fd;
+     cache_element *result;       /* pinned, until disk_lookup_done() takes it */
+     atomic_int done;
+     atomic_int refs;
+};
+
+/* Queued write: an evicted entry, or a spill file with its key */
+struct disk_job {
+     struct disk_job *next;
+     cache_element *e;
+     int fd;
+     size_t len;
+     char *key;
+     size_t key_len;
+     uint64_t hash;
+     unsigned flags;
+     time_t expires;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t lookup_cond = PTHREAD_COND_INITIALIZER;
+static char *dir_path;
+static size_t budget;
+static size_t segment_size;
+
+static struct disk_entry *table;
+static size_t table_mask;
+static size_t nentries;
+static size_t live_bytes;
+
+static struct disk_segment *oldest, *active;
+static size_t file_bytes;
+static size_t nsegments;
+static unsigned long next_id;
+
+static struct disk_job *queue_head, *queue_tail;
+static size_t queued_bytes;
+static struct disk_lookup *lookup_head, *lookup_tail;
+
+static atomic_ulong stat_lookups, stat_hits, stat_promoted;
+static unsigned long stat_written, stat_dropped, stat_compacted, stat_evicted;
+
+static size_t record_len(uint32_t key_len, uint64_t body_len) {
+    return sizeof(struct disk_record) + key_len + body_len;
+}
+
+static uint32_t record_check(const struct disk_record *r) {
+    return (uint32_t)cache_hash((const char *)r, offsetof(struct disk_record, check));
+}
+
+/*
+  Index private functions, lock held
+*/
+
+static size_t index_lookup(uint64_t hash) {
+    size_t i = hash & table_mask;
+    while (table[i].seg) {
+        if (table[i].hash == hash)
+            return i;
+        i = (i + 1) & table_mask;
+    }
+    return (size_t)-1;
+}
+
+static void index_place(struct disk_entry *slots, size_t mask, const struct disk_entry *e) {
+    size_t i = e->hash & mask;
+    while (slots[i].seg)
+        i = (i + 1) & mask;
+    slots[i] = *e;
+}
+
+static int index_grow(void) {
+    size_t slots = (table_mask + 1) * 2;
+    struct disk_entry *bigger = (struct disk_entry *)calloc(slots, sizeof(struct disk_entry));
+    if (!bigger)
+        return -1;
+    for (size_t i = 0; i <= table_mask; i++) {
+        if (table[i].seg)
+            index_place(bigger, slots - 1, table + i);
+    }
+    free(table);
+    table = bigger;
+    table_mask = slots - 1;
+    return 0;
+}
+
+static void index_delete(size_t i) {
+    struct disk_entry *e = table + i;
+    size_t len = record_len(e->key_len, e->body_len);
+    e->seg->live -= len;
+    live_bytes -= len;
+    size_t j = i;
+    for (;;) {
+        table[i].seg = NULL;
+        for (;;) {
+            j = (j + 1) & table_mask;
+            if (!table[j].seg) {
+                nentries--;
+                return;
+            }
+            size_t k = table[j].hash & table_mask;
+            int stays = i <= j ? (i < k && k <= j) : (i < k || k <= j);
+            if (!stays)
+                break;
+        }
+        table[i] = table[j];
+        i = j;
+    }
+}
+
+/* Point the index at a record just written, replacing any older one for the hash */
+static void index_set(const struct disk_entry *e) {
+    size_t i = index_lookup(e->hash);
+    if (i != (size_t)-1) {
+        index_delete(i);
+    } else if ((nentries + 1) * 10 > (table_mask + 1) * 7 && index_grow() < 0) {
+        return;
+    }
+    index_place(table, table_mask, e);
+    nentries++;
+    size_t len = record_len(e->key_len, e->body_len);
+    e->seg->live += len;
+    live_bytes += len;
+}
+
+/* Remove the entry for the record at offset of seg, if the index still points there */
+static void index_drop_record(uint64_t hash, struct disk_segment *seg, off_t offset) {
+    size_t i = index_lookup(hash);
+    if (i != (size_t)-1 && table[i].seg == seg && table[i].offset == offset)
+        index_delete(i);
+}
+
+/*
+  Segment private functions
+*/
+
+static void segment_path(char *path, size_t cap, unsigned long id) {
+    snprintf(path, cap, "%s/%08lu.seg", dir_path, id);
+}
+
+static void segment_release(struct disk_segment *seg) {
+    if (atomic_fetch_sub_explicit(&seg->refs, 1, memory_order_acq_rel) == 1) {
+        close(seg->fd);
+        free(seg);
+    }
+}
+
+static struct disk_segment *segment_open(unsigned long id, int create) {
+    char path[4096];
+    segment_path(path, sizeof(path), id);
+    struct disk_segment *seg = (struct disk_segment *)calloc(1, sizeof(struct disk_segment));
+    if (!seg)
+        return NULL;
+    seg->fd = open(path, O_RDWR | O_CLOEXEC | (create ? O_CREAT | O_TRUNC : 0), 0644);
+    if (seg->fd < 0) {
+        perror("open disk segment failed");
+        free(seg);
+        return NULL;
+    }
+    seg->id = id;
+    atomic_init(&seg->refs, 1);
+    return seg;
+}
+
+/* Append seg to the log. Lock held. */
+static void segment_link(struct disk_segment *seg) {
+    if (active)
+        active->next = seg;
+    else
+        oldest = seg;
+    active = seg;
+    nsegments++;
+    file_bytes += seg->size;
+}
+
+/* Take seg out of the log and delete its file. Lock held. */
+static void segment_unlink(struct disk_segment *seg) {
+    struct disk_segment **link = &oldest;
+    struct disk_segment *prev = NULL;
+    while (*link != seg) {
+        prev = *link;
+        link = &(*link)->next;
+    }
+    *link = seg->next;
+    if (active == seg)
+        active = prev;
+    nsegments--;
+    file_bytes -= seg->size;
+    char path[4096];
+    segment_path(path, sizeof(path), seg->id);
+    unlink(path);
+}
+
+/*
+   Read the record header at offset of seg into r and check it. Returns 1
+   for a valid record, 0 at the end of what was written, -1 for a torn or
+   corrupt one.
+ */
+static int segment_record(struct disk_segment *seg, off_t offset, size_t end, struct disk_record *r) {
+    if ((size_t)offset == end)
+        return 0;
+    if ((size_t)offset + sizeof(*r) > end || pread(seg->fd, r, sizeof(*r), offset) != sizeof(*r))
+        return -1;
+    if (r->magic != DISK_MAGIC || r->check != record_check(r))
+        return -1;
+    if (r->body_len > end || record_len(r->key_len, r->body_len) > end - offset)
+        return -1;
+    return 1;
+}
+
+/* Copy len bytes between files at the given offsets */
+static int copy_range(int from, off_t from_off, int to, off_t to_off, size_t len) {
+    while (len > 0) {
+        ssize_t n = copy_file_range(from, &from_off, to, &to_off, len, 0);
+        if (n <= 0) {
+            if (n < 0 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP))
+                break;
+            return -1;
+        }
+        len -= n;
+    }
+    char buf[16 * 1024];
+    while (len > 0) {
+        ssize_t n = pread(from, buf, len < sizeof(buf) ? len : sizeof(buf), from_off);
+        if (n <= 0 || pwrite(to, buf, n, to_off) != n)
+            return -1;
+        from_off += n;
+        to_off += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+   Drop the index entries of the records in seg, then delete it. The
+   headers are read with the lock dropped; nothing but the writer adds
+   records, so none can appear meanwhile.
+ */
+static void segment_drop(struct disk_segment *seg) {
+    struct disk_record r;
+    off_t offset = 0;
+    while (segment_record(seg, offset, seg->size, &r) > 0) {
+        pthread_mutex_lock(&lock);
+        index_drop_record(r.hash, seg, offset);
+        pthread_mutex_unlock(&lock);
+        offset += record_len(r.key_len, r.body_len);
+    }
+    pthread_mutex_lock(&lock);
+    segment_unlink(seg);
+    pthread_mutex_unlock(&lock);
+    segment_release(seg);
+}
+
+/*
+  Writer thread private functions. Only the writer changes segment sizes
+  and the log, so it reads them without the lock.
+*/
+
+/* Delete the oldest segments not being compacted until extra more bytes fit the budget */
+static void enforce_budget(size_t extra) {
+    while (file_bytes + extra > budget) {
+        struct disk_segment *victim = oldest;
+        while (victim && (victim == active || victim->busy))
+            victim = victim->next;
+        if (!victim)
+            return;
+        segment_drop(victim);
+        pthread_mutex_lock(&lock);
+        stat_evicted++;
+        pthread_mutex_unlock(&lock);
+    }
+}
+
+/*
+   Room for a record of len bytes at the end of the active segment,
+   starting a new segment if the active one has no room left. Returns the
+   segment, or NULL if none can be created.
+ */
+static struct disk_segment *segment_for(size_t len) {
+    if (!active || (active->size > 0 && active->size + len > segment_size)) {
+        struct disk_segment *seg = segment_open(next_id, 1);
+        if (!seg)
+            return NULL;
+        next_id++;
+        pthread_mutex_lock(&lock);
+        segment_link(seg);
+        pthread_mutex_unlock(&lock);
+    }
+    enforce_budget(len);
+    return active;
+}
+
+/* Account for a record of len bytes appended to seg and index it */
+static void record_written(struct disk_segment *seg, const struct disk_entry *e, size_t len) {
+    pthread_mutex_lock(&lock);
+    seg->size += len;
+    file_bytes += len;
+    index_set(e);
+    stat_written++;
+    pthread_mutex_unlock(&lock);
+}
+
+static void record_header(struct disk_record *r, uint64_t hash, size_t key_len, size_t body_len,
+                          unsigned flags, time_t expires) {
+    memset(r, 0, sizeof(*r));
+    r->magic = DISK_MAGIC;
+    r->flags = flags;
+    r->hash = hash;
+    r->expires = expires;
+    r->body_len = body_len;
+    r->key_len = key_len;
+    r->check = record_check(r);
+}
+
+/* Whether the index already has a record of this response, as after a promotion */
+static int already_stored(uint64_t hash, size_t body_len, unsigned flags, time_t expires) {
+    pthread_mutex_lock(&lock);
+    size_t i = index_lookup(hash);
+    int same = i != (size_t)-1 && table[i].body_len == body_len && table[i].flags == flags &&
+               table[i].expires == expires;
+    pthread_mutex_unlock(&lock);
+    return same;
+}
+
+static int write_element(cache_element *e) {
+    size_t body_len = cache_element_len(e);
+    unsigned flags = e->flags & ~CACHE_MAPPED;
+    if (already_stored(e->hash, body_len, flags, e->expires))
+        return 0;
+    size_t len = record_len(e->url_len, body_len);
+    struct disk_segment *seg = segment_for(len);
+    if (!seg)
+        return -1;
+
+    struct disk_record r;
+    record_header(&r, e->hash, e->url_len, body_len, flags, e->expires);
+    off_t at = seg->size;
+    struct iovec iov[DISK_IOV];
+    iov[0].iov_base = &r;
+    iov[0].iov_len = sizeof(r);
+    iov[1].iov_base = e->url;
+    iov[1].iov_len = e->url_len;
+    ssize_t n = pwritev(seg->fd, iov, 2, at);
+    if (n != (ssize_t)(sizeof(r) + e->url_len))
+        return -1;
+    size_t done = 0;
+    while (done < body_len) {
+        int cnt = cache_element_iov(e, done, iov, DISK_IOV);
+        n = pwritev(seg->fd, iov, cnt, at + sizeof(r) + e->url_len + done);
+        if (n <= 0)
+            return -1;
+        done += n;
+    }
+
+    struct disk_entry entry = {e->hash, seg, at, body_len, e->url_len, flags, e->expires};
+    record_written(seg, &entry, len);
+    return 0;
+}
+
+static int write_file(struct disk_job *job) {
+    size_t len = record_len(job->key_len, job->len);
+    struct disk_segment *seg = segment_for(len);
+    if (!seg)
+        return -1;
+
+    struct disk_record r;
+    record_header(&r, job->hash, job->key_len, job->len, job->flags, job->expires);
+    off_t at = seg->size;
+    struct iovec iov[2] = {{&r, sizeof(r)}, {job->key, job->key_len}};
+    if (pwritev(seg->fd, iov, 2, at) != (ssize_t)(sizeof(r) + job->key_len) ||
+        copy_range(job->fd, 0, seg->fd, at + sizeof(r) + job->key_len, job->len) < 0)
+        return -1;
+
+    struct disk_entry entry = {job->hash, seg, at, job->len, job->key_len, job->flags, job->expires};
+    record_written(seg, &entry, len);
+    return 0;
+}
+
+static void job_free(struct disk_job *job) {
+    if (job->e)
+        cache_release(job->e);
+    if (job->fd >= 0)
+        close(job->fd);
+    free(job->key);
+    free(job);
+}
+
+/*
+   Copy the live records of the oldest sealed segment that is at least
+   half dead to the end of the log, then delete it. Returns 1 if one was
+   compacted.
+ */
+static int compact_one(void) {
+    struct disk_segment *seg = NULL;
+    pthread_mutex_lock(&lock);
+    for (struct disk_segment *s = oldest; s && s != active; s = s->next) {
+        if (s->live * 2 < s->size) {
+            seg = s;
+            seg->busy = 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    if (!seg)
+        return 0;
+
+    struct disk_record r;
+    off_t offset = 0;
+    while (segment_record(seg, offset, seg->size, &r) > 0) {
+        size_t len = record_len(r.key_len, r.body_len);
+        pthread_mutex_lock(&lock);
+        size_t i = index_lookup(r.hash);
+        int live = i != (size_t)-1 && table[i].seg == seg && table[i].offset == offset;
+        pthread_mutex_unlock(&lock);
+
+        struct disk_segment *to;
+        if (live && (to = segment_for(len)) && copy_range(seg->fd, offset, to->fd, to->size, len) == 0) {
+            off_t at = to->size;
+            pthread_mutex_lock(&lock);
+            to->size += len;
+            file_bytes += len;
+            i = index_lookup(r.hash);
+            if (i != (size_t)-1 && table[i].seg == seg && table[i].offset == offset) {
+                struct disk_entry moved = table[i];
+                index_delete(i);
+                moved.seg = to;
+                moved.offset = at;
+                index_set(&moved);
+            }
+            pthread_mutex_unlock(&lock);
+        }
+        offset += len;
+    }
+
+    segment_drop(seg);
+    pthread_mutex_lock(&lock);
+    stat_compacted++;
+    pthread_mutex_unlock(&lock);
+    return 1;
+}
+
+static void *writer_fn(void *arg) {
+    (void)arg;
+    for (;;) {
+        pthread_mutex_lock(&lock);
+        while (!queue_head) {
+            pthread_mutex_unlock(&lock);
+            int compacted = compact_one();
+            pthread_mutex_lock(&lock);
+            if (!compacted && !queue_head)
+                pthread_cond_wait(&work_cond, &lock);
+        }
+        struct disk_job *job = queue_head;
+        queue_head = job->next;
+        if (!queue_head)
+            queue_tail = NULL;
+        if (job->e)
+            queued_bytes -= cache_element_len(job->e);
+        pthread_mutex_unlock(&lock);
+
+        int ok = job->e ? write_element(job->e) : write_file(job);
+        if (ok < 0) {
+            pthread_mutex_lock(&lock);
+            stat_dropped++;
+            pthread_mutex_unlock(&lock);
+        }
+        job_free(job);
+    }
+    return NULL;
+}
+
+static void enqueue(struct disk_job *job) {
+    job->next = NULL;
+    if (queue_tail)
+        queue_tail->next = job;
+    else
+        queue_head = job;
+    queue_tail = job;
+    pthread_cond_signal(&work_cond);
+}
+
+/*
+  Startup
+*/
+
+static int id_compare(const void *a, const void *b) {
+    unsigned long x = *(const unsigned long *)a, y = *(const unsigned long *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Index the records of an existing segment, truncating it after the last valid one */
+static void segment_load(struct disk_segment *seg) {
+    struct stat st;
+    if (fstat(seg->fd, &st) < 0)
+        return;
+    struct disk_record r;
+    off_t offset = 0;
+    int valid;
+    while ((valid = segment_record(seg, offset, st.st_size, &r)) > 0) {
+        struct disk_entry e = {r.hash, seg, offset, r.body_len, r.key_len, r.flags, r.expires};
+        seg->size = offset + record_len(r.key_len, r.body_len);
+        index_set(&e);
+        offset = seg->size;
+    }
+    if (valid < 0) {
+        fprintf(stderr, "disk segment %08lu: record at %lld is damaged, truncating\n", seg->id, (long long)offset);
+        if (ftruncate(seg->fd, offset) < 0)
+            perror("ftruncate failed");
+    }
+}
+
+static int load_segments(void) {
+    DIR *d = opendir(dir_path);
+    if (!d)
+        return -1;
+    unsigned long *ids = NULL;
+    size_t n = 0, cap = 0;
+    struct dirent *de;
+    while ((de = readdir(d))) {
+        unsigned long id;
+        char tail;
+        if (sscanf(de->d_name, "%lu.se%c", &id, &tail) != 2 || tail != 'g')
+            continue;
+        if (n == cap) {
+            cap = cap ? cap * 2 : 64;
+            unsigned long *bigger = (unsigned long *)realloc(ids, cap * sizeof(unsigned long));
+            if (!bigger)
+                break;
+            ids = bigger;
+        }
+        ids[n++] = id;
+    }
+    closedir(d);
+    if (n > 1)
+        qsort(ids, n, sizeof(unsigned long), id_compare);
+    for (size_t i = 0; i < n; i++) {
+        struct disk_segment *seg = segment_open(ids[i], 0);
+        if (!seg)
+            continue;
+        segment_load(seg);
+        segment_link(seg);
+        next_id = ids[i] + 1;
+    }
+    free(ids);
+    return 0;
+}
+
+/*
+  Disk tier public functions
+*/
+
+static void *reader_fn(void *arg);
+
+int disk_init(const char *dir, size_t size) {
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+        perror("mkdir disk cache failed");
+        return -1;
+    }
+    dir_path = strdup(dir);
+    table = (struct disk_entry *)calloc(DISK_INDEX_SLOTS, sizeof(struct disk_entry));
+    if (!dir_path || !table)
+        return -1;
+    table_mask = DISK_INDEX_SLOTS - 1;
+    segment_size = size / 8;
+    if (segment_size < DISK_SEGMENT_MIN)
+        segment_size = DISK_SEGMENT_MIN;
+    if (segment_size > DISK_SEGMENT_MAX)
+        segment_size = DISK_SEGMENT_MAX;
+    if (load_segments() < 0) {
+        perror("opendir disk cache failed");
+        return -1;
+    }
+    budget = size;
+
+    pthread_t writer, reader;
+    if (pthread_create(&writer, NULL, writer_fn, NULL) != 0) {
+        budget = 0;
+        return -1;
+    }
+    pthread_detach(writer);
+    if (pthread_create(&reader, NULL, reader_fn, NULL) != 0) {
+        budget = 0;
+        return -1;
+    }
+    pthread_detach(reader);
+    return 0;
+}
+
+int disk_enabled(void) {
+    return budget != 0;
+}
+
+const char *disk_dir(void) {
+    return dir_path;
+}
+
+size_t disk_max_object(void) {
+    return budget / 4;
+}
+
+void disk_demote(cache_element *e) {
+    size_t len = cache_element_len(e);
+    if (!disk_enabled() || (!(e->flags & CACHE_HAS_VALIDATORS) && e->expires <= time(NULL)) ||
+        len > disk_max_object()) {
+        cache_release(e);
+        return;
+    }
+    struct disk_job *job = (struct disk_job *)calloc(1, sizeof(struct disk_job));
+    pthread_mutex_lock(&lock);
+    if (!job || queued_bytes + len > DISK_QUEUE_BYTES) {
+        stat_dropped++;
+        pthread_mutex_unlock(&lock);
+        free(job);
+        cache_release(e);
+        return;
+    }
+    job->e = e;
+    job->fd = -1;
+    queued_bytes += len;
+    enqueue(job);
+    pthread_mutex_unlock(&lock);
+}
+
+void disk_store_file(cache_key *key, int fd, size_t len, unsigned flags, time_t expires) {
+    struct disk_job *job = NULL;
+    if (disk_enabled() && len <= disk_max_object())
+        job = (struct disk_job *)calloc(1, sizeof(struct disk_job));
+    if (job)
+        job->key = (char *)malloc(key->len);
+    if (!job || !job->key) {
+        free(job);
+        close(fd);
+        return;
+    }
+    memcpy(job->key, key->str, key->len);
+    job->key_len = key->len;
+    job->hash = key->hash;
+    job->fd = fd;
+    job->len = len;
+    job->flags = flags;
+    job->expires = expires;
+    pthread_mutex_lock(&lock);
+    enqueue(job);
+    pthread_mutex_unlock(&lock);
+}
+
+/* Read len bytes at offset of seg into a new buffer. Returns 0 or -1. */
+static int read_body(struct disk_segment *seg, off_t offset, size_t len, struct seg_buffer *body) {
+    while (body->len < len) {
+        size_t avail;
+        char *dst = seg_buffer_reserve(body, &avail);
+        if (!dst)
+            return -1;
+        if (avail > len - body->len)
+            avail = len - body->len;
+        ssize_t n = pread(seg->fd, dst, avail, offset + body->len);
+        if (n <= 0)
+            return -1;
+        seg_buffer_commit(body, n);
+    }
+    return 0;
+}
+
+/*
+   Find the record for key in the index, without reading it, and pin its
+   segment. Returns 0, or -1 on a miss.
+ */
+static int index_find(cache_key *key, struct disk_entry *entry) {
+    pthread_mutex_lock(&lock);
+    size_t i = index_lookup(key->hash);
+    if (i == (size_t)-1 || table[i].key_len != key->len) {
+        pthread_mutex_unlock(&lock);
+        return -1;
+    }
+    *entry = table[i];
+    if (!(entry->flags & CACHE_HAS_VALIDATORS) && entry->expires <= time(NULL)) {
+        index_delete(i);
+        pthread_mutex_unlock(&lock);
+        return -1;
+    }
+    atomic_fetch_add_explicit(&entry->seg->refs, 1, memory_order_relaxed);
+    pthread_mutex_unlock(&lock);
+    return 0;
+}
+
+/*
+   Read the record index_find() found for key: promote it into the memory
+   cache if it fits there, else return an entry that reads it from the
+   segment, which keeps the pin. NULL if the record is for another key.
+ */
+static cache_element *entry_load(cache_key *key, struct disk_entry *entry) {
+    struct disk_segment *seg = entry->seg;
+
+    /* the index only has the hash; make sure the record is for this key */
+    char stack_key[1024];
+    char *stored = key->len <= sizeof(stack_key) ? stack_key : (char *)malloc(key->len);
+    int match = stored && pread(seg->fd, stored, key->len, entry->offset + sizeof(struct disk_record)) ==
+                                  (ssize_t)key->len && !memcmp(stored, key->str, key->len);
+    if (stored != stack_key)
+        free(stored);
+    if (!match) {
+        segment_release(seg);
+        return NULL;
+    }
+    atomic_fetch_add_explicit(&stat_hits, 1, memory_order_relaxed);
+
+    off_t body_offset = entry->offset + sizeof(struct disk_record) + entry->key_len;
+    cache_element *e = NULL;
+    if (entry->body_len + key->len + sizeof(cache_element) < cache_max_element()) {
+        struct seg_buffer body;
+        seg_buffer_init(&body);
+        if (read_body(seg, body_offset, entry->body_len, &body) == 0 &&
+            add_cache_element(&body, key, entry->flags, entry->expires, &e)) {
+            atomic_fetch_add_explicit(&stat_promoted, 1, memory_order_relaxed);
+            segment_release(seg);
+            return e;
+        }
+        seg_buffer_free(&body);
+    }
+
+    e = cache_element_new(key, entry->flags | CACHE_ON_DISK, entry->expires);
+    if (!e) {
+        segment_release(seg);
+        return NULL;
+    }
+    e->segment = seg;
+    e->disk_offset = body_offset;
+    e->disk_len = entry->body_len;
+    return e;
+}
+
+cache_element *disk_find(cache_key *key) {
+    if (!disk_enabled())
+        return NULL;
+    atomic_fetch_add_explicit(&stat_lookups, 1, memory_order_relaxed);
+
+    struct disk_entry entry;
+    if (index_find(key, &entry) < 0)
+        return NULL;
+    return entry_load(key, &entry);
+}
+
+static void *reader_fn(void *arg) {
+    (void)arg;
+    for (;;) {
+        pthread_mutex_lock(&lock);
+        while (!lookup_head)
+            pthread_cond_wait(&lookup_cond, &lock);
+        struct disk_lookup *l = lookup_head;
+        lookup_head = l->next;
+        if (!lookup_head)
+            lookup_tail = NULL;
+        pthread_mutex_unlock(&lock);
+
+        l->result = entry_load(&l->key, &l->entry);
+        atomic_store_explicit(&l->done, 1, memory_order_release);
+        uint64_t one = 1;
+        if (write(l->notify_fd, &one, sizeof(one)) < 0)
+            perror("eventfd write failed");
+        disk_lookup_release(l);
+    }
+    return NULL;
+}
+
+struct disk_lookup *disk_query(cache_key *key, int notify_fd) {
+    if (!disk_enabled())
+        return NULL;
+    atomic_fetch_add_explicit(&stat_lookups, 1, memory_order_relaxed);
+
+    struct disk_entry entry;
+    if (index_find(key, &entry) < 0)
+        return NULL;
+    struct disk_lookup *l = (struct disk_lookup *)calloc(1, sizeof(struct disk_lookup));
+    char *str = l ? (char *)malloc(key->len) : NULL;
+    if (!str) {
+        free(l);
+        segment_release(entry.seg);
+        return NULL;
+    }
+    memcpy(str, key->str, key->len);
+    l->key.str = str;
+    l->key.len = key->len;
+    l->key.hash = key->hash;
+    l->key.owned = 1;
+    l->entry = entry;
+    l->notify_fd = notify_fd;
+    atomic_init(&l->done, 0);
+    atomic_init(&l->refs, 2);
+
+    pthread_mutex_lock(&lock);
+    l->next = NULL;
+    if (lookup_tail)
+        lookup_tail->next = l;
+    else
+        lookup_head = l;
+    lookup_tail = l;
+    pthread_cond_signal(&lookup_cond);
+    pthread_mutex_unlock(&lock);
+    return l;
+}
+
+int disk_lookup_done(struct disk_lookup *l, cache_element **e) {
+    if (!atomic_load_explicit(&l->done, memory_order_acquire))
+        return 0;
+    *e = l->result;
+    l->result = NULL;
+    return 1;
+}
+
+void disk_lookup_release(struct disk_lookup *l) {
+    if (atomic_fetch_sub_explicit(&l->refs, 1, memory_order_acq_rel) != 1)
+        return;
+    if (l->result)
+        cache_release(l->result);
+    cache_key_free(&l->key);
+    free(l);
+}
+
+ssize_t disk_send(struct disk_segment *seg, off_t offset, size_t len, int fd) {
+    return sendfile(fd, seg->fd, &offset, len);
+}
+
+size_t disk_read(struct disk_segment *seg, off_t offset, char *dst, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = pread(seg->fd, dst + done, len - done, offset + done);
+        if (n <= 0)
+            break;
+        done += n;
+    }
+    return done;
+}
+
+void disk_unpin(struct disk_segment *seg) {
+    segment_release(seg);
+}
+
+void disk_stats(struct disk_stats *st) {
+    pthread_mutex_lock(&lock);
+    st->entries = nentries;
+    st->live_bytes = live_bytes;
+    st->file_bytes = file_bytes;
+    st->segments = nsegments;
+    st->written = stat_written;
+    st->dropped = stat_dropped;
+    st->compacted = stat_compacted;
+    st->evicted = stat_evicted;
+    pthread_mutex_unlock(&lock);
+    st->lookups = atomic_load_explicit(&stat_lookups, memory_order_relaxed);
+    st->hits = atomic_load_explicit(&stat_hits, memory_order_relaxed);
+    st->promoted = atomic_load_explicit(&stat_promoted, memory_order_relaxed);
+}
@@ -0,0 +1,121 @@
+/*
+ * proxy_disk.h -- second cache tier in segment files on local disk.
+ *
+ * Responses evicted from the memory cache, and responses too large for it,
+ * are appended to a log of segment files in one directory. A record is a
+ * small header, the cache key and the response as it is sent to clients.
+ * Only a compact index is kept in memory: for each key hash, the record's
+ * segment and offset, its lengths, flags and expiry. The key itself stays
+ * on disk and is checked against the record on lookup.
+ *
+ * A hit that fits in the memory cache is read back and promoted there. Its
+ * record is left in place, so when the entry is evicted again and nothing
+ * has changed, nothing is written. Larger hits are returned as entries
+ * backed by the segment file and sent with sendfile(). A segment file stays
+ * open while such entries are read from it, even after it is deleted.
+ * Event loops look keys up with disk_query() instead, which leaves reading
+ * the record to a reader thread and signals the loop once it is done.
+ *
+ * All writes go through one background thread. Evicted entries are queued
+ * to it and dropped if the queue is full. Spill files of large responses
+ * are queued the same way (see relay_spill()). Between writes the thread
+ * compacts the log:
+ *   - A sealed segment whose live records have fallen below half of it is
+ *     copied forward and deleted.
+ *   - While the log is over its budget, the oldest segment is deleted
+ *     whole.
+ * On startup the segments are scanned and the index is rebuilt, so the
+ * tier survives restarts.
+ */
+
+#ifndef PROXY_DISK
+#define PROXY_DISK
+
+#include <stddef.h>
+#include <sys/types.h>
+#include "proxy_cache.h"
+
+#define DEFAULT_DISK_BUDGET 1024       /* MB */
+#define DISK_SEGMENT_MIN (1 << 20)
+#define DISK_SEGMENT_MAX (64 << 20)    /* a segment is an eighth of the budget, within these */
+#define DISK_QUEUE_BYTES (64 << 20)    /* evicted bytes waiting to be written */
+
+struct disk_segment;
+struct disk_lookup;
+
+struct disk_stats {
+     size_t entries;
+     size_t live_bytes;           /* in records the index points to */
+     size_t file_bytes;           /* in segment files */
+     size_t segments;
+     unsigned long lookups;
+     unsigned long hits;
+     unsigned long promoted;      /* of the hits, moved into the memory cache */
+     unsigned long written;       /* records appended */
+     unsigned long dropped;       /* evictions not written: queue full or write error */
+     unsigned long compacted;     /* segments copied forward */
+     unsigned long evicted;       /* segments deleted to stay within the budget */
+};
+
+/*
+   Keep the tier in dir, created if missing, using at most budget bytes.
+   The index is rebuilt from the segments found there and the writer thread
+   is started. Returns -1 if dir cannot be used. Without a call the tier is
+   disabled and the other functions do nothing.
+ */
+int disk_init(const char *dir, size_t budget);
+int disk_enabled(void);
+const char *disk_dir(void);
+
+/* Largest response the tier takes, 0 if disabled */
+size_t disk_max_object(void);
+
+/*
+   Queue the response entry e, just evicted from the memory cache, to be
+   written. Takes over the caller's reference to e.
+ */
+void disk_demote(cache_element *e);
+
+/*
+   Queue the len bytes of a response in the file fd, from offset 0, to be
+   written under key. Takes over fd.
+ */
+void disk_store_file(cache_key *key, int fd, size_t len, unsigned flags, time_t expires);
+
+/*
+   Find key. Returns NULL on a miss. On a hit it returns a pinned entry:
+   either a memory cache entry the response was promoted into, or an entry
+   flagged CACHE_ON_DISK that is read from the segment file. Expired
+   responses without validators are dropped and count as misses.
+ */
+cache_element *disk_find(cache_key *key);
+
+/*
+   disk_find() without reading any file on the calling thread. Returns NULL
+   if the index has no record for key. Otherwise the record is read, its
+   key checked and the response promoted by the reader thread, and 1 is
+   added to the eventfd notify_fd once disk_lookup_done() has the answer.
+ */
+struct disk_lookup *disk_query(cache_key *key, int notify_fd);
+
+/*
+   Whether lookup is complete. If so, *e is set to what disk_find() would
+   have returned, which is the caller's to release.
+ */
+int disk_lookup_done(struct disk_lookup *lookup, cache_element **e);
+
+/* Drop the caller's hold on lookup, complete or not */
+void disk_lookup_release(struct disk_lookup *lookup);
+
+/* Send up to len bytes at offset of seg to the socket fd, as sendfile() does */
+ssize_t disk_send(struct disk_segment *seg, off_t offset, size_t len, int fd);
+
+/* Copy up to len bytes at offset of seg into dst. Returns the count. */
+size_t disk_read(struct disk_segment *seg, off_t offset, char *dst, size_t len);
+
+/* Drop a CACHE_ON_DISK entry's hold on its segment */
+void disk_unpin(struct disk_segment *seg);
+
+void disk_stats(struct disk_stats *st);
+
+#endif
@@ -0,0 +1,1123 @@
+/*
+ * proxy_epoll.c -- edge-triggered epoll engine for the caching proxy.
+ *
+ * Each event loop owns an epoll instance and runs in its own thread. Loops
+ * either share one listening socket (registered with EPOLLEXCLUSIVE so only
+ * one loop is woken per connection) or each get their own SO_REUSEPORT
+ * socket. Every client connection is a small state machine:
+ *
+ *   CONN_READ_REQUEST -> (CONN_DISK_LOOKUP)
+ *                     -> fresh hit -> CONN_SEND_CACHED -> close or next request
+ *                     -> miss on a key being fetched -> CONN_COLLAPSED -> close or next request
+ *                     -> miss or stale hit -> (CONN_RESOLVE) -> CONN_CONNECT_UPSTREAM
+ *                                          -> CONN_SEND_UPSTREAM (pooled connection)
+ *                                          -> CONN_RELAY -> CONN_SPLICE -> close or next request
+ *                                                        -> 304 -> CONN_SEND_CACHED
+ *
+ * CONN_RELAY reads the response headers into user space, where they decide
+ * between caching, revalidation and plain relaying; CONN_SPLICE then moves
+ * the body through a pipe without copying it (see proxy_relay.h). When the
+ * body ends before the upstream connection does, the connection is taken
+ * out of the loop and parked in the upstream pool (see proxy_upstream.h).
+ *
+ * A keep-alive client connection goes back to CONN_READ_REQUEST once a
+ * response has been sent in full, with any pipelined requests left in its
+ * buffer. While it waits for the next request it sits on the loop's idle
+ * list, which is swept for connections past their idle timeout.
+ *
+ * Host names are resolved by the resolver threads (see proxy_resolve.h).
+ * A connection whose origin is not in the resolver cache waits in
+ * CONN_RESOLVE on the loop's resolving list; the resolver signals the
+ * loop's eventfd when a lookup completes and the waiting connections query
+ * the cache again.
+ *
+ * The disk tier is never read on a loop. A memory miss whose key is in the
+ * disk tier's index waits in CONN_DISK_LOOKUP on the loop's disk list while
+ * the disk reader thread checks the record and promotes it into memory
+ * (see proxy_disk.h); it signals the loop's third eventfd when done.
+ *
+ * A miss on a key that another connection is already fetching follows that
+ * fetch in CONN_COLLAPSED (see proxy_inflight.h), streaming the response as
+ * the fetcher publishes it. The fetch signals progress on the loop's second
+ * eventfd, which re-drives the connections on the loop's collapsed list.
+ *
+ * Both sockets of a connection are registered once for input and output in
+ * edge-triggered mode. Any event on either of them re-drives the state
+ * machine, which performs I/O until it would block.
+ */
+
+#define _GNU_SOURCE
+#include "proxy_server.h"
+#include "proxy_relay.h"
+#include "proxy_upstream.h"
+#include "proxy_resolve.h"
+#include "proxy_inflight.h"
+#include "proxy_arena.h"
+#include "proxy_disk.h"
+#include "proxy_metrics.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+
+#define MAX_EVENTS 256
+#define IDLE_SWEEP_MS 1000
+
+enum conn_state {
+    CONN_READ_REQUEST,
+    CONN_DISK_LOOKUP,
+    CONN_SEND_CACHED,
+    CONN_COLLAPSED,
+    CONN_RESOLVE,
+    CONN_CONNECT_UPSTREAM,
+    CONN_SEND_UPSTREAM,
+    CONN_RELAY,
+    CONN_SPLICE,
+    CONN_CLOSED
+};
+
+/* Result of one step of the state machine */
+enum {
+    STEP_NEXT,   /* state changed, keep going */
+    STEP_WAIT,   /* would block, wait for the next event */
+    STEP_DONE    /* connection finished or failed, close it */
+};
+
+struct ev_conn;
+
+/*
+   epoll_event.data.ptr points at one of these; conn is NULL for the
+   listeners and the loop's eventfds
+ */
+struct ev_endpoint {
+    int fd;
+    struct ev_conn *conn;
+};
+
+struct ev_conn {
+    struct ev_endpoint client;
+    struct ev_endpoint upstream;
+    enum conn_state state;
+
+    struct arena *arena;         /* the buffer, then the request being served */
+    struct arena_mark mark;      /* where the request's allocations start */
+    char *buffer;                /* client request, grown up to MAX_HEADER_BYTES */
+    size_t buffer_len;
+    size_t buffer_cap;
+    size_t request_len;          /* of the request being served; pipelined ones follow */
+    struct RequestParser parser; /* resumed as the request arrives */
+    struct RequestView view;
+    uint64_t read_start;         /* metrics_now() at the request's first bytes, 0 before them */
+    uint64_t started;            /* when the request's headers were complete */
+    int keep_alive;              /* seconds to wait for another request, 0 to close */
+    int served;                  /* requests served on this connection */
+    ParsedRequest *request;
+    cache_key key;
+
+    struct disk_lookup *lookup;  /* pending in CONN_DISK_LOOKUP */
+    uint64_t lookup_start;
+    struct ev_conn *lookup_next;
+    cache_element *hit;          /* pinned, fresh or being revalidated; what CONN_SEND_CACHED sends */
+    int stale;                   /* the upstream request is conditional on hit */
+    size_t hit_pos;
+
+    struct inflight *fetch;      /* this connection's fetch, which others may follow */
+    struct inflight *follow;     /* the fetch followed in CONN_COLLAPSED */
+    size_t follow_pos;
+    int collapsed;               /* on the loop's collapsed list */
+    struct ev_conn *collapsed_next;
+
+    char *out;                   /* upstream request */
+    size_t out_len;
+    size_t out_pos;
+    time_t request_time;
+    uint64_t connect_start;      /* when the upstream connection was asked for */
+    uint64_t sent_at;            /* when the upstream request was sent */
+    int server_port;
+    int reused;                  /* upstream came from the pool */
+    struct resolve_result addrs; /* of the origin, tried in turn */
+    int addr_index;
+    struct ev_conn *resolve_next;
+
+    char *resp;                  /* upstream response, kept for the cache */
+    size_t resp_len;
+    size_t resp_cap;
+    size_t fwd_pos;              /* bytes of resp relayed to the client */
+    int headers_done;
+    struct ParsedResponse *response;
+    struct ResponseBody body;    /* where the response ends */
+    int reusable;                /* upstream may be pooled once the body is done */
+    int client_gone;             /* client closed mid-relay */
+    struct relay relay;          /* body relay, open in CONN_SPLICE */
+    int splicing;
+
+    time_t idle_since;           /* waiting for a request since, or since its first bytes */
+    int idle;                    /* on the loop's idle list, from accept until a request is complete */
+    struct ev_conn *idle_prev;
+    struct ev_conn *idle_next;
+
+    struct ev_conn *next_closed;
+};
+
+struct ev_loop {
+    int epfd;
+    struct ev_endpoint *listeners;
+    struct ev_conn *closed;      /* freed once the current batch is done */
+    struct ev_conn *idle;        /* keep-alive connections between requests */
+    struct ev_endpoint dns;      /* eventfd the resolver signals */
+    struct ev_conn *resolving;   /* connections in CONN_RESOLVE */
+    struct ev_endpoint fetches;  /* eventfd followed fetches signal */
+    struct ev_conn *collapsed;   /* connections waiting for a followed fetch */
+    struct ev_endpoint disk;     /* eventfd the disk reader signals */
+    struct ev_conn *looking_up;  /* connections in CONN_DISK_LOOKUP */
+    time_t last_sweep;
+    pthread_t thread;
+};
+
+static int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0)
+        return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static int would_block(void) {
+    return errno == EAGAIN || errno == EWOULDBLOCK;
+}
+
+static void idle_add(struct ev_loop *loop, struct ev_conn *c) {
+    if (c->idle)
+        return;
+    c->idle = 1;
+    c->idle_since = time(NULL);
+    c->idle_prev = NULL;
+    c->idle_next = loop->idle;
+    if (loop->idle)
+        loop->idle->idle_prev = c;
+    loop->idle = c;
+}
+
+static void collapsed_add(struct ev_loop *loop, struct ev_conn *c) {
+    if (c->collapsed)
+        return;
+    c->collapsed = 1;
+    c->collapsed_next = loop->collapsed;
+    loop->collapsed = c;
+}
+
+static void collapsed_remove(struct ev_loop *loop, struct ev_conn *c) {
+    if (!c->collapsed)
+        return;
+    struct ev_conn **link = &loop->collapsed;
+    while (*link != c)
+        link = &(*link)->collapsed_next;
+    *link = c->collapsed_next;
+    c->collapsed = 0;
+}
+
+static void lookup_remove(struct ev_loop *loop, struct ev_conn *c) {
+    struct ev_conn **link = &loop->looking_up;
+    while (*link && *link != c)
+        link = &(*link)->lookup_next;
+    if (*link)
+        *link = c->lookup_next;
+}
+
+static void idle_remove(struct ev_loop *loop, struct ev_conn *c) {
+    if (!c->idle)
+        return;
+    if (c->idle_prev)
+        c->idle_prev->idle_next = c->idle_next;
+    else
+        loop->idle = c->idle_next;
+    if (c->idle_next)
+        c->idle_next->idle_prev = c->idle_prev;
+    c->idle = 0;
+}
+
+/*
+   Close both sockets. The connection itself is only freed after the current
+   batch of events, which may still hold pointers to its endpoints.
+ */
+static void conn_close(struct ev_loop *loop, struct ev_conn *c) {
+    idle_remove(loop, c);
+    collapsed_remove(loop, c);
+    if (c->state == CONN_RESOLVE) {
+        struct ev_conn **link = &loop->resolving;
+        while (*link && *link != c)
+            link = &(*link)->resolve_next;
+        if (*link)
+            *link = c->resolve_next;
+    }
+    if (c->state == CONN_DISK_LOOKUP)
+        lookup_remove(loop, c);
+    if (c->upstream.fd >= 0)
+        close(c->upstream.fd);
+    shutdown(c->client.fd, SHUT_RDWR);
+    close(c->client.fd);
+    metrics_add(METRIC_CONNECTIONS_CLOSED, 1);
+    c->state = CONN_CLOSED;
+    c->next_closed = loop->closed;
+    loop->closed = c;
+}
+
+/* Free what belongs to the request being served and reset it for the next */
+static void conn_clear_request(struct ev_conn *c) {
+    if (c->hit)
+        cache_release(c->hit);
+    if (c->request)
+        ParsedRequest_destroy(c->request);
+    cache_key_free(&c->key);
+    if (c->splicing)
+        relay_close(&c->relay);
+    if (c->response)
+        ParsedResponse_destroy(c->response);
+    /* a fetch that did not get to its end is not shared */
+    inflight_end(c->fetch, NULL);
+    if (c->follow)
+        inflight_release(c->follow);
+    if (c->lookup)
+        disk_lookup_release(c->lookup);
+
+    c->request = NULL;
+    c->lookup = NULL;
+    c->hit = NULL;
+    c->stale = 0;
+    c->hit_pos = 0;
+    c->fetch = NULL;
+    c->follow = NULL;
+    c->follow_pos = 0;
+    c->out = NULL;
+    c->out_len = c->out_pos = 0;
+    c->reused = 0;
+    c->resp = NULL;
+    c->resp_len = c->resp_cap = c->fwd_pos = 0;
+    c->headers_done = 0;
+    c->response = NULL;
+    memset(&c->body, 0, sizeof(c->body));
+    c->reusable = 0;
+    c->client_gone = 0;
+    c->splicing = 0;
+}
+
+static void conn_free(struct ev_conn *c) {
+    conn_clear_request(c);
+    RequestView_release(&c->view);
+    arena_recycle(c->arena);
+    free(c);
+}
+
+static int conn_register(struct ev_loop *loop, struct ev_endpoint *ep) {
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = ep;
+    return epoll_ctl(loop->epfd, EPOLL_CTL_ADD, ep->fd, &ev);
+}
+
+/*
+   Start a non-blocking connect to the origin's addresses from addr_index
+   on, skipping those that fail at once.
+ */
+static int conn_connect_addr(struct ev_loop *loop, struct ev_conn *c) {
+    for (; c->addr_index < c->addrs.naddrs; c->addr_index++) {
+        struct sockaddr_in server_addr;
+        remoteAddress(c->addrs.addrs[c->addr_index], c->server_port, &server_addr);
+
+        int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if (fd < 0) {
+            perror("Error in Creating Socket.\n");
+            return -1;
+        }
+        if (connect(fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0 && errno != EINPROGRESS) {
+            perror("Error in connecting !\n");
+            close(fd);
+            continue;
+        }
+        setNoDelay(fd);
+        c->upstream.fd = fd;
+        c->state = CONN_CONNECT_UPSTREAM;
+        if (conn_register(loop, &c->upstream) < 0) {
+            perror("epoll_ctl failed\n");
+            return -1;
+        }
+        return 0;
+    }
+    metrics_add(METRIC_CONNECT_FAILURES, 1);
+    return -1;
+}
+
+/*
+   Look the origin up in the resolver cache and connect, or wait in
+   CONN_RESOLVE for the lookup to complete.
+ */
+static int conn_resolve(struct ev_loop *loop, struct ev_conn *c) {
+    int ret = resolver_query(c->request->host, &c->addrs, loop->dns.fd);
+    if (ret == RESOLVE_PENDING) {
+        c->state = CONN_RESOLVE;
+        c->resolve_next = loop->resolving;
+        loop->resolving = c;
+        return 0;
+    }
+    if (ret == RESOLVE_FAILED) {
+        fprintf(stderr, "No such host exists.\n");
+        metrics_add(METRIC_CONNECT_FAILURES, 1);
+        return -1;
+    }
+    c->addr_index = 0;
+    return conn_connect_addr(loop, c);
+}
+
+/*
+   Connect to the request's origin: take an idle pooled connection and go
+   straight to CONN_SEND_UPSTREAM, or resolve the origin and start a
+   non-blocking connect.
+ */
+static int conn_connect(struct ev_loop *loop, struct ev_conn *c, ParsedRequest *request) {
+    int fd = upstream_acquire(request->host, c->server_port);
+    c->reused = fd >= 0;
+    if (!c->reused)
+        return conn_resolve(loop, c);
+
+    set_nonblocking(fd);
+    c->upstream.fd = fd;
+    c->state = CONN_SEND_UPSTREAM;
+    if (conn_register(loop, &c->upstream) < 0) {
+        perror("epoll_ctl failed\n");
+        return -1;
+    }
+    metrics_since(HIST_CONNECT, c->connect_start);
+    return 0;
+}
+
+static int conn_start_upstream(struct ev_loop *loop, struct ev_conn *c, ParsedRequest *request) {
+    c->out = buildRemoteRequest(request, &c->out_len);
+    if (!c->out)
+        return -1;
+    c->out_pos = 0;
+    c->request_time = time(NULL);
+    c->server_port = request->port ? atoi(request->port) : 80;
+    c->connect_start = metrics_now();
+    return conn_connect(loop, c, request);
+}
+
+/*
+   A pooled connection failed before any of the response arrived: the origin
+   closed it after the liveness check. Send the request again on another.
+ */
+static int conn_retry_upstream(struct ev_loop *loop, struct ev_conn *c) {
+    epoll_ctl(loop->epfd, EPOLL_CTL_DEL, c->upstream.fd, NULL);
+    close(c->upstream.fd);
+    c->upstream.fd = -1;
+    c->out_pos = 0;
+    c->connect_start = metrics_now();
+    if (conn_connect(loop, c, c->request) < 0) {
+        sendErrorMessage(c->client.fd, 500);
+        return STEP_DONE;
+    }
+    return STEP_NEXT;
+}
+
+/* The response is complete: hand the upstream connection to the pool */
+static void conn_park_upstream(struct ev_loop *loop, struct ev_conn *c) {
+    if (!c->reusable || !c->body.done || c->body.error)
+        return;
+    epoll_ctl(loop->epfd, EPOLL_CTL_DEL, c->upstream.fd, NULL);
+    upstream_release(c->request->host, c->server_port, c->upstream.fd);
+    c->upstream.fd = -1;
+}
+
+static int conn_serve(struct ev_loop *loop, struct ev_conn *c);
+
+/* Handle a complete request: look it up in the cache, then serve it */
+static int conn_dispatch(struct ev_loop *loop, struct ev_conn *c) {
+    ParsedRequest *request = ParsedRequest_createIn(c->arena);
+    if (!request)
+        return STEP_DONE;
+    c->request = request;
+    atomic_fetch_add(&client_requests, 1);
+    if (c->served++ > 0)
+        atomic_fetch_add(&client_reuses, 1);
+    if (ParsedRequest_fromView(request, &c->view) < 0) {
+        perror("Parsing failed\n");
+        return STEP_DONE;
+    }
+    if (strcmp(request->method, "GET")) {
+        printf("This code doesn't support any method other than GET\n");
+        return STEP_DONE;
+    }
+    if (!request->host || !request->path || checkHTTPversion(request->version) != 1 ||
+        buildCacheKey(request, NULL, &c->key) < 0) {
+        sendErrorMessage(c->client.fd, 500);
+        return STEP_DONE;
+    }
+    /* before buildRemoteRequest() rewrites the connection headers */
+    c->keep_alive = clientKeepAlive(request);
+    c->lookup_start = metrics_now();
+    metrics_observe(HIST_PARSE, c->lookup_start - c->started);
+
+    c->hit = findCachedResponseAsync(request, &c->key, loop->disk.fd, &c->lookup);
+    if (c->lookup) {
+        c->state = CONN_DISK_LOOKUP;
+        c->lookup_next = loop->looking_up;
+        loop->looking_up = c;
+        return STEP_WAIT;
+    }
+    return conn_serve(loop, c);
+}
+
+/* The cache lookup is done: send the hit, or fetch from the origin */
+static int conn_serve(struct ev_loop *loop, struct ev_conn *c) {
+    ParsedRequest *request = c->request;
+    metrics_since(HIST_LOOKUP, c->lookup_start);
+    if (c->hit && cacheEntryFresh(request, c->hit)) {
+        c->hit_pos = 0;
+        c->state = CONN_SEND_CACHED;
+        return STEP_NEXT;
+    }
+    if (c->hit) {
+        c->stale = addConditionalHeaders(request, c->hit);
+        if (!c->stale) {
+            cache_release(c->hit);
+            c->hit = NULL;
+        }
+    }
+
+    /* follow a fetch of the same response in flight, if there is one */
+    struct inflight *fetch;
+    if (inflight_begin(&c->key, loop->fetches.fd, &fetch) == INFLIGHT_FOLLOW) {
+        c->follow = fetch;
+        c->state = CONN_COLLAPSED;
+        return STEP_NEXT;
+    }
+    c->fetch = fetch;
+    if (conn_start_upstream(loop, c, request) < 0) {
+        sendErrorMessage(c->client.fd, 500);
+        return STEP_DONE;
+    }
+    return STEP_NEXT;
+}
+
+/* Wait for the disk reader to answer the lookup, then serve the request */
+static int step_disk_lookup(struct ev_loop *loop, struct ev_conn *c) {
+    if (!disk_lookup_done(c->lookup, &c->hit))
+        return STEP_WAIT;
+    lookup_remove(loop, c);
+    disk_lookup_release(c->lookup);
+    c->lookup = NULL;
+    return conn_serve(loop, c);
+}
+
+static int step_read_request(struct ev_loop *loop, struct ev_conn *c) {
+    for (;;) {
+        /* Pipelined requests may already be buffered, in part or whole */
+        int status = RequestParser_feed(&c->parser, c->buffer, c->buffer_len);
+        if (status == REQUEST_COMPLETE) {
+            c->started = metrics_now();
+            metrics_observe(HIST_READ, c->started - c->read_start);
+            c->read_start = 0;
+            c->request_len = c->view.header_len;
+            idle_remove(loop, c);
+            return conn_dispatch(loop, c);
+        }
+        if (status != REQUEST_NEED_MORE) {
+            sendErrorMessage(c->client.fd, status == REQUEST_TOO_LARGE ? 431 : 400);
+            return STEP_DONE;
+        }
+        if (c->buffer_len == c->buffer_cap) {
+            if (growRequestBuffer(c->arena, &c->buffer, c->buffer_len, &c->buffer_cap) < 0) {
+                perror("Error in receiving from client.\n");
+                return STEP_DONE;
+            }
+            c->mark = arena_mark(c->arena);
+        }
+
+        ssize_t n = recv(c->client.fd, c->buffer + c->buffer_len, c->buffer_cap - c->buffer_len, 0);
+        if (n > 0) {
+            if (!c->read_start) {
+                /* the headers' deadline runs from here */
+                c->read_start = metrics_now();
+                c->idle_since = time(NULL);
+            }
+            c->buffer_len += n;
+        } else if (n == 0) {
+            if (!c->served)
+                printf("Client disconnected!\n");
+            return STEP_DONE;
+        } else if (would_block()) {
+            return STEP_WAIT;
+        } else {
+            perror("Error in receiving from client.\n");
+            return STEP_DONE;
+        }
+    }
+}
+
+/*
+   A response has been sent. delimited tells whether the client can find
+   its end without the connection closing; if so and the client keeps the
+   connection alive, clear the request and go back to reading the next one.
+ */
+static int conn_finish(struct ev_loop *loop, struct ev_conn *c, int delimited) {
+    if (!delimited || !c->keep_alive || c->served >= max_requests)
+        return STEP_DONE;
+
+    if (c->upstream.fd >= 0) {
+        close(c->upstream.fd);
+        c->upstream.fd = -1;
+    }
+    conn_clear_request(c);
+    arena_reset(c->arena, c->mark);
+    c->buffer_len -= c->request_len;
+    memmove(c->buffer, c->buffer + c->request_len, c->buffer_len);
+    c->request_len = 0;
+    /* a pipelined request's first bytes are already here */
+    c->read_start = c->buffer_len ? metrics_now() : 0;
+    RequestView_release(&c->view);
+    RequestParser_init(&c->parser, &c->view, MAX_HEADER_BYTES);
+    c->state = CONN_READ_REQUEST;
+    idle_add(loop, c);
+    return STEP_NEXT;
+}
+
+static int step_send_cached(struct ev_loop *loop, struct ev_conn *c) {
+    size_t len = cache_element_len(c->hit);
+    while (c->hit_pos < len) {
+        ssize_t n = cache_element_send(c->hit, c->client.fd, c->hit_pos, MSG_NOSIGNAL);
+        if (n < 0)
+            return would_block() ? STEP_WAIT : STEP_DONE;
+        c->hit_pos += n;
+    }
+    metrics_add(METRIC_CACHE_BYTES_SENT, len);
+    metrics_since(c->stale ? HIST_REVALIDATED : HIST_HIT, c->started);
+    printf("Data retrieved from the Cache\n\n");
+    return conn_finish(loop, c, !(c->hit->flags & CACHE_UNFRAMED));
+}
+
+/*
+   Send what the followed fetch has received so far. Once it is complete
+   the request is done; if it fails before anything was sent, fetch the
+   response ourselves.
+ */
+static int step_collapsed(struct ev_loop *loop, struct ev_conn *c) {
+    ssize_t n;
+    while ((n = inflight_send(c->follow, c->client.fd, c->follow_pos, MSG_NOSIGNAL)) != 0) {
+        if (n < 0) {
+            if (!would_block())
+                return STEP_DONE;
+            /* woken by the client socket or the fetch, whichever is ready first */
+            collapsed_add(loop, c);
+            return STEP_WAIT;
+        }
+        c->follow_pos += n;
+    }
+
+    int delimited;
+    int status = inflight_status(c->follow, &delimited);
+    inflight_release(c->follow);
+    c->follow = NULL;
+    if (status == INFLIGHT_DONE) {
+        metrics_since(HIST_COLLAPSED, c->started);
+        printf("Data streamed from a collapsed fetch\n\n");
+        return conn_finish(loop, c, delimited);
+    }
+    if (c->follow_pos > 0)
+        return STEP_DONE;
+    if (conn_start_upstream(loop, c, c->request) < 0) {
+        sendErrorMessage(c->client.fd, 500);
+        return STEP_DONE;
+    }
+    return STEP_NEXT;
+}
+
+static int step_connect_upstream(struct ev_loop *loop, struct ev_conn *c) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(c->upstream.fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+        err = errno;
+    if (err == EINPROGRESS || err == EALREADY)
+        return STEP_WAIT;
+    if (err) {
+        errno = err;
+        perror("Error in connecting !\n");
+        /* fail over to the origin's next address */
+        epoll_ctl(loop->epfd, EPOLL_CTL_DEL, c->upstream.fd, NULL);
+        close(c->upstream.fd);
+        c->upstream.fd = -1;
+        c->addr_index++;
+        if (conn_connect_addr(loop, c) == 0)
+            return STEP_NEXT;
+        sendErrorMessage(c->client.fd, 500);
+        return STEP_DONE;
+    }
+    metrics_since(HIST_CONNECT, c->connect_start);
+    c->state = CONN_SEND_UPSTREAM;
+    return STEP_NEXT;
+}
+
+static int step_send_upstream(struct ev_loop *loop, struct ev_conn *c) {
+    while (c->out_pos < c->out_len) {
+        ssize_t n = send(c->upstream.fd, c->out + c->out_pos, c->out_len - c->out_pos, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == ENOTCONN || would_block())
+                return STEP_WAIT;
+            if (c->reused)
+                return conn_retry_upstream(loop, c);
+            sendErrorMessage(c->client.fd, 500);
+            return STEP_DONE;
+        }
+        c->out_pos += n;
+    }
+    c->sent_at = metrics_now();
+    c->state = CONN_RELAY;
+    return STEP_NEXT;
+}
+
+static int resp_reserve(struct ev_conn *c, size_t len) {
+    if (c->resp_len + len + 1 > c->resp_cap) {
+        size_t cap = c->resp_cap ? c->resp_cap : MAX_BYTES * 2;
+        while (c->resp_len + len + 1 > cap)
+            cap *= 2;
+        char *resp = (char *)arena_realloc(c->arena, c->resp, c->resp_len, cap);
+        if (!resp)
+            return -1;
+        c->resp = resp;
+        c->resp_cap = cap;
+    }
+    return 0;
+}
+
+/*
+   The response headers are complete. Whatever body arrived with them is
+   passed through its framing, and anything beyond the end of the response
+   dropped. A 304 to a revalidation refreshes the cached entry, which is
+   then sent instead of the 304.
+ */
+static int conn_response_headers(struct ev_loop *loop, struct ev_conn *c) {
+    c->headers_done = 1;
+    c->response = ParsedResponse_create();
+    if (c->response && ParsedResponse_parse(c->response, c->resp, c->resp_len) < 0) {
+        ParsedResponse_destroy(c->response);
+        c->response = NULL;
+    }
+    if (!c->response)
+        return STEP_NEXT;
+
+    ResponseBody_init(&c->body, c->response);
+    size_t extra = c->resp_len - c->response->header_len;
+    size_t used = ResponseBody_consume(&c->body, c->resp + c->response->header_len, extra);
+    c->reusable = ParsedResponse_keepAlive(c->response) && c->body.framing != BODY_UNTIL_CLOSE &&
+                  used == extra;
+    c->resp_len = c->response->header_len + used;
+    if (!c->stale || c->response->status != 304)
+        return STEP_NEXT;
+
+    metrics_since(HIST_LAST_BYTE, c->sent_at);
+    conn_park_upstream(loop, c);
+
+    /* if the refreshed response cannot be cached, the stale one is still valid */
+    cache_element *refreshed = refreshCachedResponse(c->request, &c->key, c->hit, c->response,
+                                                     c->request_time);
+    inflight_end(c->fetch, refreshed);
+    c->fetch = NULL;
+    if (refreshed) {
+        cache_release(c->hit);
+        c->hit = refreshed;
+    }
+    c->hit_pos = 0;
+    c->state = CONN_SEND_CACHED;
+    printf("Data revalidated in the Cache\n\n");
+    return STEP_NEXT;
+}
+
+/*
+   The headers and whatever body arrived with them have been relayed; move
+   the rest of the body with splice(), keeping a copy if it will be cached.
+ */
+static int conn_start_splice(struct ev_conn *c) {
+    int keep = responseCacheable(c->request, c->response, c->request_time);
+    if (c->client_gone && !keep)
+        return STEP_DONE;
+    if (openRelay(&c->relay, c->resp, c->resp_len, keep) < 0)
+        return STEP_DONE;
+    if (!keep || !responseShareable(c->request, c->response, c->request_time)) {
+        /* the connections following this fetch have to make their own */
+        inflight_end(c->fetch, NULL);
+        c->fetch = NULL;
+    }
+    inflight_publish(c->fetch, &c->relay.copy);
+    c->splicing = 1;
+    c->state = CONN_SPLICE;
+    return STEP_NEXT;
+}
+
+static int step_splice(struct ev_loop *loop, struct ev_conn *c) {
+    struct relay *r = &c->relay;
+    for (;;) {
+        if (c->client_gone) {
+            relay_discard(r);
+            if (!r->keep)
+                return STEP_DONE;
+        } else if (relay_drain(r, c->client.fd) < 0) {
+            if (would_block())
+                return STEP_WAIT;
+            /* Like the thread engine, keep reading so the cache is filled */
+            c->client_gone = 1;
+            continue;
+        }
+
+        ssize_t n = relay_fill_body(r, c->upstream.fd, &c->body);
+        if (n == 0) {
+            metrics_since(HIST_LAST_BYTE, c->sent_at);
+            metrics_since(HIST_MISS, c->started);
+            cache_element *cached = NULL;
+            if (r->keep && !c->body.error && (c->body.done || c->body.framing == BODY_UNTIL_CLOSE))
+                cacheRelayedResponse(c->request, &c->key, c->response, c->request_time, r,
+                                     c->fetch ? &cached : NULL);
+            inflight_end(c->fetch, cached);
+            c->fetch = NULL;
+            if (cached)
+                cache_release(cached);
+            conn_park_upstream(loop, c);
+            return conn_finish(loop, c, !c->client_gone && c->body.done &&
+                               c->body.framing != BODY_UNTIL_CLOSE);
+        }
+        if (n < 0)
+            return would_block() ? STEP_WAIT : STEP_DONE;
+        if (r->spill_fd >= 0 && c->fetch) {
+            /* the copy has left memory, so followers cannot be fed from it */
+            inflight_end(c->fetch, NULL);
+            c->fetch = NULL;
+        }
+        inflight_publish(c->fetch, &r->copy);
+    }
+}
+
+static int step_relay(struct ev_loop *loop, struct ev_conn *c) {
+    for (;;) {
+        while (c->headers_done && !c->client_gone && c->fwd_pos < c->resp_len) {
+            ssize_t n = send(c->client.fd, c->resp + c->fwd_pos, c->resp_len - c->fwd_pos, MSG_NOSIGNAL);
+            if (n < 0) {
+                if (would_block())
+                    return STEP_WAIT;
+                /* Like the thread engine, keep reading so the cache is filled */
+                c->client_gone = 1;
+                break;
+            }
+            c->fwd_pos += n;
+        }
+        if (c->response)
+            return conn_start_splice(c);
+        if (c->headers_done) {
+            /*
+               A response passed through is not cached, so once the client
+               has it all, or is gone, the buffer starts over as a window.
+             */
+            if (c->client_gone)
+                return STEP_DONE;
+            c->resp_len = c->fwd_pos = 0;
+        }
+
+        if (resp_reserve(c, MAX_BYTES) < 0)
+            return STEP_DONE;
+        ssize_t n = recv(c->upstream.fd, c->resp + c->resp_len, MAX_BYTES, 0);
+        if (n > 0) {
+            if (!c->headers_done && c->resp_len == 0)
+                metrics_since(HIST_FIRST_BYTE, c->sent_at);
+            c->resp_len += n;
+            c->resp[c->resp_len] = '\0';
+            /* Hold the response back until its headers are complete */
+            if (!c->headers_done && ParsedResponse_headerEnd(c->resp, c->resp_len)) {
+                int ret = conn_response_headers(loop, c);
+                if (c->state != CONN_RELAY || ret == STEP_DONE)
+                    return ret;
+            } else if (!c->headers_done && c->resp_len > MAX_HEADER_BYTES) {
+                /* not a response we understand, pass it through */
+                c->headers_done = 1;
+            }
+        } else if (c->reused && !c->headers_done && c->resp_len == 0) {
+            return n < 0 && would_block() ? STEP_WAIT : conn_retry_upstream(loop, c);
+        } else if (n == 0) {
+            if (!c->headers_done) {
+                /* not HTTP, pass whatever arrived through */
+                c->headers_done = 1;
+                continue;
+            }
+            return STEP_DONE;
+        } else {
+            return would_block() ? STEP_WAIT : STEP_DONE;
+        }
+    }
+}
+
+static void conn_drive(struct ev_loop *loop, struct ev_conn *c) {
+    while (c->state != CONN_CLOSED) {
+        int ret;
+        switch (c->state) {
+            case CONN_READ_REQUEST:
+                ret = step_read_request(loop, c);
+                break;
+            case CONN_SEND_CACHED:
+                ret = step_send_cached(loop, c);
+                break;
+            case CONN_COLLAPSED:
+                ret = step_collapsed(loop, c);
+                break;
+            case CONN_DISK_LOOKUP:
+                ret = step_disk_lookup(loop, c);
+                break;
+            case CONN_RESOLVE:
+                ret = STEP_WAIT;
+                break;
+            case CONN_CONNECT_UPSTREAM:
+                ret = step_connect_upstream(loop, c);
+                break;
+            case CONN_SEND_UPSTREAM:
+                ret = step_send_upstream(loop, c);
+                break;
+            case CONN_RELAY:
+                ret = step_relay(loop, c);
+                break;
+            case CONN_SPLICE:
+                ret = step_splice(loop, c);
+                break;
+            default:
+                ret = STEP_DONE;
+        }
+        if (ret == STEP_WAIT)
+            return;
+        if (ret == STEP_DONE) {
+            conn_close(loop, c);
+            return;
+        }
+    }
+}
+
+static void loop_accept(struct ev_loop *loop, int listen_fd) {
+    for (;;) {
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK);
+        if (fd < 0) {
+            if (!would_block() && errno != EINTR)
+                perror("Error in Accepting connection !\n");
+            return;
+        }
+        setNoDelay(fd);
+
+        struct ev_conn *c = (struct ev_conn *)calloc(1, sizeof(struct ev_conn));
+        if (c)
+            c->arena = arena_acquire();
+        if (c && c->arena)
+            c->buffer = (char *)arena_alloc(c->arena, MAX_BYTES);
+        if (!c || !c->buffer) {
+            if (c && c->arena)
+                arena_recycle(c->arena);
+            free(c);
+            close(fd);
+            continue;
+        }
+        c->buffer_cap = MAX_BYTES;
+        c->mark = arena_mark(c->arena);
+        RequestParser_init(&c->parser, &c->view, MAX_HEADER_BYTES);
+        atomic_fetch_add(&client_connections, 1);
+        metrics_add(METRIC_CONNECTIONS_OPENED, 1);
+        c->client.fd = fd;
+        c->client.conn = c;
+        c->upstream.fd = -1;
+        c->upstream.conn = c;
+        c->state = CONN_READ_REQUEST;
+        idle_add(loop, c);
+
+        if (conn_register(loop, &c->client) < 0) {
+            perror("epoll_ctl failed\n");
+            conn_close(loop, c);
+        }
+        /* The registration reports any bytes already queued on the socket */
+    }
+}
+
+/* The resolver finished lookups: retry the connections waiting for one */
+static void loop_resolved(struct ev_loop *loop) {
+    uint64_t count;
+    if (read(loop->dns.fd, &count, sizeof(count)) < 0 && !would_block())
+        perror("eventfd read failed\n");
+
+    struct ev_conn *c = loop->resolving;
+    loop->resolving = NULL;
+    while (c) {
+        struct ev_conn *next = c->resolve_next;
+        if (conn_resolve(loop, c) < 0) {
+            sendErrorMessage(c->client.fd, 500);
+            conn_close(loop, c);
+        } else {
+            conn_drive(loop, c);
+        }
+        c = next;
+    }
+}
+
+/* The disk reader finished lookups: re-drive the connections waiting for one */
+static void loop_disk_lookups(struct ev_loop *loop) {
+    uint64_t count;
+    if (read(loop->disk.fd, &count, sizeof(count)) < 0 && !would_block())
+        perror("eventfd read failed\n");
+
+    struct ev_conn *c = loop->looking_up;
+    loop->looking_up = NULL;
+    while (c) {
+        struct ev_conn *next = c->lookup_next;
+        /* those still waiting put themselves back */
+        c->lookup_next = loop->looking_up;
+        loop->looking_up = c;
+        conn_drive(loop, c);
+        c = next;
+    }
+}
+
+/* Followed fetches made progress: re-drive the connections waiting on them */
+static void loop_fetch_progress(struct ev_loop *loop) {
+    uint64_t count;
+    if (read(loop->fetches.fd, &count, sizeof(count)) < 0 && !would_block())
+        perror("eventfd read failed\n");
+
+    struct ev_conn *c = loop->collapsed;
+    loop->collapsed = NULL;
+    while (c) {
+        struct ev_conn *next = c->collapsed_next;
+        c->collapsed = 0;
+        if (c->state == CONN_COLLAPSED)
+            conn_drive(loop, c);
+        c = next;
+    }
+}
+
+/*
+   Close connections that have waited too long for a request: past the
+   keep-alive timeout between requests, or REQUEST_HEADER_TIMEOUT for the
+   first one and for the headers of any request once they have begun.
+ */
+static void loop_sweep_idle(struct ev_loop *loop) {
+    time_t now = time(NULL);
+    if (now == loop->last_sweep)
+        return;
+    loop->last_sweep = now;
+
+    struct ev_conn *c = loop->idle;
+    while (c) {
+        struct ev_conn *next = c->idle_next;
+        int timeout = c->served && !c->buffer_len ? c->keep_alive : REQUEST_HEADER_TIMEOUT;
+        if (now - c->idle_since >= timeout)
+            conn_close(loop, c);
+        c = next;
+    }
+}
+
+static void *loop_run(void *arg) {
+    struct ev_loop *loop = (struct ev_loop *)arg;
+    struct epoll_event events[MAX_EVENTS];
+
+    while (1) {
+        int n = epoll_wait(loop->epfd, events, MAX_EVENTS, loop->idle ? IDLE_SWEEP_MS : -1);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait failed\n");
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            struct ev_endpoint *ep = (struct ev_endpoint *)events[i].data.ptr;
+            if (ep == &loop->dns)
+                loop_resolved(loop);
+            else if (ep == &loop->fetches)
+                loop_fetch_progress(loop);
+            else if (ep == &loop->disk)
+                loop_disk_lookups(loop);
+            else if (!ep->conn)
+                loop_accept(loop, ep->fd);
+            else
+                conn_drive(loop, ep->conn);
+        }
+        loop_sweep_idle(loop);
+        while (loop->closed) {
+            struct ev_conn *c = loop->closed;
+            loop->closed = c->next_closed;
+            conn_free(c);
+        }
+    }
+    return NULL;
+}
+
+int epoll_engine_run(int *listen_fds, int nlisteners, int nloops, int pin) {
+    struct ev_loop *loops = (struct ev_loop *)calloc(nloops, sizeof(struct ev_loop));
+    if (!loops)
+        return -1;
+
+    for (int i = 0; i < nlisteners; i++)
+        set_nonblocking(listen_fds[i]);
+    for (int i = 0; i < nloops; i++) {
+        struct ev_loop *loop = loops + i;
+        loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+        loop->listeners = (struct ev_endpoint *)calloc(nlisteners, sizeof(struct ev_endpoint));
+        if (loop->epfd < 0 || !loop->listeners) {
+            perror("epoll_create1 failed\n");
+            return -1;
+        }
+        loop->dns.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        loop->dns.conn = NULL;
+        if (loop->dns.fd < 0 || conn_register(loop, &loop->dns) < 0) {
+            perror("eventfd failed\n");
+            return -1;
+        }
+        loop->fetches.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        loop->fetches.conn = NULL;
+        if (loop->fetches.fd < 0 || conn_register(loop, &loop->fetches) < 0) {
+            perror("eventfd failed\n");
+            return -1;
+        }
+        loop->disk.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        loop->disk.conn = NULL;
+        if (loop->disk.fd < 0 || conn_register(loop, &loop->disk) < 0) {
+            perror("eventfd failed\n");
+            return -1;
+        }
+
+        /*
+           Every listener needs at least one loop and every loop at least one
+           listener. Listeners shared by several loops rely on EPOLLEXCLUSIVE
+           to wake only one of them.
+         */
+        for (int j = 0; j < nlisteners; j++) {
+            if (j % nloops != i && j != i % nlisteners)
+                continue;
+            loop->listeners[j].fd = listen_fds[j];
+            loop->listeners[j].conn = NULL;
+
+            struct epoll_event ev;
+            ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+            ev.data.ptr = loop->listeners + j;
+            if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, listen_fds[j], &ev) < 0) {
+                perror("epoll_ctl(listen) failed\n");
+                return -1;
+            }
+        }
+    }
+
+    for (int i = 1; i < nloops; i++) {
+        if (pthread_create(&loops[i].thread, NULL, loop_run, loops + i) != 0) {
+            perror("Failed to start event loop\n");
+            return -1;
+        }
+        if (pin)
+            pinThreadToCpu(loops[i].thread, i);
+    }
+    if (pin)
+        pinThreadToCpu(pthread_self(), 0);
+    loop_run(loops);
+    return -1;
+}
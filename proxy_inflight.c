@@ -0,0 +1,266 @@
+/*
+  proxy_inflight.c -- collapsed forwarding of concurrent cache misses.
+
+  One mutex protects the table and every fetch in it. Followers only hold it
+  to take a snapshot of the bytes available as iovecs; the bytes themselves
+  are sent after it is dropped. That is safe because neither the published
+  copy nor the cached entry changes bytes it already holds or frees its
+  segments while a follower holds a reference.
+
+  The fetcher's own cache copy is only duplicated into the published copy
+  once a follower has attached, so an uncontended miss costs no more than
+  before.
+*/
+
+#define _GNU_SOURCE
+#include "proxy_inflight.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#define INFLIGHT_BUCKETS 1024
+#define INFLIGHT_IOV_MAX 64          /* iovecs per sendmsg() */
+
+struct inflight {
+    char *key;
+    size_t key_len;
+    uint64_t hash;
+    int state;
+    int listed;                  /* still in the table, open to followers */
+    int refs;                    /* the fetcher's and one per follower */
+    int followers;               /* ever attached; the copy is published once there is one */
+    struct seg_buffer data;      /* published copy of the response so far */
+    cache_element *entry;        /* pinned once the response is cached */
+    pthread_cond_t cond;
+    int *waiters;                /* eventfds to notify of progress */
+    int nwaiters;
+    int waiters_cap;
+    struct inflight *next;       /* hash chain */
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct inflight *table[INFLIGHT_BUCKETS];
+static int collapse = 1;
+static size_t nactive;
+static unsigned long stat_fetches, stat_collapsed, stat_saved;
+
+void inflight_init(int enabled) {
+    collapse = enabled;
+}
+
+static struct inflight **bucket_of(uint64_t hash) {
+    return table + (hash % INFLIGHT_BUCKETS);
+}
+
+static struct inflight *fetch_find(cache_key *key) {
+    for (struct inflight *f = *bucket_of(key->hash); f; f = f->next) {
+        if (f->hash == key->hash && f->key_len == key->len && !memcmp(f->key, key->str, key->len))
+            return f;
+    }
+    return NULL;
+}
+
+static struct inflight *fetch_create(cache_key *key) {
+    struct inflight *f = (struct inflight *)calloc(1, sizeof(struct inflight));
+    if (!f)
+        return NULL;
+    f->key = (char *)malloc(key->len);
+    if (!f->key) {
+        free(f);
+        return NULL;
+    }
+    memcpy(f->key, key->str, key->len);
+    f->key_len = key->len;
+    f->hash = key->hash;
+    f->state = INFLIGHT_PENDING;
+    f->refs = 1;
+    seg_buffer_init(&f->data);
+    pthread_cond_init(&f->cond, NULL);
+    return f;
+}
+
+static void fetch_free(struct inflight *f) {
+    seg_buffer_free(&f->data);
+    if (f->entry)
+        cache_release(f->entry);
+    pthread_cond_destroy(&f->cond);
+    free(f->waiters);
+    free(f->key);
+    free(f);
+}
+
+/* Take f out of the table so no more followers attach. Lock held. */
+static void fetch_unlist(struct inflight *f) {
+    if (!f->listed)
+        return;
+    struct inflight **link = bucket_of(f->hash);
+    while (*link != f)
+        link = &(*link)->next;
+    *link = f->next;
+    f->listed = 0;
+    nactive--;
+}
+
+static int fetch_add_waiter(struct inflight *f, int fd) {
+    for (int i = 0; i < f->nwaiters; i++) {
+        if (f->waiters[i] == fd)
+            return 0;
+    }
+    if (f->nwaiters == f->waiters_cap) {
+        int cap = f->waiters_cap ? f->waiters_cap * 2 : 4;
+        int *waiters = (int *)realloc(f->waiters, cap * sizeof(int));
+        if (!waiters)
+            return -1;
+        f->waiters = waiters;
+        f->waiters_cap = cap;
+    }
+    f->waiters[f->nwaiters++] = fd;
+    return 0;
+}
+
+/* Wake the followers of f. Lock held. */
+static void fetch_wake(struct inflight *f) {
+    uint64_t one = 1;
+    pthread_cond_broadcast(&f->cond);
+    for (int i = 0; i < f->nwaiters; i++) {
+        if (write(f->waiters[i], &one, sizeof(one)) < 0 && errno != EAGAIN)
+            perror("eventfd write failed\n");
+    }
+}
+
+/* Drop a reference. Lock held. Returns f if it was the last, to be freed unlocked. */
+static struct inflight *fetch_unref(struct inflight *f) {
+    return --f->refs == 0 ? f : NULL;
+}
+
+int inflight_begin(cache_key *key, int notify_fd, struct inflight **f) {
+    *f = NULL;
+    if (!collapse)
+        return INFLIGHT_FETCH;
+
+    pthread_mutex_lock(&lock);
+    struct inflight *found = fetch_find(key);
+    if (found && (notify_fd < 0 || fetch_add_waiter(found, notify_fd) == 0)) {
+        found->refs++;
+        found->followers++;
+        stat_collapsed++;
+        pthread_mutex_unlock(&lock);
+        *f = found;
+        return INFLIGHT_FOLLOW;
+    }
+    if (!found) {
+        *f = fetch_create(key);
+        if (*f) {
+            struct inflight **bucket = bucket_of(key->hash);
+            (*f)->next = *bucket;
+            *bucket = *f;
+            (*f)->listed = 1;
+            nactive++;
+            stat_fetches++;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    return INFLIGHT_FETCH;
+}
+
+void inflight_publish(struct inflight *f, const struct seg_buffer *data) {
+    if (!f)
+        return;
+    pthread_mutex_lock(&lock);
+    if (f->state == INFLIGHT_PENDING && f->followers && data->len > f->data.len) {
+        if (seg_buffer_append_range(&f->data, data, f->data.len, data->len - f->data.len) < 0) {
+            /* followers cannot be given the rest */
+            f->state = INFLIGHT_FAILED;
+            fetch_unlist(f);
+        }
+        fetch_wake(f);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+void inflight_end(struct inflight *f, cache_element *entry) {
+    if (!f)
+        return;
+    pthread_mutex_lock(&lock);
+    if (f->state == INFLIGHT_PENDING) {
+        if (entry) {
+            cache_retain(entry);
+            f->entry = entry;
+            f->state = INFLIGHT_DONE;
+        } else {
+            f->state = INFLIGHT_FAILED;
+        }
+    }
+    fetch_unlist(f);
+    fetch_wake(f);
+    f = fetch_unref(f);
+    pthread_mutex_unlock(&lock);
+    if (f)
+        fetch_free(f);
+}
+
+/* Bytes followers can be sent from. Lock held. */
+static const struct seg_buffer *fetch_source(struct inflight *f) {
+    return f->entry ? &f->entry->body : &f->data;
+}
+
+ssize_t inflight_send(struct inflight *f, int fd, size_t offset, int flags) {
+    struct iovec iov[INFLIGHT_IOV_MAX];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+
+    pthread_mutex_lock(&lock);
+    const struct seg_buffer *src = fetch_source(f);
+    if (offset < src->len)
+        msg.msg_iovlen = seg_buffer_iov(src, offset, iov, INFLIGHT_IOV_MAX);
+    int state = f->state;
+    pthread_mutex_unlock(&lock);
+
+    if (msg.msg_iovlen > 0)
+        return sendmsg(fd, &msg, flags);
+    if (state == INFLIGHT_PENDING) {
+        errno = EAGAIN;
+        return -1;
+    }
+    return 0;
+}
+
+void inflight_wait(struct inflight *f, size_t offset) {
+    pthread_mutex_lock(&lock);
+    while (f->state == INFLIGHT_PENDING && fetch_source(f)->len <= offset)
+        pthread_cond_wait(&f->cond, &lock);
+    pthread_mutex_unlock(&lock);
+}
+
+int inflight_status(struct inflight *f, int *delimited) {
+    pthread_mutex_lock(&lock);
+    int state = f->state;
+    *delimited = f->entry && !(f->entry->flags & CACHE_UNFRAMED);
+    pthread_mutex_unlock(&lock);
+    return state;
+}
+
+void inflight_release(struct inflight *f) {
+    pthread_mutex_lock(&lock);
+    if (f->state == INFLIGHT_DONE)
+        stat_saved++;
+    f = fetch_unref(f);
+    pthread_mutex_unlock(&lock);
+    if (f)
+        fetch_free(f);
+}
+
+void inflight_stats(struct inflight_stats *st) {
+    pthread_mutex_lock(&lock);
+    st->active = nactive;
+    st->fetches = stat_fetches;
+    st->collapsed = stat_collapsed;
+    st->saved = stat_saved;
+    pthread_mutex_unlock(&lock);
+}
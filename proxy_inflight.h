@@ -0,0 +1,92 @@
+/*
+ * proxy_inflight.h -- collapsed forwarding of concurrent cache misses.
+ *
+ * The first request to miss on a cache key registers an in-flight fetch
+ * under the key and goes to the origin as usual. Requests that miss on the
+ * same key while it is in flight attach to it instead of fetching again,
+ * and stream the response to their clients while it arrives: the fetcher
+ * publishes the cache copy of the response as it grows and, once it is
+ * cached, the entry itself. Only responses that will be cached and do not
+ * vary are shared; for any other the followers are released and fetch for
+ * themselves.
+ *
+ * Followers are woken by a condition variable (thread engine) or by an
+ * eventfd of their event loop (epoll engine), as with the resolver.
+ */
+
+#ifndef PROXY_INFLIGHT
+#define PROXY_INFLIGHT
+
+#include <sys/types.h>
+#include "proxy_cache.h"
+
+/* inflight_begin() results */
+enum {
+    INFLIGHT_FETCH,              /* the caller fetches the response */
+    INFLIGHT_FOLLOW              /* the caller follows a fetch in flight */
+};
+
+/* State of a fetch as seen by its followers */
+enum {
+    INFLIGHT_PENDING,
+    INFLIGHT_DONE,               /* the response is complete and cached */
+    INFLIGHT_FAILED              /* it will not be completed or shared */
+};
+
+struct inflight;
+
+struct inflight_stats {
+     size_t active;               /* fetches in flight */
+     unsigned long fetches;       /* fetches registered */
+     unsigned long collapsed;     /* requests that followed one */
+     unsigned long saved;         /* of those, answered without an upstream fetch */
+};
+
+/* Turn collapsing on or off; it is on unless disabled here */
+void inflight_init(int enabled);
+
+/*
+   Register a fetch for key, or attach to the one in flight. As fetcher the
+   caller gets a new fetch in *f (NULL if collapsing is off), which it must
+   end with inflight_end(). As follower it gets a reference to the fetch,
+   to be dropped with inflight_release(); notify_fd, if not -1, is an
+   eventfd that 1 is added to whenever the fetch makes progress.
+ */
+int inflight_begin(cache_key *key, int notify_fd, struct inflight **f);
+
+/*
+   Fetcher: data is the response received so far, headers included, and has
+   grown. Followers get the new bytes. Does nothing for a NULL fetch.
+ */
+void inflight_publish(struct inflight *f, const struct seg_buffer *data);
+
+/*
+   Fetcher: finish with f. entry is the cached response, which followers
+   then send the rest of, or NULL if the response is not to be shared after
+   all. Does nothing for a NULL fetch.
+ */
+void inflight_end(struct inflight *f, cache_element *entry);
+
+/*
+   Follower: send the response from offset on to the socket fd with one
+   sendmsg() call. Returns the number of bytes sent, -1 with errno EAGAIN if
+   no more has arrived yet (or the socket would block), -1 as sendmsg()
+   does, or 0 at the end of what the fetch will produce.
+ */
+ssize_t inflight_send(struct inflight *f, int fd, size_t offset, int flags);
+
+/* Follower: block until more than offset bytes are available or the fetch ends */
+void inflight_wait(struct inflight *f, size_t offset);
+
+/*
+   Follower: INFLIGHT_PENDING, INFLIGHT_DONE or INFLIGHT_FAILED. For
+   INFLIGHT_DONE, *delimited tells whether the client can find the end of
+   the response without the connection closing.
+ */
+int inflight_status(struct inflight *f, int *delimited);
+
+void inflight_release(struct inflight *f);
+
+void inflight_stats(struct inflight_stats *st);
+
+#endif
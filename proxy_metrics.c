@@ -0,0 +1,215 @@
+/*
+  proxy_metrics.c -- per-thread counters and latency histograms.
+
+  A thread's block is only written by that thread, with relaxed atomic
+  loads and stores rather than read-modify-writes, which compile to plain
+  moves; readers may see a count a moment old but never a torn one. The
+  list of blocks only grows, under lock.
+*/
+
+#define _GNU_SOURCE
+#include "proxy_metrics.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+
+struct metrics_block {
+     atomic_ulong counters[METRIC_COUNTERS];
+     struct {
+          atomic_ulong count;
+          atomic_ulong sum;
+          atomic_ulong buckets[HIST_BUCKETS];
+     } hist[HIST_COUNT];
+     struct metrics_block *next;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct metrics_block *blocks;
+static __thread struct metrics_block *self;
+
+static const char *const histogram_names[HIST_COUNT] = {
+    "queue", "read", "parse", "lookup", "connect", "first_byte", "last_byte",
+    "hit", "miss", "revalidated", "collapsed"
+};
+
+/* Prometheus bucket bounds in seconds */
+static const double bucket_bounds[] = {
+    1e-6, 2.5e-6, 5e-6, 1e-5, 2.5e-5, 5e-5, 1e-4, 2.5e-4, 5e-4, 1e-3, 2.5e-3, 5e-3,
+    1e-2, 2.5e-2, 5e-2, 0.1, 0.25, 0.5, 1, 2.5, 5, 10
+};
+
+static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+
+/* The calling thread's block, registered on first use; NULL if out of memory */
+static struct metrics_block *block(void) {
+    if (self)
+        return self;
+    struct metrics_block *b = (struct metrics_block *)calloc(1, sizeof(struct metrics_block));
+    if (!b)
+        return NULL;
+    pthread_mutex_lock(&lock);
+    b->next = blocks;
+    blocks = b;
+    pthread_mutex_unlock(&lock);
+    self = b;
+    return b;
+}
+
+/* Add n to a counter only the calling thread writes */
+static void bump(atomic_ulong *c, unsigned long n) {
+    atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+static unsigned bucket_index(uint64_t ns) {
+    if (ns < HIST_SUB_BUCKETS)
+        return (unsigned)ns;
+    if (ns >= (uint64_t)1 << HIST_MAX_EXP)
+        ns = ((uint64_t)1 << HIST_MAX_EXP) - 1;
+    unsigned e = 63 - __builtin_clzll(ns);
+    return (e - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS + ((ns >> (e - HIST_SUB_BITS)) & (HIST_SUB_BUCKETS - 1));
+}
+
+/* One past the largest value bucket i holds */
+static uint64_t bucket_limit(unsigned i) {
+    if (i < HIST_SUB_BUCKETS)
+        return i + 1;
+    unsigned shift = i / HIST_SUB_BUCKETS - 1;
+    return ((uint64_t)(HIST_SUB_BUCKETS + i % HIST_SUB_BUCKETS) + 1) << shift;
+}
+
+uint64_t metrics_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void metrics_add(enum metric_counter c, unsigned long n) {
+    struct metrics_block *b = block();
+    if (b)
+        bump(&b->counters[c], n);
+}
+
+void metrics_observe(enum metric_histogram h, uint64_t ns) {
+    struct metrics_block *b = block();
+    if (!b)
+        return;
+    bump(&b->hist[h].count, 1);
+    bump(&b->hist[h].sum, ns);
+    bump(&b->hist[h].buckets[bucket_index(ns)], 1);
+}
+
+void metrics_since(enum metric_histogram h, uint64_t start) {
+    uint64_t now = metrics_now();
+    metrics_observe(h, now > start ? now - start : 0);
+}
+
+unsigned long metrics_counter(enum metric_counter c) {
+    unsigned long sum = 0;
+    pthread_mutex_lock(&lock);
+    for (struct metrics_block *b = blocks; b; b = b->next)
+        sum += atomic_load_explicit(&b->counters[c], memory_order_relaxed);
+    pthread_mutex_unlock(&lock);
+    return sum;
+}
+
+void metrics_histogram(enum metric_histogram h, struct metrics_histogram *out) {
+    memset(out, 0, sizeof(*out));
+    pthread_mutex_lock(&lock);
+    for (struct metrics_block *b = blocks; b; b = b->next) {
+        out->count += atomic_load_explicit(&b->hist[h].count, memory_order_relaxed);
+        out->sum += atomic_load_explicit(&b->hist[h].sum, memory_order_relaxed);
+        for (unsigned i = 0; i < HIST_BUCKETS; i++)
+            out->buckets[i] += atomic_load_explicit(&b->hist[h].buckets[i], memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+const char *metrics_histogram_name(enum metric_histogram h) {
+    return histogram_names[h];
+}
+
+uint64_t metrics_quantile(const struct metrics_histogram *h, double q) {
+    /* the buckets are read one by one, so they may sum to a little more or less than count */
+    unsigned long total = 0;
+    for (unsigned i = 0; i < HIST_BUCKETS; i++)
+        total += h->buckets[i];
+    if (total == 0)
+        return 0;
+    unsigned long rank = (unsigned long)(q * total);
+    if (rank >= total)
+        rank = total - 1;
+    unsigned long seen = 0;
+    for (unsigned i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen > rank)
+            return bucket_limit(i) - 1;
+    }
+    return bucket_limit(HIST_BUCKETS - 1) - 1;
+}
+
+void metrics_write_family(FILE *out, const char *name, const char *type, const char *help) {
+    fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+void metrics_write_value(FILE *out, const char *name, const char *type, const char *help, double value) {
+    metrics_write_family(out, name, type, help);
+    fprintf(out, "%s %.17g\n", name, value);
+}
+
+/* Write histograms first to last (exclusive) as family name, labelled label="<histogram>" */
+static void write_histograms(FILE *out, const char *name, const char *help, const char *label,
+                             enum metric_histogram first, enum metric_histogram last) {
+    struct metrics_histogram *h = (struct metrics_histogram *)malloc(sizeof(struct metrics_histogram));
+    if (!h)
+        return;
+    metrics_write_family(out, name, "histogram", help);
+    for (enum metric_histogram i = first; i < last; i++) {
+        metrics_histogram(i, h);
+        unsigned long cumulative = 0;
+        unsigned b = 0;
+        for (size_t k = 0; k < sizeof(bucket_bounds) / sizeof(bucket_bounds[0]); k++) {
+            uint64_t bound = (uint64_t)(bucket_bounds[k] * 1e9);
+            for (; b < HIST_BUCKETS && bucket_limit(b) <= bound + 1; b++)
+                cumulative += h->buckets[b];
+            fprintf(out, "%s_bucket{%s=\"%s\",le=\"%g\"} %lu\n", name, label, histogram_names[i],
+                    bucket_bounds[k], cumulative);
+        }
+        /* count is read apart from the buckets; +Inf must not fall below the last bucket */
+        for (; b < HIST_BUCKETS; b++)
+            cumulative += h->buckets[b];
+        fprintf(out, "%s_bucket{%s=\"%s\",le=\"+Inf\"} %lu\n", name, label, histogram_names[i], cumulative);
+        fprintf(out, "%s_sum{%s=\"%s\"} %.9f\n", name, label, histogram_names[i], h->sum / 1e9);
+        fprintf(out, "%s_count{%s=\"%s\"} %lu\n", name, label, histogram_names[i], cumulative);
+    }
+
+    fprintf(out, "# HELP %s_quantile Quantiles of %s, to within %.1f%%.\n# TYPE %s_quantile gauge\n", name, name,
+            100.0 / HIST_SUB_BUCKETS, name);
+    for (enum metric_histogram i = first; i < last; i++) {
+        metrics_histogram(i, h);
+        for (size_t k = 0; k < sizeof(quantiles) / sizeof(quantiles[0]); k++)
+            fprintf(out, "%s_quantile{%s=\"%s\",quantile=\"%g\"} %.9f\n", name, label, histogram_names[i],
+                    quantiles[k], metrics_quantile(h, quantiles[k]) / 1e9);
+    }
+    free(h);
+}
+
+void metrics_write(FILE *out) {
+    unsigned long opened = metrics_counter(METRIC_CONNECTIONS_OPENED);
+    unsigned long closed = metrics_counter(METRIC_CONNECTIONS_CLOSED);
+    metrics_write_value(out, "proxy_client_connections_active", "gauge", "Client connections open.",
+                        opened > closed ? opened - closed : 0);
+    metrics_write_value(out, "proxy_upstream_connect_failures_total", "counter",
+                        "Origins that could not be resolved or connected to.",
+                        metrics_counter(METRIC_CONNECT_FAILURES));
+    metrics_write_value(out, "proxy_error_responses_total", "counter", "Error responses sent by the proxy.",
+                        metrics_counter(METRIC_ERROR_RESPONSES));
+    metrics_write_value(out, "proxy_cache_sent_bytes_total", "counter",
+                        "Bytes of cached responses sent to clients.", metrics_counter(METRIC_CACHE_BYTES_SENT));
+    write_histograms(out, "proxy_stage_duration_seconds", "Time spent in each stage of a request.", "stage",
+                     HIST_QUEUE, HIST_FIRST_RESULT);
+    write_histograms(out, "proxy_request_duration_seconds",
+                     "Time from a request's complete headers to its last byte sent, by how it was answered.",
+                     "result", HIST_FIRST_RESULT, HIST_COUNT);
+}
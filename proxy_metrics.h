@@ -0,0 +1,112 @@
+/*
+ * proxy_metrics.h -- per-thread counters and latency histograms.
+ *
+ * Every thread that serves requests gets its own block of counters and
+ * histograms the first time it records one, so recording is a few plain
+ * loads and stores to memory no other thread writes. Blocks are never
+ * freed: the threads that record (workers, event loops) live as long as
+ * the proxy. A reader merges all blocks on demand, for the admin port or
+ * the statistics printed with -s.
+ *
+ * Histograms are log-linear in the manner of HdrHistogram: each power of
+ * two of nanoseconds is split into HIST_SUB_BUCKETS equal buckets, so any
+ * value is known to within 1/HIST_SUB_BUCKETS of itself from 1 ns up to
+ * 2^HIST_MAX_EXP ns (about 68 s), where values are clamped.
+ *
+ * The stages of a request are timed as follows:
+ *
+ *   queue       an accepted socket waiting for a worker (thread engine)
+ *   read        the request's first bytes to its complete headers
+ *   parse       the complete headers to a parsed request and cache key
+ *   lookup      the cache lookup, memory and disk tiers
+ *   connect     getting an upstream connection: pooled, or resolve and connect
+ *   first_byte  the upstream request sent to the first byte of the response
+ *   last_byte   the upstream request sent to the response's end
+ *
+ * and each answered request, from its complete headers to the last byte
+ * sent to the client, by how it was answered: a fresh hit, a miss fetched
+ * from the origin, a stale hit revalidated, or a miss collapsed onto
+ * another request's fetch.
+ */
+
+#ifndef PROXY_METRICS
+#define PROXY_METRICS
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define HIST_SUB_BITS 4
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_MAX_EXP 36
+#define HIST_BUCKETS ((HIST_MAX_EXP - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS)
+
+enum metric_counter {
+    METRIC_CONNECTIONS_OPENED,
+    METRIC_CONNECTIONS_CLOSED,
+    METRIC_CONNECT_FAILURES,     /* origins that could not be resolved or connected to */
+    METRIC_ERROR_RESPONSES,      /* error statuses sent by the proxy itself */
+    METRIC_CACHE_BYTES_SENT,     /* bytes of cached responses sent to clients */
+    METRIC_COUNTERS
+};
+
+enum metric_histogram {
+    HIST_QUEUE,
+    HIST_READ,
+    HIST_PARSE,
+    HIST_LOOKUP,
+    HIST_CONNECT,
+    HIST_FIRST_BYTE,
+    HIST_LAST_BYTE,
+    HIST_HIT,
+    HIST_MISS,
+    HIST_REVALIDATED,
+    HIST_COLLAPSED,
+    HIST_COUNT
+};
+
+#define HIST_FIRST_RESULT HIST_HIT   /* histograms from here on time whole requests */
+
+/* A histogram merged over all threads */
+struct metrics_histogram {
+     unsigned long count;
+     uint64_t sum;                /* ns */
+     unsigned long buckets[HIST_BUCKETS];
+};
+
+/* Monotonic time in ns */
+uint64_t metrics_now(void);
+
+void metrics_add(enum metric_counter c, unsigned long n);
+
+/* Record ns in histogram h */
+void metrics_observe(enum metric_histogram h, uint64_t ns);
+
+/* Record the time since start, from metrics_now(), in histogram h */
+void metrics_since(enum metric_histogram h, uint64_t start);
+
+/* Sum of counter c over all threads */
+unsigned long metrics_counter(enum metric_counter c);
+
+/* Histogram h merged over all threads */
+void metrics_histogram(enum metric_histogram h, struct metrics_histogram *out);
+
+/* The stage or result histogram h times, as in the list above */
+const char *metrics_histogram_name(enum metric_histogram h);
+
+/* Value in ns at quantile q (0 to 1), to within a bucket; 0 if h is empty */
+uint64_t metrics_quantile(const struct metrics_histogram *h, double q);
+
+/*
+   Write the counters and histograms in the Prometheus text format. A
+   histogram's buckets are reported at fixed bounds from 1 us to 10 s and
+   its 0.5, 0.9, 0.99 and 0.999 quantiles as a separate gauge family.
+ */
+void metrics_write(FILE *out);
+
+/* Write the HELP and TYPE lines of a metric family; type is "counter" or "gauge" */
+void metrics_write_family(FILE *out, const char *name, const char *type, const char *help);
+
+/* Write a metric family with its one, unlabelled sample */
+void metrics_write_value(FILE *out, const char *name, const char *type, const char *help, double value);
+
+#endif
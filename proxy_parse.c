@@ -3,14 +3,17 @@
   COS 461  
 */
 
+#define _GNU_SOURCE
 #include "proxy_parse.h"
+#include "proxy_scan.h"
+#include "proxy_arena.h"
+#include <strings.h>
+#include <stdint.h>
 
 #define DEFAULT_NHDRS 8
 #define MAX_REQ_LEN 65535
 #define MIN_REQ_LEN 4
 
-static const char *root_abs_path = "/";
-
 /* private function declarations */
 int ParsedRequest_printRequestLine(struct ParsedRequest *pr, char *buf, size_t buflen, size_t *tmp);
 size_t ParsedRequest_requestLineLen(struct ParsedRequest *pr);
@@ -30,41 +33,276 @@ void debug(const char *format, ...) {
 }
 
 /*
- *  ParsedHeader Public Methods
- */
+  Memory of a request comes from its arena if it has one, in which case
+  nothing is freed individually: it all goes when the arena is reset.
+*/
 
-/* Set a header with key and value */
-int ParsedHeader_set(struct ParsedRequest *pr, const char *key, const char *value) {
-    struct ParsedHeader *ph;
-    ParsedHeader_remove(pr, key);
+static void *ParsedRequest_alloc(struct ParsedRequest *pr, size_t size) {
+    return pr->arena ? arena_alloc(pr->arena, size) : malloc(size);
+}
+
+static char *ParsedRequest_strndup(struct ParsedRequest *pr, const char *s, size_t len) {
+    return pr->arena ? arena_strndup(pr->arena, s, len) : strndup(s, len);
+}
+
+static void ParsedRequest_free(struct ParsedRequest *pr, void *p) {
+    if (!pr->arena)
+        free(p);
+}
+
+/*
+  Header store. The header array keeps headers in the order they were
+  added, which is the order they are unparsed in; a removed header leaves a
+  hole (a NULL key) that is skipped and squeezed out the next time the
+  array fills up. Headers the proxy looks at are recognized by name when
+  they are added and their positions kept in pr->known; the rest are found
+  through pr->index, an open-addressed table of positions + 1 hashed on the
+  lowercased name. Both are rebuilt whenever the array is moved.
+*/
+
+static const struct {
+    const char *name;
+    size_t len;
+} known_headers[HEADER_KNOWN] = {
+    [HEADER_HOST] = {"Host", 4},
+    [HEADER_CONNECTION] = {"Connection", 10},
+    [HEADER_PROXY_CONNECTION] = {"Proxy-Connection", 16},
+    [HEADER_KEEP_ALIVE] = {"Keep-Alive", 10},
+    [HEADER_CONTENT_LENGTH] = {"Content-Length", 14},
+    [HEADER_TRANSFER_ENCODING] = {"Transfer-Encoding", 17},
+    [HEADER_CACHE_CONTROL] = {"Cache-Control", 13},
+    [HEADER_PRAGMA] = {"Pragma", 6},
+    [HEADER_IF_NONE_MATCH] = {"If-None-Match", 13},
+    [HEADER_IF_MODIFIED_SINCE] = {"If-Modified-Since", 17},
+    [HEADER_ACCEPT] = {"Accept", 6},
+    [HEADER_ACCEPT_ENCODING] = {"Accept-Encoding", 15},
+    [HEADER_ACCEPT_LANGUAGE] = {"Accept-Language", 15},
+    [HEADER_USER_AGENT] = {"User-Agent", 10},
+    [HEADER_COOKIE] = {"Cookie", 6},
+    [HEADER_REFERER] = {"Referer", 7},
+};
+
+#define KNOWN_KEY(len, first) ((len) << 8 | (first))
+
+/*
+  The HEADER_ id of a header name, or -1. Every header name is looked up
+  here as it is added, so rather than comparing it with each known name,
+  its length and case-folded first letter pick the one candidate (the two
+  Accept- names of 15 also need their eighth letter), which a single
+  strncasecmp() then confirms.
+*/
+static int ParsedHeader_knownId(const char *key, size_t len) {
+    if (len == 0)
+        return -1;
+    int id;
+    switch (KNOWN_KEY(len, (unsigned char)key[0] | 0x20)) {
+    case KNOWN_KEY(4, 'h'): id = HEADER_HOST; break;
+    case KNOWN_KEY(10, 'c'): id = HEADER_CONNECTION; break;
+    case KNOWN_KEY(16, 'p'): id = HEADER_PROXY_CONNECTION; break;
+    case KNOWN_KEY(10, 'k'): id = HEADER_KEEP_ALIVE; break;
+    case KNOWN_KEY(14, 'c'): id = HEADER_CONTENT_LENGTH; break;
+    case KNOWN_KEY(17, 't'): id = HEADER_TRANSFER_ENCODING; break;
+    case KNOWN_KEY(13, 'c'): id = HEADER_CACHE_CONTROL; break;
+    case KNOWN_KEY(6, 'p'): id = HEADER_PRAGMA; break;
+    case KNOWN_KEY(13, 'i'): id = HEADER_IF_NONE_MATCH; break;
+    case KNOWN_KEY(17, 'i'): id = HEADER_IF_MODIFIED_SINCE; break;
+    case KNOWN_KEY(6, 'a'): id = HEADER_ACCEPT; break;
+    case KNOWN_KEY(15, 'a'):
+        id = ((unsigned char)key[7] | 0x20) == 'e' ? HEADER_ACCEPT_ENCODING : HEADER_ACCEPT_LANGUAGE;
+        break;
+    case KNOWN_KEY(10, 'u'): id = HEADER_USER_AGENT; break;
+    case KNOWN_KEY(6, 'c'): id = HEADER_COOKIE; break;
+    case KNOWN_KEY(7, 'r'): id = HEADER_REFERER; break;
+    default: return -1;
+    }
+    return strncasecmp(known_headers[id].name, key, len) == 0 ? id : -1;
+}
+
+/* FNV-1a over the name with ASCII letters folded to lowercase */
+static unsigned ParsedHeader_hash(const char *key, size_t len) {
+    unsigned h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = key[i];
+        if (c >= 'A' && c <= 'Z')
+            c |= 0x20;
+        h = (h ^ c) * 16777619u;
+    }
+    return h;
+}
+
+static int ParsedHeader_matches(struct ParsedHeader *ph, const char *key, size_t len) {
+    return ph->keylen == len + 1 && strncasecmp(ph->key, key, len) == 0;
+}
 
-    if (pr->headerslen <= pr->headersused + 1) {
-        pr->headerslen *= 2;
-        pr->headers = (struct ParsedHeader *)realloc(pr->headers, pr->headerslen * sizeof(struct ParsedHeader));
-        if (!pr->headers)
+/* Slot of pr->index holding the header at pos */
+static size_t ParsedHeader_slot(struct ParsedRequest *pr, size_t pos) {
+    size_t mask = pr->indexlen - 1;
+    size_t i = pr->headers[pos].hash & mask;
+    while (pr->index[i] != pos + 1)
+        i = (i + 1) & mask;
+    return i;
+}
+
+static void ParsedHeader_link(struct ParsedRequest *pr, size_t pos) {
+    struct ParsedHeader *ph = pr->headers + pos;
+    if (ph->id >= 0) {
+        pr->known[ph->id] = pos;
+        return;
+    }
+    size_t mask = pr->indexlen - 1;
+    size_t i = ph->hash & mask;
+    while (pr->index[i])
+        i = (i + 1) & mask;
+    pr->index[i] = pos + 1;
+}
+
+/* Take the header at pos out of the index, shifting back the entries probed past it */
+static void ParsedHeader_unlink(struct ParsedRequest *pr, size_t pos) {
+    struct ParsedHeader *ph = pr->headers + pos;
+    if (ph->id >= 0) {
+        pr->known[ph->id] = HEADER_ABSENT;
+        return;
+    }
+    size_t mask = pr->indexlen - 1;
+    size_t hole = ParsedHeader_slot(pr, pos);
+    size_t i = hole;
+    for (;;) {
+        i = (i + 1) & mask;
+        if (!pr->index[i])
+            break;
+        size_t home = pr->headers[pr->index[i] - 1].hash & mask;
+        /* an entry may fill the hole unless its home lies between the hole and it */
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            pr->index[hole] = pr->index[i];
+            hole = i;
+        }
+    }
+    pr->index[hole] = 0;
+}
+
+/*
+  Make room for one more header: squeeze out the holes if they are at
+  least half the array, else double it, and rebuild the index.
+*/
+static int ParsedHeader_reserve(struct ParsedRequest *pr) {
+    if (pr->headersused < pr->headerslen)
+        return 0;
+
+    if (pr->headerslen && pr->headersremoved * 2 >= pr->headerslen) {
+        size_t n = 0;
+        for (size_t i = 0; i < pr->headersused; i++) {
+            if (pr->headers[i].key)
+                pr->headers[n++] = pr->headers[i];
+        }
+        pr->headersused = n;
+        pr->headersremoved = 0;
+    } else {
+        size_t len = pr->headerslen ? pr->headerslen * 2 : DEFAULT_NHDRS;
+        size_t size = pr->headerslen * sizeof(struct ParsedHeader);
+        struct ParsedHeader *headers;
+        if (pr->arena)
+            headers = (struct ParsedHeader *)arena_realloc(pr->arena, pr->headers, size, len * sizeof(struct ParsedHeader));
+        else
+            headers = (struct ParsedHeader *)realloc(pr->headers, len * sizeof(struct ParsedHeader));
+        if (!headers)
+            return -1;
+        pr->headers = headers;
+        pr->headerslen = len;
+
+        /* twice as many slots as headers keeps probe sequences short */
+        size_t *index = (size_t *)ParsedRequest_alloc(pr, 2 * len * sizeof(size_t));
+        if (!index)
             return -1;
+        ParsedRequest_free(pr, pr->index);
+        pr->index = index;
+        pr->indexlen = 2 * len;
     }
 
-    ph = pr->headers + pr->headersused;
-    pr->headersused += 1;
+    memset(pr->index, 0, pr->indexlen * sizeof(size_t));
+    for (int id = 0; id < HEADER_KNOWN; id++)
+        pr->known[id] = HEADER_ABSENT;
+    for (size_t i = 0; i < pr->headersused; i++) {
+        if (pr->headers[i].key)
+            ParsedHeader_link(pr, i);
+    }
+    return 0;
+}
+
+/* Position of the header named key (len bytes), or HEADER_ABSENT */
+static size_t ParsedHeader_find(struct ParsedRequest *pr, const char *key, size_t len, int id, unsigned hash) {
+    if (id >= 0)
+        return pr->known[id];
+    if (!pr->indexlen)
+        return HEADER_ABSENT;
+    size_t mask = pr->indexlen - 1;
+    for (size_t i = hash & mask; pr->index[i]; i = (i + 1) & mask) {
+        struct ParsedHeader *ph = pr->headers + pr->index[i] - 1;
+        if (ph->hash == hash && ParsedHeader_matches(ph, key, len))
+            return pr->index[i] - 1;
+    }
+    return HEADER_ABSENT;
+}
 
-    ph->key = strdup(key);
-    ph->value = strdup(value);
+/*
+  Set the header named key to value: in place if it is there, keeping its
+  position and the spelling of its name, else at the end.
+*/
+static int ParsedHeader_setn(struct ParsedRequest *pr, const char *key, size_t keylen, const char *value,
+                             size_t valuelen) {
+    int id = ParsedHeader_knownId(key, keylen);
+    unsigned hash = id >= 0 ? 0 : ParsedHeader_hash(key, keylen);
+    size_t pos = ParsedHeader_find(pr, key, keylen, id, hash);
+
+    char *copy = ParsedRequest_strndup(pr, value, valuelen);
+    if (!copy)
+        return -1;
+    if (pos != HEADER_ABSENT) {
+        struct ParsedHeader *ph = pr->headers + pos;
+        ParsedRequest_free(pr, ph->value);
+        ph->value = copy;
+        ph->valuelen = valuelen + 1;
+        return 0;
+    }
 
-    ph->keylen = strlen(key) + 1;
-    ph->valuelen = strlen(value) + 1;
+    char *name = ParsedRequest_strndup(pr, key, keylen);
+    if (!name || ParsedHeader_reserve(pr) < 0) {
+        ParsedRequest_free(pr, name);
+        ParsedRequest_free(pr, copy);
+        return -1;
+    }
+    struct ParsedHeader *ph = pr->headers + pr->headersused;
+    ph->key = name;
+    ph->keylen = keylen + 1;
+    ph->value = copy;
+    ph->valuelen = valuelen + 1;
+    ph->id = id;
+    ph->hash = hash;
+    ParsedHeader_link(pr, pr->headersused++);
     return 0;
 }
 
+/*
+ *  ParsedHeader Public Methods
+ */
+
+/* Set a header with key and value */
+int ParsedHeader_set(struct ParsedRequest *pr, const char *key, const char *value) {
+    return ParsedHeader_setn(pr, key, strlen(key), value, strlen(value));
+}
+
 /* Get the parsedHeader with the specified key or NULL */
 struct ParsedHeader* ParsedHeader_get(struct ParsedRequest *pr, const char *key) {
-    for (size_t i = 0; i < pr->headersused; i++) {
-        struct ParsedHeader *tmp = pr->headers + i;
-        if (tmp->key && strcmp(tmp->key, key) == 0) {
-            return tmp;
-        }
-    }
-    return NULL;
+    return ParsedHeader_getn(pr, key, strlen(key));
+}
+
+struct ParsedHeader* ParsedHeader_getn(struct ParsedRequest *pr, const char *key, size_t len) {
+    int id = ParsedHeader_knownId(key, len);
+    size_t pos = ParsedHeader_find(pr, key, len, id, id >= 0 ? 0 : ParsedHeader_hash(key, len));
+    return pos == HEADER_ABSENT ? NULL : pr->headers + pos;
+}
+
+struct ParsedHeader* ParsedHeader_known(struct ParsedRequest *pr, int id) {
+    return pr->known[id] == HEADER_ABSENT ? NULL : pr->headers + pr->known[id];
 }
 
 /* Remove the specified key from parsedHeader */
@@ -73,9 +311,12 @@ int ParsedHeader_remove(struct ParsedRequest *pr, const char *key) {
     if (!tmp)
         return -1;
 
-    free(tmp->key);
-    free(tmp->value);
+    ParsedHeader_unlink(pr, tmp - pr->headers);
+    ParsedRequest_free(pr, tmp->key);
+    ParsedRequest_free(pr, tmp->value);
     tmp->key = NULL;
+    tmp->value = NULL;
+    pr->headersremoved++;
     return 0;
 }
 
@@ -84,13 +325,18 @@ int ParsedHeader_remove(struct ParsedRequest *pr, const char *key) {
 */
 
 void ParsedHeader_create(struct ParsedRequest *pr) {
-    pr->headers = (struct ParsedHeader *)malloc(sizeof(struct ParsedHeader) * DEFAULT_NHDRS);
-    pr->headerslen = DEFAULT_NHDRS;
+    pr->headers = NULL;
+    pr->headerslen = 0;
     pr->headersused = 0;
+    pr->headersremoved = 0;
+    pr->index = NULL;
+    pr->indexlen = 0;
+    for (int id = 0; id < HEADER_KNOWN; id++)
+        pr->known[id] = HEADER_ABSENT;
 }
 
 size_t ParsedHeader_lineLen(struct ParsedHeader *ph) {
-    return ph->key ? strlen(ph->key) + strlen(ph->value) + 4 : 0;
+    return ph->key ? ph->keylen + ph->valuelen + 2 : 0;
 }
 
 size_t ParsedHeader_headersLen(struct ParsedRequest *pr) {
@@ -115,72 +361,340 @@ int ParsedHeader_printHeaders(struct ParsedRequest *pr, char *buf, size_t len) {
     for (size_t i = 0; i < pr->headersused; i++) {
         struct ParsedHeader *ph = pr->headers + i;
         if (ph->key) {
-            memcpy(current, ph->key, strlen(ph->key));
-            memcpy(current + strlen(ph->key), ": ", 2);
-            memcpy(current + strlen(ph->key) + 2, ph->value, strlen(ph->value));
-            memcpy(current + strlen(ph->key) + 2 + strlen(ph->value), "\r\n", 2);
-            current += strlen(ph->key) + strlen(ph->value) + 4;
+            memcpy(current, ph->key, ph->keylen - 1);
+            current += ph->keylen - 1;
+            memcpy(current, ": ", 2);
+            memcpy(current + 2, ph->value, ph->valuelen - 1);
+            current += ph->valuelen + 1;
+            memcpy(current, "\r\n", 2);
+            current += 2;
         }
     }
     memcpy(current, "\r\n", 2);
     return 0;
 }
 
-void ParsedHeader_destroyOne(struct ParsedHeader *ph) {
-    if (ph->key) {
-        free(ph->key);
-        free(ph->value);
-        ph->key = NULL;
-        ph->value = NULL;
-        ph->keylen = 0;
-        ph->valuelen = 0;
-    }
-}
-
 void ParsedHeader_destroy(struct ParsedRequest *pr) {
     for (size_t i = 0; i < pr->headersused; i++) {
-        ParsedHeader_destroyOne(pr->headers + i);
+        ParsedRequest_free(pr, pr->headers[i].key);
+        ParsedRequest_free(pr, pr->headers[i].value);
     }
     pr->headersused = 0;
-    free(pr->headers);
+    ParsedRequest_free(pr, pr->headers);
+    ParsedRequest_free(pr, pr->index);
     pr->headerslen = 0;
 }
 
-int ParsedHeader_parse(struct ParsedRequest *pr, char *line) {
-    char *index1 = strchr(line, ':');
-    if (!index1) {
-        debug("No colon found\n");
+/* Add a header from views, replacing one with the same key as ParsedHeader_set() does */
+int ParsedHeader_setView(struct ParsedRequest *pr, struct StrView key, struct StrView value) {
+    return ParsedHeader_setn(pr, key.data, key.len, value.data, value.len);
+}
+
+/*
+  RequestView Methods
+*/
+
+static int StrView_equals(struct StrView v, const char *s) {
+    size_t len = strlen(s);
+    return v.len == len && memcmp(v.data, s, len) == 0;
+}
+
+/* Split the view at the first c: the part before it goes to head, the rest stays. -1 if absent. */
+static int StrView_cut(struct StrView *v, char c, struct StrView *head) {
+    const char *at = (const char *)memchr(v->data, c, v->len);
+    if (!at)
         return -1;
+    head->data = v->data;
+    head->len = at - v->data;
+    v->len -= head->len + 1;
+    v->data = at + 1;
+    return 0;
+}
+
+static int RequestView_addHeader(struct RequestView *rv, struct StrView key, struct StrView value) {
+    if (rv->headersused == rv->headerslen) {
+        size_t len = rv->headerslen * 2;
+        struct HeaderView *headers;
+        if (rv->headers == rv->inline_headers) {
+            headers = (struct HeaderView *)malloc(len * sizeof(struct HeaderView));
+            if (headers)
+                memcpy(headers, rv->inline_headers, sizeof(rv->inline_headers));
+        } else {
+            headers = (struct HeaderView *)realloc(rv->headers, len * sizeof(struct HeaderView));
+        }
+        if (!headers)
+            return -1;
+        rv->headers = headers;
+        rv->headerslen = len;
     }
+    rv->headers[rv->headersused].key = key;
+    rv->headers[rv->headersused].value = value;
+    rv->headersused++;
+    return 0;
+}
 
-    char *key = strndup(line, index1 - line);
-    index1 += 2;
-    char *index2 = strstr(index1, "\r\n");
-    char *value = strndup(index1, index2 - index1);
+/* Parse "protocol://host[:port]/path" */
+static int RequestView_parseTarget(struct RequestView *rv, struct StrView target) {
+    const char *sep = (const char *)memmem(target.data, target.len, "://", 3);
+    if (!sep || sep == target.data) {
+        debug("invalid request line, missing host\n");
+        return -1;
+    }
+    rv->protocol.data = target.data;
+    rv->protocol.len = sep - target.data;
+    target.len -= rv->protocol.len + 3;
+    target.data = sep + 3;
 
-    ParsedHeader_set(pr, key, value);
-    free(key);
-    free(value);
+    struct StrView authority;
+    if (StrView_cut(&target, '/', &authority) < 0) {
+        debug("invalid request line, missing host or absolute path\n");
+        return -1;
+    }
+    rv->path.data = target.data - 1;
+    rv->path.len = target.len + 1;
+    if (target.len > 0 && target.data[0] == '/') {
+        debug("invalid request line, path cannot begin with two slash characters\n");
+        return -1;
+    }
+
+    rv->port.data = NULL;
+    rv->port.len = 0;
+    rv->host = authority;
+    if (StrView_cut(&authority, ':', &rv->host) == 0)
+        rv->port = authority;
+    if (rv->host.len == 0) {
+        debug("invalid request line, missing host\n");
+        return -1;
+    }
+    for (size_t i = 0; i < rv->port.len; i++) {
+        if (!isdigit((unsigned char)rv->port.data[i])) {
+            debug("invalid request line, bad port: %.*s\n", (int)rv->port.len, rv->port.data);
+            return -1;
+        }
+    }
     return 0;
 }
 
+/* Parse "method target version" */
+static int RequestView_parseRequestLine(struct RequestView *rv, struct StrView line) {
+    struct StrView target;
+    size_t method_len = scan_token(line.data, line.len);
+    if (method_len == 0 || method_len == line.len || line.data[method_len] != ' ') {
+        debug("invalid request line, no method\n");
+        return -1;
+    }
+    rv->method.data = line.data;
+    rv->method.len = method_len;
+    line.data += method_len + 1;
+    line.len -= method_len + 1;
+    if (StrView_cut(&line, ' ', &target) < 0 || target.len == 0) {
+        debug("invalid request line, no full address\n");
+        return -1;
+    }
+    rv->version = line;
+    if (rv->version.len < 5 || memcmp(rv->version.data, "HTTP/", 5)) {
+        debug("invalid request line, unsupported version %.*s\n", (int)rv->version.len, rv->version.data);
+        return -1;
+    }
+    return RequestView_parseTarget(rv, target);
+}
+
+/* Parse "key: value" and add it. The key must be a token and the value free of control characters. */
+static int RequestView_parseHeader(struct RequestView *rv, struct StrView line) {
+    struct StrView key, value;
+    size_t key_len = scan_token(line.data, line.len);
+    if (key_len == line.len || line.data[key_len] != ':') {
+        debug(memchr(line.data, ':', line.len) ? "invalid character in header name\n" : "No colon found\n");
+        return -1;
+    }
+    if (key_len == 0) {
+        debug("invalid header, empty name\n");
+        return -1;
+    }
+    key.data = line.data;
+    key.len = key_len;
+    value.data = line.data + key_len + 1;
+    value.len = line.len - key_len - 1;
+    while (value.len > 0 && (value.data[0] == ' ' || value.data[0] == '\t')) {
+        value.data++;
+        value.len--;
+    }
+    if (scan_field(value.data, value.len) != value.len) {
+        debug("invalid character in value of header %.*s\n", (int)key.len, key.data);
+        return -1;
+    }
+    while (value.len > 0 && (value.data[value.len - 1] == ' ' || value.data[value.len - 1] == '\t'))
+        value.len--;
+    return RequestView_addHeader(rv, key, value);
+}
+
+int RequestView_parse(struct RequestView *rv, const char *buf, size_t buflen) {
+    struct RequestParser p;
+    RequestParser_init(&p, rv, buflen);
+    int ret = RequestParser_feed(&p, buf, buflen);
+    if (ret == REQUEST_TOO_LARGE)
+        debug("invalid request line, no end of header\n");
+    return ret == REQUEST_COMPLETE ? 0 : -1;
+}
+
+void RequestView_release(struct RequestView *rv) {
+    if (rv->headers != rv->inline_headers)
+        free(rv->headers);
+    rv->headers = rv->inline_headers;
+    rv->headersused = 0;
+    rv->headerslen = REQUEST_VIEW_HEADERS;
+}
+
+struct HeaderView* RequestView_header(struct RequestView *rv, const char *key) {
+    size_t len = strlen(key);
+    for (size_t i = 0; i < rv->headersused; i++) {
+        struct HeaderView *h = rv->headers + i;
+        if (h->key.len == len && strncasecmp(h->key.data, key, len) == 0)
+            return h;
+    }
+    return NULL;
+}
+
+/*
+  RequestParser Methods
+*/
+
+/* RequestParser states; the last three are final */
+enum {
+    PARSER_REQUEST_LINE,
+    PARSER_HEADERS,
+    PARSER_DONE,
+    PARSER_FAILED,
+    PARSER_TOO_LARGE
+};
+
+/*
+   Until the request is complete the views hold offsets from the start of
+   the buffer rather than pointers, as the buffer may move between calls.
+ */
+static void StrView_toOffset(struct StrView *v, const char *buf) {
+    v->data = (const char *)(uintptr_t)(v->data - buf);
+}
+
+static void StrView_fromOffset(struct StrView *v, const char *buf) {
+    v->data = buf + (uintptr_t)v->data;
+}
+
+static void RequestView_requestLineOffsets(struct RequestView *rv, const char *buf, int to) {
+    struct StrView *fields[] = {&rv->method, &rv->protocol, &rv->host, &rv->port, &rv->path, &rv->version};
+    for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+        if (to)
+            StrView_toOffset(fields[i], buf);
+        else
+            StrView_fromOffset(fields[i], buf);
+    }
+}
+
+static int RequestParser_fail(struct RequestParser *p, int state) {
+    RequestView_release(p->rv);
+    p->state = state;
+    return state == PARSER_TOO_LARGE ? REQUEST_TOO_LARGE : REQUEST_ERROR;
+}
+
+void RequestParser_init(struct RequestParser *p, struct RequestView *rv, size_t limit) {
+    p->state = PARSER_REQUEST_LINE;
+    p->pos = 0;
+    p->line = 0;
+    p->limit = limit;
+    p->rv = rv;
+    rv->headers = rv->inline_headers;
+    rv->headersused = 0;
+    rv->headerslen = REQUEST_VIEW_HEADERS;
+    rv->header_len = 0;
+}
+
+int RequestParser_feed(struct RequestParser *p, const char *buf, size_t len) {
+    struct RequestView *rv = p->rv;
+    switch (p->state) {
+        case PARSER_DONE:
+            return REQUEST_COMPLETE;
+        case PARSER_FAILED:
+            return REQUEST_ERROR;
+        case PARSER_TOO_LARGE:
+            return REQUEST_TOO_LARGE;
+    }
+
+    for (;;) {
+        /* nothing past the limit is looked at */
+        size_t end = len < p->limit ? len : p->limit;
+        const char *nl = p->pos < end ? (const char *)memchr(buf + p->pos, '\n', end - p->pos) : NULL;
+        if (!nl) {
+            p->pos = end;
+            if (len < p->limit)
+                return REQUEST_NEED_MORE;
+            debug("request header block larger than %zu bytes\n", p->limit);
+            return RequestParser_fail(p, PARSER_TOO_LARGE);
+        }
+
+        struct StrView line = {buf + p->line, nl - (buf + p->line)};
+        p->pos = p->line = nl + 1 - buf;
+        if (line.len < 1 || line.data[line.len - 1] != '\r') {
+            debug("line does not end in CRLF\n");
+            return RequestParser_fail(p, PARSER_FAILED);
+        }
+        line.len--;
+
+        if (p->state == PARSER_REQUEST_LINE) {
+            /* empty lines before a request line are ignored (RFC 7230 3.5) */
+            if (line.len == 0)
+                continue;
+            if (RequestView_parseRequestLine(rv, line) < 0)
+                return RequestParser_fail(p, PARSER_FAILED);
+            if (rv->port.len == 0)
+                rv->port.data = rv->path.data;
+            RequestView_requestLineOffsets(rv, buf, 1);
+            p->state = PARSER_HEADERS;
+        } else if (line.len == 0) {
+            rv->header_len = p->pos;
+            RequestView_requestLineOffsets(rv, buf, 0);
+            for (size_t i = 0; i < rv->headersused; i++) {
+                StrView_fromOffset(&rv->headers[i].key, buf);
+                StrView_fromOffset(&rv->headers[i].value, buf);
+            }
+            p->state = PARSER_DONE;
+            return REQUEST_COMPLETE;
+        } else {
+            if (RequestView_parseHeader(rv, line) < 0)
+                return RequestParser_fail(p, PARSER_FAILED);
+            StrView_toOffset(&rv->headers[rv->headersused - 1].key, buf);
+            StrView_toOffset(&rv->headers[rv->headersused - 1].value, buf);
+        }
+    }
+}
+
 /*
   ParsedRequest Public Methods
 */
 
 void ParsedRequest_destroy(struct ParsedRequest *pr) {
+    /* an arena's request goes with the arena */
+    if (pr->arena)
+        return;
     if (pr->buf)
         free(pr->buf);
     if (pr->path)
         free(pr->path);
-    if (pr->headerslen > 0)
-        ParsedHeader_destroy(pr);
+    ParsedHeader_destroy(pr);
     free(pr);
 }
 
 struct ParsedRequest* ParsedRequest_create() {
-    struct ParsedRequest *pr = (struct ParsedRequest *)malloc(sizeof(struct ParsedRequest));
+    return ParsedRequest_createIn(NULL);
+}
+
+struct ParsedRequest* ParsedRequest_createIn(struct arena *arena) {
+    struct ParsedRequest *pr;
+    if (arena)
+        pr = (struct ParsedRequest *)arena_alloc(arena, sizeof(struct ParsedRequest));
+    else
+        pr = (struct ParsedRequest *)malloc(sizeof(struct ParsedRequest));
     if (pr) {
+        pr->arena = arena;
         ParsedHeader_create(pr);
         pr->buf = NULL;
         pr->method = NULL;
@@ -251,122 +765,55 @@ int ParsedRequest_parse(struct ParsedRequest *parse, const char *buf, int buflen
         return -1;
     }
 
-    char *tmp_buf = strndup(buf, buflen);
-    char *index = strstr(tmp_buf, "\r\n\r\n");
-    if (!index) {
-        debug("invalid request line, no end of header\n");
-        free(tmp_buf);
-        return -1;
-    }
-
-    index = strstr(tmp_buf, "\r\n");
-    parse->buf = strndup(tmp_buf, index - tmp_buf);
-
-    char *saveptr;
-    parse->method = strtok_r(parse->buf, " ", &saveptr);
-    if (!parse->method || strcmp(parse->method, "GET")) {
-        debug("invalid request line, method not 'GET': %s\n", parse->method);
-        free(tmp_buf);
-        free(parse->buf);
-        parse->buf = NULL;
-        return -1;
-    }
-
-    char *full_addr = strtok_r(NULL, " ", &saveptr);
-    if (!full_addr) {
-        debug("invalid request line, no full address\n");
-        free(tmp_buf);
-        free(parse->buf);
-        parse->buf = NULL;
-        return -1;
-    }
-
-    parse->version = full_addr + strlen(full_addr) + 1;
-    if (!parse->version || strncmp(parse->version, "HTTP/", 5)) {
-        debug("invalid request line, unsupported version %s\n", parse->version);
-        free(tmp_buf);
-        free(parse->buf);
-        parse->buf = NULL;
+    struct RequestView rv;
+    if (RequestView_parse(&rv, buf, buflen) < 0)
         return -1;
-    }
-
-    parse->protocol = strtok_r(full_addr, "://", &saveptr);
-    if (!parse->protocol) {
-        debug("invalid request line, missing host\n");
-        free(tmp_buf);
-        free(parse->buf);
-        parse->buf = NULL;
-        return -1;
-    }
-
-    const char *rem = full_addr + strlen(parse->protocol) + strlen("://");
-    size_t abs_uri_len = strlen(rem);
+    int ret = ParsedRequest_fromView(parse, &rv);
+    RequestView_release(&rv);
+    return ret;
+}
 
-    parse->host = strtok_r(NULL, "/", &saveptr);
-    if (!parse->host || strlen(parse->host) == abs_uri_len) {
-        debug("invalid request line, missing host or absolute path\n");
-        free(tmp_buf);
-        free(parse->buf);
-        parse->buf = NULL;
+int ParsedRequest_fromView(struct ParsedRequest *parse, struct RequestView *rv) {
+    if (parse->buf) {
+        debug("parse object already assigned to a request\n");
         return -1;
     }
-
-    parse->path = strtok_r(NULL, " ", &saveptr);
-    if (!parse->path) {
-        parse->path = strdup(root_abs_path);
-    } else if (strncmp(parse->path, root_abs_path, strlen(root_abs_path)) == 0) {
-        debug("invalid request line, path cannot begin with two slash characters\n");
-        free(tmp_buf);
-        free(parse->buf);
-        parse->buf = NULL;
-        parse->path = NULL;
+    if (!StrView_equals(rv->method, "GET")) {
+        debug("invalid request line, method not 'GET': %.*s\n", (int)rv->method.len, rv->method.data);
         return -1;
-    } else {
-        char *tmp_path = parse->path;
-        parse->path = (char *)malloc(strlen(root_abs_path) + strlen(tmp_path) + 1);
-        strcpy(parse->path, root_abs_path);
-        strcat(parse->path, tmp_path);
     }
 
-    parse->host = strtok_r(parse->host, ":", &saveptr);
-    parse->port = strtok_r(NULL, "/", &saveptr);
-
-    if (!parse->host) {
-        debug("invalid request line, missing host\n");
-        free(tmp_buf);
-        free(parse->buf);
-        free(parse->path);
+    /* the request line fields are kept NUL terminated in one block */
+    parse->buflen = rv->method.len + rv->protocol.len + rv->host.len + rv->port.len + rv->version.len + 5;
+    parse->buf = (char *)ParsedRequest_alloc(parse, parse->buflen);
+    parse->path = ParsedRequest_strndup(parse, rv->path.data, rv->path.len);
+    if (!parse->buf || !parse->path) {
+        ParsedRequest_free(parse, parse->buf);
+        ParsedRequest_free(parse, parse->path);
         parse->buf = NULL;
         parse->path = NULL;
         return -1;
     }
-
-    if (parse->port) {
-        int port = strtol(parse->port, NULL, 10);
-        if (port == 0 && errno == EINVAL) {
-            debug("invalid request line, bad port: %s\n", parse->port);
-            free(tmp_buf);
-            free(parse->buf);
-            free(parse->path);
-            parse->buf = NULL;
-            parse->path = NULL;
-            return -1;
-        }
+    char *current = parse->buf;
+    struct StrView *fields[] = {&rv->method, &rv->protocol, &rv->host, &rv->port, &rv->version};
+    char **copies[] = {&parse->method, &parse->protocol, &parse->host, &parse->port, &parse->version};
+    for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+        *copies[i] = current;
+        if (fields[i]->len)
+            memcpy(current, fields[i]->data, fields[i]->len);
+        current[fields[i]->len] = '\0';
+        current += fields[i]->len + 1;
     }
+    if (rv->port.len == 0)
+        parse->port = NULL;
 
     int ret = 0;
-    char *currentHeader = strstr(tmp_buf, "\r\n") + 2;
-    while (currentHeader[0] != '\0' && !(currentHeader[0] == '\r' && currentHeader[1] == '\n')) {
-        if (ParsedHeader_parse(parse, currentHeader)) {
+    for (size_t i = 0; i < rv->headersused; i++) {
+        if (ParsedHeader_setView(parse, rv->headers[i].key, rv->headers[i].value) < 0) {
             ret = -1;
             break;
         }
-        currentHeader = strstr(currentHeader, "\r\n");
-        if (!currentHeader || strlen(currentHeader) < 2)
-            break;
-        currentHeader += 2;
     }
-    free(tmp_buf);
     return ret;
 }
 
@@ -17,18 +17,52 @@
 #ifndef PROXY_PARSE
 #define PROXY_PARSE
 
+struct arena;
+
 #define DEBUG 1
 
+/*
+   Request headers the proxy itself acts on, or that nearly every request
+   carries. They are recognized by name when added to a ParsedRequest and
+   found with ParsedHeader_known() without hashing.
+ */
+enum {
+    HEADER_HOST,
+    HEADER_CONNECTION,
+    HEADER_PROXY_CONNECTION,
+    HEADER_KEEP_ALIVE,
+    HEADER_CONTENT_LENGTH,
+    HEADER_TRANSFER_ENCODING,
+    HEADER_CACHE_CONTROL,
+    HEADER_PRAGMA,
+    HEADER_IF_NONE_MATCH,
+    HEADER_IF_MODIFIED_SINCE,
+    HEADER_ACCEPT,
+    HEADER_ACCEPT_ENCODING,
+    HEADER_ACCEPT_LANGUAGE,
+    HEADER_USER_AGENT,
+    HEADER_COOKIE,
+    HEADER_REFERER,
+    HEADER_KNOWN
+};
+
+#define HEADER_ABSENT ((size_t)-1)
+
 /* 
    ParsedRequest objects are created from parsing a buffer containing a HTTP
    request. The request buffer consists of a request line followed by a number
    of headers. Request line fields such as method, protocol etc. are stored
    explicitly. Headers such as 'Content-Length' and their values are maintained
-   in a linked list. Each node in this list is a ParsedHeader and contains a
-   key-value pair.
+   in an array, in the order they are unparsed in. Each element is a
+   ParsedHeader and contains a key-value pair; removed ones are left with a
+   NULL key. Header names are looked up without regard to case, the
+   HEADER_ ones below through known and all others through a hash index.
 
    The buf and buflen fields are used internally to maintain the parsed request
    line.
+
+   A request created in an arena takes all its memory from the arena, and
+   it is released with the arena rather than by ParsedRequest_destroy().
  */
 struct ParsedRequest {
      char *method; 
@@ -42,6 +76,11 @@ struct ParsedRequest {
      struct ParsedHeader *headers;
      size_t headersused;
      size_t headerslen;
+     size_t headersremoved;       /* NULL key holes among the used ones */
+     size_t known[HEADER_KNOWN];  /* position of each, or HEADER_ABSENT */
+     size_t *index;               /* positions + 1 of the others by name hash, 0 if free */
+     size_t indexlen;             /* a power of two */
+     struct arena *arena;         /* NULL if allocated with malloc() */
 };
 
 /* 
@@ -54,17 +93,123 @@ struct ParsedHeader {
      size_t keylen;
      char * value;
      size_t valuelen;
+     int id;                      /* request headers: HEADER_ id or -1 */
+     unsigned hash;               /* request headers: of the name, if not known */
+};
+
+
+/*
+   A (pointer, length) view of bytes in someone else's buffer. It is not NUL
+   terminated and is only valid as long as the buffer is.
+ */
+struct StrView {
+     const char *data;
+     size_t len;
 };
 
+struct HeaderView {
+     struct StrView key;
+     struct StrView value;        /* without surrounding whitespace */
+};
+
+#define REQUEST_VIEW_HEADERS 32  /* headers held without allocating */
+
+/*
+   RequestView is the allocation-free form of ParsedRequest: every field is a
+   view into the buffer that was parsed, which must outlive it. Up to
+   REQUEST_VIEW_HEADERS headers are kept in the struct itself; only requests
+   with more allocate, so RequestView_release() must still be called. The
+   struct must not be copied once parsed, as headers may point into it.
+ */
+struct RequestView {
+     struct StrView method;
+     struct StrView protocol;
+     struct StrView host;
+     struct StrView port;         /* empty if the URI has none */
+     struct StrView path;         /* from the '/' after the host on */
+     struct StrView version;
+     size_t header_len;           /* bytes up to and including the blank line */
+     struct HeaderView *headers;
+     size_t headersused;
+     size_t headerslen;
+     struct HeaderView inline_headers[REQUEST_VIEW_HEADERS];
+};
+
+/*
+   Parse the request line and headers at the start of buf, which need not
+   be NUL terminated. Any method is accepted; the target must be an
+   absolute URI. Returns 0, or -1 if the header block is incomplete or
+   malformed.
+ */
+int RequestView_parse(struct RequestView *rv, const char *buf, size_t buflen);
+
+/* RequestParser_feed() results */
+enum {
+    REQUEST_TOO_LARGE = -2,      /* no end of the header block within the limit */
+    REQUEST_ERROR = -1,          /* malformed */
+    REQUEST_NEED_MORE = 0,
+    REQUEST_COMPLETE = 1
+};
+
+/*
+   RequestParser is the incremental form of RequestView_parse(), for a
+   request that arrives in pieces. The caller appends what it receives to
+   one buffer and calls RequestParser_feed() with all of it after every
+   read; the parser resumes where it stopped, so each byte is scanned once
+   however the request is split up, and each line is parsed as soon as it
+   is complete. The buffer may be moved (e.g. by realloc()) between calls.
+ */
+struct RequestParser {
+     int state;
+     size_t pos;                  /* bytes of the buffer scanned */
+     size_t line;                 /* where the line being received starts */
+     size_t limit;                /* most bytes the header block may take */
+     struct RequestView *rv;      /* filled in as the request is parsed */
+};
+
+/*
+   Start parsing a request into rv, whose header block may take at most
+   limit bytes.
+ */
+void RequestParser_init(struct RequestParser *p, struct RequestView *rv, size_t limit);
+
+/*
+   Continue with the len bytes at buf, the request received so far.
+   Returns REQUEST_COMPLETE once the header block has ended, after which the
+   views in rv point into buf and rv->header_len bytes are the request: any
+   bytes after them are the next, pipelined one. REQUEST_NEED_MORE asks for
+   more bytes; REQUEST_ERROR and REQUEST_TOO_LARGE are final, with rv
+   released. Calling it again after a final result returns the same result.
+ */
+int RequestParser_feed(struct RequestParser *p, const char *buf, size_t len);
+
+/* Free the header array of a request with many headers */
+void RequestView_release(struct RequestView *rv);
+
+/* Case-insensitive lookup of the first header named key, or NULL */
+struct HeaderView* RequestView_header(struct RequestView *rv, const char *key);
 
 /* Create an empty parsing object to be used exactly once for parsing a single
  * request buffer */
 struct ParsedRequest* ParsedRequest_create();
 
-/* Parse the request buffer in buf given that buf is of length buflen */
+/* The same, with everything allocated in arena */
+struct ParsedRequest* ParsedRequest_createIn(struct arena *arena);
+
+/*
+   Parse the request buffer in buf given that buf is of length buflen. Only
+   GET is accepted. This is a compatibility wrapper around
+   RequestView_parse() that copies the views into the object.
+ */
 int ParsedRequest_parse(struct ParsedRequest * parse, const char *buf,
 			int buflen);
 
+/*
+   Fill a newly created object from a parsed view, as ParsedRequest_parse()
+   does. Only GET is accepted. rv is left to the caller to release.
+ */
+int ParsedRequest_fromView(struct ParsedRequest *parse, struct RequestView *rv);
+
 /* Destroy the parsing object. */
 void ParsedRequest_destroy(struct ParsedRequest *pr);
 
@@ -95,13 +240,23 @@ size_t ParsedRequest_totalLen(struct ParsedRequest *pr);
  */
 size_t ParsedHeader_headersLen(struct ParsedRequest *pr);
 
-/* Set, get, and remove null-terminated header keys and values */
+/*
+   Set, get, and remove null-terminated header keys and values. Keys match
+   regardless of case, and a request holds one header per key: setting an
+   existing one replaces its value where it stands.
+ */
 int ParsedHeader_set(struct ParsedRequest *pr, const char * key, 
 		      const char * value);
 struct ParsedHeader* ParsedHeader_get(struct ParsedRequest *pr, 
 				      const char * key);
 int ParsedHeader_remove (struct ParsedRequest *pr, const char * key);
 
+/* ParsedHeader_get() for a key of len bytes, not NUL terminated */
+struct ParsedHeader* ParsedHeader_getn(struct ParsedRequest *pr, const char *key, size_t len);
+
+/* The header with the given HEADER_ id, or NULL */
+struct ParsedHeader* ParsedHeader_known(struct ParsedRequest *pr, int id);
+
 /* debug() prints out debugging info if DEBUG is set to 1 */
 void debug(const char * format, ...);
 
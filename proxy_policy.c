@@ -0,0 +1,493 @@
+/*
+  proxy_policy.c -- LRU, W-TinyLFU and GDSF eviction for the cache shards.
+
+  The LRU lists are intrusive, through the entries' prev and next pointers,
+  and ordered by a per-instance monotonic clock. An access stamps the entry
+  with the clock; when a victim is picked, a tail entry stamped after it
+  was placed has been hit since and is moved up instead of evicted.
+
+  W-TinyLFU keeps three such lists: the window, and the probation and
+  protected segments of the main cache. A probation entry hit since it was
+  placed moves to protected, whose overflow goes back to probation. The
+  frequency sketch has four 4-bit counters per key in a table of 64-bit
+  words, updated with compare-and-swap so that lookups under the shared
+  lock can count; once it has counted ten times as many keys as it has
+  counters, all counters are halved so that old popularity fades.
+
+  GDSF keeps a binary min-heap of the entries by priority. Hits only count;
+  a priority is brought up to date when its entry reaches the top of the
+  heap, which can only raise it, so the heap order is otherwise kept.
+*/
+
+#define _GNU_SOURCE
+#include "proxy_policy.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define SKETCH_ENTRY_BYTES 4096        /* average entry assumed when sizing a sketch */
+#define SKETCH_MIN_WORDS 64
+#define SKETCH_DEPTH 4
+#define SKETCH_SAMPLE 10               /* keys counted per counter between halvings */
+
+enum { WINDOW, PROBATION, PROTECTED };
+
+struct policy_list {
+     cache_element *head;         /* most recently placed */
+     cache_element *tail;         /* eviction candidate */
+     size_t bytes;
+};
+
+struct sketch {
+     atomic_uint_fast64_t *table; /* 16 counters per word */
+     size_t mask;                 /* of counter indexes */
+     atomic_ulong additions;
+     unsigned long sample;
+};
+
+struct lru {
+     struct policy_list list;
+     atomic_uint_fast64_t clock;
+     struct policy_stats st;
+};
+
+struct wtinylfu {
+     struct policy_list q[3];
+     size_t window_max;
+     size_t main_max;
+     size_t protected_max;
+     atomic_uint_fast64_t clock;
+     struct sketch sketch;
+     struct policy_stats st;
+};
+
+struct gdsf {
+     cache_element **heap;
+     size_t count;
+     size_t cap;
+     double inflation;            /* priority of the last victim */
+     struct policy_stats st;
+};
+
+/*
+  Lists
+*/
+
+static void list_unlink(struct policy_list *l, cache_element *e) {
+    if (e->prev)
+        e->prev->next = e->next;
+    else
+        l->head = e->next;
+    if (e->next)
+        e->next->prev = e->prev;
+    else
+        l->tail = e->prev;
+    e->prev = e->next = NULL;
+    l->bytes -= e->size;
+}
+
+static void list_push_head(struct policy_list *l, cache_element *e, atomic_uint_fast64_t *clock) {
+    e->prev = NULL;
+    e->next = l->head;
+    if (l->head)
+        l->head->prev = e;
+    l->head = e;
+    if (!l->tail)
+        l->tail = e;
+    l->bytes += e->size;
+    e->list_stamp = atomic_fetch_add_explicit(clock, 1, memory_order_relaxed) + 1;
+    atomic_store_explicit(&e->lru_time_track, e->list_stamp, memory_order_relaxed);
+}
+
+static void stamp(cache_element *e, atomic_uint_fast64_t *clock) {
+    uint64_t now = atomic_load_explicit(clock, memory_order_relaxed) + 1;
+    atomic_store_explicit(&e->lru_time_track, now, memory_order_relaxed);
+}
+
+/* Whether e was hit since it was placed on its list */
+static int touched(cache_element *e) {
+    return atomic_load_explicit(&e->lru_time_track, memory_order_relaxed) > e->list_stamp;
+}
+
+static size_t list_order(struct policy_list *l, cache_element **out) {
+    size_t n = 0;
+    for (cache_element *e = l->tail; e; e = e->prev)
+        out[n++] = e;
+    return n;
+}
+
+/*
+  LRU
+*/
+
+static void *lru_create(size_t budget) {
+    return calloc(1, sizeof(struct lru));
+}
+
+static void lru_destroy(void *p) {
+    free(p);
+}
+
+static void lru_access(void *p, uint64_t hash, cache_element *e) {
+    if (e)
+        stamp(e, &((struct lru *)p)->clock);
+}
+
+static int lru_insert(void *p, cache_element *e) {
+    struct lru *l = (struct lru *)p;
+    list_push_head(&l->list, e, &l->clock);
+    return 0;
+}
+
+static void lru_remove(void *p, cache_element *e) {
+    list_unlink(&((struct lru *)p)->list, e);
+}
+
+static cache_element *lru_victim(void *p) {
+    struct lru *l = (struct lru *)p;
+    while (l->list.tail) {
+        cache_element *e = l->list.tail;
+        if (!touched(e)) {
+            l->st.victims++;
+            return e;
+        }
+        list_unlink(&l->list, e);
+        list_push_head(&l->list, e, &l->clock);
+        l->st.reordered++;
+    }
+    return NULL;
+}
+
+static size_t lru_order(void *p, cache_element **out) {
+    return list_order(&((struct lru *)p)->list, out);
+}
+
+static void lru_stats(void *p, struct policy_stats *st) {
+    *st = ((struct lru *)p)->st;
+}
+
+const struct cache_policy policy_lru = {
+    "lru", lru_create, lru_destroy, lru_access, lru_insert, lru_remove, lru_victim, lru_order, lru_stats,
+};
+
+/*
+  Count-min sketch
+*/
+
+static const uint64_t sketch_seeds[SKETCH_DEPTH] = {
+    0xc3a5c85c97cb3127ULL, 0xb492b66fbe98f273ULL, 0x9ae16a3b2f90404fULL, 0xcbf29ce484222325ULL,
+};
+
+static int sketch_init(struct sketch *sk, size_t budget) {
+    size_t words = SKETCH_MIN_WORDS;
+    while (words * 16 < budget / SKETCH_ENTRY_BYTES * SKETCH_DEPTH)
+        words *= 2;
+    sk->table = (atomic_uint_fast64_t *)calloc(words, sizeof(atomic_uint_fast64_t));
+    if (!sk->table)
+        return -1;
+    sk->mask = words * 16 - 1;
+    sk->sample = words * 16 * SKETCH_SAMPLE / SKETCH_DEPTH;
+    atomic_init(&sk->additions, 0);
+    return 0;
+}
+
+static size_t sketch_index(const struct sketch *sk, uint64_t hash, int i) {
+    uint64_t h = (hash ^ (hash >> 29)) * sketch_seeds[i];
+    return (h >> 32) & sk->mask;
+}
+
+static unsigned sketch_frequency(const struct sketch *sk, uint64_t hash) {
+    unsigned freq = 15;
+    for (int i = 0; i < SKETCH_DEPTH; i++) {
+        size_t c = sketch_index(sk, hash, i);
+        uint64_t w = atomic_load_explicit(&sk->table[c >> 4], memory_order_relaxed);
+        unsigned n = (w >> ((c & 15) * 4)) & 15;
+        if (n < freq)
+            freq = n;
+    }
+    return freq;
+}
+
+static void sketch_halve(struct sketch *sk) {
+    for (size_t i = 0; i <= sk->mask >> 4; i++) {
+        uint64_t w = atomic_load_explicit(&sk->table[i], memory_order_relaxed);
+        while (!atomic_compare_exchange_weak_explicit(&sk->table[i], &w, (w >> 1) & 0x7777777777777777ULL,
+                                                      memory_order_relaxed, memory_order_relaxed))
+            ;
+    }
+}
+
+static void sketch_increment(struct sketch *sk, uint64_t hash) {
+    int added = 0;
+    for (int i = 0; i < SKETCH_DEPTH; i++) {
+        size_t c = sketch_index(sk, hash, i);
+        unsigned shift = (c & 15) * 4;
+        atomic_uint_fast64_t *word = &sk->table[c >> 4];
+        uint64_t w = atomic_load_explicit(word, memory_order_relaxed);
+        while (((w >> shift) & 15) < 15) {
+            if (atomic_compare_exchange_weak_explicit(word, &w, w + (1ULL << shift), memory_order_relaxed,
+                                                      memory_order_relaxed)) {
+                added = 1;
+                break;
+            }
+        }
+    }
+    if (added && atomic_fetch_add_explicit(&sk->additions, 1, memory_order_relaxed) + 1 == sk->sample) {
+        sketch_halve(sk);
+        atomic_fetch_sub_explicit(&sk->additions, sk->sample / 2, memory_order_relaxed);
+    }
+}
+
+/*
+  W-TinyLFU
+*/
+
+static void *wtinylfu_create(size_t budget) {
+    struct wtinylfu *w = (struct wtinylfu *)calloc(1, sizeof(struct wtinylfu));
+    if (!w)
+        return NULL;
+    if (sketch_init(&w->sketch, budget) < 0) {
+        free(w);
+        return NULL;
+    }
+    w->window_max = budget * POLICY_WINDOW_PERCENT / 100;
+    w->main_max = budget - w->window_max;
+    w->protected_max = w->main_max * POLICY_PROTECTED_PERCENT / 100;
+    return w;
+}
+
+static void wtinylfu_destroy(void *p) {
+    struct wtinylfu *w = (struct wtinylfu *)p;
+    free(w->sketch.table);
+    free(w);
+}
+
+static void wtinylfu_access(void *p, uint64_t hash, cache_element *e) {
+    struct wtinylfu *w = (struct wtinylfu *)p;
+    sketch_increment(&w->sketch, hash);
+    if (e)
+        stamp(e, &w->clock);
+}
+
+static void move_to(struct wtinylfu *w, cache_element *e, int queue) {
+    list_unlink(&w->q[e->queue], e);
+    e->queue = queue;
+    list_push_head(&w->q[queue], e, &w->clock);
+}
+
+static int wtinylfu_insert(void *p, cache_element *e) {
+    struct wtinylfu *w = (struct wtinylfu *)p;
+    e->queue = WINDOW;
+    list_push_head(&w->q[WINDOW], e, &w->clock);
+    return 0;
+}
+
+static void wtinylfu_remove(void *p, cache_element *e) {
+    struct wtinylfu *w = (struct wtinylfu *)p;
+    list_unlink(&w->q[e->queue], e);
+}
+
+/* Least recently used entry of the window, moving up those hit since placed */
+static cache_element *window_candidate(struct wtinylfu *w) {
+    while (w->q[WINDOW].tail) {
+        cache_element *e = w->q[WINDOW].tail;
+        if (!touched(e))
+            return e;
+        move_to(w, e, WINDOW);
+        w->st.reordered++;
+    }
+    return NULL;
+}
+
+/*
+   Least recently used entry of probation, promoting to protected those hit
+   since placed, or the protected tail if probation is empty.
+ */
+static cache_element *main_victim(struct wtinylfu *w) {
+    while (w->q[PROBATION].tail) {
+        cache_element *e = w->q[PROBATION].tail;
+        if (!touched(e))
+            return e;
+        move_to(w, e, PROTECTED);
+        w->st.reordered++;
+        while (w->q[PROTECTED].bytes > w->protected_max && w->q[PROTECTED].tail != e)
+            move_to(w, w->q[PROTECTED].tail, PROBATION);
+    }
+    return w->q[PROTECTED].tail;
+}
+
+static cache_element *wtinylfu_victim(void *p) {
+    struct wtinylfu *w = (struct wtinylfu *)p;
+    cache_element *victim = NULL;
+
+    /* entries leaving the window try to get into the main cache */
+    while (!victim && w->q[WINDOW].bytes > w->window_max) {
+        cache_element *candidate = window_candidate(w);
+        size_t main_bytes = w->q[PROBATION].bytes + w->q[PROTECTED].bytes;
+        if (main_bytes + candidate->size <= w->main_max) {
+            move_to(w, candidate, PROBATION);
+            w->st.admitted++;
+            continue;
+        }
+        cache_element *incumbent = main_victim(w);
+        if (incumbent && sketch_frequency(&w->sketch, candidate->hash) > sketch_frequency(&w->sketch, incumbent->hash)) {
+            move_to(w, candidate, PROBATION);
+            w->st.admitted++;
+            victim = incumbent;
+        } else {
+            w->st.rejected++;
+            victim = candidate;
+        }
+    }
+    if (!victim)
+        victim = main_victim(w);
+    if (!victim)
+        victim = window_candidate(w);
+    if (victim)
+        w->st.victims++;
+    return victim;
+}
+
+static size_t wtinylfu_order(void *p, cache_element **out) {
+    struct wtinylfu *w = (struct wtinylfu *)p;
+    size_t n = list_order(&w->q[WINDOW], out);
+    n += list_order(&w->q[PROBATION], out + n);
+    return n + list_order(&w->q[PROTECTED], out + n);
+}
+
+static void wtinylfu_stats(void *p, struct policy_stats *st) {
+    *st = ((struct wtinylfu *)p)->st;
+}
+
+const struct cache_policy policy_wtinylfu = {
+    "wtinylfu", wtinylfu_create, wtinylfu_destroy, wtinylfu_access, wtinylfu_insert, wtinylfu_remove,
+    wtinylfu_victim, wtinylfu_order, wtinylfu_stats,
+};
+
+/*
+  GDSF
+*/
+
+static double gdsf_priority(const struct gdsf *g, const cache_element *e, unsigned hits) {
+    return g->inflation + (hits + 1.0) / (e->size ? e->size : 1);
+}
+
+static void heap_set(struct gdsf *g, size_t i, cache_element *e) {
+    g->heap[i] = e;
+    e->heap_slot = i;
+}
+
+static void sift_up(struct gdsf *g, size_t i) {
+    cache_element *e = g->heap[i];
+    while (i > 0 && g->heap[(i - 1) / 2]->priority > e->priority) {
+        heap_set(g, i, g->heap[(i - 1) / 2]);
+        i = (i - 1) / 2;
+    }
+    heap_set(g, i, e);
+}
+
+static void sift_down(struct gdsf *g, size_t i) {
+    cache_element *e = g->heap[i];
+    for (;;) {
+        size_t child = 2 * i + 1;
+        if (child >= g->count)
+            break;
+        if (child + 1 < g->count && g->heap[child + 1]->priority < g->heap[child]->priority)
+            child++;
+        if (g->heap[child]->priority >= e->priority)
+            break;
+        heap_set(g, i, g->heap[child]);
+        i = child;
+    }
+    heap_set(g, i, e);
+}
+
+static void *gdsf_create(size_t budget) {
+    return calloc(1, sizeof(struct gdsf));
+}
+
+static void gdsf_destroy(void *p) {
+    free(((struct gdsf *)p)->heap);
+    free(p);
+}
+
+static void gdsf_access(void *p, uint64_t hash, cache_element *e) {
+    if (e)
+        atomic_fetch_add_explicit(&e->hits, 1, memory_order_relaxed);
+}
+
+static int gdsf_insert(void *p, cache_element *e) {
+    struct gdsf *g = (struct gdsf *)p;
+    if (g->count == g->cap) {
+        size_t cap = g->cap ? g->cap * 2 : 256;
+        cache_element **heap = (cache_element **)realloc(g->heap, cap * sizeof(cache_element *));
+        if (!heap)
+            return -1;
+        g->heap = heap;
+        g->cap = cap;
+    }
+    atomic_store_explicit(&e->hits, 0, memory_order_relaxed);
+    e->hits_seen = 0;
+    e->priority = gdsf_priority(g, e, 0);
+    heap_set(g, g->count++, e);
+    sift_up(g, e->heap_slot);
+    return 0;
+}
+
+static void gdsf_remove(void *p, cache_element *e) {
+    struct gdsf *g = (struct gdsf *)p;
+    size_t i = e->heap_slot;
+    cache_element *last = g->heap[--g->count];
+    if (i == g->count)
+        return;
+    heap_set(g, i, last);
+    sift_down(g, i);
+    sift_up(g, last->heap_slot);
+}
+
+static cache_element *gdsf_victim(void *p) {
+    struct gdsf *g = (struct gdsf *)p;
+    while (g->count > 0) {
+        cache_element *e = g->heap[0];
+        unsigned hits = atomic_load_explicit(&e->hits, memory_order_relaxed);
+        if (hits == e->hits_seen) {
+            g->inflation = e->priority;
+            g->st.victims++;
+            return e;
+        }
+        e->hits_seen = hits;
+        e->priority = gdsf_priority(g, e, hits);
+        sift_down(g, 0);
+        g->st.reordered++;
+    }
+    return NULL;
+}
+
+static int by_priority(const void *a, const void *b) {
+    double pa = (*(cache_element *const *)a)->priority, pb = (*(cache_element *const *)b)->priority;
+    return pa < pb ? -1 : pa > pb;
+}
+
+static size_t gdsf_order(void *p, cache_element **out) {
+    struct gdsf *g = (struct gdsf *)p;
+    memcpy(out, g->heap, g->count * sizeof(cache_element *));
+    qsort(out, g->count, sizeof(cache_element *), by_priority);
+    return g->count;
+}
+
+static void gdsf_stats(void *p, struct policy_stats *st) {
+    *st = ((struct gdsf *)p)->st;
+}
+
+const struct cache_policy policy_gdsf = {
+    "gdsf", gdsf_create, gdsf_destroy, gdsf_access, gdsf_insert, gdsf_remove, gdsf_victim, gdsf_order, gdsf_stats,
+};
+
+const struct cache_policy *const cache_policies[] = {&policy_lru, &policy_wtinylfu, &policy_gdsf, NULL};
+
+const struct cache_policy *policy_find(const char *name) {
+    for (int i = 0; cache_policies[i]; i++) {
+        if (!strcmp(cache_policies[i]->name, name))
+            return cache_policies[i];
+    }
+    return NULL;
+}
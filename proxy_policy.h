@@ -0,0 +1,92 @@
+/*
+ * proxy_policy.h -- eviction policies of the response cache.
+ *
+ * A policy decides which entry of a cache shard goes when the shard is
+ * over its budget. Each shard has its own instance of the policy in use,
+ * called with the shard's lock held: exclusively to place, remove and pick
+ * entries, shared for the access of a lookup. Accesses therefore only
+ * stamp or count through atomics, and whatever reordering they call for is
+ * done the next time a victim is picked.
+ *
+ *   lru       Least recently used, with a second chance for entries hit
+ *             since they were placed (how the cache always evicted).
+ *   wtinylfu  W-TinyLFU: new entries go to a small LRU window; an entry
+ *             leaving it enters the main segmented LRU only if a count-min
+ *             sketch of recent lookups, hits and misses alike, says its key
+ *             is more popular than the entry it would displace. A burst of
+ *             one-time requests passes through the window without touching
+ *             the main cache.
+ *   gdsf      GreedyDual-Size-Frequency: an entry's priority is the
+ *             shard's inflation value plus its hits over its size, and the
+ *             lowest priority goes first, after which the inflation value
+ *             rises to it. Small popular entries outlast large ones with
+ *             few hits, which in turn still age out.
+ */
+
+#ifndef PROXY_POLICY
+#define PROXY_POLICY
+
+#include <stddef.h>
+#include <stdint.h>
+#include "proxy_cache.h"
+
+#define POLICY_WINDOW_PERCENT 1        /* of a shard's budget, W-TinyLFU's window */
+#define POLICY_PROTECTED_PERCENT 80    /* of the rest, its protected segment */
+
+/* Counts of one policy instance, or summed over the shards */
+struct policy_stats {
+     unsigned long victims;       /* entries picked for eviction */
+     unsigned long reordered;     /* entries moved when a victim was picked, for accesses since */
+     unsigned long admitted;      /* W-TinyLFU: window entries taken into the main cache */
+     unsigned long rejected;      /* W-TinyLFU: window entries evicted in favour of a main one */
+};
+
+struct cache_policy {
+     const char *name;
+
+     /* An instance for a shard of budget bytes, NULL if out of memory */
+     void *(*create)(size_t budget);
+     void (*destroy)(void *p);
+
+     /*
+        A lookup of the key with the given hash, which found entry e or,
+        if e is NULL, missed. Shared lock.
+      */
+     void (*access)(void *p, uint64_t hash, cache_element *e);
+
+     /*
+        Place e, just added to the shard. Returns 0, or -1 if out of
+        memory. Exclusive lock.
+      */
+     int (*insert)(void *p, cache_element *e);
+
+     /* Take out e, evicted or replaced. Exclusive lock. */
+     void (*remove)(void *p, cache_element *e);
+
+     /*
+        The entry to evict next, still placed, or NULL if there is none.
+        The caller removes it. Exclusive lock.
+      */
+     cache_element *(*victim)(void *p);
+
+     /*
+        Store every placed entry in out, which has room for all of them,
+        roughly in the order they would be evicted. Returns the count.
+        Shared lock.
+      */
+     size_t (*order)(void *p, cache_element **out);
+
+     void (*stats)(void *p, struct policy_stats *st);
+};
+
+extern const struct cache_policy policy_lru;
+extern const struct cache_policy policy_wtinylfu;
+extern const struct cache_policy policy_gdsf;
+
+/* The policy called name, NULL if there is none */
+const struct cache_policy *policy_find(const char *name);
+
+/* All policies, NULL terminated; the first is the default */
+extern const struct cache_policy *const cache_policies[];
+
+#endif
@@ -0,0 +1,156 @@
+/*
+  proxy_pool.c -- bounded worker pool fed by a lock-free queue of sockets.
+
+  The queue is the classic bounded MPMC ring: every slot carries a sequence
+  number, producers claim a position with a CAS on enqueue_pos and publish
+  by advancing the slot's sequence, consumers do the same on dequeue_pos.
+  Workers sleep on a semaphore that is posted once per published socket.
+  Each socket is stamped as it is pushed, and the time it waited recorded
+  as the queue stage once a worker takes it.
+*/
+
+#include "proxy_pool.h"
+#include "proxy_metrics.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <sched.h>
+
+int conn_queue_init(struct conn_queue *q, size_t capacity) {
+    size_t size = 2;
+    while (size < capacity)
+        size <<= 1;
+
+    q->slots = (struct conn_slot *)malloc(size * sizeof(struct conn_slot));
+    if (!q->slots)
+        return -1;
+    for (size_t i = 0; i < size; i++) {
+        atomic_init(&q->slots[i].seq, i);
+        q->slots[i].fd = -1;
+    }
+    q->mask = size - 1;
+    atomic_init(&q->enqueue_pos, 0);
+    atomic_init(&q->dequeue_pos, 0);
+    return 0;
+}
+
+void conn_queue_destroy(struct conn_queue *q) {
+    free(q->slots);
+    q->slots = NULL;
+}
+
+int conn_queue_push(struct conn_queue *q, int fd) {
+    struct conn_slot *slot;
+    size_t pos = atomic_load_explicit(&q->enqueue_pos, memory_order_relaxed);
+
+    for (;;) {
+        slot = q->slots + (pos & q->mask);
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        long diff = (long)seq - (long)pos;
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&q->enqueue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            return -1;
+        } else {
+            pos = atomic_load_explicit(&q->enqueue_pos, memory_order_relaxed);
+        }
+    }
+
+    slot->fd = fd;
+    slot->queued_at = metrics_now();
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+    return 0;
+}
+
+int conn_queue_pop(struct conn_queue *q, int *fd, uint64_t *queued_at) {
+    struct conn_slot *slot;
+    size_t pos = atomic_load_explicit(&q->dequeue_pos, memory_order_relaxed);
+
+    for (;;) {
+        slot = q->slots + (pos & q->mask);
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        long diff = (long)seq - (long)(pos + 1);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&q->dequeue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            return -1;
+        } else {
+            pos = atomic_load_explicit(&q->dequeue_pos, memory_order_relaxed);
+        }
+    }
+
+    *fd = slot->fd;
+    *queued_at = slot->queued_at;
+    atomic_store_explicit(&slot->seq, pos + q->mask + 1, memory_order_release);
+    return 0;
+}
+
+size_t conn_queue_depth(struct conn_queue *q) {
+    size_t tail = atomic_load_explicit(&q->dequeue_pos, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&q->enqueue_pos, memory_order_relaxed);
+    return head > tail ? head - tail : 0;
+}
+
+static void *worker_fn(void *arg) {
+    struct worker_pool *pool = (struct worker_pool *)arg;
+    int fd;
+    uint64_t queued_at;
+
+    while (1) {
+        while (sem_wait(&pool->items) < 0)
+            ;
+        /*
+           The semaphore only counts published sockets, but a producer that
+           claimed an earlier slot may not have published it yet.
+         */
+        while (conn_queue_pop(&pool->queue, &fd, &queued_at) < 0)
+            sched_yield();
+        metrics_since(HIST_QUEUE, queued_at);
+        pool->handler(fd);
+    }
+    return NULL;
+}
+
+int worker_pool_start(struct worker_pool *pool, int nthreads, size_t depth,
+                      void (*handler)(int fd)) {
+    if (conn_queue_init(&pool->queue, depth) < 0)
+        return -1;
+    if (sem_init(&pool->items, 0, 0) < 0) {
+        conn_queue_destroy(&pool->queue);
+        return -1;
+    }
+    pool->threads = (pthread_t *)calloc(nthreads, sizeof(pthread_t));
+    if (!pool->threads) {
+        conn_queue_destroy(&pool->queue);
+        return -1;
+    }
+    pool->nthreads = nthreads;
+    pool->handler = handler;
+    atomic_init(&pool->submitted, 0);
+    atomic_init(&pool->rejected, 0);
+
+    for (int i = 0; i < nthreads; i++) {
+        if (pthread_create(&pool->threads[i], NULL, worker_fn, pool) != 0) {
+            perror("Failed to start worker thread\n");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int worker_pool_submit(struct worker_pool *pool, int fd) {
+    if (conn_queue_push(&pool->queue, fd) < 0) {
+        atomic_fetch_add_explicit(&pool->rejected, 1, memory_order_relaxed);
+        return -1;
+    }
+    atomic_fetch_add_explicit(&pool->submitted, 1, memory_order_relaxed);
+    sem_post(&pool->items);
+    return 0;
+}
+
+size_t worker_pool_depth(struct worker_pool *pool) {
+    return conn_queue_depth(&pool->queue);
+}
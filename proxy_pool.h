@@ -0,0 +1,78 @@
+/*
+ * proxy_pool.h -- bounded worker pool fed by a lock-free queue of sockets.
+ *
+ * Accepted client sockets are pushed onto a fixed-size multi-producer,
+ * multi-consumer ring and picked up by a fixed set of pre-spawned worker
+ * threads. When the ring is full worker_pool_submit() fails immediately so
+ * the caller can shed the connection instead of creating more threads.
+ */
+
+#ifndef PROXY_POOL
+#define PROXY_POOL
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#define POOL_CACHELINE 64
+
+/* One ring slot. seq tells producers and consumers whose turn it is. */
+struct conn_slot {
+     atomic_size_t seq;
+     int fd;
+     uint64_t queued_at;          /* metrics_now() when pushed */
+};
+
+/*
+   Bounded MPMC ring of file descriptors. capacity is rounded up to a power
+   of two. The enqueue and dequeue positions live on separate cache lines so
+   acceptors and workers do not false-share.
+ */
+struct conn_queue {
+     struct conn_slot *slots;
+     size_t mask;
+     char pad0[POOL_CACHELINE];
+     atomic_size_t enqueue_pos;
+     char pad1[POOL_CACHELINE];
+     atomic_size_t dequeue_pos;
+     char pad2[POOL_CACHELINE];
+};
+
+int conn_queue_init(struct conn_queue *q, size_t capacity);
+void conn_queue_destroy(struct conn_queue *q);
+
+/*
+   Returns 0 on success or -1 if the queue is full (push) or empty (pop).
+   pop also returns when the socket was pushed in *queued_at.
+ */
+int conn_queue_push(struct conn_queue *q, int fd);
+int conn_queue_pop(struct conn_queue *q, int *fd, uint64_t *queued_at);
+
+/* Approximate number of queued sockets */
+size_t conn_queue_depth(struct conn_queue *q);
+
+struct worker_pool {
+     struct conn_queue queue;
+     sem_t items;                  /* counts sockets waiting in queue */
+     pthread_t *threads;
+     int nthreads;
+     void (*handler)(int fd);
+     atomic_ulong submitted;
+     atomic_ulong rejected;
+};
+
+/* Start nthreads workers that call handler for every submitted socket */
+int worker_pool_start(struct worker_pool *pool, int nthreads, size_t depth,
+		      void (*handler)(int fd));
+
+/*
+   Queue fd for the workers. Returns -1 without blocking when the queue is
+   full; the caller still owns fd in that case.
+ */
+int worker_pool_submit(struct worker_pool *pool, int fd);
+
+size_t worker_pool_depth(struct worker_pool *pool);
+
+#endif
@@ -0,0 +1,206 @@
+/*
+  proxy_relay.c -- zero-copy relay of response bodies between sockets.
+*/
+
+#define _GNU_SOURCE
+#include "proxy_relay.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+int relay_open(struct relay *r, const char *prefix, size_t prefix_len, int keep, size_t copy_max) {
+    r->pending = 0;
+    seg_buffer_init(&r->copy);
+    r->copy_pipe[0] = r->copy_pipe[1] = -1;
+    r->spill_dir = NULL;
+    r->spill_max = 0;
+    r->spill_fd = -1;
+    r->spilled = 0;
+    if (pipe2(r->pipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+        perror("pipe2 failed\n");
+        return -1;
+    }
+    r->keep = keep;
+    r->copy_max = copy_max;
+    if (keep && (pipe2(r->copy_pipe, O_NONBLOCK | O_CLOEXEC) < 0 ||
+                 seg_buffer_append(&r->copy, prefix, prefix_len) < 0)) {
+        perror("pipe2 failed\n");
+        relay_close(r);
+        return -1;
+    }
+    return 0;
+}
+
+/* Stop collecting the copy, e.g. because the body outgrew copy_max */
+static void relay_drop_copy(struct relay *r) {
+    if (r->copy_pipe[0] >= 0) {
+        close(r->copy_pipe[0]);
+        close(r->copy_pipe[1]);
+        r->copy_pipe[0] = r->copy_pipe[1] = -1;
+    }
+    if (r->spill_fd >= 0) {
+        close(r->spill_fd);
+        r->spill_fd = -1;
+    }
+    seg_buffer_free(&r->copy);
+    r->keep = 0;
+}
+
+void relay_close(struct relay *r) {
+    relay_drop_copy(r);
+    close(r->pipe[0]);
+    close(r->pipe[1]);
+}
+
+void relay_spill(struct relay *r, const char *dir, size_t max) {
+    r->spill_dir = dir;
+    r->spill_max = max;
+}
+
+int relay_take_spill(struct relay *r, size_t *len) {
+    int fd = r->spill_fd;
+    *len = r->spilled;
+    r->spill_fd = -1;
+    r->spilled = 0;
+    return fd;
+}
+
+/* Move the copy collected so far into a new unnamed file in spill_dir */
+static int relay_start_spill(struct relay *r) {
+    if (!r->spill_dir || r->copy.len > r->spill_max)
+        return -1;
+    r->spill_fd = open(r->spill_dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (r->spill_fd < 0)
+        return -1;
+    size_t done = 0;
+    while (done < r->copy.len) {
+        struct iovec iov[64];
+        int cnt = seg_buffer_iov(&r->copy, done, iov, 64);
+        ssize_t n = writev(r->spill_fd, iov, cnt);
+        if (n <= 0)
+            return -1;
+        done += n;
+    }
+    r->spilled = r->copy.len;
+    seg_buffer_free(&r->copy);
+    return 0;
+}
+
+/* Move the n bytes just tee()d into the copy pipe onto the end of the spill file */
+static int relay_take_spilled(struct relay *r, size_t n) {
+    while (n > 0) {
+        ssize_t got = splice(r->copy_pipe[0], NULL, r->spill_fd, NULL, n, SPLICE_F_MOVE);
+        if (got <= 0)
+            return -1;
+        r->spilled += got;
+        n -= got;
+    }
+    return 0;
+}
+
+/* Read the n bytes just tee()d into the copy pipe onto the end of the copy */
+static int relay_take_copy(struct relay *r, size_t n) {
+    while (n > 0) {
+        size_t avail;
+        char *dst = seg_buffer_reserve(&r->copy, &avail);
+        if (!dst)
+            return -1;
+        ssize_t got = read(r->copy_pipe[0], dst, n < avail ? n : avail);
+        if (got <= 0)
+            return -1;
+        seg_buffer_commit(&r->copy, got);
+        n -= got;
+    }
+    return 0;
+}
+
+/* Account for n bytes just put into the pipe and tee them into the copy */
+static void relay_copy(struct relay *r, size_t n) {
+    r->pending += n;
+    if (!r->keep)
+        return;
+    if (r->spill_fd < 0 && r->copy.len + n > r->copy_max && relay_start_spill(r) < 0) {
+        relay_drop_copy(r);
+    } else if (r->spill_fd >= 0) {
+        if (r->spilled + n > r->spill_max ||
+            tee(r->pipe[0], r->copy_pipe[1], n, SPLICE_F_NONBLOCK) != (ssize_t)n ||
+            relay_take_spilled(r, n) < 0)
+            relay_drop_copy(r);
+    } else if (tee(r->pipe[0], r->copy_pipe[1], n, SPLICE_F_NONBLOCK) != (ssize_t)n ||
+               relay_take_copy(r, n) < 0) {
+        relay_drop_copy(r);
+    }
+}
+
+static ssize_t relay_splice_in(struct relay *r, int from, size_t max) {
+    ssize_t n = splice(from, NULL, r->pipe[1], NULL, max, SPLICE_F_MOVE);
+    if (n > 0)
+        relay_copy(r, n);
+    return n;
+}
+
+ssize_t relay_fill(struct relay *r, int from) {
+    return relay_splice_in(r, from, RELAY_CHUNK);
+}
+
+/*
+   Take framing bytes off the socket: peek, let the framing decide how many
+   belong to the body, and read exactly those so nothing past the end of the
+   response is consumed. They reach the client through the same pipe.
+ */
+static ssize_t relay_framing(struct relay *r, int from, struct ResponseBody *body) {
+    char buf[RELAY_FRAMING_PEEK];
+    ssize_t n = recv(from, buf, sizeof(buf), MSG_PEEK);
+    if (n <= 0)
+        return n;
+    size_t used = ResponseBody_consume(body, buf, n);
+    if (used == 0)
+        return 0;
+    if (recv(from, buf, used, 0) != (ssize_t)used || write(r->pipe[1], buf, used) != (ssize_t)used) {
+        errno = EIO;
+        return -1;
+    }
+    relay_copy(r, used);
+    return used;
+}
+
+ssize_t relay_fill_body(struct relay *r, int from, struct ResponseBody *body) {
+    if (body->done)
+        return 0;
+    unsigned long long data = ResponseBody_dataLeft(body);
+    if (data == 0)
+        return relay_framing(r, from, body);
+
+    ssize_t n = relay_splice_in(r, from, data < RELAY_CHUNK ? data : RELAY_CHUNK);
+    if (n > 0)
+        ResponseBody_skipData(body, n);
+    return n;
+}
+
+int relay_drain(struct relay *r, int to) {
+    while (r->pending > 0) {
+        ssize_t n = splice(r->pipe[0], NULL, to, NULL, r->pending, SPLICE_F_MOVE);
+        if (n < 0)
+            return -1;
+        if (n == 0) {
+            errno = EPIPE;
+            return -1;
+        }
+        r->pending -= n;
+    }
+    return 0;
+}
+
+void relay_discard(struct relay *r) {
+    char scratch[4096];
+    while (r->pending > 0) {
+        ssize_t n = read(r->pipe[0], scratch, r->pending < sizeof(scratch) ? r->pending : sizeof(scratch));
+        if (n <= 0)
+            break;
+        r->pending -= n;
+    }
+}
@@ -0,0 +1,91 @@
+/*
+ * proxy_relay.h -- zero-copy relay of response bodies between sockets.
+ *
+ * A relay moves bytes from the upstream socket into a pipe and from the
+ * pipe to the client socket with splice(), so the body never enters user
+ * space. When the response is being cached, every chunk is also tee()d into
+ * a second pipe and read from there into the cache copy; that read is the
+ * only pass over the data in user space.
+ *
+ * The relay works with blocking and non-blocking sockets alike. It never
+ * reads from upstream while bytes are still pending in the pipe, so the
+ * pipes never fill and tee() always duplicates a whole chunk.
+ *
+ * relay_fill_body() stops at the end of the response instead of the end of
+ * the stream, so the upstream connection can carry another request. Body
+ * payload is spliced as usual; only chunk headers and trailers are read
+ * into user space, and they are written into the pipe in order.
+ *
+ * A copy that outgrows copy_max can spill into an anonymous file instead
+ * of being dropped: what was collected is written out, and from then on the
+ * tee()d chunks are spliced from the copy pipe into the file, so a large
+ * response reaches the disk cache tier without passing through user space.
+ */
+
+#ifndef PROXY_RELAY
+#define PROXY_RELAY
+
+#include <stddef.h>
+#include <sys/types.h>
+#include "proxy_buffer.h"
+#include "proxy_response.h"
+
+#define RELAY_CHUNK (64 * 1024)
+#define RELAY_FRAMING_PEEK 256   /* bytes examined per chunk header */
+
+struct relay {
+     int pipe[2];                 /* upstream -> client */
+     int copy_pipe[2];            /* tee()d copy, -1 when not keeping one */
+     size_t pending;              /* bytes in pipe not yet sent on */
+     int keep;                    /* copy is being collected */
+     struct seg_buffer copy;
+     size_t copy_max;
+     const char *spill_dir;       /* where to spill the copy, NULL if not to */
+     size_t spill_max;
+     int spill_fd;                /* the copy continues here, -1 until spilled */
+     size_t spilled;              /* bytes in spill_fd */
+};
+
+/*
+   Set up a relay. With keep set, the copy starts with the prefix_len bytes
+   at prefix (typically the response headers and the start of the body
+   read so far) and the relayed body is appended to it until it would
+   exceed copy_max. Returns 0, or -1 if the pipes cannot be created.
+ */
+int relay_open(struct relay *r, const char *prefix, size_t prefix_len, int keep, size_t copy_max);
+void relay_close(struct relay *r);
+
+/*
+   Let the copy spill into a file in dir once it exceeds copy_max, rather
+   than being dropped; it is then dropped once it would exceed max.
+ */
+void relay_spill(struct relay *r, const char *dir, size_t max);
+
+/*
+   Take the spill file of a finished copy, -1 if the copy did not spill.
+   Its length is returned in *len; the caller closes it.
+ */
+int relay_take_spill(struct relay *r, size_t *len);
+
+/*
+   Move up to RELAY_CHUNK bytes from the socket from into the pipe, teeing
+   them into the copy if one is kept. Must only be called with nothing
+   pending. Returns the byte count, 0 at end of stream, or -1 with errno
+   set (EAGAIN for a non-blocking socket with nothing to read).
+ */
+ssize_t relay_fill(struct relay *r, int from);
+
+/*
+   Like relay_fill(), but never reads past the end of the response body
+   described by body. Returns 0 once the body is complete or at end of
+   stream; body->done tells the two apart.
+ */
+ssize_t relay_fill_body(struct relay *r, int from, struct ResponseBody *body);
+
+/* Send the pending bytes to the socket to. Returns 0 once all are sent or -1. */
+int relay_drain(struct relay *r, int to);
+
+/* Throw the pending bytes away, as when the client has gone */
+void relay_discard(struct relay *r);
+
+#endif
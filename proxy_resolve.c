@@ -0,0 +1,630 @@
+/*
+  proxy_resolve.c -- caching, asynchronous host name resolver.
+*/
+
+#define _GNU_SOURCE
+#include "proxy_resolve.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/random.h>
+
+#define RESOLVER_BUCKETS 1024
+#define RESOLVER_MAX_ENTRIES 4096    /* looked up names kept; the oldest go first */
+#define RESOLVER_MAX_SEARCH 6        /* search domains used from resolv.conf */
+#define DNS_NAME_MAX 253
+#define DNS_MSG_MAX 1232             /* largest UDP answer accepted */
+
+#define DNS_TYPE_A 1
+#define DNS_TYPE_CNAME 5
+#define DNS_CLASS_IN 1
+#define DNS_RCODE_NXDOMAIN 3
+
+struct resolve_entry {
+    char *name;                  /* lowercase, without a trailing dot */
+    int pending;                 /* a resolver thread is looking it up */
+    int ok;
+    time_t expires;              /* 0 for hosts file entries, which never expire */
+    struct resolve_result res;
+    int *waiters;                /* eventfds to notify when the lookup completes */
+    int nwaiters;
+    int waiters_cap;
+    struct resolve_entry *next;        /* hash chain */
+    struct resolve_entry *queue_next;  /* lookups waiting for a resolver thread */
+    struct resolve_entry *age_prev;    /* looked up names, least recently resolved first */
+    struct resolve_entry *age_next;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+static struct resolve_entry *table[RESOLVER_BUCKETS];
+static size_t nentries;
+static size_t naged;             /* entries on the age list, i.e. not from the hosts file */
+static struct resolve_entry *age_head, *age_tail;
+static struct resolve_entry *queue_head, *queue_tail;
+
+static struct sockaddr_in servers[RESOLVER_MAX_SERVERS];
+static int nservers;
+static char *search[RESOLVER_MAX_SEARCH];
+static int nsearch;
+static int ndots = 1;
+
+static unsigned long stat_hits, stat_negative_hits, stat_coalesced, stat_queries, stat_failures;
+
+static unsigned bucket_of(const char *name) {
+    uint32_t h = 2166136261u;
+    for (const char *c = name; *c; c++) {
+        h ^= (unsigned char)*c;
+        h *= 16777619u;
+    }
+    return h % RESOLVER_BUCKETS;
+}
+
+/* Copy name into out lowercased and without a trailing dot. -1 if too long. */
+static int normalize_name(const char *name, char *out) {
+    size_t len = strlen(name);
+    if (len > 0 && name[len - 1] == '.')
+        len--;
+    if (len == 0 || len > DNS_NAME_MAX)
+        return -1;
+    for (size_t i = 0; i < len; i++)
+        out[i] = tolower((unsigned char)name[i]);
+    out[len] = '\0';
+    return 0;
+}
+
+static struct resolve_entry *entry_find(const char *name) {
+    for (struct resolve_entry *e = table[bucket_of(name)]; e; e = e->next) {
+        if (!strcmp(e->name, name))
+            return e;
+    }
+    return NULL;
+}
+
+static void entry_free(struct resolve_entry *e) {
+    free(e->name);
+    free(e->waiters);
+    free(e);
+}
+
+static void age_unlink(struct resolve_entry *e) {
+    if (e->age_prev)
+        e->age_prev->age_next = e->age_next;
+    else
+        age_head = e->age_next;
+    if (e->age_next)
+        e->age_next->age_prev = e->age_prev;
+    else
+        age_tail = e->age_prev;
+}
+
+static void age_append(struct resolve_entry *e) {
+    e->age_next = NULL;
+    e->age_prev = age_tail;
+    if (age_tail)
+        age_tail->age_next = e;
+    else
+        age_head = e;
+    age_tail = e;
+}
+
+/*
+   Make room for one more looked up name by dropping the least recently
+   resolved entry that is not pending. Lock held. Returns -1 if every entry
+   is pending.
+ */
+static int entry_evict(void) {
+    struct resolve_entry *e = age_head;
+    while (e && e->pending)
+        e = e->age_next;
+    if (!e)
+        return -1;
+    struct resolve_entry **link = table + bucket_of(e->name);
+    while (*link != e)
+        link = &(*link)->next;
+    *link = e->next;
+    age_unlink(e);
+    entry_free(e);
+    naged--;
+    nentries--;
+    return 0;
+}
+
+/* A new entry for name; hosts file entries are not counted against RESOLVER_MAX_ENTRIES. */
+static struct resolve_entry *entry_create(const char *name, int from_hosts) {
+    if (!from_hosts && naged >= RESOLVER_MAX_ENTRIES && entry_evict() < 0)
+        return NULL;
+    struct resolve_entry *e = (struct resolve_entry *)calloc(1, sizeof(struct resolve_entry));
+    if (!e)
+        return NULL;
+    e->name = strdup(name);
+    if (!e->name) {
+        free(e);
+        return NULL;
+    }
+    unsigned b = bucket_of(name);
+    e->next = table[b];
+    table[b] = e;
+    nentries++;
+    if (!from_hosts) {
+        age_append(e);
+        naged++;
+    }
+    return e;
+}
+
+static int entry_add_waiter(struct resolve_entry *e, int fd) {
+    if (e->nwaiters == e->waiters_cap) {
+        int cap = e->waiters_cap ? e->waiters_cap * 2 : 4;
+        int *waiters = (int *)realloc(e->waiters, cap * sizeof(int));
+        if (!waiters)
+            return -1;
+        e->waiters = waiters;
+        e->waiters_cap = cap;
+    }
+    e->waiters[e->nwaiters++] = fd;
+    return 0;
+}
+
+static int add_addr(struct resolve_result *res, struct in_addr addr) {
+    for (int i = 0; i < res->naddrs; i++) {
+        if (res->addrs[i].s_addr == addr.s_addr)
+            return 0;
+    }
+    if (res->naddrs == RESOLVER_MAX_ADDRS)
+        return -1;
+    res->addrs[res->naddrs++] = addr;
+    return 0;
+}
+
+/*
+   Look name (normalized) up with the lock held. waiting is set when called
+   again by a blocked resolver_lookup(), which is not counted twice.
+ */
+static int query_locked(const char *name, struct resolve_result *res, int notify_fd, int waiting) {
+    time_t now = time(NULL);
+    struct resolve_entry *e = entry_find(name);
+
+    if (e && !e->pending && (!e->expires || now < e->expires)) {
+        if (!waiting) {
+            if (e->ok)
+                stat_hits++;
+            else
+                stat_negative_hits++;
+        }
+        if (!e->ok)
+            return RESOLVE_FAILED;
+        *res = e->res;
+        return RESOLVE_OK;
+    }
+    if (e && e->pending) {
+        if (!waiting)
+            stat_coalesced++;
+    } else {
+        if (!e && !(e = entry_create(name, 0)))
+            return RESOLVE_FAILED;
+        /* new or expired: queue a lookup */
+        e->pending = 1;
+        e->queue_next = NULL;
+        if (queue_tail)
+            queue_tail->queue_next = e;
+        else
+            queue_head = e;
+        queue_tail = e;
+        stat_queries++;
+        pthread_cond_signal(&work_cond);
+    }
+    if (notify_fd >= 0 && entry_add_waiter(e, notify_fd) < 0)
+        return RESOLVE_FAILED;
+    return RESOLVE_PENDING;
+}
+
+int resolver_query(const char *name, struct resolve_result *res, int notify_fd) {
+    char key[DNS_NAME_MAX + 1];
+    struct in_addr addr;
+
+    if (inet_aton(name, &addr)) {
+        res->naddrs = 1;
+        res->addrs[0] = addr;
+        return RESOLVE_OK;
+    }
+    if (normalize_name(name, key) < 0)
+        return RESOLVE_FAILED;
+
+    pthread_mutex_lock(&lock);
+    int ret = query_locked(key, res, notify_fd, 0);
+    pthread_mutex_unlock(&lock);
+    return ret;
+}
+
+int resolver_lookup(const char *name, struct resolve_result *res) {
+    char key[DNS_NAME_MAX + 1];
+    struct in_addr addr;
+
+    if (inet_aton(name, &addr)) {
+        res->naddrs = 1;
+        res->addrs[0] = addr;
+        return 0;
+    }
+    if (normalize_name(name, key) < 0)
+        return -1;
+
+    pthread_mutex_lock(&lock);
+    int ret = query_locked(key, res, -1, 0);
+    while (ret == RESOLVE_PENDING) {
+        pthread_cond_wait(&done_cond, &lock);
+        ret = query_locked(key, res, -1, 1);
+    }
+    pthread_mutex_unlock(&lock);
+    return ret == RESOLVE_OK ? 0 : -1;
+}
+
+void resolver_stats(struct resolver_stats *st) {
+    pthread_mutex_lock(&lock);
+    st->entries = nentries;
+    st->hits = stat_hits;
+    st->negative_hits = stat_negative_hits;
+    st->coalesced = stat_coalesced;
+    st->queries = stat_queries;
+    st->failures = stat_failures;
+    pthread_mutex_unlock(&lock);
+}
+
+/*
+  DNS over UDP
+*/
+
+/* Skip the possibly compressed name at pos. Returns the position after it or -1. */
+static long dns_skip_name(const unsigned char *msg, size_t len, size_t pos) {
+    while (pos < len) {
+        unsigned char c = msg[pos];
+        if (c == 0)
+            return pos + 1;
+        if ((c & 0xC0) == 0xC0)
+            return pos + 2 <= len ? (long)pos + 2 : -1;
+        if (c & 0xC0)
+            return -1;
+        pos += c + 1;
+    }
+    return -1;
+}
+
+static size_t dns_build_query(unsigned char *msg, uint16_t id, const char *name) {
+    memset(msg, 0, 12);
+    msg[0] = id >> 8;
+    msg[1] = id & 0xFF;
+    msg[2] = 0x01;               /* recursion desired */
+    msg[5] = 1;                  /* one question */
+
+    size_t pos = 12;
+    const char *label = name;
+    while (*label) {
+        size_t n = strcspn(label, ".");
+        if (n == 0 || n > 63)
+            return 0;
+        msg[pos++] = n;
+        memcpy(msg + pos, label, n);
+        pos += n;
+        label += n;
+        if (*label == '.')
+            label++;
+    }
+    msg[pos++] = 0;
+    msg[pos++] = 0;
+    msg[pos++] = DNS_TYPE_A;
+    msg[pos++] = 0;
+    msg[pos++] = DNS_CLASS_IN;
+    return pos;
+}
+
+/*
+   Parse the answer to query id. Returns 1 with the A records in res and
+   their smallest TTL in *ttl, 0 if the name does not exist or has no
+   address, and -1 if the server gave no usable answer.
+ */
+static int dns_parse_answer(const unsigned char *msg, size_t len, struct resolve_result *res, int *ttl) {
+    int rcode = msg[3] & 0x0F;
+    int truncated = msg[2] & 0x02;
+    if (rcode == DNS_RCODE_NXDOMAIN)
+        return 0;
+    if (rcode != 0)
+        return -1;
+
+    int qdcount = (msg[4] << 8) | msg[5];
+    int ancount = (msg[6] << 8) | msg[7];
+    long pos = 12;
+    for (int i = 0; i < qdcount && pos >= 0; i++) {
+        pos = dns_skip_name(msg, len, pos);
+        if (pos >= 0)
+            pos += 4;
+    }
+
+    res->naddrs = 0;
+    *ttl = RESOLVER_MAX_TTL;
+    for (int i = 0; i < ancount; i++) {
+        if (pos < 0 || (pos = dns_skip_name(msg, len, pos)) < 0 || (size_t)pos + 10 > len)
+            return -1;
+        const unsigned char *rr = msg + pos;
+        int type = (rr[0] << 8) | rr[1];
+        int class = (rr[2] << 8) | rr[3];
+        uint32_t rr_ttl = ((uint32_t)rr[4] << 24) | (rr[5] << 16) | (rr[6] << 8) | rr[7];
+        int rdlength = (rr[8] << 8) | rr[9];
+        pos += 10;
+        if ((size_t)pos + rdlength > len)
+            return -1;
+        if (class == DNS_CLASS_IN && (type == DNS_TYPE_A || type == DNS_TYPE_CNAME) && rr_ttl < (uint32_t)*ttl)
+            *ttl = rr_ttl;
+        if (class == DNS_CLASS_IN && type == DNS_TYPE_A && rdlength == 4) {
+            struct in_addr addr;
+            memcpy(&addr, msg + pos, 4);
+            add_addr(res, addr);
+        }
+        pos += rdlength;
+    }
+    if (res->naddrs == 0)
+        return truncated ? -1 : 0;
+    return 1;
+}
+
+/* Ask server for the A records of name, retrying on timeout. Same results as dns_parse_answer(). */
+static int dns_query(const struct sockaddr_in *server, const char *name, struct resolve_result *res, int *ttl) {
+    unsigned char query[DNS_NAME_MAX + 18], answer[DNS_MSG_MAX];
+    uint16_t id;
+    if (getrandom(&id, sizeof(id), 0) != sizeof(id))
+        id = (uint16_t)(time(NULL) ^ (uintptr_t)&id);
+    size_t qlen = dns_build_query(query, id, name);
+    if (!qlen)
+        return 0;
+
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("Error in Creating Socket.\n");
+        return -1;
+    }
+    /* a connected socket only receives datagrams from the server */
+    if (connect(fd, (const struct sockaddr *)server, sizeof(*server)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    int ret = -1;
+    for (int attempt = 0; attempt < RESOLVER_TRIES && ret < 0; attempt++) {
+        if (send(fd, query, qlen, 0) != (ssize_t)qlen)
+            break;
+        struct pollfd pfd;
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        while (poll(&pfd, 1, RESOLVER_TIMEOUT_MS) > 0) {
+            ssize_t n = recv(fd, answer, sizeof(answer), 0);
+            if (n < 0)
+                break;
+            /* ignore anything that is not the answer to this query */
+            if (n < 12 || answer[0] != (id >> 8) || answer[1] != (id & 0xFF) || !(answer[2] & 0x80))
+                continue;
+            ret = dns_parse_answer(answer, n, res, ttl);
+            break;
+        }
+        if (ret < 0 && errno == ECONNREFUSED)
+            break;
+    }
+    close(fd);
+    return ret;
+}
+
+static int resolve_getaddrinfo(const char *name, struct resolve_result *res) {
+    struct addrinfo hints, *list;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(name, NULL, &hints, &list) != 0)
+        return 0;
+    res->naddrs = 0;
+    for (struct addrinfo *ai = list; ai; ai = ai->ai_next)
+        add_addr(res, ((struct sockaddr_in *)ai->ai_addr)->sin_addr);
+    freeaddrinfo(list);
+    return res->naddrs > 0;
+}
+
+/* Look name up as given, failing over between the nameservers. Returns 1 or 0. */
+static int resolve_absolute(const char *name, struct resolve_result *res, int *ttl) {
+    for (int i = 0; i < nservers; i++) {
+        int ret = dns_query(servers + i, name, res, ttl);
+        if (ret >= 0)
+            return ret;
+    }
+    return 0;
+}
+
+/*
+   Resolve name as the system resolver would: a name with at least ndots
+   dots is tried as given before the search domains are appended to it,
+   any other after them. Returns 1 or 0.
+ */
+static int resolve_name(const char *name, struct resolve_result *res, int *ttl) {
+    if (!nservers) {
+        *ttl = RESOLVER_DEFAULT_TTL;
+        return resolve_getaddrinfo(name, res);
+    }
+    int dots = 0;
+    for (const char *c = name; *c; c++)
+        dots += *c == '.';
+    if (dots >= ndots && resolve_absolute(name, res, ttl))
+        return 1;
+
+    char qualified[DNS_NAME_MAX + 1];
+    size_t len = strlen(name);
+    for (int i = 0; i < nsearch; i++) {
+        size_t slen = strlen(search[i]);
+        if (len + 1 + slen > DNS_NAME_MAX)
+            continue;
+        memcpy(qualified, name, len);
+        qualified[len] = '.';
+        memcpy(qualified + len + 1, search[i], slen + 1);
+        if (resolve_absolute(qualified, res, ttl))
+            return 1;
+    }
+    return dots < ndots && resolve_absolute(name, res, ttl);
+}
+
+static void *resolver_fn(void *arg) {
+    pthread_mutex_lock(&lock);
+    while (1) {
+        while (!queue_head)
+            pthread_cond_wait(&work_cond, &lock);
+        struct resolve_entry *e = queue_head;
+        queue_head = e->queue_next;
+        if (!queue_head)
+            queue_tail = NULL;
+        /* pending entries are never freed, so e->name stays valid unlocked */
+        pthread_mutex_unlock(&lock);
+
+        struct resolve_result res;
+        int ttl = RESOLVER_NEGATIVE_TTL;
+        int ok = resolve_name(e->name, &res, &ttl);
+        if (!ok)
+            ttl = RESOLVER_NEGATIVE_TTL;
+        else if (ttl < RESOLVER_MIN_TTL)
+            ttl = RESOLVER_MIN_TTL;
+
+        pthread_mutex_lock(&lock);
+        e->ok = ok;
+        if (ok)
+            e->res = res;
+        else
+            stat_failures++;
+        e->expires = time(NULL) + ttl;
+        e->pending = 0;
+        age_unlink(e);
+        age_append(e);
+        uint64_t one = 1;
+        for (int i = 0; i < e->nwaiters; i++) {
+            if (write(e->waiters[i], &one, sizeof(one)) < 0)
+                perror("eventfd write failed\n");
+        }
+        e->nwaiters = 0;
+        pthread_cond_broadcast(&done_cond);
+    }
+    return NULL;
+}
+
+/* Parse "address[:port]" into addr. Returns 0 or -1. */
+static int parse_server(const char *spec, struct sockaddr_in *addr) {
+    char host[INET_ADDRSTRLEN];
+    const char *colon = strchr(spec, ':');
+    size_t len = colon ? (size_t)(colon - spec) : strlen(spec);
+    if (len >= sizeof(host))
+        return -1;
+    memcpy(host, spec, len);
+    host[len] = '\0';
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_port = htons(colon ? atoi(colon + 1) : 53);
+    return inet_aton(host, &addr->sin_addr) ? 0 : -1;
+}
+
+/* Replace the search list with the domains on a search or domain line */
+static void set_search(char *domains) {
+    char key[DNS_NAME_MAX + 1];
+    while (nsearch > 0)
+        free(search[--nsearch]);
+    char *save;
+    for (char *d = strtok_r(domains, " \t\n", &save); d && nsearch < RESOLVER_MAX_SEARCH;
+         d = strtok_r(NULL, " \t\n", &save)) {
+        if (normalize_name(d, key) == 0 && (search[nsearch] = strdup(key)))
+            nsearch++;
+    }
+}
+
+/* Take search domains, ndots and, if want_servers, the nameservers from resolv.conf */
+static void load_resolv_conf(int want_servers) {
+    FILE *f = fopen(DEFAULT_RESOLV_CONF, "r");
+    if (!f)
+        return;
+    char line[1024], server[64];
+    while (fgets(line, sizeof(line), f)) {
+        char *p = line + strspn(line, " \t");
+        if (!strncmp(p, "search", 6) && isspace((unsigned char)p[6])) {
+            set_search(p + 6);
+        } else if (!strncmp(p, "domain", 6) && isspace((unsigned char)p[6])) {
+            set_search(p + 6);
+        } else if (!strncmp(p, "options", 7) && isspace((unsigned char)p[7])) {
+            char *opt = strstr(p, "ndots:");
+            if (opt) {
+                ndots = atoi(opt + 6);
+                if (ndots < 0)
+                    ndots = 0;
+                else if (ndots > 15)
+                    ndots = 15;
+            }
+        } else if (want_servers && nservers < RESOLVER_MAX_SERVERS &&
+                   sscanf(p, "nameserver %63s", server) == 1 && parse_server(server, servers + nservers) == 0) {
+            nservers++;
+        }
+    }
+    fclose(f);
+}
+
+/* Add every IPv4 line of the hosts file as never-expiring entries */
+static int load_hosts(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        perror("Cannot open hosts file\n");
+        return -1;
+    }
+    char line[1024], key[DNS_NAME_MAX + 1];
+    while (fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "#\n")] = '\0';
+        char *save;
+        char *field = strtok_r(line, " \t", &save);
+        struct in_addr addr;
+        if (!field || !inet_aton(field, &addr))
+            continue;
+        while ((field = strtok_r(NULL, " \t", &save))) {
+            if (normalize_name(field, key) < 0)
+                continue;
+            struct resolve_entry *e = entry_find(key);
+            if (!e && !(e = entry_create(key, 1)))
+                break;
+            e->ok = 1;
+            e->expires = 0;
+            add_addr(&e->res, addr);
+        }
+    }
+    fclose(f);
+    return 0;
+}
+
+int resolver_init(const char *hosts_file, char **server_specs, int nspecs) {
+    for (int i = 0; i < nspecs && nservers < RESOLVER_MAX_SERVERS; i++) {
+        if (parse_server(server_specs[i], servers + nservers) < 0) {
+            fprintf(stderr, "Invalid nameserver: %s\n", server_specs[i]);
+            return -1;
+        }
+        nservers++;
+    }
+    load_resolv_conf(!nspecs);
+    if (hosts_file && load_hosts(hosts_file) < 0)
+        return -1;
+
+    for (int i = 0; i < RESOLVER_THREADS; i++) {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, resolver_fn, NULL) != 0) {
+            perror("Failed to start resolver thread\n");
+            return -1;
+        }
+        pthread_detach(tid);
+    }
+    return 0;
+}
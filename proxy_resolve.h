@@ -0,0 +1,75 @@
+/*
+ * proxy_resolve.h -- caching, asynchronous host name resolver.
+ *
+ * Names are looked up in a hosts file first and otherwise sent as DNS
+ * queries over UDP to the configured nameservers by a few resolver threads,
+ * never by the thread serving the request, with the search domains of
+ * resolv.conf applied as the system resolver would. Answers are cached for their TTL
+ * and failures for a short time, shared by all workers and event loops.
+ * Concurrent lookups of a name that is being resolved wait for the one
+ * query in flight instead of sending their own. Every IPv4 address of a
+ * name is returned so that connecting can fail over between them.
+ */
+
+#ifndef PROXY_RESOLVE
+#define PROXY_RESOLVE
+
+#include <netinet/in.h>
+
+#define RESOLVER_MAX_ADDRS 8
+#define RESOLVER_MAX_SERVERS 4
+#define RESOLVER_THREADS 2
+#define RESOLVER_TIMEOUT_MS 1000     /* per query and nameserver */
+#define RESOLVER_TRIES 2             /* queries per nameserver */
+#define RESOLVER_MIN_TTL 1
+#define RESOLVER_MAX_TTL 3600
+#define RESOLVER_NEGATIVE_TTL 5      /* seconds a failed lookup is remembered */
+#define RESOLVER_DEFAULT_TTL 60      /* for answers from getaddrinfo() */
+#define DEFAULT_HOSTS_FILE "/etc/hosts"
+#define DEFAULT_RESOLV_CONF "/etc/resolv.conf"
+
+/* resolver_query() results */
+enum {
+    RESOLVE_FAILED = -1,
+    RESOLVE_PENDING = 0,
+    RESOLVE_OK = 1
+};
+
+struct resolve_result {
+     int naddrs;
+     struct in_addr addrs[RESOLVER_MAX_ADDRS];
+};
+
+struct resolver_stats {
+     size_t entries;
+     unsigned long hits;          /* answered from the cache or hosts file */
+     unsigned long negative_hits; /* answered by a cached failure */
+     unsigned long coalesced;     /* joined a lookup already in flight */
+     unsigned long queries;       /* lookups handed to the resolver threads */
+     unsigned long failures;      /* of those, names that did not resolve */
+};
+
+/*
+   Load hosts_file (NULL for none) and use the nameservers given as
+   "address[:port]" strings, or those in /etc/resolv.conf if there are
+   none. Without any nameserver, names not in the hosts file are resolved
+   with getaddrinfo() and cached for RESOLVER_DEFAULT_TTL. Starts the
+   resolver threads. Returns 0 or -1.
+ */
+int resolver_init(const char *hosts_file, char **servers, int nservers);
+
+/*
+   Non-blocking lookup. Returns RESOLVE_OK with res filled in from the
+   cache, RESOLVE_FAILED if the name is known not to resolve, or
+   RESOLVE_PENDING while a query is in flight; then 1 is added to the
+   eventfd notify_fd, if not -1, once it completes and the name should be
+   queried again.
+ */
+int resolver_query(const char *name, struct resolve_result *res, int notify_fd);
+
+/* Blocking lookup: waits for a pending query. Returns 0 or -1. */
+int resolver_lookup(const char *name, struct resolve_result *res);
+
+void resolver_stats(struct resolver_stats *st);
+
+#endif
@@ -0,0 +1,503 @@
+/*
+  proxy_response.c -- parsing of upstream HTTP responses and the HTTP
+  caching rules the proxy applies to them as a shared cache.
+*/
+
+#define _GNU_SOURCE
+#include "proxy_response.h"
+#include <strings.h>
+#include <ctype.h>
+
+#define DEFAULT_NHDRS 8
+#define HEURISTIC_MAX_LIFETIME 86400   /* cap for Last-Modified heuristics */
+#define MAX_CHUNK_SIZE_DIGITS 16       /* hex digits of a chunk size that fit 64 bits */
+
+size_t ParsedResponse_headerEnd(const char *buf, size_t buflen) {
+    const char *end = memmem(buf, buflen, "\r\n\r\n", 4);
+    return end ? (size_t)(end - buf) + 4 : 0;
+}
+
+struct ParsedResponse* ParsedResponse_create() {
+    struct ParsedResponse *pr = (struct ParsedResponse *)calloc(1, sizeof(struct ParsedResponse));
+    if (pr) {
+        pr->headers = (struct ParsedHeader *)malloc(sizeof(struct ParsedHeader) * DEFAULT_NHDRS);
+        pr->headerslen = pr->headers ? DEFAULT_NHDRS : 0;
+    }
+    return pr;
+}
+
+void ParsedResponse_destroy(struct ParsedResponse *pr) {
+    free(pr->buf);
+    free(pr->headers);
+    free(pr);
+}
+
+static int ParsedResponse_append(struct ParsedResponse *pr, char *key, char *value) {
+    if (pr->headersused == pr->headerslen) {
+        size_t len = pr->headerslen ? pr->headerslen * 2 : DEFAULT_NHDRS;
+        struct ParsedHeader *headers = (struct ParsedHeader *)realloc(pr->headers, len * sizeof(struct ParsedHeader));
+        if (!headers)
+            return -1;
+        pr->headers = headers;
+        pr->headerslen = len;
+    }
+    struct ParsedHeader *ph = pr->headers + pr->headersused++;
+    ph->key = key;
+    ph->keylen = strlen(key) + 1;
+    ph->value = value;
+    ph->valuelen = strlen(value) + 1;
+    return 0;
+}
+
+int ParsedResponse_parse(struct ParsedResponse *pr, const char *buf, size_t buflen) {
+    if (pr->buf) {
+        debug("parse object already assigned to a response\n");
+        return -1;
+    }
+    size_t len = ParsedResponse_headerEnd(buf, buflen);
+    if (!len) {
+        debug("incomplete response header\n");
+        return -1;
+    }
+
+    /* fields are handled as strings, which a NUL would cut short */
+    if (memchr(buf, '\0', len)) {
+        debug("NUL in response header\n");
+        return -1;
+    }
+
+    pr->buf = (char *)malloc(len + 1);
+    if (!pr->buf)
+        return -1;
+    memcpy(pr->buf, buf, len);
+    pr->buf[len] = '\0';
+    pr->header_len = len;
+
+    char *last = pr->buf + len - 2;
+    char *eol = memmem(pr->buf, len, "\r\n", 2);
+    if (!eol || eol >= last) {
+        debug("invalid status line\n");
+        return -1;
+    }
+    *eol = '\0';
+    char *sp = strchr(pr->buf, ' ');
+    if (!sp || strncmp(pr->buf, "HTTP/", 5)) {
+        debug("invalid status line: %s\n", pr->buf);
+        return -1;
+    }
+    *sp = '\0';
+    pr->version = pr->buf;
+
+    char *end;
+    pr->status = strtol(sp + 1, &end, 10);
+    if (end == sp + 1 || pr->status < 100 || pr->status > 999) {
+        debug("invalid status code\n");
+        return -1;
+    }
+    while (*end == ' ')
+        end++;
+    pr->reason = end;
+
+    char *line = eol + 2;
+    while (line < last) {
+        eol = memmem(line, last + 2 - line, "\r\n", 2);
+        if (!eol) {
+            debug("unterminated response header line\n");
+            return -1;
+        }
+        *eol = '\0';
+        char *colon = strchr(line, ':');
+        if (colon) {
+            *colon = '\0';
+            char *value = colon + 1;
+            while (*value == ' ' || *value == '\t')
+                value++;
+            char *tail = colon;
+            while (tail > line && (tail[-1] == ' ' || tail[-1] == '\t'))
+                *--tail = '\0';
+            tail = eol;
+            while (tail > value && (tail[-1] == ' ' || tail[-1] == '\t'))
+                *--tail = '\0';
+            if (ParsedResponse_append(pr, line, value) < 0)
+                return -1;
+        }
+        line = eol + 2;
+    }
+    return 0;
+}
+
+size_t ParsedResponse_totalLen(struct ParsedResponse *pr) {
+    size_t len = strlen(pr->version) + 1 + 3 + 1 + strlen(pr->reason) + 2;
+    for (size_t i = 0; i < pr->headersused; i++)
+        len += strlen(pr->headers[i].key) + 2 + strlen(pr->headers[i].value) + 2;
+    return len + 2;
+}
+
+int ParsedResponse_unparse(struct ParsedResponse *pr, char *buf, size_t buflen) {
+    if (buflen < ParsedResponse_totalLen(pr))
+        return -1;
+    char *p = buf + sprintf(buf, "%s %03d %s\r\n", pr->version, pr->status, pr->reason);
+    for (size_t i = 0; i < pr->headersused; i++) {
+        struct ParsedHeader *ph = pr->headers + i;
+        size_t keylen = strlen(ph->key), valuelen = strlen(ph->value);
+        memcpy(p, ph->key, keylen);
+        p += keylen;
+        memcpy(p, ": ", 2);
+        p += 2;
+        memcpy(p, ph->value, valuelen);
+        p += valuelen;
+        memcpy(p, "\r\n", 2);
+        p += 2;
+    }
+    memcpy(p, "\r\n", 2);
+    return 0;
+}
+
+struct ParsedHeader* ParsedResponse_get(struct ParsedResponse *pr, const char *key) {
+    for (size_t i = 0; i < pr->headersused; i++) {
+        if (!strcasecmp(pr->headers[i].key, key))
+            return pr->headers + i;
+    }
+    return NULL;
+}
+
+int ParsedResponse_merge(struct ParsedResponse *pr, struct ParsedResponse *update) {
+    for (size_t i = 0; i < update->headersused; i++) {
+        struct ParsedHeader *uh = update->headers + i;
+        if (!strcasecmp(uh->key, "Content-Length"))
+            continue;
+        struct ParsedHeader *ph = ParsedResponse_get(pr, uh->key);
+        if (ph) {
+            *ph = *uh;
+        } else if (ParsedResponse_append(pr, uh->key, uh->value) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int ParsedResponse_vary(struct ParsedResponse *pr, char *out, size_t outlen) {
+    size_t n = 0;
+
+    for (size_t i = 0; i < pr->headersused; i++) {
+        struct ParsedHeader *ph = pr->headers + i;
+        if (strcasecmp(ph->key, "Vary"))
+            continue;
+        for (const char *c = ph->value; *c; c++) {
+            if (*c == ' ' || *c == '\t')
+                continue;
+            if (*c == '*' || n + 2 >= outlen)
+                return -1;
+            if (*c == ',' && (n == 0 || out[n - 1] == ','))
+                continue;
+            out[n++] = tolower((unsigned char)*c);
+        }
+        if (n > 0 && out[n - 1] != ',')
+            out[n++] = ',';
+    }
+    while (n > 0 && out[n - 1] == ',')
+        n--;
+    out[n] = '\0';
+    return n > 0;
+}
+
+int ParsedResponse_keepAlive(struct ParsedResponse *pr) {
+    int keep_alive = !strcmp(pr->version, "HTTP/1.1");
+    for (size_t i = 0; i < pr->headersused; i++) {
+        if (strcasecmp(pr->headers[i].key, "Connection"))
+            continue;
+        if (strcasestr(pr->headers[i].value, "close"))
+            return 0;
+        if (strcasestr(pr->headers[i].value, "keep-alive"))
+            keep_alive = 1;
+    }
+    return keep_alive;
+}
+
+/*
+  Body framing
+*/
+
+/* States of the chunked decoder */
+enum {
+    CHUNK_SIZE,          /* hex digits of the chunk size */
+    CHUNK_EXT,           /* chunk extensions up to the end of the size line */
+    CHUNK_DATA,
+    CHUNK_DATA_END,      /* CRLF after the chunk data */
+    CHUNK_TRAILER_START, /* start of a trailer line, or the final CRLF */
+    CHUNK_TRAILER        /* rest of a trailer line */
+};
+
+void ResponseBody_init(struct ResponseBody *body, struct ParsedResponse *pr) {
+    memset(body, 0, sizeof(*body));
+    body->framing = BODY_UNTIL_CLOSE;
+
+    if ((pr->status >= 100 && pr->status < 200) || pr->status == 204 || pr->status == 304) {
+        body->framing = BODY_LENGTH;
+        body->done = 1;
+        return;
+    }
+    struct ParsedHeader *te = ParsedResponse_get(pr, "Transfer-Encoding");
+    if (te) {
+        if (strcasestr(te->value, "chunked")) {
+            body->framing = BODY_CHUNKED;
+            body->state = CHUNK_SIZE;
+        }
+        return;
+    }
+    struct ParsedHeader *length = ParsedResponse_get(pr, "Content-Length");
+    if (length) {
+        /* strtoull() would take a sign, and ignore what follows the digits */
+        const char *p = length->value;
+        unsigned long long value = 0;
+        for (; *p >= '0' && *p <= '9'; p++) {
+            if (value > (~0ULL - (*p - '0')) / 10)
+                break;
+            value = value * 10 + (*p - '0');
+        }
+        if (p == length->value || *p) {
+            body->error = 1;
+            return;
+        }
+        body->remaining = value;
+        body->framing = BODY_LENGTH;
+        body->done = body->remaining == 0;
+    }
+}
+
+/* The chunked encoding cannot be followed; read the rest up to the close */
+static size_t chunked_error(struct ResponseBody *body, size_t len) {
+    body->error = 1;
+    body->framing = BODY_UNTIL_CLOSE;
+    return len;
+}
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+static size_t chunked_consume(struct ResponseBody *body, const char *data, size_t len) {
+    size_t i = 0;
+    while (i < len && !body->done) {
+        char c = data[i];
+        switch (body->state) {
+            case CHUNK_SIZE:
+                if (hex_value(c) >= 0) {
+                    if (body->size_digits++ == MAX_CHUNK_SIZE_DIGITS)
+                        return chunked_error(body, len);
+                    body->remaining = body->remaining * 16 + hex_value(c);
+                    i++;
+                    continue;
+                }
+                /* an empty size would otherwise read as the last chunk */
+                if (!body->size_digits)
+                    return chunked_error(body, len);
+                body->state = CHUNK_EXT;
+                continue;
+            case CHUNK_EXT:
+                i++;
+                if (c == '\n')
+                    body->state = body->remaining ? CHUNK_DATA : CHUNK_TRAILER_START;
+                continue;
+            case CHUNK_DATA: {
+                size_t n = len - i < body->remaining ? len - i : body->remaining;
+                body->remaining -= n;
+                i += n;
+                if (!body->remaining)
+                    body->state = CHUNK_DATA_END;
+                continue;
+            }
+            case CHUNK_DATA_END:
+                i++;
+                if (c == '\n') {
+                    body->state = CHUNK_SIZE;
+                    body->size_digits = 0;
+                } else if (c != '\r') {
+                    return chunked_error(body, len);
+                }
+                continue;
+            case CHUNK_TRAILER_START:
+                i++;
+                if (c == '\n')
+                    body->done = 1;
+                else if (c != '\r')
+                    body->state = CHUNK_TRAILER;
+                continue;
+            case CHUNK_TRAILER:
+                i++;
+                if (c == '\n')
+                    body->state = CHUNK_TRAILER_START;
+                continue;
+        }
+    }
+    return i;
+}
+
+size_t ResponseBody_consume(struct ResponseBody *body, const char *data, size_t len) {
+    if (body->done)
+        return 0;
+    switch (body->framing) {
+        case BODY_LENGTH: {
+            size_t n = len < body->remaining ? len : body->remaining;
+            body->remaining -= n;
+            body->done = body->remaining == 0;
+            return n;
+        }
+        case BODY_CHUNKED:
+            return chunked_consume(body, data, len);
+        default:
+            return len;
+    }
+}
+
+unsigned long long ResponseBody_dataLeft(struct ResponseBody *body) {
+    if (body->done)
+        return 0;
+    if (body->framing == BODY_UNTIL_CLOSE)
+        return ~0ULL;
+    if (body->framing == BODY_CHUNKED && body->state != CHUNK_DATA)
+        return 0;
+    return body->remaining;
+}
+
+void ResponseBody_skipData(struct ResponseBody *body, size_t n) {
+    if (body->framing == BODY_UNTIL_CLOSE)
+        return;
+    body->remaining -= n;
+    if (body->framing == BODY_LENGTH)
+        body->done = body->remaining == 0;
+    else if (!body->remaining)
+        body->state = CHUNK_DATA_END;
+}
+
+/*
+  Caching rules
+*/
+
+void CacheControl_parse(const char *value, struct CacheControl *cc) {
+    const char *p = value;
+    while (*p) {
+        while (*p == ' ' || *p == '\t' || *p == ',')
+            p++;
+        size_t n = strcspn(p, "=,");
+        const char *arg = p[n] == '=' ? p + n + 1 : NULL;
+
+        if (n == 8 && !strncasecmp(p, "no-store", n)) {
+            cc->no_store = 1;
+        } else if (n == 8 && !strncasecmp(p, "no-cache", n)) {
+            cc->no_cache = 1;
+        } else if (n == 7 && !strncasecmp(p, "private", n)) {
+            cc->is_private = 1;
+        } else if (n == 15 && !strncasecmp(p, "must-revalidate", n)) {
+            cc->must_revalidate = 1;
+        } else if (n == 6 && !strncasecmp(p, "public", n)) {
+            cc->is_public = 1;
+        } else if (n == 7 && !strncasecmp(p, "max-age", n) && arg) {
+            cc->max_age = strtol(arg + (*arg == '"'), NULL, 10);
+        } else if (n == 8 && !strncasecmp(p, "s-maxage", n) && arg) {
+            cc->s_maxage = strtol(arg + (*arg == '"'), NULL, 10);
+        }
+
+        p += n;
+        if (*p == '=') {
+            p++;
+            if (*p == '"') {
+                const char *q = strchr(p + 1, '"');
+                p = q ? q + 1 : p + strlen(p);
+            }
+            p += strcspn(p, ",");
+        }
+    }
+}
+
+time_t parse_http_date(const char *value) {
+    static const char *formats[] = {
+        "%a, %d %b %Y %H:%M:%S GMT",    /* IMF-fixdate */
+        "%A, %d-%b-%y %H:%M:%S GMT",    /* RFC 850 */
+        "%a %b %e %H:%M:%S %Y"          /* asctime */
+    };
+    for (size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+        struct tm tm;
+        memset(&tm, 0, sizeof(tm));
+        const char *end = strptime(value, formats[i], &tm);
+        if (end && *end == '\0')
+            return timegm(&tm);
+    }
+    return -1;
+}
+
+/* Status codes a cache may store without explicit freshness information */
+static int heuristically_cacheable(int status) {
+    switch (status) {
+        case 200: case 203: case 204: case 300: case 301: case 308:
+        case 404: case 405: case 410: case 414: case 501:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+void ParsedResponse_freshness(struct ParsedResponse *pr, time_t request_time,
+                              time_t response_time, struct ResponseFreshness *f) {
+    struct CacheControl cc = {0, 0, 0, 0, 0, -1, -1};
+    int have_cc = 0;
+    for (size_t i = 0; i < pr->headersused; i++) {
+        if (!strcasecmp(pr->headers[i].key, "Cache-Control")) {
+            CacheControl_parse(pr->headers[i].value, &cc);
+            have_cc = 1;
+        }
+    }
+    struct ParsedHeader *pragma = ParsedResponse_get(pr, "Pragma");
+    if (!have_cc && pragma && strcasestr(pragma->value, "no-cache"))
+        cc.no_cache = 1;
+
+    struct ParsedHeader *expires = ParsedResponse_get(pr, "Expires");
+    struct ParsedHeader *date = ParsedResponse_get(pr, "Date");
+    struct ParsedHeader *last_modified = ParsedResponse_get(pr, "Last-Modified");
+    struct ParsedHeader *age = ParsedResponse_get(pr, "Age");
+
+    int explicit = cc.s_maxage >= 0 || cc.max_age >= 0 || expires;
+    f->storable = !cc.no_store && !cc.is_private &&
+                  pr->status != 206 && pr->status != 304 &&
+                  (explicit || heuristically_cacheable(pr->status));
+    f->has_validators = ParsedResponse_get(pr, "ETag") || last_modified;
+    f->authorized_ok = cc.is_public || cc.s_maxage >= 0 || cc.must_revalidate;
+
+    time_t date_value = date ? parse_http_date(date->value) : -1;
+    if (date_value < 0)
+        date_value = response_time;
+
+    long lifetime = 0;
+    if (cc.s_maxage >= 0) {
+        lifetime = cc.s_maxage;
+    } else if (cc.max_age >= 0) {
+        lifetime = cc.max_age;
+    } else if (expires) {
+        /* an invalid Expires, such as "0", means already expired */
+        time_t t = parse_http_date(expires->value);
+        lifetime = t > date_value ? t - date_value : 0;
+    } else if (last_modified && heuristically_cacheable(pr->status)) {
+        time_t t = parse_http_date(last_modified->value);
+        if (t >= 0 && t < date_value)
+            lifetime = (date_value - t) / 10;
+        if (lifetime > HEURISTIC_MAX_LIFETIME)
+            lifetime = HEURISTIC_MAX_LIFETIME;
+    }
+    if (cc.no_cache)
+        lifetime = 0;
+
+    long age_value = age ? strtol(age->value, NULL, 10) : 0;
+    if (age_value < 0)
+        age_value = 0;
+    long apparent_age = response_time > date_value ? response_time - date_value : 0;
+    long corrected_age = age_value + (response_time - request_time);
+    long initial_age = apparent_age > corrected_age ? apparent_age : corrected_age;
+
+    f->expires = response_time + lifetime - initial_age;
+}
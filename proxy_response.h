@@ -0,0 +1,153 @@
+/*
+ * proxy_response.h -- parsing of upstream HTTP responses and the HTTP
+ * caching rules (RFC 7234) the proxy applies to them as a shared cache.
+ */
+
+#ifndef PROXY_RESPONSE
+#define PROXY_RESPONSE
+
+#include "proxy_parse.h"
+#include <time.h>
+
+/*
+   ParsedResponse holds the status line and headers of a response. The
+   header block is copied once into buf; version, reason and every header
+   key/value point into it, so parsing does one allocation for the block
+   and one for the header array.
+ */
+struct ParsedResponse {
+     char *buf;
+     char *version;
+     int status;
+     char *reason;
+     size_t header_len;           /* bytes up to and including the blank line */
+     struct ParsedHeader *headers;
+     size_t headersused;
+     size_t headerslen;
+};
+
+/* Length of the header block at the start of buf, or 0 if incomplete */
+size_t ParsedResponse_headerEnd(const char *buf, size_t buflen);
+
+struct ParsedResponse* ParsedResponse_create();
+
+/*
+   Parse the status line and headers at the start of buf. Returns 0, or -1
+   if the header block is incomplete or malformed.
+ */
+int ParsedResponse_parse(struct ParsedResponse *pr, const char *buf, size_t buflen);
+
+void ParsedResponse_destroy(struct ParsedResponse *pr);
+
+/* Length of the status line, headers and trailing \r\n as unparsed */
+size_t ParsedResponse_totalLen(struct ParsedResponse *pr);
+
+/*
+   Write the status line, headers and trailing \r\n into buf, which must
+   hold ParsedResponse_totalLen() bytes. buf is not NUL terminated.
+ */
+int ParsedResponse_unparse(struct ParsedResponse *pr, char *buf, size_t buflen);
+
+/* Case-insensitive lookup of the first header named key, or NULL */
+struct ParsedHeader* ParsedResponse_get(struct ParsedResponse *pr, const char *key);
+
+/*
+   Replace pr's headers with the same-named ones from update, appending the
+   rest, as a cache does with the headers of a 304. The merged headers point
+   into update, which must outlive pr's use of them.
+ */
+int ParsedResponse_merge(struct ParsedResponse *pr, struct ParsedResponse *update);
+
+/*
+   Collect pr's Vary field names into out as a lowercase, comma-separated
+   list without spaces. Returns 1 if the response varies, 0 if it has no
+   Vary header and -1 if it varies on "*" or the list does not fit.
+ */
+int ParsedResponse_vary(struct ParsedResponse *pr, char *out, size_t outlen);
+
+/*
+   Whether the connection the response arrived on may carry another
+   exchange: HTTP/1.1 without "Connection: close", or HTTP/1.0 with
+   "Connection: keep-alive".
+ */
+int ParsedResponse_keepAlive(struct ParsedResponse *pr);
+
+/*
+   Where the body of a response ends: after Content-Length bytes, after the
+   last chunk of a chunked body, right after the headers for responses that
+   have no body, or when the connection closes.
+ */
+enum {
+     BODY_LENGTH,
+     BODY_CHUNKED,
+     BODY_UNTIL_CLOSE
+};
+
+struct ResponseBody {
+     int framing;
+     int state;                   /* position in the chunked encoding */
+     unsigned long long remaining;   /* of the Content-Length or current chunk */
+     int size_digits;             /* hex digits read of the current chunk size */
+     int done;                    /* the last byte of the body has been seen */
+     int error;                   /* malformed Content-Length or chunked encoding */
+};
+
+/*
+   Set up body for the framing pr announces. A Content-Length that is not
+   a plain decimal number sets error; the body then runs until the close.
+ */
+void ResponseBody_init(struct ResponseBody *body, struct ParsedResponse *pr);
+
+/*
+   Pass len bytes of the body, as received, through the framing. Returns how
+   many of them belong to the body; fewer than len once it is done. A chunk
+   size line without hex digits or with more than 16 of them sets error and
+   the rest of the body runs until the close.
+ */
+size_t ResponseBody_consume(struct ResponseBody *body, const char *data, size_t len);
+
+/*
+   Bytes that are known to be body payload and can be passed on without
+   being looked at, or 0 when framing (a chunk header) comes next.
+ */
+unsigned long long ResponseBody_dataLeft(struct ResponseBody *body);
+
+/* Account for n payload bytes passed on without ResponseBody_consume() */
+void ResponseBody_skipData(struct ResponseBody *body, size_t n);
+
+/* Parsed Cache-Control directives; -1 marks an absent delta-seconds value */
+struct CacheControl {
+     int no_store;
+     int no_cache;
+     int is_private;
+     int must_revalidate;
+     int is_public;
+     long max_age;
+     long s_maxage;
+};
+
+void CacheControl_parse(const char *value, struct CacheControl *cc);
+
+/* Parse an HTTP-date in any of the three formats allowed. -1 if invalid. */
+time_t parse_http_date(const char *value);
+
+/* How a shared cache may keep a response */
+struct ResponseFreshness {
+     int storable;                /* status and directives allow storing it */
+     int has_validators;          /* carries ETag or Last-Modified */
+     int authorized_ok;           /* may be stored for a request with Authorization */
+     time_t expires;              /* when it becomes stale */
+};
+
+/*
+   Decide whether a response may be stored and until when it is fresh, from
+   Cache-Control (s-maxage, max-age, no-store, no-cache, private), Expires,
+   Date, Age and Last-Modified. request_time and response_time bracket the
+   upstream exchange. A response to a request with credentials may only be
+   shared if it says so with public, s-maxage or must-revalidate (RFC 9111
+   section 3.5); the caller checks the request.
+ */
+void ParsedResponse_freshness(struct ParsedResponse *pr, time_t request_time,
+			      time_t response_time, struct ResponseFreshness *f);
+
+#endif
@@ -0,0 +1,209 @@
+/*
+  proxy_scan.c -- vectorized byte class scanning for the request parser.
+
+  SSE4.2 uses PCMPESTRI in ranges mode, which reports the first byte in up
+  to eight ranges of 16. The tchar set needs nine ranges of exceptions, so
+  the last range also covers '|' and '~', and those two are stepped over
+  when PCMPESTRI stops on them.
+
+  AVX2 classifies 32 bytes at a time with two nibble lookups: a byte is in
+  the class if the bitmask for its low nibble has the bit for its high
+  nibble set.
+
+  Blocks are only loaded while a whole one is left, so nothing is read past
+  the end of the input: AVX2 finishes with one 16 byte step of the same
+  lookups, in VEX encoding so as not to mix in legacy SSE code, and the
+  rest is left to the scalar loop.
+*/
+
+#include "proxy_scan.h"
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SCAN_X86 1
+#include <immintrin.h>
+#endif
+
+static unsigned char token_map[256];
+static unsigned char field_map[256];
+
+static size_t token_scalar(const char *p, size_t len) {
+    size_t i = 0;
+    while (i < len && token_map[(unsigned char)p[i]])
+        i++;
+    return i;
+}
+
+static size_t field_scalar(const char *p, size_t len) {
+    size_t i = 0;
+    while (i < len && field_map[(unsigned char)p[i]])
+        i++;
+    return i;
+}
+
+#ifdef SCAN_X86
+
+/* Ranges of bytes that are not tchar, plus '|' and '~' */
+static const char token_ranges[16] = "\x00\x20\"\"()//,,:@[]{\xff";
+/* Control characters other than HTAB */
+static const char field_ranges[16] = "\x00\x08\x0a\x1f\x7f\x7f";
+
+__attribute__((target("sse4.2")))
+static size_t token_sse42(const char *p, size_t len) {
+    __m128i ranges = _mm_loadu_si128((const __m128i *)token_ranges);
+    size_t i = 0;
+    while (len - i >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+        int at = _mm_cmpestri(ranges, 16, v, 16, _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES | _SIDD_LEAST_SIGNIFICANT);
+        i += at;
+        if (at == 16)
+            continue;
+        if (!token_map[(unsigned char)p[i]])
+            return i;
+        i++;
+    }
+    return i + token_scalar(p + i, len - i);
+}
+
+__attribute__((target("sse4.2")))
+static size_t field_sse42(const char *p, size_t len) {
+    __m128i ranges = _mm_loadu_si128((const __m128i *)field_ranges);
+    size_t i = 0;
+    while (len - i >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+        int at = _mm_cmpestri(ranges, 6, v, 16, _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES | _SIDD_LEAST_SIGNIFICANT);
+        if (at < 16)
+            return i + at;
+        i += 16;
+    }
+    return i + field_scalar(p + i, len - i);
+}
+
+/* Bitmasks of valid high nibbles per low nibble, and the bit of each high nibble */
+static unsigned char token_lo[16];
+static unsigned char token_hi[16];
+
+__attribute__((target("avx2")))
+static size_t token_avx2(const char *p, size_t len) {
+    __m256i lo_lut = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)token_lo));
+    __m256i hi_lut = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)token_hi));
+    __m256i nibble = _mm256_set1_epi8(0x0f);
+    size_t i = 0;
+    while (len - i >= 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+        __m256i lo = _mm256_shuffle_epi8(lo_lut, _mm256_and_si256(v, nibble));
+        __m256i hi = _mm256_shuffle_epi8(hi_lut, _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble));
+        __m256i bad = _mm256_cmpeq_epi8(_mm256_and_si256(lo, hi), _mm256_setzero_si256());
+        unsigned mask = (unsigned)_mm256_movemask_epi8(bad);
+        if (mask)
+            return i + __builtin_ctz(mask);
+        i += 32;
+    }
+    if (len - i >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+        __m128i lo = _mm_shuffle_epi8(_mm256_castsi256_si128(lo_lut), _mm_and_si128(v, _mm256_castsi256_si128(nibble)));
+        __m128i hi = _mm_shuffle_epi8(_mm256_castsi256_si128(hi_lut),
+                                      _mm_and_si128(_mm_srli_epi16(v, 4), _mm256_castsi256_si128(nibble)));
+        unsigned mask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(lo, hi), _mm_setzero_si128()));
+        if (mask)
+            return i + __builtin_ctz(mask);
+        i += 16;
+    }
+    return i + token_scalar(p + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static size_t field_avx2(const char *p, size_t len) {
+    __m256i space = _mm256_set1_epi8(0x1f);
+    __m256i tab = _mm256_set1_epi8('\t');
+    __m256i del = _mm256_set1_epi8(0x7f);
+    size_t i = 0;
+    while (len - i >= 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+        __m256i ctl = _mm256_cmpeq_epi8(_mm256_max_epu8(v, space), space);
+        ctl = _mm256_andnot_si256(_mm256_cmpeq_epi8(v, tab), ctl);
+        ctl = _mm256_or_si256(ctl, _mm256_cmpeq_epi8(v, del));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(ctl);
+        if (mask)
+            return i + __builtin_ctz(mask);
+        i += 32;
+    }
+    if (len - i >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+        __m128i ctl = _mm_cmpeq_epi8(_mm_max_epu8(v, _mm256_castsi256_si128(space)), _mm256_castsi256_si128(space));
+        ctl = _mm_andnot_si128(_mm_cmpeq_epi8(v, _mm256_castsi256_si128(tab)), ctl);
+        ctl = _mm_or_si128(ctl, _mm_cmpeq_epi8(v, _mm256_castsi256_si128(del)));
+        unsigned mask = (unsigned)_mm_movemask_epi8(ctl);
+        if (mask)
+            return i + __builtin_ctz(mask);
+        i += 16;
+    }
+    return i + field_scalar(p + i, len - i);
+}
+
+#endif
+
+static size_t (*token_impl)(const char *, size_t) = token_scalar;
+static size_t (*field_impl)(const char *, size_t) = field_scalar;
+static int level = SCAN_SCALAR;
+
+size_t scan_token(const char *p, size_t len) {
+    return token_impl(p, len);
+}
+
+size_t scan_field(const char *p, size_t len) {
+    return field_impl(p, len);
+}
+
+int scan_level(void) {
+    return level;
+}
+
+int scan_set_level(int want) {
+    token_impl = token_scalar;
+    field_impl = field_scalar;
+    level = SCAN_SCALAR;
+#ifdef SCAN_X86
+    __builtin_cpu_init();
+    if (want >= SCAN_AVX2 && __builtin_cpu_supports("avx2")) {
+        token_impl = token_avx2;
+        field_impl = field_avx2;
+        level = SCAN_AVX2;
+    } else if (want >= SCAN_SSE42 && __builtin_cpu_supports("sse4.2")) {
+        token_impl = token_sse42;
+        field_impl = field_sse42;
+        level = SCAN_SSE42;
+    }
+#endif
+    return level;
+}
+
+const char *scan_level_name(int l) {
+    switch (l) {
+        case SCAN_AVX2:
+            return "avx2";
+        case SCAN_SSE42:
+            return "sse4.2";
+        default:
+            return "scalar";
+    }
+}
+
+__attribute__((constructor))
+static void scan_setup(void) {
+    static const char specials[] = "!#$%&'*+-.^_`|~";
+    for (int c = 0; c < 256; c++) {
+        token_map[c] = (c >= '0' && c <= '9') || (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') ||
+                       (c && strchr(specials, c));
+        field_map[c] = (c >= 0x20 && c != 0x7f) || c == '\t';
+    }
+#ifdef SCAN_X86
+    for (int c = 0; c < 128; c++) {
+        if (token_map[c])
+            token_lo[c & 0x0f] |= 1 << (c >> 4);
+    }
+    for (int h = 0; h < 8; h++)
+        token_hi[h] = 1 << h;
+#endif
+    scan_set_level(SCAN_AVX2);
+}
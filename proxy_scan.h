@@ -0,0 +1,48 @@
+/*
+ * proxy_scan.h -- vectorized byte class scanning for the request parser.
+ *
+ * Each scanner returns the length of the leading run of bytes that belong
+ * to a class, so one call both finds the delimiter that ends a field and
+ * checks every byte before it. They look at 16 (SSE4.2) or 32 (AVX2) bytes
+ * per step; the implementation is chosen once, from what the CPU supports,
+ * the first time the library is loaded, with a table-driven scalar loop as
+ * the fallback.
+ */
+
+#ifndef PROXY_SCAN
+#define PROXY_SCAN
+
+#include <stddef.h>
+
+/* Implementations, from slowest */
+enum {
+    SCAN_SCALAR,
+    SCAN_SSE42,
+    SCAN_AVX2
+};
+
+/*
+   Length of the leading run of RFC 7230 token characters (tchar), which
+   header names and methods consist of. The byte after it is the delimiter.
+ */
+size_t scan_token(const char *p, size_t len);
+
+/*
+   Length of the leading run of header field value characters: anything but
+   control characters, horizontal tab excepted. In a line the run normally
+   ends at its CR.
+ */
+size_t scan_field(const char *p, size_t len);
+
+/* The implementation in use */
+int scan_level(void);
+
+/*
+   Use the given implementation, or the best supported one below it.
+   Returns the one now in use. For benchmarks; not thread-safe.
+ */
+int scan_set_level(int level);
+
+const char *scan_level_name(int level);
+
+#endif
@@ -0,0 +1,203 @@
+/*
+ * proxy_server.h -- declarations shared by the proxy server's engines.
+ *
+ * The thread engine (proxy_server_with_cache.c) and the event engine
+ * (proxy_epoll.c) run the same parse, cache and forward logic; everything
+ * they have in common is declared here.
+ */
+
+#ifndef PROXY_SERVER
+#define PROXY_SERVER
+
+#include "proxy_parse.h"
+#include "proxy_cache.h"
+#include "proxy_response.h"
+#include <stdio.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+struct ParsedRequest;
+typedef struct ParsedRequest ParsedRequest;
+struct arena;
+struct relay;
+struct disk_lookup;
+
+#define MAX_BYTES 4096
+#define MAX_HEADER_BYTES (64 * 1024)
+#define MAX_CLIENTS 400
+#define DEFAULT_WORKERS 64
+#define DEFAULT_QUEUE_DEPTH 1024
+#define DEFAULT_KEEPALIVE_TIMEOUT 5     /* seconds a client may idle between requests */
+#define DEFAULT_MAX_REQUESTS 100        /* requests served on one client connection */
+#define REQUEST_HEADER_TIMEOUT 10       /* seconds to send a request's headers, from its first byte */
+
+/* Connection engines selectable at startup */
+enum {
+    ENGINE_THREAD = 0,
+    ENGINE_EPOLL = 1
+};
+
+extern int port_number;
+extern int keepalive_timeout;
+extern int max_requests;
+
+/*
+   Client connections accepted and requests served on them by both engines;
+   client_reuses counts requests that arrived on an already used connection.
+ */
+extern atomic_ulong client_connections;
+extern atomic_ulong client_requests;
+extern atomic_ulong client_reuses;
+
+int sendErrorMessage(int socket, int status_code);
+int checkHTTPversion(char *msg);
+void *thread_fn(void *socketNew);
+void print_stats(FILE *out);
+
+/*
+   Double a client's request buffer of *cap bytes, holding len, up to
+   MAX_HEADER_BYTES once all of it is in use. The buffer is in arena, and
+   must be its latest allocation for it to grow in place. Returns -1 if it
+   is at the limit or cannot grow.
+ */
+int growRequestBuffer(struct arena *arena, char **buf, size_t len, size_t *cap);
+
+/*
+   Whether the client connection may carry another request after request:
+   HTTP/1.1 unless Connection (or Proxy-Connection) says close, HTTP/1.0
+   only if it says keep-alive. Returns how many seconds the connection may
+   then sit idle -- keepalive_timeout, or less if the client's Keep-Alive
+   header asks for a shorter timeout -- or 0 if it must be closed.
+ */
+int clientKeepAlive(ParsedRequest *request);
+
+/*
+   Turn off Nagle's algorithm on a client or upstream socket. Headers and
+   body go out in separate writes, and a small write held back until the
+   peer's delayed ACK would stall a response by tens of milliseconds.
+ */
+void setNoDelay(int socket);
+
+/* Fill server_addr with addr and port_num */
+void remoteAddress(struct in_addr addr, int port_num, struct sockaddr_in *server_addr);
+
+/*
+   Resolve host_addr and connect to port_num on it, failing over to its
+   other addresses if connecting fails. Returns the socket or -1.
+ */
+int connectRemoteServer(char *host_addr, int port_num);
+
+/*
+   Build the upstream request line and headers for request in a buffer
+   sized to fit, allocated in the request's arena, with its length in *len.
+   Returns NULL on failure.
+ */
+char *buildRemoteRequest(ParsedRequest *request, size_t *len);
+
+/*
+   Build the normalized cache key for request: method, scheme, lowercase
+   host, port unless it is 80, and path. vary, if not NULL, is a
+   comma-separated list of request fields whose values are appended.
+ */
+int buildCacheKey(ParsedRequest *request, const char *vary, cache_key *key);
+
+/*
+   Look up the response for request under its base key, following a Vary
+   marker to the matching variant. Returns a pinned entry or NULL.
+ */
+cache_element *findCachedResponse(ParsedRequest *request, cache_key *key);
+
+/*
+   findCachedResponse() for the event loops, which must not read the disk
+   tier: when the response is not in memory but may be on disk, it returns
+   NULL and sets *lookup to the pending disk_query() for it, which adds 1
+   to notify_fd once complete.
+ */
+cache_element *findCachedResponseAsync(ParsedRequest *request, cache_key *key, int notify_fd,
+                                       struct disk_lookup **lookup);
+
+/*
+   Whether cached entry e may answer request without contacting the origin:
+   it has not expired and the request does not ask for revalidation with
+   no-cache or max-age=0.
+ */
+int cacheEntryFresh(ParsedRequest *request, cache_element *e);
+
+/*
+   Make request conditional on the validators (ETag, Last-Modified) of the
+   cached entry e. Returns 1 if it was, 0 if e has no validators.
+ */
+int addConditionalHeaders(ParsedRequest *request, cache_element *e);
+
+/*
+   Whether response, whose headers have just arrived, could be cached for
+   request once complete: caching rules allow storing it, it does not vary
+   on "*" and its Content-Length, if any, fits a cache entry.
+ */
+int responseCacheable(ParsedRequest *request, struct ParsedResponse *response, time_t request_time);
+
+/*
+   Whether response, besides being cacheable, may be streamed to requests
+   that collapsed onto its fetch: it must not vary, since they may differ in
+   the fields it varies on, and must fit a memory cache entry. Being
+   cacheable, a response to a request with Authorization is only shared if
+   it is marked public, s-maxage or must-revalidate.
+ */
+int responseShareable(ParsedRequest *request, struct ParsedResponse *response, time_t request_time);
+
+/*
+   Cache a complete upstream response for request if HTTP caching rules
+   allow it, until its freshness lifetime runs out. Responses with a Vary
+   header are stored under a variant key behind a marker at key; responses
+   that vary on "*" are not cached. request_time is when the request was
+   sent upstream. On success the cache takes over data's segments and, if
+   pinned is not NULL, the new entry is returned there pinned.
+ */
+int cacheResponse(ParsedRequest *request, cache_key *key, struct ParsedResponse *response,
+                  time_t request_time, struct seg_buffer *data, cache_element **pinned);
+
+/*
+   Open a relay for the rest of a response, keeping a copy if keep is set.
+   The copy is limited to what fits a memory cache entry; with the disk
+   tier enabled, a larger one spills into a file for the tier. Returns 0 or
+   -1 as relay_open() does.
+ */
+int openRelay(struct relay *r, const char *resp, size_t resp_len, int keep);
+
+/*
+   Cache the copy collected by the relay r once the response is complete,
+   as cacheResponse() does, or hand it to the disk tier if it spilled. Only
+   a response cached in memory is returned in pinned.
+ */
+int cacheRelayedResponse(ParsedRequest *request, cache_key *key, struct ParsedResponse *response,
+                         time_t request_time, struct relay *r, cache_element **pinned);
+
+/*
+   Apply the 304 response update to the stale cached entry: merge its
+   headers into the stored ones and re-cache the result with a new
+   freshness lifetime. Returns the new entry pinned, or NULL if it could not
+   be cached; entries on disk are never refreshed.
+ */
+cache_element *refreshCachedResponse(ParsedRequest *request, cache_key *key, cache_element *stale,
+                                     struct ParsedResponse *update, time_t request_time);
+
+/*
+   Open a listening socket on port, with SO_REUSEPORT if reuseport is set so
+   several sockets can share the port. Returns the socket or -1.
+ */
+int openListener(int port, int reuseport);
+
+/* Pin thread to cpu (modulo the number of online CPUs) */
+int pinThreadToCpu(pthread_t thread, int cpu);
+
+/*
+   Run nloops edge-triggered epoll loops, each in its own thread. Listeners
+   are spread over the loops; with one SO_REUSEPORT listener per loop the
+   kernel shards connections across loops. With pin set loop i runs on CPU
+   i. Does not return unless the loops could not be started.
+ */
+int epoll_engine_run(int *listen_fds, int nlisteners, int nloops, int pin);
+
+#endif
@@ -1,13 +1,23 @@
-#include "proxy_parse.h"
+#define _GNU_SOURCE
+#include "proxy_server.h"
+#include "proxy_pool.h"
+#include "proxy_relay.h"
+#include "proxy_upstream.h"
+#include "proxy_resolve.h"
+#include "proxy_inflight.h"
+#include "proxy_arena.h"
+#include "proxy_disk.h"
+#include "proxy_snapshot.h"
+#include "proxy_policy.h"
+#include "proxy_slab.h"
+#include "proxy_metrics.h"
 #include <stdio.h>
-
-struct ParsedRequest;  
-typedef struct ParsedRequest ParsedRequest;
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <unistd.h>
@@ -17,32 +27,44 @@ typedef struct ParsedRequest ParsedRequest;
 #include <errno.h>
 #include <pthread.h>
 #include <semaphore.h>
-
-#define MAX_BYTES 4096
-#define MAX_CLIENTS 400
-#define MAX_SIZE 200 * (1 << 20)
-#define MAX_ELEMENT_SIZE 10 * (1 << 20)
-
-typedef struct cache_element {
-    char *data;
-    int len;
-    char *url;
-    time_t lru_time_track;
-    struct cache_element *next;
-} cache_element;
-
-cache_element *find(char *url);
-int add_cache_element(char *data, int size, char *url);
-void remove_cache_element();
+#include <signal.h>
+#include <getopt.h>
+#include <ctype.h>
+#include <strings.h>
+#include <sched.h>
+#include <poll.h>
 
 int port_number = 8080;
 int proxy_socketId;
-pthread_t tid[MAX_CLIENTS];
-sem_t semaphore;
-pthread_mutex_t lock;
 
-cache_element *head;
-int cache_size;
+int engine = ENGINE_THREAD;
+int event_loops = 0;
+int worker_threads = DEFAULT_WORKERS;
+int queue_depth = DEFAULT_QUEUE_DEPTH;
+int stats_interval = 0;
+int acceptors = 1;
+int pin_threads = 0;
+int cache_shard_count = DEFAULT_CACHE_SHARDS;
+const char *eviction_policy = "lru";
+int use_hugepages = 0;
+int upstream_idle = DEFAULT_UPSTREAM_IDLE;
+int upstream_timeout = DEFAULT_UPSTREAM_TIMEOUT;
+int keepalive_timeout = DEFAULT_KEEPALIVE_TIMEOUT;
+int max_requests = DEFAULT_MAX_REQUESTS;
+const char *hosts_file = DEFAULT_HOSTS_FILE;
+char *nameservers[RESOLVER_MAX_SERVERS];
+int nameserver_count = 0;
+int collapse_misses = 1;
+const char *disk_cache_dir = NULL;
+long disk_cache_mb = DEFAULT_DISK_BUDGET;
+const char *snapshot_path = NULL;
+const char *metrics_listen = NULL;
+atomic_ulong client_connections;
+atomic_ulong client_requests;
+atomic_ulong client_reuses;
+struct worker_pool pool;
+
+#define IDLE_POLL_MS 100   /* how often an idle keep-alive worker checks the queue */
 
 int sendErrorMessage(int socket, int status_code) {
     char str[1024];
@@ -53,109 +75,738 @@ int sendErrorMessage(int socket, int status_code) {
 
     switch (status_code) {
         case 400:
-            snprintf(str, sizeof(str), "HTTP/1.1 400 Bad Request\r\nContent-Length: 95\r\nConnection: keep-alive\r\nContent-Type: text/html\r\nDate: %s\r\nAryanS/01021\r\n\r\n<HTML><HEAD><TITLE>400 Bad Request</TITLE></HEAD>\n<BODY><H1>400 Bad Request</H1>\n</BODY></HTML>", currentTime);
+            snprintf(str, sizeof(str), "HTTP/1.1 400 Bad Request\r\nContent-Length: 95\r\nConnection: close\r\nContent-Type: text/html\r\nDate: %s\r\nAryanS/01021\r\n\r\n<HTML><HEAD><TITLE>400 Bad Request</TITLE></HEAD>\n<BODY><H1>400 Bad Request</H1>\n</BODY></HTML>", currentTime);
             break;
         case 403:
-            snprintf(str, sizeof(str), "HTTP/1.1 403 Forbidden\r\nContent-Length: 112\r\nContent-Type: text/html\r\nConnection: keep-alive\r\nDate: %s\r\nAryanS/01021\r\n\r\n<HTML><HEAD><TITLE>403 Forbidden</TITLE></HEAD>\n<BODY><H1>403 Forbidden</H1><br>Permission Denied\n</BODY></HTML>", currentTime);
+            snprintf(str, sizeof(str), "HTTP/1.1 403 Forbidden\r\nContent-Length: 112\r\nContent-Type: text/html\r\nConnection: close\r\nDate: %s\r\nAryanS/01021\r\n\r\n<HTML><HEAD><TITLE>403 Forbidden</TITLE></HEAD>\n<BODY><H1>403 Forbidden</H1><br>Permission Denied\n</BODY></HTML>", currentTime);
             break;
         case 404:
-            snprintf(str, sizeof(str), "HTTP/1.1 404 Not Found\r\nContent-Length: 91\r\nContent-Type: text/html\r\nConnection: keep-alive\r\nDate: %s\r\nAryanS/01021\r\n\r\n<HTML><HEAD><TITLE>404 Not Found</TITLE></HEAD>\n<BODY><H1>404 Not Found</H1>\n</BODY></HTML>", currentTime);
+            snprintf(str, sizeof(str), "HTTP/1.1 404 Not Found\r\nContent-Length: 91\r\nContent-Type: text/html\r\nConnection: close\r\nDate: %s\r\nAryanS/01021\r\n\r\n<HTML><HEAD><TITLE>404 Not Found</TITLE></HEAD>\n<BODY><H1>404 Not Found</H1>\n</BODY></HTML>", currentTime);
+            break;
+        case 431:
+            snprintf(str, sizeof(str), "HTTP/1.1 431 Request Header Fields Too Large\r\nContent-Length: 135\r\nConnection: close\r\nContent-Type: text/html\r\nDate: %s\r\nAryanS/01021\r\n\r\n<HTML><HEAD><TITLE>431 Request Header Fields Too Large</TITLE></HEAD>\n<BODY><H1>431 Request Header Fields Too Large</H1>\n</BODY></HTML>", currentTime);
             break;
         case 500:
-            snprintf(str, sizeof(str), "HTTP/1.1 500 Internal Server Error\r\nContent-Length: 115\r\nConnection: keep-alive\r\nContent-Type: text/html\r\nDate: %s\r\nAryanS/01021\r\n\r\n<HTML><HEAD><TITLE>500 Internal Server Error</TITLE></HEAD>\n<BODY><H1>500 Internal Server Error</H1>\n</BODY></HTML>", currentTime);
+            snprintf(str, sizeof(str), "HTTP/1.1 500 Internal Server Error\r\nContent-Length: 115\r\nConnection: close\r\nContent-Type: text/html\r\nDate: %s\r\nAryanS/01021\r\n\r\n<HTML><HEAD><TITLE>500 Internal Server Error</TITLE></HEAD>\n<BODY><H1>500 Internal Server Error</H1>\n</BODY></HTML>", currentTime);
+            break;
+        case 503:
+            snprintf(str, sizeof(str), "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 111\r\nConnection: close\r\nContent-Type: text/html\r\nDate: %s\r\nAryanS/01021\r\n\r\n<HTML><HEAD><TITLE>503 Service Unavailable</TITLE></HEAD>\n<BODY><H1>503 Service Unavailable</H1>\n</BODY></HTML>", currentTime);
             break;
         case 501:
-            snprintf(str, sizeof(str), "HTTP/1.1 501 Not Implemented\r\nContent-Length: 103\r\nConnection: keep-alive\r\nContent-Type: text/html\r\nDate: %s\r\nAryanS/01021\r\n\r\n<HTML><HEAD><TITLE>501 Not Implemented</TITLE></HEAD>\n<BODY><H1>501 Not Implemented</H1>\n</BODY></HTML>", currentTime);
+            snprintf(str, sizeof(str), "HTTP/1.1 501 Not Implemented\r\nContent-Length: 103\r\nConnection: close\r\nContent-Type: text/html\r\nDate: %s\r\nAryanS/01021\r\n\r\n<HTML><HEAD><TITLE>501 Not Implemented</TITLE></HEAD>\n<BODY><H1>501 Not Implemented</H1>\n</BODY></HTML>", currentTime);
             break;
         case 505:
-            snprintf(str, sizeof(str), "HTTP/1.1 505 HTTP Version Not Supported\r\nContent-Length: 125\r\nConnection: keep-alive\r\nContent-Type: text/html\r\nDate: %s\r\nAryanS/01021\r\n\r\n<HTML><HEAD><TITLE>505 HTTP Version Not Supported</TITLE></HEAD>\n<BODY><H1>505 HTTP Version Not Supported</H1>\n</BODY></HTML>", currentTime);
+            snprintf(str, sizeof(str), "HTTP/1.1 505 HTTP Version Not Supported\r\nContent-Length: 125\r\nConnection: close\r\nContent-Type: text/html\r\nDate: %s\r\nAryanS/01021\r\n\r\n<HTML><HEAD><TITLE>505 HTTP Version Not Supported</TITLE></HEAD>\n<BODY><H1>505 HTTP Version Not Supported</H1>\n</BODY></HTML>", currentTime);
             break;
         default:
             return -1;
     }
     send(socket, str, strlen(str), 0);
+    metrics_add(METRIC_ERROR_RESPONSES, 1);
     return 1;
 }
 
-int connectRemoteServer(char *host_addr, int port_num) {
-    int remoteSocket = socket(AF_INET, SOCK_STREAM, 0);
-    if (remoteSocket < 0) {
-        perror("Error in Creating Socket.\n");
-        return -1;
+void setNoDelay(int socket) {
+    int one = 1;
+    if (setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) < 0) {
+        perror("setsockopt(TCP_NODELAY) failed\n");
     }
+}
 
-    struct hostent *host = gethostbyname(host_addr);
-    if (!host) {
+void remoteAddress(struct in_addr addr, int port_num, struct sockaddr_in *server_addr) {
+    bzero((char *)server_addr, sizeof(*server_addr));
+    server_addr->sin_family = AF_INET;
+    server_addr->sin_port = htons(port_num);
+    server_addr->sin_addr = addr;
+}
+
+int connectRemoteServer(char *host_addr, int port_num) {
+    struct resolve_result res;
+    if (resolver_lookup(host_addr, &res) < 0) {
         fprintf(stderr, "No such host exists.\n");
         return -1;
     }
 
-    struct sockaddr_in server_addr;
-    bzero((char *)&server_addr, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(port_num);
-    bcopy((char *)host->h_addr_list[0], (char *)&server_addr.sin_addr.s_addr, host->h_length);
+    /* Try every address of the host in turn */
+    for (int i = 0; i < res.naddrs; i++) {
+        int remoteSocket = socket(AF_INET, SOCK_STREAM, 0);
+        if (remoteSocket < 0) {
+            perror("Error in Creating Socket.\n");
+            return -1;
+        }
 
-    if (connect(remoteSocket, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+        struct sockaddr_in server_addr;
+        remoteAddress(res.addrs[i], port_num, &server_addr);
+        if (connect(remoteSocket, (struct sockaddr *)&server_addr, sizeof(server_addr)) == 0) {
+            setNoDelay(remoteSocket);
+            return remoteSocket;
+        }
         perror("Error in connecting !\n");
-        return -1;
+        close(remoteSocket);
     }
-    return remoteSocket;
+    return -1;
 }
 
-int handle_request(int clientSocket, ParsedRequest *request, char *tempReq) {
-    char *buf = (char *)malloc(MAX_BYTES);
-    snprintf(buf, MAX_BYTES, "GET %s %s\r\n", request->path, request->version);
-
-    size_t len = strlen(buf);
+char *buildRemoteRequest(ParsedRequest *request, size_t *len) {
+    /* the client's hop-by-hop headers are not forwarded */
+    ParsedHeader_remove(request, "Proxy-Connection");
+    ParsedHeader_remove(request, "Keep-Alive");
 
-    if (ParsedHeader_set(request, "Connection", "close") < 0) {
+    /* pooled upstream connections are kept open for the next miss */
+    if (ParsedHeader_set(request, "Connection", upstream_pool_enabled() ? "keep-alive" : "close") < 0) {
         perror("Set header key not working\n");
     }
 
-    if (!ParsedHeader_get(request, "Host")) {
+    if (!ParsedHeader_known(request, HEADER_HOST)) {
         if (ParsedHeader_set(request, "Host", request->host) < 0) {
             perror("Set \"Host\" header key not working\n");
         }
     }
 
-    if (ParsedRequest_unparse_headers(request, buf + len, MAX_BYTES - len) < 0) {
+    size_t line_len = strlen(request->path) + strlen(request->version) + 7;
+    size_t buflen = line_len + ParsedHeader_headersLen(request);
+    char *buf = (char *)arena_alloc(request->arena, buflen + 1);
+    if (!buf) {
+        return NULL;
+    }
+    snprintf(buf, line_len + 1, "GET %s %s\r\n", request->path, request->version);
+    if (ParsedRequest_unparse_headers(request, buf + line_len, buflen - line_len) < 0) {
         perror("Unparse failed\n");
+        return NULL;
     }
+    buf[buflen] = '\0';
+    *len = buflen;
+    return buf;
+}
 
-    int server_port = request->port ? atoi(request->port) : 80;
-    int remoteSocketID = connectRemoteServer(request->host, server_port);
-    if (remoteSocketID < 0) {
-        free(buf);
+int growRequestBuffer(struct arena *arena, char **buf, size_t len, size_t *cap) {
+    if (*cap >= MAX_HEADER_BYTES) {
+        return -1;
+    }
+    size_t new_cap = *cap * 2 < MAX_HEADER_BYTES ? *cap * 2 : MAX_HEADER_BYTES;
+    char *grown = (char *)arena_realloc(arena, *buf, len, new_cap);
+    if (!grown) {
         return -1;
     }
+    *buf = grown;
+    *cap = new_cap;
+    return 0;
+}
 
-    send(remoteSocketID, buf, strlen(buf), 0);
-    bzero(buf, MAX_BYTES);
+int clientKeepAlive(ParsedRequest *request) {
+    if (keepalive_timeout <= 0) {
+        return 0;
+    }
+    struct ParsedHeader *ph = ParsedHeader_known(request, HEADER_CONNECTION);
+    if (!ph) {
+        /* sent by browsers talking to a proxy */
+        ph = ParsedHeader_known(request, HEADER_PROXY_CONNECTION);
+    }
+    int keep = !strcmp(request->version, "HTTP/1.1");
+    if (ph && strcasestr(ph->value, "close")) {
+        keep = 0;
+    } else if (ph && strcasestr(ph->value, "keep-alive")) {
+        keep = 1;
+    }
+    if (!keep) {
+        return 0;
+    }
 
-    int bytes_recv = recv(remoteSocketID, buf, MAX_BYTES - 1, 0);
-    char *temp_buffer = (char *)malloc(MAX_BYTES);
-    int temp_buffer_size = MAX_BYTES;
-    int temp_buffer_index = 0;
+    int timeout = keepalive_timeout;
+    const char *param;
+    if ((ph = ParsedHeader_known(request, HEADER_KEEP_ALIVE)) && (param = strcasestr(ph->value, "timeout="))) {
+        int asked = atoi(param + 8);
+        if (asked > 0 && asked < timeout) {
+            timeout = asked;
+        }
+    }
+    return timeout;
+}
 
-    while (bytes_recv > 0) {
-        send(clientSocket, buf, bytes_recv, 0);
-        for (int i = 0; i < bytes_recv; i++) {
-            temp_buffer[temp_buffer_index++] = buf[i];
+int buildCacheKey(ParsedRequest *request, const char *vary, cache_key *key) {
+    char port_str[16] = "";
+    int port = request->port ? atoi(request->port) : 80;
+    if (port != 80) {
+        snprintf(port_str, sizeof(port_str), ":%d", port);
+    }
+
+    size_t len = strlen(request->method) + 1 + strlen(request->protocol) + 3 + strlen(request->host) +
+                 strlen(port_str) + strlen(request->path);
+    const char *p = vary;
+    while (p && *p) {
+        size_t namelen = strcspn(p, ",");
+        struct ParsedHeader *ph = ParsedHeader_getn(request, p, namelen);
+        len += 1 + namelen + 1 + (ph ? strlen(ph->value) : 0);
+        p += namelen;
+        if (*p == ',') {
+            p++;
         }
-        temp_buffer_size += MAX_BYTES;
-        temp_buffer = (char *)realloc(temp_buffer, temp_buffer_size);
-        bzero(buf, MAX_BYTES);
-        bytes_recv = recv(remoteSocketID, buf, MAX_BYTES - 1, 0);
     }
-    temp_buffer[temp_buffer_index] = '\0';
+
+    char *str = (char *)arena_alloc(request->arena, len + 1);
+    if (!str) {
+        return -1;
+    }
+    int n = sprintf(str, "%s %s://", request->method, request->protocol);
+    for (int i = 0; i < n; i++) {
+        str[i] = tolower((unsigned char)str[i]);
+    }
+    for (const char *h = request->host; *h; h++) {
+        str[n++] = tolower((unsigned char)*h);
+    }
+    n += sprintf(str + n, "%s%s", port_str, request->path);
+
+    /* One "\nname:value" line per field the response varies on */
+    p = vary;
+    while (p && *p) {
+        size_t namelen = strcspn(p, ",");
+        struct ParsedHeader *ph = ParsedHeader_getn(request, p, namelen);
+        str[n++] = '\n';
+        memcpy(str + n, p, namelen);
+        n += namelen;
+        str[n++] = ':';
+        if (ph) {
+            n += sprintf(str + n, "%s", ph->value);
+        }
+        p += namelen;
+        if (*p == ',') {
+            p++;
+        }
+    }
+    str[n] = '\0';
+    cache_key_borrow(key, str, n);
+    return 0;
+}
+
+/* Look key up on disk, or if lookup is not NULL, start a disk_query() for it in *lookup */
+static cache_element *findOnDisk(cache_key *key, int notify_fd, struct disk_lookup **lookup) {
+    if (lookup) {
+        *lookup = disk_query(key, notify_fd);
+        return NULL;
+    }
+    return disk_find(key);
+}
+
+/* Look key up in memory, then on disk */
+static cache_element *findTiered(cache_key *key, int notify_fd, struct disk_lookup **lookup) {
+    cache_element *e = find(key);
+    if (!e) {
+        e = findOnDisk(key, notify_fd, lookup);
+    }
+    return e;
+}
+
+static cache_element *findResponse(ParsedRequest *request, cache_key *key, int notify_fd,
+                                   struct disk_lookup **lookup) {
+    /* Vary markers are only kept in memory */
+    cache_element *e = find(key);
+    if (!e) {
+        return findOnDisk(key, notify_fd, lookup);
+    }
+    if (!(e->flags & CACHE_VARY_MARKER)) {
+        return e;
+    }
+
+    char vary[MAX_BYTES];
+    size_t len = cache_element_copyout(e, 0, vary, sizeof(vary) - 1);
+    vary[len] = '\0';
+    cache_release(e);
+
+    cache_key variant;
+    int ret = buildCacheKey(request, vary, &variant);
+    if (ret < 0) {
+        return NULL;
+    }
+    e = findTiered(&variant, notify_fd, lookup);
+    cache_key_free(&variant);
+    return e;
+}
+
+cache_element *findCachedResponse(ParsedRequest *request, cache_key *key) {
+    return findResponse(request, key, -1, NULL);
+}
+
+cache_element *findCachedResponseAsync(ParsedRequest *request, cache_key *key, int notify_fd,
+                                       struct disk_lookup **lookup) {
+    *lookup = NULL;
+    return findResponse(request, key, notify_fd, lookup);
+}
+
+/* The request's Cache-Control directives, with Pragma: no-cache as no-cache */
+static void requestCacheControl(ParsedRequest *request, struct CacheControl *cc) {
+    memset(cc, 0, sizeof(*cc));
+    cc->max_age = cc->s_maxage = -1;
+
+    struct ParsedHeader *ph = ParsedHeader_known(request, HEADER_CACHE_CONTROL);
+    if (ph) {
+        CacheControl_parse(ph->value, cc);
+    } else if ((ph = ParsedHeader_known(request, HEADER_PRAGMA)) && strcasestr(ph->value, "no-cache")) {
+        cc->no_cache = 1;
+    }
+}
+
+int cacheEntryFresh(ParsedRequest *request, cache_element *e) {
+    struct CacheControl cc;
+    requestCacheControl(request, &cc);
+    if (cc.no_cache || cc.max_age == 0) {
+        return 0;
+    }
+    return time(NULL) < e->expires;
+}
+
+/* Parse the status line and headers of the cached response e into pr */
+static int parseCachedResponse(cache_element *e, struct ParsedResponse *pr) {
+    size_t len = cache_element_len(e);
+    if (len > MAX_HEADER_BYTES) {
+        len = MAX_HEADER_BYTES;
+    }
+    char *buf = (char *)malloc(len);
+    if (!buf) {
+        return -1;
+    }
+    len = cache_element_copyout(e, 0, buf, len);
+    int ret = ParsedResponse_parse(pr, buf, len);
     free(buf);
-    add_cache_element(temp_buffer, strlen(temp_buffer), tempReq);
-    free(temp_buffer);
-    close(remoteSocketID);
+    return ret;
+}
+
+int addConditionalHeaders(ParsedRequest *request, cache_element *e) {
+    if (!(e->flags & CACHE_HAS_VALIDATORS)) {
+        return 0;
+    }
+
+    struct ParsedResponse *cached = ParsedResponse_create();
+    int ret = 0;
+    if (cached && parseCachedResponse(e, cached) == 0) {
+        struct ParsedHeader *etag = ParsedResponse_get(cached, "ETag");
+        struct ParsedHeader *last_modified = ParsedResponse_get(cached, "Last-Modified");
+        if (etag && ParsedHeader_set(request, "If-None-Match", etag->value) == 0) {
+            ret = 1;
+        }
+        if (last_modified && ParsedHeader_set(request, "If-Modified-Since", last_modified->value) == 0) {
+            ret = 1;
+        }
+    }
+    if (cached) {
+        ParsedResponse_destroy(cached);
+    }
+    return ret;
+}
+
+/*
+   Compute response's freshness and whether caching rules let it be stored for
+   request. The cache key ignores credentials, so a response to a request with
+   Authorization is only kept if it is explicitly shareable.
+ */
+static int responseStorable(ParsedRequest *request, struct ParsedResponse *response,
+                            time_t request_time, struct ResponseFreshness *freshness) {
+    struct CacheControl cc;
+    time_t now = time(NULL);
+
+    requestCacheControl(request, &cc);
+    ParsedResponse_freshness(response, request_time, now, freshness);
+    if (!freshness->authorized_ok && ParsedHeader_get(request, "Authorization")) {
+        return 0;
+    }
+    /* a response that is stale on arrival is only worth keeping to revalidate */
+    return !cc.no_store && freshness->storable && (freshness->expires > now || freshness->has_validators);
+}
+
+int responseCacheable(ParsedRequest *request, struct ParsedResponse *response, time_t request_time) {
+    struct ResponseFreshness freshness;
+    char vary[MAX_BYTES];
+
+    size_t max = disk_enabled() ? disk_max_object() : cache_max_element();
+    struct ResponseBody body;
+    ResponseBody_init(&body, response);
+    if (body.error || (body.framing == BODY_LENGTH && body.remaining + response->header_len > max)) {
+        return 0;
+    }
+    return responseStorable(request, response, request_time, &freshness) &&
+           ParsedResponse_vary(response, vary, sizeof(vary)) >= 0;
+}
+
+int responseShareable(ParsedRequest *request, struct ParsedResponse *response, time_t request_time) {
+    char vary[MAX_BYTES];
+    /* followers are fed from the copy in memory, which a larger response would outgrow */
+    struct ResponseBody body;
+    ResponseBody_init(&body, response);
+    if (body.framing == BODY_LENGTH && body.remaining + response->header_len > cache_max_element()) {
+        return 0;
+    }
+    return responseCacheable(request, response, request_time) &&
+           ParsedResponse_vary(response, vary, sizeof(vary)) == 0;
+}
+
+int cacheResponse(ParsedRequest *request, cache_key *key, struct ParsedResponse *response,
+                  time_t request_time, struct seg_buffer *data, cache_element **pinned) {
+    struct ResponseFreshness freshness;
+    if (!responseStorable(request, response, request_time, &freshness)) {
+        return 0;
+    }
+    unsigned flags = freshness.has_validators ? CACHE_HAS_VALIDATORS : 0;
+    struct ResponseBody body;
+    ResponseBody_init(&body, response);
+    if (body.framing == BODY_UNTIL_CLOSE) {
+        flags |= CACHE_UNFRAMED;
+    }
+
+    char vary[MAX_BYTES];
+    int varies = ParsedResponse_vary(response, vary, sizeof(vary));
+    if (varies < 0) {
+        return 0;
+    }
+    if (!varies) {
+        return add_cache_element(data, key, flags, freshness.expires, pinned);
+    }
+
+    cache_key variant;
+    struct seg_buffer marker;
+    seg_buffer_init(&marker);
+    if (buildCacheKey(request, vary, &variant) < 0) {
+        return 0;
+    }
+    int ret = seg_buffer_append(&marker, vary, strlen(vary)) == 0 &&
+              add_cache_element(&marker, key, CACHE_VARY_MARKER, freshness.expires, NULL) &&
+              add_cache_element(data, &variant, flags, freshness.expires, pinned);
+    seg_buffer_free(&marker);
+    cache_key_free(&variant);
+    return ret;
+}
+
+/*
+   Hand a response that spilled past the memory cache's entry size to the
+   disk tier, fd holding its len bytes. Responses that vary are not stored:
+   their marker would have to outlive them in memory.
+ */
+static void cacheSpilledResponse(ParsedRequest *request, cache_key *key, struct ParsedResponse *response,
+                                 time_t request_time, int fd, size_t len) {
+    struct ResponseFreshness freshness;
+    char vary[MAX_BYTES];
+    if (!responseStorable(request, response, request_time, &freshness) ||
+        ParsedResponse_vary(response, vary, sizeof(vary)) != 0) {
+        close(fd);
+        return;
+    }
+    unsigned flags = freshness.has_validators ? CACHE_HAS_VALIDATORS : 0;
+    struct ResponseBody body;
+    ResponseBody_init(&body, response);
+    if (body.framing == BODY_UNTIL_CLOSE) {
+        flags |= CACHE_UNFRAMED;
+    }
+    disk_store_file(key, fd, len, flags, freshness.expires);
+}
+
+int openRelay(struct relay *r, const char *resp, size_t resp_len, int keep) {
+    if (relay_open(r, resp, resp_len, keep, cache_max_element()) < 0) {
+        return -1;
+    }
+    if (disk_enabled()) {
+        relay_spill(r, disk_dir(), disk_max_object());
+    }
     return 0;
 }
 
+int cacheRelayedResponse(ParsedRequest *request, cache_key *key, struct ParsedResponse *response,
+                         time_t request_time, struct relay *r, cache_element **pinned) {
+    size_t len;
+    int fd = relay_take_spill(r, &len);
+    if (fd < 0) {
+        return cacheResponse(request, key, response, request_time, &r->copy, pinned);
+    }
+    cacheSpilledResponse(request, key, response, request_time, fd, len);
+    return 0;
+}
+
+cache_element *refreshCachedResponse(ParsedRequest *request, cache_key *key, cache_element *stale,
+                                     struct ParsedResponse *update, time_t request_time) {
+    struct ParsedResponse *cached;
+    struct seg_buffer refreshed;
+    cache_element *e = NULL;
+
+    /* a response kept on disk is not rewritten; it stays stale and is revalidated again */
+    if (stale->flags & CACHE_ON_DISK) {
+        return NULL;
+    }
+    cached = ParsedResponse_create();
+
+    seg_buffer_init(&refreshed);
+    if (cached && parseCachedResponse(stale, cached) == 0 &&
+        ParsedResponse_merge(cached, update) == 0) {
+        size_t header_len = ParsedResponse_totalLen(cached);
+        char *headers = (char *)malloc(header_len);
+        if (headers && ParsedResponse_unparse(cached, headers, header_len) == 0 &&
+            seg_buffer_append(&refreshed, headers, header_len) == 0 &&
+            cache_element_append(&refreshed, stale, cached->header_len,
+                                 cache_element_len(stale) - cached->header_len) == 0) {
+            cacheResponse(request, key, cached, request_time, &refreshed, &e);
+        }
+        free(headers);
+    }
+    seg_buffer_free(&refreshed);
+    if (cached) {
+        ParsedResponse_destroy(cached);
+    }
+    return e;
+}
+
+static int sendAll(int socket, const char *data, size_t len) {
+    size_t pos = 0;
+    while (pos < len) {
+        int sent = send(socket, data + pos, len - pos, 0);
+        if (sent <= 0) {
+            return -1;
+        }
+        pos += sent;
+    }
+    return 0;
+}
+
+/* Send a whole cached response, from memory with sendmsg() or from disk with sendfile() */
+static int sendEntry(int socket, cache_element *e) {
+    size_t pos = 0;
+    size_t len = cache_element_len(e);
+    while (pos < len) {
+        ssize_t sent = cache_element_send(e, socket, pos, 0);
+        if (sent <= 0) {
+            return -1;
+        }
+        pos += sent;
+    }
+    metrics_add(METRIC_CACHE_BYTES_SENT, len);
+    return 0;
+}
+
+/*
+   Relay the rest of the response body from remoteSocket to clientSocket
+   with splice(), up to the end of the body as framed by body. If keep is
+   set, the relay collects a copy that starts with resp (resp_len bytes of
+   headers and body start) and caches it once the body is complete. The
+   copy is published to the requests collapsed onto fetch as it grows, and
+   fetch is ended. Returns 1 if the client got the whole body, 0 if not and
+   -1 on failure.
+ */
+static int relayBody(int clientSocket, int remoteSocket, ParsedRequest *request, cache_key *key,
+                     struct ParsedResponse *response, struct ResponseBody *body, time_t request_time,
+                     const char *resp, size_t resp_len, int keep, struct inflight *fetch) {
+    struct relay relay;
+    if (openRelay(&relay, resp, resp_len, keep) < 0) {
+        inflight_end(fetch, NULL);
+        return -1;
+    }
+
+    int client_gone = 0;
+    ssize_t n;
+    inflight_publish(fetch, &relay.copy);
+    while ((n = relay_fill_body(&relay, remoteSocket, body)) > 0) {
+        if (relay.spill_fd >= 0 && fetch) {
+            /* the copy has left memory, so followers cannot be fed from it */
+            inflight_end(fetch, NULL);
+            fetch = NULL;
+        }
+        inflight_publish(fetch, &relay.copy);
+        if (!client_gone && relay_drain(&relay, clientSocket) < 0) {
+            /* keep reading so the cache is filled */
+            client_gone = 1;
+        }
+        if (client_gone) {
+            relay_discard(&relay);
+            if (!relay.keep) {
+                break;
+            }
+        }
+    }
+    cache_element *cached = NULL;
+    if (n == 0 && relay.keep && !body->error && (body->done || body->framing == BODY_UNTIL_CLOSE)) {
+        cacheRelayedResponse(request, key, response, request_time, &relay, fetch ? &cached : NULL);
+    }
+    inflight_end(fetch, cached);
+    if (cached) {
+        cache_release(cached);
+    }
+    relay_close(&relay);
+    return n == 0 && !client_gone;
+}
+
+/*
+   Send the request (req_len bytes at req) to the origin, over an idle pooled
+   connection if there is one, and receive the first bytes of the response
+   into buf. The origin may have closed a pooled connection after it passed
+   the liveness check, so if one fails before any response arrives the
+   request is sent again on another. Returns the socket, with the recv()
+   result in *bytes_recv and when the request went out in *sent, or -1 if
+   no connection could be made.
+ */
+static int sendUpstreamRequest(ParsedRequest *request, int server_port, const char *req, size_t req_len,
+                               char *buf, int *bytes_recv, uint64_t *sent) {
+    for (;;) {
+        uint64_t start = metrics_now();
+        int remoteSocketID = upstream_acquire(request->host, server_port);
+        int reused = remoteSocketID >= 0;
+        if (!reused) {
+            remoteSocketID = connectRemoteServer(request->host, server_port);
+            if (remoteSocketID < 0) {
+                metrics_add(METRIC_CONNECT_FAILURES, 1);
+                return -1;
+            }
+        }
+
+        *sent = metrics_now();
+        *bytes_recv = -1;
+        if (sendAll(remoteSocketID, req, req_len) == 0) {
+            *bytes_recv = recv(remoteSocketID, buf, MAX_BYTES, 0);
+        }
+        if (*bytes_recv > 0 || !reused) {
+            metrics_observe(HIST_CONNECT, *sent - start);
+            if (*bytes_recv > 0) {
+                metrics_since(HIST_FIRST_BYTE, *sent);
+            }
+            return remoteSocketID;
+        }
+        close(remoteSocketID);
+    }
+}
+
+/*
+   Fetch request from the origin and stream the response to the client. If
+   stale is a cached response with validators the fetch is conditional, and
+   a 304 refreshes stale instead of transferring the body again. fetch, if
+   not NULL, is the in-flight fetch other requests for key may follow; it is
+   ended once the response is cached or turns out not to be shareable.
+   started is when the request's headers were complete. Returns 1 if the
+   client got a complete response whose end it can tell without the
+   connection closing, 0 if it got some other response, and -1 if nothing
+   was sent.
+ */
+int handle_request(int clientSocket, ParsedRequest *request, cache_key *key, cache_element *stale,
+                   struct inflight *fetch, uint64_t started) {
+    if (stale && !addConditionalHeaders(request, stale)) {
+        stale = NULL;
+    }
+
+    size_t out_len;
+    char *out = buildRemoteRequest(request, &out_len);
+    char *buf = (char *)arena_alloc(request->arena, MAX_BYTES);
+    if (!out || !buf) {
+        inflight_end(fetch, NULL);
+        return -1;
+    }
+
+    int server_port = request->port ? atoi(request->port) : 80;
+    time_t request_time = time(NULL);
+    int bytes_recv;
+    uint64_t sent_at;
+    int remoteSocketID = sendUpstreamRequest(request, server_port, out, out_len, buf, &bytes_recv, &sent_at);
+    if (remoteSocketID < 0) {
+        inflight_end(fetch, NULL);
+        return -1;
+    }
+
+    /* Read up to the end of the response headers */
+    char *resp = NULL;
+    size_t resp_len = 0, resp_cap = 0;
+    int headers_done = 0;
+
+    while (bytes_recv > 0) {
+        if (resp_len + bytes_recv + 1 > resp_cap) {
+            size_t cap = resp_cap ? resp_cap * 2 : MAX_BYTES * 2;
+            char *bigger = (char *)arena_realloc(request->arena, resp, resp_len, cap);
+            if (!bigger) {
+                break;
+            }
+            resp = bigger;
+            resp_cap = cap;
+        }
+        memcpy(resp + resp_len, buf, bytes_recv);
+        resp_len += bytes_recv;
+        resp[resp_len] = '\0';
+        if (ParsedResponse_headerEnd(resp, resp_len)) {
+            headers_done = 1;
+            break;
+        }
+        if (resp_len > MAX_HEADER_BYTES) {
+            /* not a response we understand, pass it through */
+            break;
+        }
+        bytes_recv = recv(remoteSocketID, buf, MAX_BYTES, 0);
+    }
+
+    struct ParsedResponse *response = NULL;
+    if (headers_done) {
+        response = ParsedResponse_create();
+        if (response && ParsedResponse_parse(response, resp, resp_len) < 0) {
+            ParsedResponse_destroy(response);
+            response = NULL;
+        }
+    }
+
+    /*
+       Find where the body ends. The connection can go back to the pool only
+       if it does so before the connection closes and nothing follows it.
+     */
+    struct ResponseBody body;
+    int reusable = 0;
+    memset(&body, 0, sizeof(body));
+    body.framing = BODY_UNTIL_CLOSE;
+    if (response) {
+        ResponseBody_init(&body, response);
+        size_t extra = resp_len - response->header_len;
+        size_t used = ResponseBody_consume(&body, resp + response->header_len, extra);
+        reusable = ParsedResponse_keepAlive(response) && body.framing != BODY_UNTIL_CLOSE && used == extra;
+        resp_len = response->header_len + used;
+    }
+
+    /* the client may send another request only after a complete, delimited response */
+    int delivered = 0;
+    int answered = resp_len > 0;
+    int revalidated = stale && response && response->status == 304;
+    if (revalidated) {
+        metrics_since(HIST_LAST_BYTE, sent_at);
+        /* if the refreshed response cannot be cached, the stale one is still valid */
+        cache_element *refreshed = refreshCachedResponse(request, key, stale, response, request_time);
+        cache_element *sent = refreshed ? refreshed : stale;
+        inflight_end(fetch, refreshed);
+        delivered = sendEntry(clientSocket, sent) == 0 && !(sent->flags & CACHE_UNFRAMED);
+        printf("Data revalidated in the Cache\n\n");
+        if (refreshed) {
+            cache_release(refreshed);
+        }
+    } else {
+        int keep = response && responseCacheable(request, response, request_time);
+        if (!keep || !responseShareable(request, response, request_time)) {
+            /* the requests following this fetch have to make their own */
+            inflight_end(fetch, NULL);
+            fetch = NULL;
+        }
+        int sent = resp_len > 0 && sendAll(clientSocket, resp, resp_len) == 0;
+        if (bytes_recv > 0) {
+            int ret = relayBody(clientSocket, remoteSocketID, request, key, response, &body,
+                                request_time, resp, resp_len, keep, fetch);
+            if (ret < 0) {
+                perror("Relay failed\n");
+            }
+            metrics_since(HIST_LAST_BYTE, sent_at);
+            delivered = sent && ret == 1 && body.done && body.framing != BODY_UNTIL_CLOSE;
+        } else {
+            inflight_end(fetch, NULL);
+        }
+    }
+
+    if (reusable && body.done && !body.error) {
+        upstream_release(request->host, server_port, remoteSocketID);
+    } else {
+        close(remoteSocketID);
+    }
+    if (response) {
+        ParsedResponse_destroy(response);
+    }
+    if (!answered) {
+        return -1;
+    }
+    metrics_since(revalidated ? HIST_REVALIDATED : HIST_MISS, started);
+    return delivered;
+}
+
 int checkHTTPversion(char *msg) {
     if (strncmp(msg, "HTTP/1.1", 8) == 0 || strncmp(msg, "HTTP/1.0", 8) == 0) {
         return 1;
@@ -163,128 +814,304 @@ int checkHTTPversion(char *msg) {
     return -1;
 }
 
-void *thread_fn(void *socketNew) {
-    sem_wait(&semaphore);
-    int socket = *(int *)socketNew;
-    int bytes_recv_client, len;
+/*
+   Wait up to timeout seconds for the first byte of a request, on a new or
+   a keep-alive connection. An idle connection holds its worker, so give up
+   early when other clients are queued for one. Returns 1 once the socket
+   is readable.
+ */
+static int waitForRequest(int socket, int timeout) {
+    struct pollfd pfd;
+    pfd.fd = socket;
+    pfd.events = POLLIN;
+    for (int waited = 0; waited < timeout * 1000; waited += IDLE_POLL_MS) {
+        int ret = poll(&pfd, 1, IDLE_POLL_MS);
+        if (ret != 0) {
+            return ret > 0;
+        }
+        if (worker_pool_depth(&pool) > 0) {
+            return 0;
+        }
+    }
+    return 0;
+}
 
-    char *buffer = (char *)calloc(MAX_BYTES, sizeof(char));
-    bytes_recv_client = recv(socket, buffer, MAX_BYTES, 0);
+/*
+   Wait for more of a request whose first bytes arrived at read_start, from
+   metrics_now(). The whole of its headers must arrive within
+   REQUEST_HEADER_TIMEOUT, however slowly they trickle in. Returns 1 once
+   the socket is readable, 0 when the time is up.
+ */
+static int waitForHeaders(int socket, uint64_t read_start) {
+    struct pollfd pfd;
+    pfd.fd = socket;
+    pfd.events = POLLIN;
+    uint64_t elapsed_ms = (metrics_now() - read_start) / 1000000;
+    if (elapsed_ms >= REQUEST_HEADER_TIMEOUT * 1000) {
+        return 0;
+    }
+    int ret = poll(&pfd, 1, REQUEST_HEADER_TIMEOUT * 1000 - (int)elapsed_ms);
+    return ret > 0;
+}
 
-    while (bytes_recv_client > 0) {
-        len = strlen(buffer);
-        if (!strstr(buffer, "\r\n\r\n")) {
-            bytes_recv_client = recv(socket, buffer + len, MAX_BYTES - len, 0);
+/*
+   Stream the response of fetch, which another request for the same key
+   started, to the client as it arrives. Returns like handle_request(); -1
+   means nothing was sent because the fetch will not produce a response
+   this request can use.
+ */
+static int serveCollapsed(int socket, struct inflight *fetch) {
+    size_t pos = 0;
+    ssize_t n;
+    while ((n = inflight_send(fetch, socket, pos, 0)) != 0) {
+        if (n > 0) {
+            pos += n;
+        } else if (errno == EAGAIN) {
+            inflight_wait(fetch, pos);
         } else {
-            break;
+            return 0;
         }
     }
+    int delimited;
+    if (inflight_status(fetch, &delimited) == INFLIGHT_DONE) {
+        printf("Data streamed from a collapsed fetch\n\n");
+        return delimited;
+    }
+    return pos ? 0 : -1;
+}
 
-    char *tempReq = strdup(buffer);
-    cache_element *temp = find(tempReq);
-
-    if (temp) {
-        int size = temp->len;
-        int pos = 0;
-        char response[MAX_BYTES];
-        while (pos < size) {
-            bzero(response, MAX_BYTES);
-            for (int i = 0; i < MAX_BYTES && pos < size; i++) {
-                response[i] = temp->data[pos++];
-            }
-            send(socket, response, MAX_BYTES, 0);
-        }
-        printf("Data retrieved from the Cache\n\n");
-    } else if (bytes_recv_client > 0) {
-        len = strlen(buffer);
-        ParsedRequest *request = ParsedRequest_create();
-        if (ParsedRequest_parse(request, buffer, len) < 0) {
-            perror("Parsing failed\n");
+/*
+   Answer the parsed request view, whose headers were complete at started,
+   allocating in arena. Returns how many seconds the connection may then
+   wait for another request, or 0 if it must be closed.
+ */
+static int serveRequest(int socket, struct RequestView *view, struct arena *arena, uint64_t started) {
+    int idle_timeout = 0;
+    ParsedRequest *request = ParsedRequest_createIn(arena);
+    if (!request || ParsedRequest_fromView(request, view) < 0) {
+        perror("Parsing failed\n");
+    } else if (strcmp(request->method, "GET")) {
+        printf("This code doesn't support any method other than GET\n");
+    } else if (!request->host || !request->path || checkHTTPversion(request->version) != 1) {
+        sendErrorMessage(socket, 500);
+    } else {
+        /* before buildRemoteRequest() rewrites the connection headers */
+        int keep_alive = clientKeepAlive(request);
+        int delivered = 0;
+        cache_key key;
+        cache_element *temp = NULL;
+        int keyed = buildCacheKey(request, NULL, &key);
+        uint64_t parsed = metrics_now();
+        metrics_observe(HIST_PARSE, parsed - started);
+        if (keyed == 0) {
+            temp = findCachedResponse(request, &key);
+            metrics_since(HIST_LOOKUP, parsed);
+        }
+        if (keyed < 0) {
+            sendErrorMessage(socket, 500);
+        } else if (temp && cacheEntryFresh(request, temp)) {
+            delivered = sendEntry(socket, temp) == 0 && !(temp->flags & CACHE_UNFRAMED);
+            metrics_since(HIST_HIT, started);
+            cache_release(temp);
+            printf("Data retrieved from the Cache\n\n");
+            cache_key_free(&key);
         } else {
-            bzero(buffer, MAX_BYTES);
-            if (!strcmp(request->method, "GET")) {
-                if (request->host && request->path && checkHTTPversion(request->version) == 1) {
-                    if (handle_request(socket, request, tempReq) == -1) {
-                        sendErrorMessage(socket, 500);
-                    }
-                } else {
-                    sendErrorMessage(socket, 500);
+            /* follow a fetch of the same response in flight, if there is one */
+            struct inflight *fetch;
+            delivered = -1;
+            if (inflight_begin(&key, -1, &fetch) == INFLIGHT_FOLLOW) {
+                delivered = serveCollapsed(socket, fetch);
+                inflight_release(fetch);
+                fetch = NULL;
+                if (delivered != -1) {
+                    metrics_since(HIST_COLLAPSED, started);
                 }
+            }
+            if (delivered == -1) {
+                delivered = handle_request(socket, request, &key, temp, fetch, started);
+            }
+            if (delivered == -1) {
+                sendErrorMessage(socket, 500);
+            }
+            if (temp) {
+                cache_release(temp);
+            }
+            cache_key_free(&key);
+        }
+        if (delivered == 1) {
+            idle_timeout = keep_alive;
+        }
+    }
+    ParsedRequest_destroy(request);
+    return idle_timeout;
+}
+
+void *thread_fn(void *socketNew) {
+    int socket = *(int *)socketNew;
+    int served = 0, idle_timeout = 0;
+    size_t buffered = 0, cap = MAX_BYTES;
+    struct RequestView view;
+    struct RequestParser parser;
+
+    /* the receive buffer lasts as long as the connection, requests are released past the mark */
+    struct arena *arena = arena_acquire();
+    char *buffer = arena ? (char *)arena_alloc(arena, cap) : NULL;
+    struct arena_mark mark;
+    if (arena) {
+        mark = arena_mark(arena);
+    }
+    atomic_fetch_add(&client_connections, 1);
+    metrics_add(METRIC_CONNECTIONS_OPENED, 1);
+    RequestParser_init(&parser, &view, MAX_HEADER_BYTES);
+
+    while (buffer) {
+        /* Pipelined requests may already be buffered, in part or whole */
+        int status;
+        ssize_t bytes_recv_client = 1;
+        uint64_t read_start = buffered ? metrics_now() : 0;
+        while ((status = RequestParser_feed(&parser, buffer, buffered)) == REQUEST_NEED_MORE) {
+            if (buffered == cap) {
+                if (growRequestBuffer(arena, &buffer, buffered, &cap) < 0) {
+                    bytes_recv_client = -1;
+                    break;
+                }
+                mark = arena_mark(arena);
+            }
+            /* a worker is not held for a client that may never speak, nor for one too slow to finish */
+            int ready;
+            if (buffered == 0) {
+                ready = waitForRequest(socket, served > 0 ? idle_timeout : REQUEST_HEADER_TIMEOUT);
             } else {
-                printf("This code doesn't support any method other than GET\n");
+                ready = waitForHeaders(socket, read_start);
+            }
+            if (!ready) {
+                bytes_recv_client = 0;
+                break;
+            }
+            bytes_recv_client = recv(socket, buffer + buffered, cap - buffered, 0);
+            if (bytes_recv_client <= 0) {
+                break;
+            }
+            if (!read_start) {
+                read_start = metrics_now();
             }
+            buffered += bytes_recv_client;
+        }
+
+        if (bytes_recv_client < 0) {
+            perror("Error in receiving from client.\n");
+            break;
+        } else if (bytes_recv_client == 0) {
+            if (served == 0) {
+                printf("Client disconnected!\n");
+            }
+            break;
+        } else if (status != REQUEST_COMPLETE) {
+            sendErrorMessage(socket, status == REQUEST_TOO_LARGE ? 431 : 400);
+            break;
+        }
+
+        uint64_t started = metrics_now();
+        metrics_observe(HIST_READ, started - read_start);
+        atomic_fetch_add(&client_requests, 1);
+        if (served > 0) {
+            atomic_fetch_add(&client_reuses, 1);
+        }
+        idle_timeout = serveRequest(socket, &view, arena, started);
+        arena_reset(arena, mark);
+        served++;
+        buffered -= view.header_len;
+        memmove(buffer, buffer + view.header_len, buffered);
+        RequestView_release(&view);
+        RequestParser_init(&parser, &view, MAX_HEADER_BYTES);
+        if (!idle_timeout || served >= max_requests) {
+            break;
         }
-        ParsedRequest_destroy(request);
-    } else if (bytes_recv_client < 0) {
-        perror("Error in receiving from client.\n");
-    } else if (bytes_recv_client == 0) {
-        printf("Client disconnected!\n");
     }
 
     shutdown(socket, SHUT_RDWR);
     close(socket);
-    free(buffer);
-    sem_post(&semaphore);
-    free(tempReq);
+    metrics_add(METRIC_CONNECTIONS_CLOSED, 1);
+    RequestView_release(&view);
+    if (arena) {
+        arena_recycle(arena);
+    }
     return NULL;
 }
 
-int main(int argc, char *argv[]) {
-    int client_socketId, client_len;
-    struct sockaddr_in server_addr, client_addr;
-
-    sem_init(&semaphore, 0, MAX_CLIENTS);
-    pthread_mutex_init(&lock, NULL);
+static void pool_handler(int fd) {
+    thread_fn(&fd);
+}
 
-    if (argc == 2) {
-        port_number = atoi(argv[1]);
-    } else {
-        fprintf(stderr, "Too few arguments\n");
-        exit(1);
+int pinThreadToCpu(pthread_t thread, int cpu) {
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu % (ncpu > 0 ? ncpu : 1), &set);
+    if (pthread_setaffinity_np(thread, sizeof(set), &set) != 0) {
+        fprintf(stderr, "Failed to pin thread to cpu %d\n", cpu);
+        return -1;
     }
+    return 0;
+}
 
-    printf("Setting Proxy Server Port : %d\n", port_number);
-
-    proxy_socketId = socket(AF_INET, SOCK_STREAM, 0);
-    if (proxy_socketId < 0) {
+/* A listening socket on addr (network byte order) and port */
+static int openListenerAt(in_addr_t addr, int port, int reuseport) {
+    struct sockaddr_in server_addr;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
         perror("Failed to create socket.\n");
-        exit(1);
+        return -1;
     }
 
     int reuse = 1;
-    if (setsockopt(proxy_socketId, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) < 0) {
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) < 0) {
         perror("setsockopt(SO_REUSEADDR) failed\n");
     }
+    if (reuseport && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) < 0) {
+        perror("setsockopt(SO_REUSEPORT) failed\n");
+        close(fd);
+        return -1;
+    }
 
     bzero(&server_addr, sizeof(server_addr));
     server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(port_number);
-    server_addr.sin_addr.s_addr = INADDR_ANY;
+    server_addr.sin_port = htons(port);
+    server_addr.sin_addr.s_addr = addr;
 
-    if (bind(proxy_socketId, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+    if (bind(fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
         perror("Port is not free\n");
-        exit(1);
+        close(fd);
+        return -1;
     }
-    printf("Binding on port: %d\n", port_number);
 
-    if (listen(proxy_socketId, MAX_CLIENTS) < 0) {
+    if (listen(fd, MAX_CLIENTS) < 0) {
         perror("Error while Listening !\n");
-        exit(1);
+        close(fd);
+        return -1;
     }
+    return fd;
+}
 
-    int i = 0;
-    int Connected_socketId[MAX_CLIENTS];
+int openListener(int port, int reuseport) {
+    return openListenerAt(INADDR_ANY, port, reuseport);
+}
+
+/* Accept clients from one listening socket and hand them to the worker pool */
+static void *acceptor_fn(void *arg) {
+    int listen_fd = (int)(long)arg;
+    int client_socketId, client_len;
+    struct sockaddr_in client_addr;
 
     while (1) {
         bzero(&client_addr, sizeof(client_addr));
         client_len = sizeof(client_addr);
-        client_socketId = accept(proxy_socketId, (struct sockaddr *)&client_addr, (socklen_t *)&client_len);
+        client_socketId = accept(listen_fd, (struct sockaddr *)&client_addr, (socklen_t *)&client_len);
         if (client_socketId < 0) {
             perror("Error in Accepting connection !\n");
-            exit(1);
-        } else {
-            Connected_socketId[i] = client_socketId;
+            continue;
         }
+        setNoDelay(client_socketId);
 
         struct sockaddr_in *client_pt = (struct sockaddr_in *)&client_addr;
         struct in_addr ip_addr = client_pt->sin_addr;
@@ -292,99 +1119,578 @@ int main(int argc, char *argv[]) {
         inet_ntop(AF_INET, &ip_addr, str, INET_ADDRSTRLEN);
         printf("Client is connected with port number: %d and ip address: %s \n", ntohs(client_addr.sin_port), str);
 
-        pthread_create(&tid[i], NULL, thread_fn, (void *)&Connected_socketId[i]);
-        i++;
+        if (worker_pool_submit(&pool, client_socketId) < 0) {
+            sendErrorMessage(client_socketId, 503);
+            close(client_socketId);
+        }
     }
-    close(proxy_socketId);
-    return 0;
+    return NULL;
 }
 
-cache_element *find(char *url) {
-    cache_element *site = NULL;
-    pthread_mutex_lock(&lock);
-    if (head) {
-        site = head;
-        while (site) {
-            if (!strcmp(site->url, url)) {
-                site->lru_time_track = time(NULL);
-                break;
-            }
-            site = site->next;
+void print_stats(FILE *out) {
+    fprintf(out, "Stats: cache %zu entries, %zu bytes, %zu bytes pinned by readers after eviction\n",
+            cache_count(), cache_bytes(), cache_pinned_bytes());
+    struct policy_stats pst;
+    cache_policy_stats(&pst);
+    fprintf(out, "Stats: eviction %s, %lu victims, %lu reordered, %lu admitted, %lu rejected\n",
+            cache_policy_name(), pst.victims, pst.reordered, pst.admitted, pst.rejected);
+    static const char *const backing[] = {"small pages", "transparent huge pages", "huge pages"};
+    struct slab_stats sst;
+    slab_stats(&sst);
+    fprintf(out, "Stats: slab %zu/%zu pages free (%s), %zu bytes in chunks for %zu requested (%.1f%% internal waste), "
+            "%zu bytes free in class pages\n", sst.free_pages, sst.pages, backing[sst.backing], sst.used_bytes,
+            sst.requested, sst.used_bytes ? 100.0 * (sst.used_bytes - sst.requested) / sst.used_bytes : 0.0,
+            sst.free_bytes);
+    fprintf(out, "Stats: slab %lu pages reclaimed, %lu entries evicted for them, %lu allocations failed\n",
+            sst.reclaimed, sst.evicted, sst.failed);
+    for (unsigned i = 0; i < slab_classes(); i++) {
+        struct slab_class_stats cst;
+        slab_class_stats(i, &cst);
+        if (cst.pages)
+            fprintf(out, "Stats: slab class %u: %zu byte chunks, %zu pages, %zu used, %zu free, %.1f%% of used bytes requested\n",
+                    i, cst.chunk_size, cst.pages, cst.used, cst.free,
+                    cst.used ? 100.0 * cst.requested / (cst.used * cst.chunk_size) : 0.0);
+    }
+    unsigned long l1_hits = 0, l1_lookups = 0;
+    for (unsigned i = 0; i < cache_shards(); i++) {
+        struct cache_shard_stats st;
+        cache_shard_stats(i, &st);
+        fprintf(out, "Stats: shard %u: %zu entries, %zu/%zu bytes, %lu locks, %lu contended, %.3f ms waiting\n",
+                i, st.count, st.bytes, st.budget, st.acquisitions, st.contended, st.wait_ns / 1e6);
+        l1_hits += st.hits;
+        l1_lookups += st.hits + st.misses;
+    }
+    struct disk_stats dst;
+    disk_stats(&dst);
+    fprintf(out, "Stats: tiers L1 %lu/%lu hits (%.1f%%), L2 %lu/%lu hits (%.1f%%) of L1 misses\n",
+            l1_hits, l1_lookups, l1_lookups ? 100.0 * l1_hits / l1_lookups : 0.0,
+            dst.hits, dst.lookups, dst.lookups ? 100.0 * dst.hits / dst.lookups : 0.0);
+    if (snapshot_path) {
+        struct snapshot_stats sst;
+        snapshot_stats(&sst);
+        fprintf(out, "Stats: snapshot loaded %zu entries, %zu bytes in %.1f ms, %lu checked on first hit, %lu corrupt; "
+                "last saved %zu entries, %zu bytes in %.1f ms\n",
+                sst.loaded, sst.loaded_bytes, sst.load_ms, sst.verified, sst.corrupt,
+                sst.saved, sst.saved_bytes, sst.save_ms);
+    }
+    if (disk_enabled()) {
+        fprintf(out, "Stats: disk %zu entries, %zu live of %zu bytes in %zu segments, %lu promoted, "
+                "%lu written, %lu dropped, %lu segments compacted, %lu evicted\n",
+                dst.entries, dst.live_bytes, dst.file_bytes, dst.segments, dst.promoted,
+                dst.written, dst.dropped, dst.compacted, dst.evicted);
+    }
+    unsigned long conns = atomic_load(&client_connections);
+    unsigned long reqs = atomic_load(&client_requests);
+    fprintf(out, "Stats: clients %lu connections, %lu requests, %.2f requests/connection, %.1f%% on reused connections\n",
+            conns, reqs, conns ? (double)reqs / conns : 0.0,
+            reqs ? 100.0 * atomic_load(&client_reuses) / reqs : 0.0);
+    struct upstream_stats ust;
+    upstream_pool_stats(&ust);
+    struct resolver_stats rst;
+    resolver_stats(&rst);
+    fprintf(out, "Stats: resolver %zu names, %lu hits, %lu negative hits, %lu coalesced, %lu queries, %lu failed\n",
+            rst.entries, rst.hits, rst.negative_hits, rst.coalesced, rst.queries, rst.failures);
+    struct inflight_stats ist;
+    inflight_stats(&ist);
+    fprintf(out, "Stats: collapsed forwarding %zu fetches in flight, %lu fetches, %lu collapsed requests, %lu upstream fetches saved\n",
+            ist.active, ist.fetches, ist.collapsed, ist.saved);
+    fprintf(out, "Stats: upstream pool %zu idle, %lu reused, %lu parked, %lu dropped\n",
+            ust.idle, ust.reused, ust.parked, ust.dropped);
+    struct arena_stats ast;
+    arena_stats(&ast);
+    fprintf(out, "Stats: arena %lu requests, %.1f allocations/request, %.0f bytes/request, %.2f mallocs/request\n",
+            ast.requests, ast.requests ? (double)ast.allocs / ast.requests : 0.0,
+            ast.requests ? (double)ast.bytes / ast.requests : 0.0,
+            ast.requests ? (double)ast.mallocs / ast.requests : 0.0);
+    if (engine == ENGINE_THREAD) {
+        fprintf(out, "Stats: queue depth %zu/%d, accepted %lu, rejected %lu\n",
+                worker_pool_depth(&pool), queue_depth,
+                atomic_load(&pool.submitted), atomic_load(&pool.rejected));
+    }
+    struct metrics_histogram *h = (struct metrics_histogram *)malloc(sizeof(struct metrics_histogram));
+    for (int i = 0; h && i < HIST_COUNT; i++) {
+        metrics_histogram(i, h);
+        if (h->count)
+            fprintf(out, "Stats: latency %s: %lu, mean %.3f ms, p50 %.3f ms, p99 %.3f ms, p999 %.3f ms\n",
+                    metrics_histogram_name(i), h->count, h->sum / 1e6 / h->count, metrics_quantile(h, 0.5) / 1e6,
+                    metrics_quantile(h, 0.99) / 1e6, metrics_quantile(h, 0.999) / 1e6);
+    }
+    free(h);
+}
+
+static void *stats_fn(void *arg) {
+    while (1) {
+        sleep(stats_interval);
+        print_stats(stdout);
+        fflush(stdout);
+    }
+    return NULL;
+}
+
+/* Write a labelled sample of a family started with metrics_write_family() */
+static void writeSample(FILE *out, const char *name, const char *label, const char *value, double sample) {
+    fprintf(out, "%s{%s=\"%s\"} %.17g\n", name, label, value, sample);
+}
+
+/* The admin port's metrics: the request stages and results, then the modules' own counts */
+static void writeMetrics(FILE *out) {
+    metrics_write(out);
+    metrics_write_value(out, "proxy_client_connections_total", "counter", "Client connections accepted.",
+                        atomic_load(&client_connections));
+    metrics_write_value(out, "proxy_client_requests_total", "counter", "Requests received from clients.",
+                        atomic_load(&client_requests));
+    metrics_write_value(out, "proxy_client_reused_requests_total", "counter",
+                        "Requests received on a connection that had served one before.",
+                        atomic_load(&client_reuses));
+
+    unsigned long hits = 0, misses = 0;
+    size_t budget = 0;
+    for (unsigned i = 0; i < cache_shards(); i++) {
+        struct cache_shard_stats st;
+        cache_shard_stats(i, &st);
+        hits += st.hits;
+        misses += st.misses;
+        budget += st.budget;
+    }
+    struct disk_stats dst;
+    disk_stats(&dst);
+    metrics_write_family(out, "proxy_cache_hits_total", "counter", "Cache lookups that found the key, by tier.");
+    writeSample(out, "proxy_cache_hits_total", "tier", "memory", hits);
+    writeSample(out, "proxy_cache_hits_total", "tier", "disk", dst.hits);
+    metrics_write_family(out, "proxy_cache_misses_total", "counter",
+                         "Cache lookups that did not find the key, by tier; the disk tier is asked on memory misses.");
+    writeSample(out, "proxy_cache_misses_total", "tier", "memory", misses);
+    writeSample(out, "proxy_cache_misses_total", "tier", "disk", dst.lookups - dst.hits);
+    metrics_write_value(out, "proxy_cache_entries", "gauge", "Entries in the memory cache.", cache_count());
+    metrics_write_value(out, "proxy_cache_bytes", "gauge", "Bytes charged to the memory cache.", cache_bytes());
+    metrics_write_value(out, "proxy_cache_budget_bytes", "gauge", "Memory cache budget.", budget);
+    metrics_write_value(out, "proxy_cache_pinned_bytes", "gauge",
+                        "Bytes of evicted entries still held by their readers.", cache_pinned_bytes());
+
+    struct policy_stats pst;
+    cache_policy_stats(&pst);
+    struct slab_stats sst;
+    slab_stats(&sst);
+    metrics_write_family(out, "proxy_cache_evictions_total", "counter", "Entries evicted from the memory cache, by cause.");
+    writeSample(out, "proxy_cache_evictions_total", "cause", "policy", pst.victims);
+    writeSample(out, "proxy_cache_evictions_total", "cause", "slab_reclaim", sst.evicted);
+    metrics_write_value(out, "proxy_cache_admission_rejected_total", "counter",
+                        "Responses the eviction policy declined to admit.", pst.rejected);
+    metrics_write_value(out, "proxy_slab_free_pages", "gauge", "Slab pages not given to any size class.",
+                        sst.free_pages);
+    metrics_write_value(out, "proxy_slab_requested_bytes", "gauge", "Bytes asked for in used slab chunks.",
+                        sst.requested);
+    metrics_write_value(out, "proxy_slab_failed_total", "counter", "Slab allocations that found no memory.",
+                        sst.failed);
+    if (disk_enabled()) {
+        metrics_write_value(out, "proxy_disk_entries", "gauge", "Entries in the disk tier.", dst.entries);
+        metrics_write_value(out, "proxy_disk_live_bytes", "gauge", "Bytes of live records in the disk tier.",
+                            dst.live_bytes);
+        metrics_write_value(out, "proxy_disk_written_total", "counter", "Records written to the disk tier.",
+                            dst.written);
+    }
+
+    struct inflight_stats ist;
+    inflight_stats(&ist);
+    metrics_write_value(out, "proxy_collapsed_requests_total", "counter",
+                        "Misses that followed another request's fetch.", ist.collapsed);
+    struct upstream_stats ust;
+    upstream_pool_stats(&ust);
+    metrics_write_value(out, "proxy_upstream_idle_connections", "gauge", "Idle pooled upstream connections.",
+                        ust.idle);
+    metrics_write_value(out, "proxy_upstream_reused_total", "counter",
+                        "Upstream requests sent on a pooled connection.", ust.reused);
+    struct resolver_stats rst;
+    resolver_stats(&rst);
+    metrics_write_value(out, "proxy_resolver_queries_total", "counter", "DNS queries sent.", rst.queries);
+    metrics_write_value(out, "proxy_resolver_failures_total", "counter", "DNS lookups that failed.",
+                        rst.failures);
+    if (engine == ENGINE_THREAD) {
+        metrics_write_value(out, "proxy_worker_queue_depth", "gauge", "Accepted connections waiting for a worker.",
+                            worker_pool_depth(&pool));
+        metrics_write_value(out, "proxy_worker_queue_rejected_total", "counter",
+                            "Connections refused with 503 because the worker queue was full.",
+                            atomic_load(&pool.rejected));
+    }
+}
+
+/* Answer one admin connection: GET /metrics, or 404 for anything else */
+static void serveAdmin(int socket) {
+    char req[1024];
+    size_t len = 0;
+    struct timeval tv = {1, 0};
+    setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    while (len < sizeof(req) - 1) {
+        ssize_t n = recv(socket, req + len, sizeof(req) - 1 - len, 0);
+        if (n <= 0) {
+            break;
+        }
+        len += n;
+        req[len] = '\0';
+        if (strstr(req, "\r\n\r\n")) {
+            break;
         }
     }
-    pthread_mutex_unlock(&lock);
-    return site;
+    req[len] = '\0';
+
+    if (strncmp(req, "GET /metrics", 12) || (req[12] != ' ' && req[12] != '?')) {
+        const char *notFound = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+        sendAll(socket, notFound, strlen(notFound));
+        return;
+    }
+    char *body = NULL;
+    size_t body_len = 0;
+    FILE *out = open_memstream(&body, &body_len);
+    if (!out) {
+        return;
+    }
+    writeMetrics(out);
+    fclose(out);
+    char header[256];
+    int header_len = snprintf(header, sizeof(header), "HTTP/1.1 200 OK\r\n"
+                              "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+                              "Content-Length: %zu\r\nConnection: close\r\n\r\n", body_len);
+    if (sendAll(socket, header, header_len) == 0) {
+        sendAll(socket, body, body_len);
+    }
+    free(body);
 }
 
-void remove_cache_element() {
-    pthread_mutex_lock(&lock);
-    if (head) {
-        cache_element *p = head, *q = head, *temp = head;
-        while (q->next) {
-            if (q->next->lru_time_track < temp->lru_time_track) {
-                temp = q->next;
-                p = q;
-            }
-            q = q->next;
+/* Serve the admin port, one connection at a time */
+static void *metrics_fn(void *arg) {
+    int listen_fd = (int)(long)arg;
+    while (1) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) {
+            perror("Error in Accepting connection !\n");
+            continue;
         }
-        if (temp == head) {
-            head = head->next;
-        } else {
-            p->next = temp->next;
+        serveAdmin(fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+/* Open the admin port given as [ADDR:]PORT, on loopback if no address is given */
+static int openMetricsListener(const char *spec) {
+    struct in_addr addr;
+    addr.s_addr = htonl(INADDR_LOOPBACK);
+    const char *colon = strrchr(spec, ':');
+    if (colon) {
+        char host[INET_ADDRSTRLEN];
+        size_t len = colon - spec;
+        if (len >= sizeof(host)) {
+            return -1;
         }
-        cache_size -= temp->len + sizeof(cache_element) + strlen(temp->url) + 1;
-        free(temp->data);
-        free(temp->url);
-        free(temp);
+        memcpy(host, spec, len);
+        host[len] = '\0';
+        if (inet_pton(AF_INET, host, &addr) != 1) {
+            return -1;
+        }
+        spec = colon + 1;
+    }
+    int port = atoi(spec);
+    if (port <= 0) {
+        return -1;
     }
-    pthread_mutex_unlock(&lock);
+    return openListenerAt(addr.s_addr, port, 0);
 }
 
-int add_cache_element(char *data, int size, char *url) {
-    pthread_mutex_lock(&lock);
+/* Write the snapshot and report how it went */
+static void saveSnapshot(void) {
+    long n = snapshot_save(snapshot_path);
+    if (n >= 0) {
+        struct snapshot_stats sst;
+        snapshot_stats(&sst);
+        printf("Snapshot: saved %ld entries, %zu bytes to %s in %.1f ms\n", n, sst.saved_bytes, snapshot_path,
+               sst.save_ms);
+        fflush(stdout);
+    }
+}
 
-    int element_size = size + 1 + strlen(url) + sizeof(cache_element);
-    if (element_size > MAX_ELEMENT_SIZE) {
-        pthread_mutex_unlock(&lock);
-        return 0;
+/*
+   Save a snapshot on SIGUSR1, and once more before exiting on SIGINT or
+   SIGTERM. The signals are blocked in every thread and taken here with
+   sigwait(), so the snapshot is written outside of any signal handler.
+ */
+static void *signal_fn(void *arg) {
+    sigset_t *set = (sigset_t *)arg;
+    for (;;) {
+        int sig;
+        if (sigwait(set, &sig) != 0) {
+            continue;
+        }
+        saveSnapshot();
+        if (sig != SIGUSR1) {
+            exit(0);
+        }
     }
+    return NULL;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [options] <port_number>\n"
+            "  -e, --engine=thread|epoll  connection engine (default thread)\n"
+            "  -t, --loops=N              epoll event loops (default: one per core)\n"
+            "  -w, --workers=N            worker threads (default %d)\n"
+            "  -q, --queue=N              accepted connections waiting for a worker (default %d)\n"
+            "  -s, --stats=SECS           print statistics every SECS seconds\n"
+            "  -a, --acceptors=N          N SO_REUSEPORT listening sockets, each with its own acceptor\n"
+            "  -A, --affinity             pin acceptors and event loops to CPUs\n"
+            "  -c, --shards=N             cache shards, a power of two (default %d)\n"
+            "  -p, --policy=NAME          eviction policy: lru, wtinylfu or gdsf (default lru)\n"
+            "  -G, --hugepages            back the cache with huge pages, else transparent huge pages\n"
+            "  -u, --upstream-idle=N      idle upstream connections kept per origin, 0 to disable (default %d)\n"
+            "  -U, --upstream-timeout=SECS  close idle upstream connections after SECS (default %d)\n"
+            "  -k, --keepalive=SECS       close client connections idle for SECS, 0 to disable keep-alive (default %d)\n"
+            "  -r, --max-requests=N       requests served per client connection (default %d)\n"
+            "  -H, --hosts=FILE           hosts file consulted before DNS (default %s, \"\" for none)\n"
+            "  -N, --nameserver=IP[:PORT] DNS server, may be repeated (default: those in %s)\n"
+            "  -C, --collapse=0|1         collapse concurrent misses for one key into one fetch (default 1)\n"
+            "  -d, --disk=DIR             keep evicted and large responses in a disk cache tier in DIR\n"
+            "  -D, --disk-size=MB         disk tier budget (default %d)\n"
+            "  -S, --snapshot=FILE        load the cache from FILE at startup, save it on SIGUSR1 and on exit\n"
+            "  -M, --metrics=[ADDR:]PORT  serve Prometheus metrics at /metrics on PORT (default address 127.0.0.1)\n",
+            prog, DEFAULT_WORKERS, DEFAULT_QUEUE_DEPTH, DEFAULT_CACHE_SHARDS,
+            DEFAULT_UPSTREAM_IDLE, DEFAULT_UPSTREAM_TIMEOUT, DEFAULT_KEEPALIVE_TIMEOUT, DEFAULT_MAX_REQUESTS,
+            DEFAULT_HOSTS_FILE, DEFAULT_RESOLV_CONF, DEFAULT_DISK_BUDGET);
+    exit(1);
+}
 
-    while (cache_size + element_size > MAX_SIZE) {
-        remove_cache_element();
+int main(int argc, char *argv[]) {
+    static struct option long_options[] = {
+        {"engine", required_argument, 0, 'e'},
+        {"loops", required_argument, 0, 't'},
+        {"workers", required_argument, 0, 'w'},
+        {"queue", required_argument, 0, 'q'},
+        {"stats", required_argument, 0, 's'},
+        {"acceptors", required_argument, 0, 'a'},
+        {"affinity", no_argument, 0, 'A'},
+        {"shards", required_argument, 0, 'c'},
+        {"policy", required_argument, 0, 'p'},
+        {"hugepages", no_argument, 0, 'G'},
+        {"upstream-idle", required_argument, 0, 'u'},
+        {"upstream-timeout", required_argument, 0, 'U'},
+        {"keepalive", required_argument, 0, 'k'},
+        {"max-requests", required_argument, 0, 'r'},
+        {"hosts", required_argument, 0, 'H'},
+        {"nameserver", required_argument, 0, 'N'},
+        {"collapse", required_argument, 0, 'C'},
+        {"disk", required_argument, 0, 'd'},
+        {"disk-size", required_argument, 0, 'D'},
+        {"snapshot", required_argument, 0, 'S'},
+        {"metrics", required_argument, 0, 'M'},
+        {0, 0, 0, 0}
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "e:t:w:q:s:a:Ac:p:Gu:U:k:r:H:N:C:d:D:S:M:", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'e':
+                if (!strcmp(optarg, "thread")) {
+                    engine = ENGINE_THREAD;
+                } else if (!strcmp(optarg, "epoll")) {
+                    engine = ENGINE_EPOLL;
+                } else {
+                    fprintf(stderr, "Unknown engine: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 't':
+                event_loops = atoi(optarg);
+                break;
+            case 'w':
+                worker_threads = atoi(optarg);
+                break;
+            case 'q':
+                queue_depth = atoi(optarg);
+                break;
+            case 's':
+                stats_interval = atoi(optarg);
+                break;
+            case 'a':
+                acceptors = atoi(optarg);
+                break;
+            case 'A':
+                pin_threads = 1;
+                break;
+            case 'c':
+                cache_shard_count = atoi(optarg);
+                break;
+            case 'p':
+                eviction_policy = optarg;
+                break;
+            case 'G':
+                use_hugepages = 1;
+                break;
+            case 'u':
+                upstream_idle = atoi(optarg);
+                break;
+            case 'U':
+                upstream_timeout = atoi(optarg);
+                break;
+            case 'k':
+                keepalive_timeout = atoi(optarg);
+                break;
+            case 'r':
+                max_requests = atoi(optarg);
+                break;
+            case 'H':
+                hosts_file = optarg;
+                break;
+            case 'N':
+                if (nameserver_count == RESOLVER_MAX_SERVERS) {
+                    fprintf(stderr, "At most %d nameservers\n", RESOLVER_MAX_SERVERS);
+                    exit(1);
+                }
+                nameservers[nameserver_count++] = optarg;
+                break;
+            case 'C':
+                collapse_misses = atoi(optarg);
+                break;
+            case 'd':
+                disk_cache_dir = optarg;
+                break;
+            case 'D':
+                disk_cache_mb = atol(optarg);
+                break;
+            case 'S':
+                snapshot_path = optarg;
+                break;
+            case 'M':
+                metrics_listen = optarg;
+                break;
+            default:
+                usage(argv[0]);
+        }
     }
 
-    cache_element *element = (cache_element *)malloc(sizeof(cache_element));
-    if (!element) {
-        perror("Failed to allocate memory for cache element");
-        pthread_mutex_unlock(&lock);
-        return 0;
+    if (optind == argc - 1) {
+        port_number = atoi(argv[optind]);
+    } else {
+        fprintf(stderr, "Too few arguments\n");
+        usage(argv[0]);
     }
 
-    element->data = (char *)malloc(size + 1);
-    if (!element->data) {
-        perror("Failed to allocate memory for cache data");
-        free(element);
-        pthread_mutex_unlock(&lock);
-        return 0;
+    signal(SIGPIPE, SIG_IGN);
+
+    /* before any thread is started, so that all of them inherit the mask */
+    static sigset_t snapshot_signals;
+    if (snapshot_path) {
+        sigemptyset(&snapshot_signals);
+        sigaddset(&snapshot_signals, SIGUSR1);
+        sigaddset(&snapshot_signals, SIGINT);
+        sigaddset(&snapshot_signals, SIGTERM);
+        pthread_sigmask(SIG_BLOCK, &snapshot_signals, NULL);
     }
-    strcpy(element->data, data);
 
-    element->url = (char *)malloc(strlen(url) + 1);
-    if (!element->url) {
-        perror("Failed to allocate memory for cache URL");
-        free(element->data);
-        free(element);
-        pthread_mutex_unlock(&lock);
-        return 0;
+    if (cache_set_policy(eviction_policy) < 0) {
+        fprintf(stderr, "Unknown eviction policy: %s\n", eviction_policy);
+        exit(1);
+    }
+    cache_set_hugepages(use_hugepages);
+    if (cache_init(cache_shard_count) < 0) {
+        fprintf(stderr, "Failed to initialize the cache\n");
+        exit(1);
+    }
+
+    if (disk_cache_dir) {
+        if (disk_cache_mb <= 0) {
+            usage(argv[0]);
+        }
+        if (disk_init(disk_cache_dir, (size_t)disk_cache_mb << 20) < 0) {
+            fprintf(stderr, "Failed to open the disk cache in %s\n", disk_cache_dir);
+            exit(1);
+        }
     }
-    strcpy(element->url, url);
 
-    element->lru_time_track = time(NULL);
-    element->next = head;
-    element->len = size;
-    head = element;
-    cache_size += element_size;
+    if (snapshot_path) {
+        long n = snapshot_load(snapshot_path);
+        struct snapshot_stats sst;
+        snapshot_stats(&sst);
+        if (n < 0) {
+            fprintf(stderr, "Snapshot %s is damaged or incomplete, starting with an empty cache\n", snapshot_path);
+        } else {
+            printf("Snapshot: loaded %ld entries, %zu bytes from %s in %.1f ms\n", n, sst.loaded_bytes,
+                   snapshot_path, sst.load_ms);
+        }
+        pthread_t signal_tid;
+        pthread_create(&signal_tid, NULL, signal_fn, &snapshot_signals);
+        pthread_detach(signal_tid);
+    }
 
-    pthread_mutex_unlock(&lock);
-    return 1;
-}
\ No newline at end of file
+    upstream_pool_init(upstream_idle, upstream_timeout);
+    inflight_init(collapse_misses);
+    if (resolver_init(*hosts_file ? hosts_file : NULL, nameservers, nameserver_count) < 0) {
+        fprintf(stderr, "Failed to start the resolver\n");
+        exit(1);
+    }
+
+    printf("Setting Proxy Server Port : %d\n", port_number);
+
+    if (acceptors <= 0) {
+        usage(argv[0]);
+    }
+    int reuseport = acceptors > 1;
+    int *listeners = (int *)calloc(acceptors, sizeof(int));
+    for (int i = 0; i < acceptors; i++) {
+        listeners[i] = openListener(port_number, reuseport);
+        if (listeners[i] < 0) {
+            exit(1);
+        }
+    }
+    proxy_socketId = listeners[0];
+    printf("Binding on port: %d\n", port_number);
+    if (reuseport) {
+        printf("Listening on %d SO_REUSEPORT sockets\n", acceptors);
+    }
+
+    if (metrics_listen) {
+        int metrics_fd = openMetricsListener(metrics_listen);
+        if (metrics_fd < 0) {
+            fprintf(stderr, "Failed to open the metrics port %s\n", metrics_listen);
+            exit(1);
+        }
+        printf("Serving metrics on %s\n", metrics_listen);
+        pthread_t metrics_tid;
+        pthread_create(&metrics_tid, NULL, metrics_fn, (void *)(long)metrics_fd);
+        pthread_detach(metrics_tid);
+    }
+
+    if (stats_interval > 0) {
+        pthread_t stats_tid;
+        pthread_create(&stats_tid, NULL, stats_fn, NULL);
+        pthread_detach(stats_tid);
+    }
+
+    if (engine == ENGINE_EPOLL) {
+        if (event_loops <= 0) {
+            event_loops = sysconf(_SC_NPROCESSORS_ONLN);
+        }
+        printf("Running %d epoll event loops\n", event_loops);
+        epoll_engine_run(listeners, acceptors, event_loops, pin_threads);
+        return 1;
+    }
+
+    if (worker_threads <= 0 || queue_depth <= 0) {
+        usage(argv[0]);
+    }
+    if (worker_pool_start(&pool, worker_threads, queue_depth, pool_handler) < 0) {
+        fprintf(stderr, "Failed to start the worker pool\n");
+        exit(1);
+    }
+    printf("Running %d worker threads\n", worker_threads);
+
+    for (int i = 1; i < acceptors; i++) {
+        pthread_t acceptor_tid;
+        pthread_create(&acceptor_tid, NULL, acceptor_fn, (void *)(long)listeners[i]);
+        if (pin_threads) {
+            pinThreadToCpu(acceptor_tid, i);
+        }
+        pthread_detach(acceptor_tid);
+    }
+    if (pin_threads) {
+        pinThreadToCpu(pthread_self(), 0);
+    }
+    acceptor_fn((void *)(long)proxy_socketId);
+    return 0;
+}
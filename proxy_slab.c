@@ -0,0 +1,303 @@
+/*
+  proxy_slab.c -- size-class allocator for cache storage.
+
+  Every chunk starts with a small header holding its owner's key hash and
+  the bytes asked for, zero while the chunk is free. Free chunks of a page
+  are chained through their first payload word. Pages are carved lazily,
+  chunk by chunk, so the mapping is only touched as far as it is used.
+
+  One mutex guards the classes and pages. It is never held while the evict
+  callback runs, since evicting frees chunks.
+*/
+
+#define _GNU_SOURCE
+#include "proxy_slab.h"
+#include "proxy_buffer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#define HUGE_PAGE (2 << 20)
+
+struct slab_chunk {
+     uint64_t owner;
+     uint32_t requested;          /* 0 while free */
+     uint32_t pad;
+};
+
+struct slab_page {
+     int cls;                     /* -1 while free */
+     unsigned used;
+     unsigned carved;             /* chunks cut from the page so far */
+     uint64_t stamp;              /* allocation clock when a chunk was last taken */
+     struct slab_chunk *free;
+     struct slab_page *next;      /* on its class's partial list, or the free list */
+     struct slab_page *prev;
+};
+
+struct slab_class {
+     size_t size;                 /* of a chunk, header included */
+     unsigned per_page;
+     struct slab_page *partial;   /* pages with room */
+     size_t pages;
+     size_t used;
+     size_t requested;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static char *base;
+static size_t npages;
+static struct slab_page *pages;
+static struct slab_page *free_pages;
+static size_t nfree;
+static struct slab_class classes[SLAB_MAX_CLASSES];
+static unsigned nclasses;
+static int backing;
+static uint64_t clock_now;
+static void (*evict_fn)(uint64_t hash);
+static unsigned long stat_reclaimed, stat_evicted, stat_failed;
+
+static char *page_base(struct slab_page *page) {
+    return base + (size_t)(page - pages) * SLAB_PAGE;
+}
+
+static void list_push(struct slab_page **head, struct slab_page *page) {
+    page->prev = NULL;
+    page->next = *head;
+    if (*head)
+        (*head)->prev = page;
+    *head = page;
+}
+
+static void list_remove(struct slab_page **head, struct slab_page *page) {
+    if (page->prev)
+        page->prev->next = page->next;
+    else
+        *head = page->next;
+    if (page->next)
+        page->next->prev = page->prev;
+    page->next = page->prev = NULL;
+}
+
+static void *map_memory(size_t len, int hugepages) {
+    void *p;
+    if (hugepages) {
+        /* reserved up front, so that a shortage fails here rather than with SIGBUS */
+        size_t huge_len = (len + HUGE_PAGE - 1) & ~(size_t)(HUGE_PAGE - 1);
+        p = mmap(NULL, huge_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p != MAP_FAILED) {
+            backing = SLAB_HUGE_PAGES;
+            return p;
+        }
+    }
+    p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED)
+        return NULL;
+    backing = SLAB_SMALL_PAGES;
+    if (hugepages && madvise(p, len, MADV_HUGEPAGE) == 0)
+        backing = SLAB_TRANSPARENT_HUGE_PAGES;
+    return p;
+}
+
+int slab_init(size_t bytes, int hugepages, void (*evict)(uint64_t hash)) {
+    npages = (bytes + SLAB_PAGE - 1) / SLAB_PAGE;
+    pages = (struct slab_page *)calloc(npages, sizeof(struct slab_page));
+    if (!pages)
+        return -1;
+    base = (char *)map_memory(npages * SLAB_PAGE, hugepages);
+    if (!base) {
+        perror("Failed to map cache memory");
+        return -1;
+    }
+    for (size_t i = npages; i-- > 0;) {
+        pages[i].cls = -1;
+        list_push(&free_pages, pages + i);
+    }
+    nfree = npages;
+
+    size_t largest = sizeof(struct slab_chunk) + sizeof(struct seg) + SEG_SIZE;
+    for (size_t size = SLAB_MIN_CHUNK; nclasses < SLAB_MAX_CLASSES; size = (size_t)(size * SLAB_FACTOR + 7) & ~(size_t)7) {
+        if (size > largest || nclasses == SLAB_MAX_CLASSES - 1)
+            size = largest;
+        classes[nclasses].size = size;
+        classes[nclasses].per_page = SLAB_PAGE / size;
+        nclasses++;
+        if (size == largest)
+            break;
+    }
+    evict_fn = evict;
+    return 0;
+}
+
+static int class_for(size_t size) {
+    size += sizeof(struct slab_chunk);
+    for (unsigned i = 0; i < nclasses; i++) {
+        if (classes[i].size >= size)
+            return i;
+    }
+    return -1;
+}
+
+size_t slab_charge(size_t size) {
+    int cls = class_for(size ? size : 1);
+    return cls < 0 ? 0 : classes[cls].size;
+}
+
+/* A chunk of class cls from a page with room or a free page, NULL if none */
+static struct slab_chunk *take_chunk(int cls) {
+    struct slab_class *c = classes + cls;
+    struct slab_page *page = c->partial;
+    if (!page) {
+        page = free_pages;
+        if (!page)
+            return NULL;
+        list_remove(&free_pages, page);
+        nfree--;
+        page->cls = cls;
+        page->used = page->carved = 0;
+        page->free = NULL;
+        list_push(&c->partial, page);
+        c->pages++;
+    }
+    struct slab_chunk *chunk = page->free;
+    if (chunk)
+        memcpy(&page->free, chunk + 1, sizeof(page->free));
+    else
+        chunk = (struct slab_chunk *)(page_base(page) + (size_t)page->carved++ * c->size);
+    page->stamp = ++clock_now;
+    if (++page->used == c->per_page)
+        list_remove(&c->partial, page);
+    c->used++;
+    return chunk;
+}
+
+/*
+   Page no chunk was taken from for the longest, skipping those already
+   tried. Its entries are the oldest there are, while a page just given to
+   a class, however empty, is left to fill.
+ */
+static struct slab_page *reclaim_candidate(struct slab_page **tried, int ntried) {
+    struct slab_page *best = NULL;
+    for (size_t i = 0; i < npages; i++) {
+        struct slab_page *page = pages + i;
+        if (page->cls < 0 || (best && page->stamp >= best->stamp))
+            continue;
+        int skip = 0;
+        for (int t = 0; t < ntried; t++)
+            skip |= tried[t] == page;
+        if (!skip)
+            best = page;
+    }
+    return best;
+}
+
+/* Owners of the chunks in use on page. Returns the count stored in hashes. */
+static size_t page_owners(struct slab_page *page, uint64_t *hashes) {
+    struct slab_class *c = classes + page->cls;
+    size_t n = 0;
+    for (unsigned i = 0; i < page->carved; i++) {
+        struct slab_chunk *chunk = (struct slab_chunk *)(page_base(page) + (size_t)i * c->size);
+        if (chunk->requested)
+            hashes[n++] = chunk->owner;
+    }
+    return n;
+}
+
+void *slab_alloc(size_t size, uint64_t owner) {
+    int cls = class_for(size ? size : 1);
+    if (cls < 0)
+        return NULL;
+    struct slab_page *tried[SLAB_RECLAIM_TRIES];
+
+    pthread_mutex_lock(&lock);
+    struct slab_chunk *chunk = take_chunk(cls);
+    for (int t = 0; !chunk && t < SLAB_RECLAIM_TRIES && evict_fn; t++) {
+        struct slab_page *page = reclaim_candidate(tried, t);
+        if (!page)
+            break;
+        tried[t] = page;
+        uint64_t *hashes = (uint64_t *)malloc(page->carved * sizeof(uint64_t));
+        if (!hashes)
+            break;
+        size_t n = page_owners(page, hashes);
+        stat_reclaimed++;
+        stat_evicted += n;
+        pthread_mutex_unlock(&lock);
+        for (size_t i = 0; i < n; i++)
+            evict_fn(hashes[i]);
+        free(hashes);
+        pthread_mutex_lock(&lock);
+        chunk = take_chunk(cls);
+    }
+    if (!chunk) {
+        stat_failed++;
+        pthread_mutex_unlock(&lock);
+        return NULL;
+    }
+    chunk->owner = owner;
+    chunk->requested = size ? size : 1;
+    classes[cls].requested += chunk->requested;
+    pthread_mutex_unlock(&lock);
+    return chunk + 1;
+}
+
+void slab_free(void *p) {
+    if (!p)
+        return;
+    struct slab_chunk *chunk = (struct slab_chunk *)p - 1;
+    struct slab_page *page = pages + ((char *)chunk - base) / SLAB_PAGE;
+    pthread_mutex_lock(&lock);
+    struct slab_class *c = classes + page->cls;
+    c->used--;
+    c->requested -= chunk->requested;
+    chunk->requested = 0;
+    if (page->used-- == c->per_page)
+        list_push(&c->partial, page);
+    if (page->used == 0) {
+        list_remove(&c->partial, page);
+        c->pages--;
+        page->cls = -1;
+        list_push(&free_pages, page);
+        nfree++;
+    } else {
+        memcpy(p, &page->free, sizeof(page->free));
+        page->free = chunk;
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+unsigned slab_classes(void) {
+    return nclasses;
+}
+
+void slab_class_stats(unsigned cls, struct slab_class_stats *st) {
+    struct slab_class *c = classes + cls;
+    pthread_mutex_lock(&lock);
+    st->chunk_size = c->size;
+    st->pages = c->pages;
+    st->used = c->used;
+    st->free = c->pages * c->per_page - c->used;
+    st->requested = c->requested;
+    pthread_mutex_unlock(&lock);
+}
+
+void slab_stats(struct slab_stats *st) {
+    memset(st, 0, sizeof(*st));
+    for (unsigned i = 0; i < nclasses; i++) {
+        struct slab_class_stats cs;
+        slab_class_stats(i, &cs);
+        st->used_bytes += cs.used * cs.chunk_size;
+        st->requested += cs.requested;
+        st->free_bytes += cs.free * cs.chunk_size;
+    }
+    pthread_mutex_lock(&lock);
+    st->pages = npages;
+    st->free_pages = nfree;
+    st->backing = backing;
+    st->reclaimed = stat_reclaimed;
+    st->evicted = stat_evicted;
+    st->failed = stat_failed;
+    pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,85 @@
+/*
+ * proxy_slab.h -- size-class allocator for cache storage.
+ *
+ * All memory of the cache -- entries with their keys, and the segments of
+ * their responses -- comes from one mapping of the cache budget, reserved
+ * at startup and optionally backed by huge pages. The mapping is cut into
+ * SLAB_PAGE sized pages, and each page, when first needed, is given to one
+ * size class and carved into chunks of that class's size, which grow by
+ * SLAB_FACTOR from SLAB_MIN_CHUNK up to a full response segment. A chunk
+ * is charged at its class size, so the cache knows to the byte how much of
+ * the mapping its entries hold, waste included. A page whose chunks are
+ * all free goes back to be taken by any class.
+ *
+ * Each chunk records the hash of the cache key it belongs to. When a class
+ * has no free chunk and no page is left, the page that has gone longest
+ * without a chunk being taken from it, and so holds the oldest entries, is
+ * reclaimed for it: the entries owning its chunks are evicted through a
+ * callback, and once the last of them is freed the page changes class.
+ * Memory held by the cache thus stays within the mapping however the mix
+ * of response sizes shifts.
+ */
+
+#ifndef PROXY_SLAB
+#define PROXY_SLAB
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SLAB_PAGE (1 << 20)
+#define SLAB_MIN_CHUNK 64
+#define SLAB_FACTOR 1.25
+#define SLAB_MAX_CLASSES 48
+#define SLAB_RECLAIM_TRIES 4          /* pages tried per failed allocation */
+
+enum {
+    SLAB_SMALL_PAGES,
+    SLAB_TRANSPARENT_HUGE_PAGES,
+    SLAB_HUGE_PAGES
+};
+
+struct slab_class_stats {
+     size_t chunk_size;
+     size_t pages;
+     size_t used;                 /* chunks */
+     size_t free;                 /* chunks free in the class's pages, carved or not */
+     size_t requested;            /* bytes asked for in the used chunks */
+};
+
+struct slab_stats {
+     size_t pages;
+     size_t free_pages;
+     int backing;                 /* SLAB_*_PAGES */
+     size_t used_bytes;           /* in used chunks */
+     size_t requested;            /* of those, asked for */
+     size_t free_bytes;           /* in free chunks of pages given to a class */
+     unsigned long reclaimed;     /* pages whose entries were evicted for another class */
+     unsigned long evicted;       /* keys evicted to reclaim them */
+     unsigned long failed;        /* allocations that found no memory */
+};
+
+/*
+   Reserve bytes of memory, rounded up to whole pages, with huge pages if
+   hugepages is set and the system has them reserved, else transparent
+   huge pages where available. evict is called, without any slab lock
+   held, with the key hash of an entry whose chunks are wanted back.
+   Returns -1 if the mapping fails.
+ */
+int slab_init(size_t bytes, int hugepages, void (*evict)(uint64_t hash));
+
+/* Bytes a chunk for size bytes is charged, 0 if no chunk can hold them */
+size_t slab_charge(size_t size);
+
+/*
+   A chunk for size bytes of the entry with key hash owner. Returns NULL if
+   there is no memory even after reclaiming pages, or size is too large.
+ */
+void *slab_alloc(size_t size, uint64_t owner);
+
+void slab_free(void *p);
+
+unsigned slab_classes(void);
+void slab_class_stats(unsigned cls, struct slab_class_stats *st);
+void slab_stats(struct slab_stats *st);
+
+#endif
@@ -0,0 +1,389 @@
+/*
+  proxy_snapshot.c -- memory cache snapshots for warm restarts.
+
+  Checksums are a word-at-a-time variant of FNV-1a: a 200 MB snapshot is
+  summed once while it is written, and each response once on its first
+  hit, so the sum has to keep up with memory bandwidth rather than take a
+  byte per step. Snapshots are only read back on the machine that wrote
+  them, so the byte order of the words does not matter.
+*/
+
+#define _GNU_SOURCE
+#include "proxy_snapshot.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define SNAPSHOT_MAGIC 0x50414e53u       /* "SNAP" */
+#define SNAPSHOT_END 0x444e4553u         /* "SEND" */
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_IOV 64
+#define SNAPSHOT_BUFFER (1 << 20)
+
+/*
+  Layout: the header, the responses, each after the checksum of its bytes,
+  the index of records, each followed by its key, and the trailer.
+*/
+struct snapshot_header {
+     uint32_t magic;
+     uint32_t version;
+     uint64_t count;              /* records */
+     uint64_t data_len;           /* bytes of responses with their checksums */
+     uint64_t index_len;          /* bytes of records with their keys */
+     int64_t created;
+     uint32_t pad;
+     uint32_t check;              /* of the fields above */
+};
+
+struct snapshot_record {
+     int64_t expires;
+     uint64_t body_offset;        /* in the file */
+     uint64_t body_len;
+     uint32_t key_len;
+     uint32_t flags;
+     uint64_t check;              /* of the fields above and the key */
+};
+
+struct snapshot_trailer {
+     uint32_t magic;
+     uint32_t pad;
+     uint64_t count;
+};
+
+struct snapshot {
+     const char *map;
+     size_t len;
+     atomic_int refs;
+};
+
+struct sum {
+     uint64_t h;
+     uint64_t carry;              /* bytes not yet making up a word */
+     unsigned ncarry;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct snapshot_stats stats;
+static atomic_ulong stat_verified, stat_corrupt;
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static void sum_init(struct sum *s) {
+    s->h = 0xcbf29ce484222325ULL;
+    s->carry = 0;
+    s->ncarry = 0;
+}
+
+static inline void sum_word(struct sum *s, uint64_t w) {
+    s->h = (s->h ^ w) * 0x100000001b3ULL;
+    s->h ^= s->h >> 32;
+}
+
+static void sum_update(struct sum *s, const char *p, size_t len) {
+    const unsigned char *b = (const unsigned char *)p;
+    while (len > 0 && s->ncarry > 0) {
+        s->carry |= (uint64_t)*b++ << (8 * s->ncarry++);
+        len--;
+        if (s->ncarry == 8) {
+            sum_word(s, s->carry);
+            s->carry = 0;
+            s->ncarry = 0;
+        }
+    }
+    for (; len >= 8; b += 8, len -= 8) {
+        uint64_t w;
+        memcpy(&w, b, 8);
+        sum_word(s, w);
+    }
+    for (; len > 0; len--)
+        s->carry |= (uint64_t)*b++ << (8 * s->ncarry++);
+}
+
+static uint64_t sum_final(struct sum *s) {
+    sum_word(s, s->carry ^ ((uint64_t)s->ncarry << 56));
+    return s->h;
+}
+
+static uint32_t header_check(const struct snapshot_header *h) {
+    struct sum s;
+    sum_init(&s);
+    sum_update(&s, (const char *)h, offsetof(struct snapshot_header, check));
+    return (uint32_t)sum_final(&s);
+}
+
+static uint64_t record_check(const struct snapshot_record *r, const char *key) {
+    struct sum s;
+    sum_init(&s);
+    sum_update(&s, (const char *)r, offsetof(struct snapshot_record, check));
+    sum_update(&s, key, r->key_len);
+    return sum_final(&s);
+}
+
+/*
+  Saving
+*/
+
+/* Append the response of entry e, and its record to index. Returns 0 or -1. */
+static int save_entry(FILE *f, struct seg_buffer *index, cache_element *e, struct snapshot_header *h) {
+    struct iovec iov[SNAPSHOT_IOV];
+    size_t len = cache_element_len(e);
+    struct sum s;
+    sum_init(&s);
+    for (size_t done = 0; done < len;) {
+        int cnt = cache_element_iov(e, done, iov, SNAPSHOT_IOV);
+        if (cnt <= 0)
+            return -1;
+        for (int i = 0; i < cnt; i++) {
+            sum_update(&s, iov[i].iov_base, iov[i].iov_len);
+            done += iov[i].iov_len;
+        }
+    }
+    uint64_t body_sum = sum_final(&s);
+    if (fwrite(&body_sum, sizeof(body_sum), 1, f) != 1)
+        return -1;
+    for (size_t done = 0; done < len;) {
+        int cnt = cache_element_iov(e, done, iov, SNAPSHOT_IOV);
+        for (int i = 0; i < cnt; i++) {
+            if (fwrite(iov[i].iov_base, 1, iov[i].iov_len, f) != iov[i].iov_len)
+                return -1;
+            done += iov[i].iov_len;
+        }
+    }
+
+    struct snapshot_record r;
+    memset(&r, 0, sizeof(r));
+    r.expires = e->expires;
+    r.body_offset = sizeof(*h) + h->data_len + sizeof(body_sum);
+    r.body_len = len;
+    r.key_len = e->url_len;
+    r.flags = e->flags & ~(CACHE_MAPPED | CACHE_ON_DISK);
+    r.check = record_check(&r, e->url);
+    if (seg_buffer_append(index, (const char *)&r, sizeof(r)) < 0 ||
+        seg_buffer_append(index, e->url, e->url_len) < 0)
+        return -1;
+    h->count++;
+    h->data_len += sizeof(body_sum) + len;
+    h->index_len += sizeof(r) + e->url_len;
+    return 0;
+}
+
+/* Write every entry of the cache that is worth keeping. Returns 0 or -1. */
+static int save_entries(FILE *f, struct seg_buffer *index, struct snapshot_header *h) {
+    time_t now = time(NULL);
+    for (unsigned shard = 0; shard < cache_shards(); shard++) {
+        size_t count;
+        cache_element **entries = cache_collect(shard, &count);
+        int ret = 0;
+        for (size_t i = 0; i < count; i++) {
+            cache_element *e = entries[i];
+            /* expired without validators: nothing left to serve it for */
+            if (ret == 0 && (e->flags & CACHE_HAS_VALIDATORS || e->expires > now))
+                ret = save_entry(f, index, e, h);
+            cache_release(e);
+        }
+        free(entries);
+        if (ret < 0)
+            return -1;
+    }
+    return 0;
+}
+
+static int save_index(FILE *f, const struct seg_buffer *index) {
+    struct iovec iov[SNAPSHOT_IOV];
+    for (size_t done = 0; done < index->len;) {
+        int cnt = seg_buffer_iov(index, done, iov, SNAPSHOT_IOV);
+        for (int i = 0; i < cnt; i++) {
+            if (fwrite(iov[i].iov_base, 1, iov[i].iov_len, f) != iov[i].iov_len)
+                return -1;
+            done += iov[i].iov_len;
+        }
+    }
+    return 0;
+}
+
+long snapshot_save(const char *path) {
+    double start = now_ms();
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE *f = fopen(tmp, "we");
+    if (!f) {
+        perror("Failed to create snapshot");
+        return -1;
+    }
+    setvbuf(f, NULL, _IOFBF, SNAPSHOT_BUFFER);
+
+    struct snapshot_header h;
+    struct seg_buffer index;
+    memset(&h, 0, sizeof(h));
+    seg_buffer_init(&index);
+    int ok = fwrite(&h, sizeof(h), 1, f) == 1 && save_entries(f, &index, &h) == 0 && save_index(f, &index) == 0;
+    seg_buffer_free(&index);
+
+    struct snapshot_trailer t = {SNAPSHOT_END, 0, h.count};
+    h.magic = SNAPSHOT_MAGIC;
+    h.version = SNAPSHOT_VERSION;
+    h.created = time(NULL);
+    h.check = header_check(&h);
+    ok = ok && fwrite(&t, sizeof(t), 1, f) == 1 && fseek(f, 0, SEEK_SET) == 0 &&
+         fwrite(&h, sizeof(h), 1, f) == 1 && fflush(f) == 0 && fsync(fileno(f)) == 0;
+    if (fclose(f) != 0)
+        ok = 0;
+    if (!ok || rename(tmp, path) < 0) {
+        perror("Failed to write snapshot");
+        unlink(tmp);
+        return -1;
+    }
+
+    pthread_mutex_lock(&lock);
+    stats.saved = h.count;
+    stats.saved_bytes = h.data_len - h.count * sizeof(uint64_t);
+    stats.save_ms = now_ms() - start;
+    pthread_mutex_unlock(&lock);
+    return h.count;
+}
+
+/*
+  Loading
+*/
+
+/* Check every record in the index. Returns 0 if all are sound. */
+static int check_records(const char *index, const struct snapshot_header *h) {
+    size_t offset = 0;
+    uint64_t data_end = sizeof(*h) + h->data_len;
+    for (uint64_t i = 0; i < h->count; i++) {
+        struct snapshot_record r;
+        if (h->index_len - offset < sizeof(r))
+            return -1;
+        memcpy(&r, index + offset, sizeof(r));
+        offset += sizeof(r);
+        if (r.key_len > h->index_len - offset || r.check != record_check(&r, index + offset) ||
+            r.body_offset < sizeof(*h) + sizeof(uint64_t) || r.body_offset > data_end ||
+            r.body_len > data_end - r.body_offset)
+            return -1;
+        offset += r.key_len;
+    }
+    return offset == h->index_len ? 0 : -1;
+}
+
+/* Map path and check it. Returns the mapping, NULL with errno ENOENT if there is none. */
+static const char *map_snapshot(const char *path, size_t *len) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+    struct stat st;
+    const char *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(struct snapshot_header) + sizeof(struct snapshot_trailer))
+        map = (const char *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    errno = EINVAL;
+    if (map == MAP_FAILED)
+        return NULL;
+    *len = st.st_size;
+
+    struct snapshot_header h;
+    struct snapshot_trailer t;
+    memcpy(&h, map, sizeof(h));
+    memcpy(&t, map + *len - sizeof(t), sizeof(t));
+    size_t body_len = *len - sizeof(h) - sizeof(t);
+    if (h.magic != SNAPSHOT_MAGIC || h.version != SNAPSHOT_VERSION || h.check != header_check(&h) ||
+        h.data_len > body_len || h.index_len != body_len - h.data_len || t.magic != SNAPSHOT_END ||
+        t.count != h.count || check_records(map + sizeof(h) + h.data_len, &h) < 0) {
+        munmap((void *)map, *len);
+        errno = EINVAL;
+        return NULL;
+    }
+    return map;
+}
+
+long snapshot_load(const char *path) {
+    double start = now_ms();
+    size_t len;
+    const char *map = map_snapshot(path, &len);
+    if (!map)
+        return errno == ENOENT ? 0 : -1;
+
+    struct snapshot *snap = (struct snapshot *)malloc(sizeof(struct snapshot));
+    if (!snap) {
+        munmap((void *)map, len);
+        return -1;
+    }
+    snap->map = map;
+    snap->len = len;
+    atomic_init(&snap->refs, 1);
+
+    struct snapshot_header h;
+    memcpy(&h, map, sizeof(h));
+    time_t now = time(NULL);
+    const char *index = map + sizeof(h) + h.data_len;
+    size_t offset = 0, loaded = 0, bytes = 0;
+    for (uint64_t i = 0; i < h.count; i++) {
+        struct snapshot_record r;
+        memcpy(&r, index + offset, sizeof(r));
+        char *key_str = (char *)index + offset + sizeof(r);
+        offset += sizeof(r) + r.key_len;
+        if (!(r.flags & CACHE_HAS_VALIDATORS) && r.expires <= now)
+            continue;
+        cache_key key;
+        cache_key_borrow(&key, key_str, r.key_len);
+        if (cache_add_mapped(&key, r.flags, r.expires, map + r.body_offset, r.body_len, snap)) {
+            loaded++;
+            bytes += r.body_len;
+        }
+    }
+    snapshot_unpin(snap);
+
+    pthread_mutex_lock(&lock);
+    stats.loaded = loaded;
+    stats.loaded_bytes = bytes;
+    stats.load_ms = now_ms() - start;
+    pthread_mutex_unlock(&lock);
+    return loaded;
+}
+
+int snapshot_verify(cache_element *e) {
+    if (atomic_load_explicit(&e->mapped_ok, memory_order_acquire))
+        return 1;
+    uint64_t body_sum;
+    memcpy(&body_sum, e->mapped - sizeof(body_sum), sizeof(body_sum));
+    struct sum s;
+    sum_init(&s);
+    sum_update(&s, e->mapped, e->mapped_len);
+    if (sum_final(&s) != body_sum) {
+        atomic_fetch_add_explicit(&stat_corrupt, 1, memory_order_relaxed);
+        return 0;
+    }
+    atomic_store_explicit(&e->mapped_ok, 1, memory_order_release);
+    atomic_fetch_add_explicit(&stat_verified, 1, memory_order_relaxed);
+    return 1;
+}
+
+void snapshot_pin(struct snapshot *snap) {
+    atomic_fetch_add_explicit(&snap->refs, 1, memory_order_relaxed);
+}
+
+void snapshot_unpin(struct snapshot *snap) {
+    if (atomic_fetch_sub_explicit(&snap->refs, 1, memory_order_acq_rel) == 1) {
+        munmap((void *)snap->map, snap->len);
+        free(snap);
+    }
+}
+
+void snapshot_stats(struct snapshot_stats *st) {
+    pthread_mutex_lock(&lock);
+    *st = stats;
+    pthread_mutex_unlock(&lock);
+    st->verified = atomic_load_explicit(&stat_verified, memory_order_relaxed);
+    st->corrupt = atomic_load_explicit(&stat_corrupt, memory_order_relaxed);
+}
@@ -0,0 +1,65 @@
+/*
+ * proxy_snapshot.h -- memory cache snapshots for warm restarts.
+ *
+ * A snapshot is one file: a header, the cached responses in recency
+ * order, least recently used first, an index with a record of key, offset
+ * and length for each, and a trailer that repeats the record count. It is
+ * written to a temporary file next to the target and renamed into place,
+ * so a crash while saving leaves the previous snapshot intact.
+ *
+ * Loading maps the file and reads only the index, which sits in one piece
+ * at the end: each record becomes a cache entry flagged CACHE_MAPPED whose
+ * response stays in the mapping, so the proxy can serve as soon as the
+ * index is rebuilt and a response's pages are read in by the first hit on
+ * it. Every record carries a checksum of its fields and key, checked at
+ * load, and every response one of its bytes, checked on the first hit. A snapshot that is truncated, has a
+ * bad header, trailer or record, or was written by another version is
+ * rejected as a whole; an entry whose response fails its check is dropped
+ * and counts as a miss.
+ */
+
+#ifndef PROXY_SNAPSHOT
+#define PROXY_SNAPSHOT
+
+#include <stddef.h>
+#include "proxy_cache.h"
+
+struct snapshot;
+
+struct snapshot_stats {
+     size_t loaded;               /* entries taken from the snapshot at startup */
+     size_t loaded_bytes;
+     double load_ms;              /* mapping and rebuilding the index */
+     unsigned long verified;      /* entries whose response was checked on a first hit */
+     unsigned long corrupt;       /* of those, dropped because the check failed */
+     size_t saved;                /* entries in the last snapshot written */
+     size_t saved_bytes;
+     double save_ms;
+};
+
+/*
+   Write the memory cache to a snapshot at path. Returns the number of
+   entries written, or -1 with the previous snapshot, if any, left in place.
+ */
+long snapshot_save(const char *path);
+
+/*
+   Map the snapshot at path and add its entries to the memory cache.
+   Returns the number of entries added, 0 if there is no snapshot, or -1 if
+   it was rejected.
+ */
+long snapshot_load(const char *path);
+
+/*
+   Check the response of the CACHE_MAPPED entry e against its checksum,
+   once. Returns 1 if it is intact.
+ */
+int snapshot_verify(cache_element *e);
+
+/* Hold the mapping for another entry, and let go of it */
+void snapshot_pin(struct snapshot *snap);
+void snapshot_unpin(struct snapshot *snap);
+
+void snapshot_stats(struct snapshot_stats *st);
+
+#endif
@@ -0,0 +1,216 @@
+/*
+  proxy_upstream.c -- pool of idle persistent connections to origins.
+*/
+
+#define _GNU_SOURCE
+#include "proxy_upstream.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+struct idle_conn {
+    int fd;
+    time_t since;
+    struct idle_conn *next;      /* older */
+};
+
+struct upstream_host {
+    char *host;
+    int port;
+    struct idle_conn *idle;      /* newest first */
+    int nidle;
+    struct upstream_host *next;
+};
+
+struct upstream_bucket {
+    pthread_mutex_t lock;
+    struct upstream_host *hosts;
+};
+
+static struct upstream_bucket buckets[UPSTREAM_BUCKETS];
+static int max_idle = DEFAULT_UPSTREAM_IDLE;
+static int idle_timeout = DEFAULT_UPSTREAM_TIMEOUT;
+
+static atomic_long last_sweep;
+static atomic_size_t idle_count;
+static atomic_ulong reused_count;
+static atomic_ulong parked_count;
+static atomic_ulong dropped_count;
+
+void upstream_pool_init(int max, int timeout) {
+    max_idle = max > 0 ? max : 0;
+    idle_timeout = timeout;
+    for (int i = 0; i < UPSTREAM_BUCKETS; i++) {
+        pthread_mutex_init(&buckets[i].lock, NULL);
+        buckets[i].hosts = NULL;
+    }
+}
+
+int upstream_pool_enabled(void) {
+    return max_idle > 0;
+}
+
+/* FNV-1a over the lowercase host name and the port */
+static struct upstream_bucket *bucket_for(const char *host, int port) {
+    uint64_t h = 14695981039346656037ULL;
+    for (const char *c = host; *c; c++) {
+        h ^= (unsigned char)tolower((unsigned char)*c);
+        h *= 1099511628211ULL;
+    }
+    h ^= (uint64_t)port;
+    h *= 1099511628211ULL;
+    return buckets + (h % UPSTREAM_BUCKETS);
+}
+
+/* Find, or with create set add, the entry for host:port. Bucket locked. */
+static struct upstream_host *host_find(struct upstream_bucket *b, const char *host, int port, int create) {
+    struct upstream_host *uh;
+    for (uh = b->hosts; uh; uh = uh->next) {
+        if (uh->port == port && !strcasecmp(uh->host, host))
+            return uh;
+    }
+    if (!create)
+        return NULL;
+    uh = (struct upstream_host *)calloc(1, sizeof(struct upstream_host));
+    if (!uh)
+        return NULL;
+    uh->host = strdup(host);
+    if (!uh->host) {
+        free(uh);
+        return NULL;
+    }
+    uh->port = port;
+    uh->next = b->hosts;
+    b->hosts = uh;
+    return uh;
+}
+
+static void idle_close(struct idle_conn *ic) {
+    close(ic->fd);
+    free(ic);
+    atomic_fetch_sub(&idle_count, 1);
+    atomic_fetch_add(&dropped_count, 1);
+}
+
+/* Close the connections of uh that have been idle too long. Bucket locked. */
+static void host_expire(struct upstream_host *uh, time_t now) {
+    struct idle_conn **link = &uh->idle;
+    while (*link && now - (*link)->since < idle_timeout)
+        link = &(*link)->next;
+    /* the list is ordered by age, so everything from here on has expired */
+    while (*link) {
+        struct idle_conn *ic = *link;
+        *link = ic->next;
+        uh->nidle--;
+        idle_close(ic);
+    }
+}
+
+/*
+   At most once a second, expire idle connections of every origin, including
+   those that are not asked for again.
+ */
+static void pool_sweep(time_t now) {
+    long last = atomic_load(&last_sweep);
+    if (now == last || !atomic_compare_exchange_strong(&last_sweep, &last, now))
+        return;
+    for (int i = 0; i < UPSTREAM_BUCKETS; i++) {
+        pthread_mutex_lock(&buckets[i].lock);
+        for (struct upstream_host *uh = buckets[i].hosts; uh; uh = uh->next)
+            host_expire(uh, now);
+        pthread_mutex_unlock(&buckets[i].lock);
+    }
+}
+
+/*
+   An idle connection must have nothing to read: readable data or EOF means
+   the origin sent something unsolicited or closed it.
+ */
+static int conn_alive(int fd) {
+    char c;
+    ssize_t n = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+int upstream_acquire(const char *host, int port) {
+    if (!max_idle)
+        return -1;
+    struct upstream_bucket *b = bucket_for(host, port);
+    time_t now = time(NULL);
+    int fd = -1;
+
+    pool_sweep(now);
+    pthread_mutex_lock(&b->lock);
+    struct upstream_host *uh = host_find(b, host, port, 0);
+    if (uh)
+        host_expire(uh, now);
+    while (uh && uh->idle && fd < 0) {
+        struct idle_conn *ic = uh->idle;
+        uh->idle = ic->next;
+        uh->nidle--;
+        if (!conn_alive(ic->fd)) {
+            idle_close(ic);
+            continue;
+        }
+        fd = ic->fd;
+        free(ic);
+        atomic_fetch_sub(&idle_count, 1);
+        atomic_fetch_add(&reused_count, 1);
+    }
+    pthread_mutex_unlock(&b->lock);
+    return fd;
+}
+
+void upstream_release(const char *host, int port, int fd) {
+    struct upstream_bucket *b = bucket_for(host, port);
+    struct idle_conn *ic = max_idle ? (struct idle_conn *)malloc(sizeof(struct idle_conn)) : NULL;
+    if (!ic) {
+        close(fd);
+        return;
+    }
+    ic->fd = fd;
+    ic->since = time(NULL);
+
+    pool_sweep(ic->since);
+    pthread_mutex_lock(&b->lock);
+    struct upstream_host *uh = host_find(b, host, port, 1);
+    if (uh) {
+        host_expire(uh, ic->since);
+        ic->next = uh->idle;
+        uh->idle = ic;
+        uh->nidle++;
+        atomic_fetch_add(&idle_count, 1);
+        atomic_fetch_add(&parked_count, 1);
+        /* over the limit: the oldest connection goes */
+        if (uh->nidle > max_idle) {
+            struct idle_conn **link = &uh->idle;
+            while ((*link)->next)
+                link = &(*link)->next;
+            idle_close(*link);
+            *link = NULL;
+            uh->nidle--;
+        }
+        ic = NULL;
+    }
+    pthread_mutex_unlock(&b->lock);
+    if (ic) {
+        close(fd);
+        free(ic);
+    }
+}
+
+void upstream_pool_stats(struct upstream_stats *st) {
+    st->idle = atomic_load(&idle_count);
+    st->reused = atomic_load(&reused_count);
+    st->parked = atomic_load(&parked_count);
+    st->dropped = atomic_load(&dropped_count);
+}
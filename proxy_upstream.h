@@ -0,0 +1,51 @@
+/*
+ * proxy_upstream.h -- pool of idle persistent connections to origins.
+ *
+ * Once a response has been read to the end of its body, the upstream
+ * connection it arrived on is parked here under its origin's host and port
+ * instead of being closed, and the next miss for that origin reuses it and
+ * skips the TCP handshake. Each origin keeps at most a fixed number of idle
+ * connections, newest first; those idle for longer than the timeout are
+ * closed. A connection is checked before it is handed out, so one the
+ * origin has closed meanwhile is dropped rather than reused.
+ */
+
+#ifndef PROXY_UPSTREAM
+#define PROXY_UPSTREAM
+
+#include <stddef.h>
+
+#define UPSTREAM_BUCKETS 64
+#define DEFAULT_UPSTREAM_IDLE 8        /* idle connections kept per origin */
+#define DEFAULT_UPSTREAM_TIMEOUT 30    /* seconds an idle connection is kept */
+
+struct upstream_stats {
+     size_t idle;                 /* connections in the pool now */
+     unsigned long reused;        /* handed out by upstream_acquire() */
+     unsigned long parked;        /* taken back by upstream_release() */
+     unsigned long dropped;       /* closed: dead, timed out or over the limit */
+};
+
+/*
+   Keep up to max_idle connections per origin for idle_timeout seconds.
+   max_idle 0 disables pooling. Call before any other upstream_* function.
+ */
+void upstream_pool_init(int max_idle, int idle_timeout);
+int upstream_pool_enabled(void);
+
+/*
+   Take an idle connection to host:port that is still open. Returns its
+   socket, or -1 if there is none and a new connection must be made.
+ */
+int upstream_acquire(const char *host, int port);
+
+/*
+   Park fd, a connection to host:port with no request outstanding and
+   nothing left to read, for reuse. Closes it if the pool is full or
+   disabled.
+ */
+void upstream_release(const char *host, int port, int fd);
+
+void upstream_pool_stats(struct upstream_stats *st);
+
+#endif
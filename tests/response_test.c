@@ -0,0 +1,375 @@
+/*
+ * response_test.c -- checks of upstream response parsing, body framing and
+ * the shared-cache rules in proxy_response.c, run by make check.
+ *
+ * Fixed responses are fed through ParsedResponse_parse(), ResponseBody_consume()
+ * and ParsedResponse_freshness() and the results compared with what RFC 9110
+ * and RFC 9111 ask of a shared cache. Each failed check is printed with its
+ * line; the exit status is the number of failures.
+ *
+ * Usage: response_test
+ */
+
+#define _GNU_SOURCE
+#include "proxy_response.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define CHECK(cond)                                                          \
+    do {                                                                     \
+        checks++;                                                            \
+        if (!(cond)) {                                                       \
+            failures++;                                                      \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+        }                                                                    \
+    } while (0)
+
+/* Request and response time of every exchange below */
+#define NOW ((time_t)1700000000)
+
+static int checks, failures;
+
+/* Parse len bytes of raw, or NULL if ParsedResponse_parse() refuses them */
+static struct ParsedResponse *parse(const char *raw, size_t len) {
+    struct ParsedResponse *pr = ParsedResponse_create();
+    if (pr && ParsedResponse_parse(pr, raw, len) < 0) {
+        ParsedResponse_destroy(pr);
+        return NULL;
+    }
+    return pr;
+}
+
+static void release(struct ParsedResponse *pr) {
+    if (pr)
+        ParsedResponse_destroy(pr);
+}
+
+static struct ParsedResponse *parse_str(const char *raw) {
+    return parse(raw, strlen(raw));
+}
+
+/* t as an IMF-fixdate */
+static const char *http_date(time_t t, char *buf, size_t len) {
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    strftime(buf, len, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    return buf;
+}
+
+/*
+   Freshness of a 200 response dated date, with the extra header lines in
+   headers (each ending in \r\n), received at NOW.
+ */
+static int freshness(const char *headers, time_t date, struct ResponseFreshness *f) {
+    char raw[2048], buf[64];
+    snprintf(raw, sizeof(raw), "HTTP/1.1 200 OK\r\nDate: %s\r\n%s\r\n", http_date(date, buf, sizeof(buf)), headers);
+    struct ParsedResponse *pr = parse_str(raw);
+    if (!pr)
+        return -1;
+    ParsedResponse_freshness(pr, NOW, NOW, f);
+    ParsedResponse_destroy(pr);
+    return 0;
+}
+
+/* Feed raw's body to the framing n bytes at a time; returns the bytes that belonged to it */
+static size_t consume(struct ParsedResponse *pr, struct ResponseBody *body, const char *raw, size_t len,
+                      size_t step) {
+    ResponseBody_init(body, pr);
+    size_t used = 0;
+    for (size_t pos = pr->header_len; pos < len; pos += step) {
+        size_t n = len - pos < step ? len - pos : step;
+        size_t m = ResponseBody_consume(body, raw + pos, n);
+        used += m;
+        if (m < n)
+            break;
+    }
+    return used;
+}
+
+static void test_parse(void) {
+    const char *raw = "HTTP/1.1 404 Not Found\r\nContent-Type:  text/plain \r\nX-Empty:\r\n"
+                      "Content-Length: 3\r\n\r\nabc";
+    struct ParsedResponse *pr = parse_str(raw);
+    CHECK(pr != NULL);
+    if (!pr)
+        return;
+    CHECK(!strcmp(pr->version, "HTTP/1.1"));
+    CHECK(pr->status == 404);
+    CHECK(!strcmp(pr->reason, "Not Found"));
+    CHECK(pr->header_len == strlen(raw) - 3);
+    CHECK(pr->headersused == 3);
+    struct ParsedHeader *ph = ParsedResponse_get(pr, "content-type");
+    CHECK(ph && !strcmp(ph->value, "text/plain"));
+    ph = ParsedResponse_get(pr, "X-Empty");
+    CHECK(ph && !strcmp(ph->value, ""));
+
+    size_t len = ParsedResponse_totalLen(pr);
+    char *out = (char *)malloc(len);
+    CHECK(out && ParsedResponse_unparse(pr, out, len) == 0);
+    if (out) {
+        const char *expect = "HTTP/1.1 404 Not Found\r\nContent-Type: text/plain\r\nX-Empty: \r\n"
+                             "Content-Length: 3\r\n\r\n";
+        CHECK(len == strlen(expect) && !memcmp(out, expect, len));
+    }
+    free(out);
+    release(pr);
+
+    CHECK(!parse_str("HTTP/1.1 200 OK\r\nContent-Length: 0\r\n"));
+    CHECK(!parse_str("HTTP/1.1 OK\r\n\r\n"));
+    CHECK(!parse_str("HTTP/1.1 20 OK\r\n\r\n"));
+    CHECK(!parse_str("ICY 200 OK\r\n\r\n"));
+
+    /* a NUL in the status line or a header must be refused, not split on */
+    const char nul_header[] = "HTTP/1.1 200 OK\r\nX: a\0b\r\nContent-Length: 0\r\n\r\n";
+    CHECK(!parse(nul_header, sizeof(nul_header) - 1));
+    const char nul_status[] = "HTTP/1.1 200 O\0K\r\n\r\n";
+    CHECK(!parse(nul_status, sizeof(nul_status) - 1));
+    const char nul_last[] = "HTTP/1.1 200 OK\r\nX: a\0\r\n\r\n";
+    CHECK(!parse(nul_last, sizeof(nul_last) - 1));
+}
+
+static void test_keep_alive(void) {
+    struct ParsedResponse *pr = parse_str("HTTP/1.1 200 OK\r\n\r\n");
+    CHECK(pr && ParsedResponse_keepAlive(pr));
+    release(pr);
+    pr = parse_str("HTTP/1.1 200 OK\r\nConnection: close\r\n\r\n");
+    CHECK(pr && !ParsedResponse_keepAlive(pr));
+    release(pr);
+    pr = parse_str("HTTP/1.0 200 OK\r\n\r\n");
+    CHECK(pr && !ParsedResponse_keepAlive(pr));
+    release(pr);
+    pr = parse_str("HTTP/1.0 200 OK\r\nConnection: Keep-Alive\r\n\r\n");
+    CHECK(pr && ParsedResponse_keepAlive(pr));
+    release(pr);
+}
+
+static void test_framing(void) {
+    struct ResponseBody body;
+    const char *raw = "HTTP/1.1 200 OK\r\nContent-Length: 5\r\n\r\nhelloHTTP/1.1";
+    struct ParsedResponse *pr = parse_str(raw);
+    CHECK(pr && consume(pr, &body, raw, strlen(raw), 4096) == 5);
+    CHECK(body.framing == BODY_LENGTH && body.done && !body.error);
+    release(pr);
+
+    /* chunked, with an extension and a trailer, read whole and a byte at a time */
+    raw = "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n"
+          "5;name=value\r\nhello\r\nA\r\n0123456789\r\n0\r\nX-Trailer: 1\r\n\r\nNEXT";
+    pr = parse_str(raw);
+    size_t body_len = strlen(raw) - 4 - (pr ? pr->header_len : 0);
+    for (size_t step = 1; pr && step <= 4096; step *= 64) {
+        CHECK(consume(pr, &body, raw, strlen(raw), step) == body_len);
+        CHECK(body.framing == BODY_CHUNKED && body.done && !body.error);
+    }
+    release(pr);
+
+    /* chunk data passed on unread */
+    raw = "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n";
+    pr = parse_str(raw);
+    if (pr) {
+        ResponseBody_init(&body, pr);
+        CHECK(ResponseBody_consume(&body, "10\r\n", 4) == 4);
+        CHECK(ResponseBody_dataLeft(&body) == 16);
+        ResponseBody_skipData(&body, 16);
+        CHECK(ResponseBody_dataLeft(&body) == 0);
+        CHECK(ResponseBody_consume(&body, "\r\n0\r\n\r\n", 7) == 7 && body.done && !body.error);
+    }
+    release(pr);
+
+    raw = "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n3\r\nabcX";
+    pr = parse_str(raw);
+    CHECK(pr && consume(pr, &body, raw, strlen(raw), 4096) == strlen(raw) - pr->header_len);
+    CHECK(body.error && body.framing == BODY_UNTIL_CLOSE);
+    release(pr);
+
+    /* chunk sizes that would wrap or are missing must not frame the body */
+    const char *bad_chunks[] = {
+        "10000000000000005\r\nhello\r\n0\r\n\r\n",
+        "\r\nhello\r\n0\r\n\r\n",
+        ";ext\r\n0\r\n\r\n",
+        "5\r\nhello\r\nzz\r\n\r\n"
+    };
+    char chunked[256];
+    for (size_t i = 0; i < sizeof(bad_chunks) / sizeof(bad_chunks[0]); i++) {
+        snprintf(chunked, sizeof(chunked), "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n%s", bad_chunks[i]);
+        pr = parse_str(chunked);
+        for (size_t step = 1; pr && step <= 4096; step *= 4096) {
+            CHECK(consume(pr, &body, chunked, strlen(chunked), step) == strlen(chunked) - pr->header_len);
+            CHECK(body.error && body.framing == BODY_UNTIL_CLOSE && !body.done);
+        }
+        release(pr);
+    }
+    raw = "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\nFFFFFFFFFFFFFFFF\r\nabc";
+    pr = parse_str(raw);
+    CHECK(pr && consume(pr, &body, raw, strlen(raw), 4096) == strlen(raw) - pr->header_len);
+    CHECK(!body.error && ResponseBody_dataLeft(&body) == ~0ULL - 3);
+    release(pr);
+
+    /* a Content-Length with a sign, junk or too many digits is not trusted */
+    const char *bad_lengths[] = {"+5", "-5", "5x", "5 5", "", "99999999999999999999"};
+    for (size_t i = 0; i < sizeof(bad_lengths) / sizeof(bad_lengths[0]); i++) {
+        snprintf(chunked, sizeof(chunked), "HTTP/1.1 200 OK\r\nContent-Length: %s\r\n\r\nhello", bad_lengths[i]);
+        pr = parse_str(chunked);
+        CHECK(pr && consume(pr, &body, chunked, strlen(chunked), 4096) == 5);
+        CHECK(body.error && body.framing == BODY_UNTIL_CLOSE && !body.done);
+        release(pr);
+    }
+    raw = "HTTP/1.1 200 OK\r\nContent-Length: 18446744073709551615\r\n\r\n";
+    pr = parse_str(raw);
+    if (pr) {
+        ResponseBody_init(&body, pr);
+        CHECK(!body.error && body.framing == BODY_LENGTH && body.remaining == ~0ULL);
+    }
+    release(pr);
+
+    /* statuses without a body, and bodies only the close can end */
+    raw = "HTTP/1.1 304 Not Modified\r\nContent-Length: 100\r\n\r\n";
+    pr = parse_str(raw);
+    if (pr) {
+        ResponseBody_init(&body, pr);
+        CHECK(body.done && ResponseBody_consume(&body, "x", 1) == 0);
+    }
+    release(pr);
+    raw = "HTTP/1.1 204 No Content\r\n\r\n";
+    pr = parse_str(raw);
+    if (pr) {
+        ResponseBody_init(&body, pr);
+        CHECK(body.done);
+    }
+    release(pr);
+    raw = "HTTP/1.0 200 OK\r\n\r\nanything";
+    pr = parse_str(raw);
+    CHECK(pr && consume(pr, &body, raw, strlen(raw), 4096) == 8);
+    CHECK(body.framing == BODY_UNTIL_CLOSE && !body.done);
+    release(pr);
+}
+
+static void test_freshness(void) {
+    struct ResponseFreshness f;
+    char buf[64], headers[256];
+
+    CHECK(freshness("Cache-Control: max-age=60\r\n", NOW, &f) == 0);
+    CHECK(f.storable && !f.has_validators && f.expires == NOW + 60);
+    CHECK(freshness("Cache-Control: max-age=60, s-maxage=120\r\n", NOW, &f) == 0);
+    CHECK(f.storable && f.expires == NOW + 120);
+    CHECK(freshness("Cache-Control: max-age=\"90\"\r\n", NOW, &f) == 0);
+    CHECK(f.expires == NOW + 90);
+
+    /* Expires is relative to Date, and max-age overrides it */
+    snprintf(headers, sizeof(headers), "Expires: %s\r\n", http_date(NOW + 300, buf, sizeof(buf)));
+    CHECK(freshness(headers, NOW, &f) == 0);
+    CHECK(f.storable && f.expires == NOW + 300);
+    snprintf(headers, sizeof(headers), "Cache-Control: max-age=10\r\nExpires: %s\r\n",
+             http_date(NOW + 300, buf, sizeof(buf)));
+    CHECK(freshness(headers, NOW, &f) == 0);
+    CHECK(f.expires == NOW + 10);
+    CHECK(freshness("Expires: 0\r\n", NOW, &f) == 0);
+    CHECK(f.storable && f.expires <= NOW);
+
+    /* age spent upstream, stated or apparent from Date */
+    CHECK(freshness("Cache-Control: max-age=60\r\nAge: 20\r\n", NOW, &f) == 0);
+    CHECK(f.expires == NOW + 40);
+    CHECK(freshness("Cache-Control: max-age=60\r\n", NOW - 30, &f) == 0);
+    CHECK(f.expires == NOW + 30);
+    CHECK(freshness("Cache-Control: max-age=60\r\nAge: 100\r\n", NOW, &f) == 0);
+    CHECK(f.expires < NOW);
+
+    /* directives that forbid storing, or storing without revalidation */
+    CHECK(freshness("Cache-Control: no-store, max-age=60\r\n", NOW, &f) == 0);
+    CHECK(!f.storable);
+    CHECK(freshness("Cache-Control: private, max-age=60\r\n", NOW, &f) == 0);
+    CHECK(!f.storable);
+    CHECK(f.authorized_ok == 0);
+    CHECK(freshness("Cache-Control: no-cache, max-age=60\r\nETag: \"x\"\r\n", NOW, &f) == 0);
+    CHECK(f.storable && f.has_validators && f.expires == NOW);
+    CHECK(freshness("Pragma: no-cache\r\nExpires: 0\r\n", NOW, &f) == 0);
+    CHECK(f.expires == NOW);
+
+    /* responses to requests with credentials are only shared when they say so */
+    CHECK(freshness("Cache-Control: max-age=60\r\n", NOW, &f) == 0);
+    CHECK(f.storable && !f.authorized_ok);
+    CHECK(freshness("Cache-Control: public, max-age=60\r\n", NOW, &f) == 0);
+    CHECK(f.storable && f.authorized_ok);
+    CHECK(freshness("Cache-Control: s-maxage=60\r\n", NOW, &f) == 0);
+    CHECK(f.authorized_ok);
+    CHECK(freshness("Cache-Control: max-age=60, must-revalidate\r\n", NOW, &f) == 0);
+    CHECK(f.authorized_ok);
+    CHECK(freshness("Cache-Control: publicity, max-age=60\r\n", NOW, &f) == 0);
+    CHECK(!f.authorized_ok);
+
+    /* heuristic freshness: a tenth of the time since Last-Modified */
+    snprintf(headers, sizeof(headers), "Last-Modified: %s\r\n", http_date(NOW - 1000, buf, sizeof(buf)));
+    CHECK(freshness(headers, NOW, &f) == 0);
+    CHECK(f.storable && f.has_validators && f.expires == NOW + 100);
+    snprintf(headers, sizeof(headers), "Last-Modified: %s\r\n", http_date(NOW - 100 * 86400, buf, sizeof(buf)));
+    CHECK(freshness(headers, NOW, &f) == 0);
+    CHECK(f.expires == NOW + 86400);
+
+    struct ParsedResponse *pr = parse_str("HTTP/1.1 302 Found\r\nLocation: /\r\n\r\n");
+    if (pr) {
+        ParsedResponse_freshness(pr, NOW, NOW, &f);
+        CHECK(!f.storable);
+    }
+    release(pr);
+    pr = parse_str("HTTP/1.1 206 Partial Content\r\nCache-Control: max-age=60\r\n\r\n");
+    if (pr) {
+        ParsedResponse_freshness(pr, NOW, NOW, &f);
+        CHECK(!f.storable);
+    }
+    release(pr);
+
+    CHECK(parse_http_date("Sun, 06 Nov 1994 08:49:37 GMT") == 784111777);
+    CHECK(parse_http_date("Sunday, 06-Nov-94 08:49:37 GMT") == 784111777);
+    CHECK(parse_http_date("Sun Nov  6 08:49:37 1994") == 784111777);
+    CHECK(parse_http_date("yesterday") == -1);
+}
+
+static void test_merge(void) {
+    struct ParsedResponse *cached = parse_str("HTTP/1.1 200 OK\r\nETag: \"a\"\r\nCache-Control: max-age=10\r\n"
+                                              "Content-Length: 5\r\n\r\n");
+    struct ParsedResponse *update = parse_str("HTTP/1.1 304 Not Modified\r\nCache-Control: max-age=100\r\n"
+                                              "Content-Length: 0\r\nX-New: 1\r\n\r\n");
+    CHECK(cached && update && ParsedResponse_merge(cached, update) == 0);
+    if (cached && update) {
+        struct ParsedHeader *ph = ParsedResponse_get(cached, "Cache-Control");
+        CHECK(ph && !strcmp(ph->value, "max-age=100"));
+        ph = ParsedResponse_get(cached, "Content-Length");
+        CHECK(ph && !strcmp(ph->value, "5"));
+        ph = ParsedResponse_get(cached, "X-New");
+        CHECK(ph && !strcmp(ph->value, "1"));
+        CHECK(cached->status == 200);
+        struct ResponseFreshness f;
+        ParsedResponse_freshness(cached, NOW, NOW, &f);
+        CHECK(f.storable && f.has_validators && f.expires == NOW + 100);
+    }
+    release(cached);
+    release(update);
+}
+
+static void test_vary(void) {
+    char out[64];
+    struct ParsedResponse *pr = parse_str("HTTP/1.1 200 OK\r\nVary: Accept-Encoding, User-Agent\r\n"
+                                          "Vary: ,Accept-Language\r\n\r\n");
+    CHECK(pr && ParsedResponse_vary(pr, out, sizeof(out)) == 1);
+    CHECK(pr && !strcmp(out, "accept-encoding,user-agent,accept-language"));
+    CHECK(pr && ParsedResponse_vary(pr, out, 8) == -1);
+    release(pr);
+    pr = parse_str("HTTP/1.1 200 OK\r\nVary: *\r\n\r\n");
+    CHECK(pr && ParsedResponse_vary(pr, out, sizeof(out)) == -1);
+    release(pr);
+    pr = parse_str("HTTP/1.1 200 OK\r\n\r\n");
+    CHECK(pr && ParsedResponse_vary(pr, out, sizeof(out)) == 0 && !*out);
+    release(pr);
+}
+
+int main(void) {
+    test_parse();
+    test_keep_alive();
+    test_framing();
+    test_freshness();
+    test_merge();
+    test_vary();
+    printf("%d checks, %d failed\n", checks, failures);
+    return failures;
+}